@@ -56,7 +56,9 @@ typedef enum MQTTAction
     ACTION_SUBSCRIBE,
     ACTION_KEEPALIVE,
     ACTION_INIT,
-    ACTION_PARSE_INPUT_STREAM
+    ACTION_PARSE_INPUT_STREAM,
+    ACTION_PUBLISH_STREAM,
+    ACTION_CONNECT_PREBUILT
 } MQTTAction_t;
 
 /**
@@ -95,6 +97,12 @@ typedef enum MQTTErrorCodes
     NoConnection,
     AllreadyConnected,
     PingNotSend,
+    WouldBlock,
+    InvalidTopic,
+    InvalidPayload,
+    Expired,
+    Conflated,
+    RateLimited,
     Successfull     = 0,
     InvalidVersion  = 1,
     InvalidIdentifier,
@@ -127,10 +135,10 @@ typedef enum MQTTQoSLevel
 #pragma pack(1)
 typedef struct struct_flags_and_type
 {
-    uint8_t retain:1;      /* Retain or not                            */
-    uint8_t dup:1;         /* one bit value, duplicate or not          */
-    uint8_t qos:2;         /* Quality of service 0-2 @see MQTTQoSLevel */
-    uint8_t message_type:4;/* @see MQTTMessageType                     */
+    uint8_t retain:1;      /* Retain or not, bit 0                     */
+    uint8_t qos:2;         /* Quality of service 0-2, bits 1-2         */
+    uint8_t dup:1;         /* one bit value, duplicate or not, bit 3   */
+    uint8_t message_type:4;/* @see MQTTMessageType, bits 4-7           */
 } struct_flags_and_type_t;
 
 /* FIXED HEADER */
@@ -174,18 +182,77 @@ typedef struct MQTT_connect
     uint8_t                              * client_id;
 } MQTT_connect_t;
 
+/* String view - pointer and length, no null termination needed. Can be a slice of a longer buffer. */
+typedef struct MQTT_string
+{
+    uint8_t  * ptr;
+    uint16_t   length;  /* MQTT strings are at most 65535 bytes */
+} MQTT_string_t;
+
+/* Pre-encoded CONNECT, built once and sent as is on every (re)connect */
+typedef struct MQTT_connect_frame
+{
+    uint8_t  * frame_ptr;   /* Encoded message in caller's storage */
+    uint16_t   frame_size;
+    uint16_t   keepalive;   /* Keepalive in the message, drives ping timing */
+} MQTT_connect_frame_t;
+
 /****************************************************************************************
  * @section state and data handling function pointers                                   *
  * Following function pointers are used with connection and subscribe functionalities.  *
  ****************************************************************************************/
 typedef void (*connected_fptr_t)(MQTTErrorCodes_t a_status);
 
+/**
+ * Subscribe callback.
+ *
+ * a_data_ptr and a_topic_ptr point into the buffer given to mqtt_receive() and are valid
+ * only until the callback returns.
+ */
 typedef void (*subscrbe_fptr_t)(MQTTErrorCodes_t   a_status,
                                 uint8_t          * a_data_ptr,
                                 uint32_t           a_data_len,
                                 uint8_t          * a_topic_ptr,
                                 uint16_t           a_topic_len);
 
+/**
+ * Borrowed view of a received PUBLISH message.
+ *
+ * All pointers refer to the receive buffer given to mqtt_receive() - nothing is copied.
+ * The view is valid until the callback returns, unless it is pinned with
+ * mqtt_message_retain(), in which case it is valid until mqtt_message_release().
+ */
+typedef struct MQTT_message_view
+{
+    uint8_t        * packet_ptr;     /* Start of the PUBLISH packet in receive buffer */
+    uint8_t        * topic_ptr;
+    uint16_t         topic_length;
+    uint8_t        * payload_ptr;
+    uint32_t         payload_length;
+    MQTTQoSLevel_t   qos;
+    bool             retain;
+    bool             dup;
+    MQTTErrorCodes_t status;         /* InvalidPayload when envelope was not decoded  */
+} MQTT_message_view_t;
+
+typedef void (*message_view_fptr_t)(MQTT_message_view_t * a_view_ptr);
+
+/**
+ * Batch callback (@see mqtt_set_message_batch_cb).
+ *
+ * Views of PUBLISH messages received one after another, in order. Views are valid
+ * until the callback returns, unless pinned with mqtt_message_retain().
+ */
+typedef void (*message_batch_fptr_t)(MQTT_message_view_t * a_views_ptr, size_t a_count);
+
+/**
+ * Receive buffer pin hook, implemented by the transport.
+ *
+ * a_pin true takes a reference to the receive buffer containing a_data_ptr, false drops it.
+ * Return false when the buffer can not be kept beyond the callback (caller must copy).
+ */
+typedef bool (*buffer_pin_fptr_t)(uint8_t * a_data_ptr, bool a_pin);
+
 
 /****************************************************************************************
  * @section input and output function pointers                                          *
@@ -196,6 +263,264 @@ typedef int (*data_stream_in_fptr_t)(uint8_t * a_data_ptr, size_t a_amount);
 
 typedef int (*data_stream_out_fptr_t)(uint8_t * a_data_ptr, size_t a_amount);
 
+/**
+ * Payload source of a streamed publish (@see mqtt_publish_stream).
+ *
+ * Copy at most a_amount next payload bytes into a_data_ptr. a_offset is the position of the
+ * first requested byte within the payload, so random access sources (pread, flash) need no state.
+ * Return amount of bytes copied; 0 or negative value aborts the publish.
+ */
+typedef int (*publish_pull_fptr_t)(uint8_t * a_data_ptr, size_t a_amount, size_t a_offset);
+
+
+/**
+ * Writable callback.
+ *
+ * Called from mqtt_output_flush() when pending output drops to the low watermark
+ * after publishing was blocked by the high watermark.
+ */
+typedef void (*writable_fptr_t)(void);
+
+/**
+ * Startup callback (@see mqtt_connect_pipelined).
+ *
+ * Called right after CONNECT is gathered. SUBSCRIBE and PUBLISH packets sent from the
+ * callback (mqtt_subscribe with zero timeout, mqtt_publish) follow CONNECT in the same write.
+ */
+typedef void (*startup_fptr_t)(void);
+
+/**
+ * Pending output queue (optional, @see mqtt_set_output_queue).
+ *
+ * Bytes which transport did not accept (short write) are kept here in order and
+ * written out later by mqtt_output_flush().
+ */
+typedef struct MQTT_output_queue
+{
+    uint8_t          * buffer;          /* Queue memory given by the application  */
+    size_t             size;            /* Size of queue memory                   */
+    size_t             head;            /* Index of the oldest pending byte       */
+    size_t             used;            /* Amount of pending bytes                */
+    size_t             high_watermark;  /* Publish is refused at this level       */
+    size_t             low_watermark;   /* Publish is accepted again at this level*/
+    bool               blocked;         /* High watermark reached                 */
+    MQTTErrorCodes_t   status;          /* Result of the latest write             */
+    writable_fptr_t    writable_fptr;   /* Called when blocked state is cleared   */
+} MQTT_output_queue_t;
+
+/**
+ * Message batch (optional, @see mqtt_set_message_batch_cb).
+ */
+typedef struct MQTT_message_batch
+{
+    message_batch_fptr_t   batch_fptr;  /* Receiver of collected messages         */
+    MQTT_message_view_t  * views;       /* View array given by the application    */
+    size_t                 size;        /* Capacity of view array                 */
+    size_t                 used;        /* Views collected so far                 */
+} MQTT_message_batch_t;
+
+/**
+ * Ack coalescer (optional, @see mqtt_set_ack_coalescing).
+ *
+ * PUBACKs of received QoS 1 messages wait here to be written out together.
+ */
+typedef struct MQTT_ack_coalescer
+{
+    uint8_t          * buffer;          /* Ack memory given by the application    */
+    size_t             size;            /* Size of ack memory                     */
+    size_t             used;            /* Bytes of waiting acks                  */
+    uint32_t           deadline_ms;     /* Longest wait, 0 = end of receive call  */
+    int32_t            time_left_ms;    /* Time until waiting acks are written    */
+} MQTT_ack_coalescer_t;
+
+/**
+ * Outbound lanes of the scheduler (@see mqtt_schedule), highest priority first.
+ *
+ * Control packets (PINGREQ, PUBACK, SUBSCRIBE, DISCONNECT) are not queued, they are
+ * written at once and so go before every lane.
+ */
+typedef enum MQTTLane
+{
+    LANE_ALARM = 0,
+    LANE_TELEMETRY,
+    LANE_BULK,
+    LANE_COUNT
+} MQTTLane_t;
+
+/**
+ * Scheduled message, memory given by the application (@see mqtt_schedule).
+ *
+ * Application fills topic and payload. Message and its data must stay valid until
+ * the scheduled callback has been called for it.
+ */
+typedef struct MQTT_scheduled
+{
+    char                  * topic_ptr;      /* Topic name                              */
+    uint16_t                topic_size;     /* Size of topic name                      */
+    char                  * payload_ptr;    /* Payload in memory, NULL uses pull_fptr  */
+    publish_pull_fptr_t     pull_fptr;      /* Payload source when not in memory       */
+    size_t                  payload_size;   /* Total size of payload                   */
+    size_t                  sent;           /* Payload bytes sent so far               */
+    uint64_t                deadline_ms;    /* Dropped if not started by then, 0=never */
+    bool                    conflate;       /* Newer message to same topic replaces it */
+    uint8_t                 lane;           /* Lane it is queued in                    */
+    uint16_t                chunk_id;       /* Message id in chunk headers             */
+    struct MQTT_scheduled * prev;           /* Previous message in the same lane       */
+    struct MQTT_scheduled * next;           /* Next message in the same lane           */
+} MQTT_scheduled_t;
+
+/**
+ * Scheduled callback.
+ *
+ * Message has left the scheduler: Successfull when sent, Expired when dropped stale
+ * before its first byte was sent, Conflated when replaced by a newer message to the
+ * same topic, other error code when it could not be sent.
+ */
+typedef void (*scheduled_fptr_t)(MQTT_scheduled_t * a_message_ptr, MQTTErrorCodes_t a_status);
+
+/**
+ * Outbound scheduler (optional, @see mqtt_set_scheduler).
+ */
+typedef struct MQTT_scheduler
+{
+    MQTT_scheduled_t * head[LANE_COUNT];    /* Oldest message of each lane           */
+    MQTT_scheduled_t * tail[LANE_COUNT];    /* Newest message of each lane           */
+    uint8_t          * chunk_buffer;        /* Pulled payload memory (opt.)          */
+    size_t             chunk_size;          /* Bulk payload bytes in one PUBLISH     */
+    uint64_t           now_ms;              /* Time advanced by mqtt_schedule_run()  */
+    scheduled_fptr_t   scheduled_fptr;      /* Called when message leaves            */
+    MQTT_scheduled_t** conflation_index;    /* Topic hash to queued message (opt.)   */
+    uint32_t           conflation_size;     /* Slots in conflation index             */
+    uint16_t           next_chunk_id;       /* Id of the next split message          */
+} MQTT_scheduler_t;
+
+/**
+ * Reassembly of a split payload, memory given by the application (@see mqtt_chunks_add).
+ */
+typedef struct MQTT_chunk_assembly
+{
+    uint8_t  * buffer;      /* Reassembled payload memory              */
+    size_t     size;        /* Size of payload memory                  */
+    size_t     used;        /* Bytes of the current message so far     */
+    uint16_t   chunk_id;    /* Message the chunks belong to            */
+} MQTT_chunk_assembly_t;
+
+/**
+ * Token bucket of a publish rate limit (@see mqtt_set_rate_limits).
+ *
+ * Application fills prefix, rates and bursts, library keeps the tokens. Tokens are
+ * counted in thousandths so that rates below one per millisecond refill exactly.
+ */
+typedef struct MQTT_rate_limit
+{
+    char     * prefix_ptr;       /* Topic prefix, NULL or empty for whole session */
+    uint16_t   prefix_size;      /* Size of topic prefix                          */
+    uint32_t   messages_per_s;   /* Publish rate, 0 = not limited                 */
+    uint32_t   message_burst;    /* Publishes allowed at once                     */
+    uint32_t   bytes_per_s;      /* Topic and payload bytes rate, 0 = not limited */
+    uint32_t   byte_burst;       /* Bytes allowed at once                         */
+    uint64_t   message_tokens;   /* Thousandths of publishes available            */
+    uint64_t   byte_tokens;      /* Thousandths of bytes available                */
+} MQTT_rate_limit_t;
+
+/**
+ * Payload codec (optional, @see mqtt_set_payload_codec).
+ *
+ * Encoded payload is sent in an envelope: marker byte, codec id and the codec output.
+ * Marker 0xFD never appears in UTF-8 text, so JSON and other text payloads are told
+ * apart without changing the topic. Id 0 means the payload follows as is, it is used
+ * for raw payloads which happen to start with the marker.
+ */
+#define MQTT_CODEC_MARKER    (0xFD)
+#define MQTT_CODEC_STORED    (0)
+#define MQTT_CODEC_RECORDS   (0xFF)   /* Record batch (@see mqtt_record_batch_init) */
+#define MQTT_CODEC_CHUNK     (0xFE)   /* Chunk of a split payload (@see mqtt_set_scheduler) */
+#define MQTT_CODEC_ENVELOPE  (2)
+
+/**
+ * Chunk header: envelope of MQTT_CODEC_CHUNK, message id (2 bytes), payload offset of the
+ * chunk (4 bytes), flags (1 byte), all big endian like the rest of MQTT.
+ */
+#define MQTT_CHUNK_HEADER    (MQTT_CODEC_ENVELOPE + 7)
+#define MQTT_CHUNK_LAST      (0x01)   /* Flag of the last chunk of a message */
+
+/**
+ * Payload codec function.
+ *
+ * Encode or decode a_input_size bytes from a_input_ptr straight into a_output_ptr.
+ * Return amount of bytes written, -1 when result does not fit into a_output_size or
+ * input is not valid.
+ */
+typedef int (*payload_codec_fptr_t)(uint8_t * a_input_ptr,
+                                    size_t    a_input_size,
+                                    uint8_t * a_output_ptr,
+                                    size_t    a_output_size);
+
+typedef struct MQTT_payload_codec
+{
+    payload_codec_fptr_t   compress_fptr;    /* Publish encoder, NULL sends payloads as is */
+    payload_codec_fptr_t   decompress_fptr;  /* Receive decoder, NULL delivers as is       */
+    uint8_t                id;               /* Codec id in the envelope, 1-253            */
+    uint8_t              * decode_buffer;    /* Decoded payload memory                     */
+    size_t                 decode_size;      /* Size of decoded payload memory             */
+} MQTT_payload_codec_t;
+
+/**
+ * Record batch, memory given by the application (@see mqtt_record_batch_init).
+ *
+ * Many small records to one topic in one PUBLISH: envelope of MQTT_CODEC_RECORDS followed
+ * by records, each prefixed with its length encoded like the MQTT remaining length.
+ */
+typedef struct MQTT_record_batch
+{
+    char                     * topic_ptr;     /* Topic of all records                  */
+    uint16_t                   topic_size;    /* Size of topic                         */
+    uint8_t                  * buffer;        /* Payload being gathered                */
+    size_t                     size;          /* Size of payload memory                */
+    size_t                     used;          /* Envelope and records so far           */
+    uint32_t                   count;         /* Records waiting                       */
+    uint32_t                   max_delay_ms;  /* Latency bound of a record, 0 = none   */
+    int32_t                    time_left_ms;  /* Until the oldest record is due        */
+    struct MQTT_record_batch * next;          /* Next batch of the session             */
+} MQTT_record_batch_t;
+
+/**
+ * Iterator over records of a received batch (@see mqtt_records_open).
+ */
+typedef struct MQTT_record_iterator
+{
+    uint8_t * next_ptr;    /* Length of the next record, NULL after malformed record */
+    uint8_t * end_ptr;     /* End of payload                                          */
+} MQTT_record_iterator_t;
+
+/**
+ * Startup flight (@see mqtt_connect_pipelined).
+ *
+ * Packets of the session startup are gathered here and written out together.
+ */
+typedef struct MQTT_pipeline
+{
+    uint8_t          * buffer;          /* Flight memory given by the application */
+    size_t             size;            /* Size of flight memory                  */
+    size_t             used;            /* Bytes gathered so far                  */
+} MQTT_pipeline_t;
+
+/**
+ * Packet identifier pool (optional, @see mqtt_set_packet_id_pool).
+ *
+ * One bit per packet identifier, set while the identifier waits for its ack. Bit 0 of
+ * the first word stands for the invalid identifier 0 and is always set.
+ */
+#define MQTT_PACKET_ID_MAX            (65535)
+#define MQTT_PACKET_ID_POOL_WORDS(n)  (((n) / 32) + 1)  /* Words covering identifiers 1..n */
+
+typedef struct MQTT_packet_id_pool
+{
+    uint32_t         * bitmap;          /* Bitmap memory given by the application */
+    uint32_t           words;           /* Amount of 32 bit words in bitmap       */
+    uint32_t           cursor;          /* Word where search of free id starts    */
+    uint32_t           in_use;          /* Identifiers waiting for ack            */
+} MQTT_packet_id_pool_t;
 
 /****************************************************************************************
  * @section shared data structure.                                                      *
@@ -214,6 +539,20 @@ typedef struct MQTT_shared_data
     int32_t                  keepalive_in_ms;         /* Keepalive timer value          */
     int32_t                  time_to_next_ping_in_ms; /* Keepalive counter              */
     bool                     subscribe_status;        /* Internal subscribe status flag */
+    message_view_fptr_t      message_view_cb_fptr;    /* Message view callback (opt.)   */
+    buffer_pin_fptr_t        buffer_pin_fptr;         /* Receive buffer pin hook (opt.) */
+    MQTT_output_queue_t      output_queue;            /* Pending output (opt.)          */
+    MQTT_packet_id_pool_t    packet_id_pool;          /* Packet identifiers (opt.)      */
+    bool                     validate_payload_utf8;   /* Publish only UTF-8 payloads    */
+    MQTT_pipeline_t          pipeline;                /* Startup flight being gathered  */
+    MQTT_message_batch_t     message_batch;           /* Received messages batch (opt.) */
+    MQTT_ack_coalescer_t     ack_coalescer;           /* Gathered PUBACKs (opt.)        */
+    MQTT_scheduler_t         scheduler;               /* Outbound lanes (opt.)          */
+    MQTT_rate_limit_t      * rate_limits;             /* Publish token buckets (opt.)   */
+    uint32_t                 rate_limit_count;        /* Amount of token buckets        */
+    MQTT_payload_codec_t     payload_codec;           /* Payload compression (opt.)     */
+    MQTT_record_batch_t    * record_batches;          /* Batches with latency bound     */
+    bool                     unbatch_records;         /* Deliver batch records one by one */
 } MQTT_shared_data_t;
 
 /****************************************************************************************
@@ -237,9 +576,18 @@ typedef struct MQTT_publish
     uint32_t                  output_buffer_size;
 } MQTT_publish_t;
 
+typedef struct MQTT_publish_stream
+{
+    struct_flags_and_type_t   flags;
+    uint8_t                 * topic_ptr;
+    uint16_t                  topic_length;
+    uint32_t                  message_size;  /* Total payload size announced in the header */
+    publish_pull_fptr_t       pull_fptr;     /* Payload source, called until message_size */
+} MQTT_publish_stream_t;
+
 typedef struct MQTT_subscribe
 {
-    MQTTQoSLevel_t   qos;
+    MQTTQoSLevel_t   qos;           /* Requested QoS, QoS2 is requested as QoS1 */
     uint8_t        * topic_ptr;
     uint16_t         topic_length;
 } MQTT_subscribe_t;
@@ -247,12 +595,14 @@ typedef struct MQTT_subscribe
 typedef struct MQTT_action_data
 {
     union {
-        MQTT_shared_data_t  * shared_ptr;
-        MQTT_connect_t      * connect_ptr;
-        uint32_t              epalsed_time_in_ms;
-        MQTT_input_stream_t * input_stream_ptr;
-        MQTT_publish_t      * publish_ptr;
-        MQTT_subscribe_t    * subscribe_ptr;
+        MQTT_shared_data_t    * shared_ptr;
+        MQTT_connect_t        * connect_ptr;
+        MQTT_connect_frame_t  * connect_frame_ptr;
+        uint32_t                epalsed_time_in_ms;
+        MQTT_input_stream_t   * input_stream_ptr;
+        MQTT_publish_t        * publish_ptr;
+        MQTT_publish_stream_t * publish_stream_ptr;
+        MQTT_subscribe_t      * subscribe_ptr;
     } action_argument;
 } MQTT_action_data_t;
 
@@ -324,6 +674,156 @@ bool mqtt_connect(char                   * a_client_name_ptr,
                   subscrbe_fptr_t          a_subscribe_fptr,
                   uint8_t                  a_timeout_in_sec);
 
+/**
+ * mqtt_string user API
+ *
+ * Make string view of null terminated string. The string is measured once, views can be
+ * passed around without walking the string again.
+ *
+ * @param a_str_ptr [in] null terminated string or NULL.
+ * @return view, length is zero for NULL. String longer than 65535 bytes gives an invalid
+ *         view, which is refused by every call taking views (@see mqtt_string_valid).
+ */
+MQTT_string_t mqtt_string(char * a_str_ptr);
+
+/**
+ * mqtt_string_valid user API
+ *
+ * @param a_string [in] string view.
+ * @return true when view has data or is empty, false for a view made of a too long string.
+ */
+bool mqtt_string_valid(MQTT_string_t a_string);
+
+/**
+ * mqtt_connect_string user API
+ *
+ * Same as mqtt_connect, strings are given as views @see MQTT_string_t.
+ * Optional parameters are left out when zero length. Last will needs both
+ * topic and message. Connect is refused when any view is not valid.
+ *
+ * @param a_client_id [in] name of client which is connecting to broker.
+ * @param a_keepalive_timeout [in] 0-x keepalive time in seconds (0=disabled).
+ * @param a_username [in] username.
+ * @param a_password [in] password.
+ * @param a_last_will_topic [in] last will topic.
+ * @param a_last_will [in] last will data.
+ * @param mqtt_shared_data_ptr [in] @see mqtt_shared_data_ptr.
+ * @param a_output_buffer_ptr [in] common/shared output buffer.
+ * @param a_output_buffer_size [in] maximum size of output buffer.
+ * @param a_clean_session [in] is session clean or should broker restore it.
+ * @param a_out_write_fptr [in] @see data_stream_out_fptr_t.
+ * @param a_connected_fptr [in] @see connected_fptr_t.
+ * @param a_subscribe_fptr [in] @see subscrbe_fptr_t.
+ * @param a_timeout_in_sec [in] connect timeout in seconds.
+ * @return true if successfully connected.
+ */
+bool mqtt_connect_string(MQTT_string_t            a_client_id,
+                         uint16_t                 a_keepalive_timeout,
+                         MQTT_string_t            a_username,
+                         MQTT_string_t            a_password,
+                         MQTT_string_t            a_last_will_topic,
+                         MQTT_string_t            a_last_will,
+                         MQTT_shared_data_t     * mqtt_shared_data_ptr,
+                         uint8_t                * a_output_buffer_ptr,
+                         size_t                   a_output_buffer_size,
+                         bool                     a_clean_session,
+                         data_stream_out_fptr_t   a_out_write_fptr,
+                         connected_fptr_t         a_connected_fptr,
+                         subscrbe_fptr_t          a_subscribe_fptr,
+                         uint8_t                  a_timeout_in_sec);
+
+/**
+ * mqtt_connect_prebuild user API
+ *
+ * Encode CONNECT message once into given storage, @see mqtt_connect_prebuilt.
+ * Strings are copied, storage must stay valid as long as the frame is used.
+ * Optional parameters are left out when zero length. Last will needs both
+ * topic and message.
+ *
+ * @param a_frame_ptr [out] @see MQTT_connect_frame_t.
+ * @param a_storage_ptr [in] storage for the encoded message.
+ * @param a_storage_size [in] size of the storage.
+ * @param a_client_id [in] name of client which is connecting to broker.
+ * @param a_username [in] username.
+ * @param a_password [in] password.
+ * @param a_last_will_topic [in] last will topic.
+ * @param a_last_will [in] last will data.
+ * @param a_keepalive_timeout [in] 0-x keepalive time in seconds (0=disabled).
+ * @param a_clean_session [in] is session clean or should broker restore it.
+ * @return true when encoded, false when storage is too small or client name missing.
+ */
+bool mqtt_connect_prebuild(MQTT_connect_frame_t * a_frame_ptr,
+                           uint8_t              * a_storage_ptr,
+                           size_t                 a_storage_size,
+                           MQTT_string_t          a_client_id,
+                           MQTT_string_t          a_username,
+                           MQTT_string_t          a_password,
+                           MQTT_string_t          a_last_will_topic,
+                           MQTT_string_t          a_last_will,
+                           uint16_t               a_keepalive_timeout,
+                           bool                   a_clean_session);
+
+/**
+ * mqtt_connect_prebuilt user API
+ *
+ * Same as mqtt_connect, but sends frame made by mqtt_connect_prebuild as is.
+ * Nothing is encoded per attempt, which keeps mass reconnects cheap.
+ *
+ * @param a_frame_ptr [in] @see MQTT_connect_frame_t.
+ * @param mqtt_shared_data_ptr [in] @see mqtt_shared_data_ptr.
+ * @param a_output_buffer_ptr [in] common/shared output buffer.
+ * @param a_output_buffer_size [in] maximum size of output buffer.
+ * @param a_out_write_fptr [in] @see data_stream_out_fptr_t.
+ * @param a_connected_fptr [in] @see connected_fptr_t.
+ * @param a_subscribe_fptr [in] @see subscrbe_fptr_t.
+ * @param a_timeout_in_sec [in] connect timeout in seconds.
+ * @return true if successfully connected.
+ */
+bool mqtt_connect_prebuilt(MQTT_connect_frame_t   * a_frame_ptr,
+                           MQTT_shared_data_t     * mqtt_shared_data_ptr,
+                           uint8_t                * a_output_buffer_ptr,
+                           size_t                   a_output_buffer_size,
+                           data_stream_out_fptr_t   a_out_write_fptr,
+                           connected_fptr_t         a_connected_fptr,
+                           subscrbe_fptr_t          a_subscribe_fptr,
+                           uint8_t                  a_timeout_in_sec);
+
+/**
+ * mqtt_connect_pipelined user API
+ *
+ * Same as mqtt_connect_prebuilt, but does not wait for CONNACK before the session
+ * is used. CONNECT and packets sent from the startup callback are gathered into
+ * the flight buffer and written with one transport write, so subscriptions and
+ * first publishes reach the broker one round trip after connecting instead of
+ * one round trip each. CONNACK is reported through a_connected_fptr and each
+ * SUBACK through a_subscribe_fptr as they arrive. A packet which does not fit
+ * into the flight buffer is refused (send function returns false), streamed
+ * publish is refused during startup. Options which are set after connecting
+ * (output queue, packet identifier pool) can be set in the startup callback.
+ *
+ * @param a_frame_ptr [in] @see MQTT_connect_frame_t.
+ * @param mqtt_shared_data_ptr [in] @see mqtt_shared_data_ptr.
+ * @param a_output_buffer_ptr [in] common/shared output buffer.
+ * @param a_output_buffer_size [in] maximum size of output buffer.
+ * @param a_flight_ptr [in] memory where the startup packets are gathered.
+ * @param a_flight_size [in] size of the flight memory.
+ * @param a_out_write_fptr [in] @see data_stream_out_fptr_t.
+ * @param a_connected_fptr [in] @see connected_fptr_t.
+ * @param a_subscribe_fptr [in] @see subscrbe_fptr_t.
+ * @param a_startup_fptr [in] @see startup_fptr_t (can be NULL).
+ * @return true when the startup flight was written.
+ */
+bool mqtt_connect_pipelined(MQTT_connect_frame_t   * a_frame_ptr,
+                            MQTT_shared_data_t     * mqtt_shared_data_ptr,
+                            uint8_t                * a_output_buffer_ptr,
+                            size_t                   a_output_buffer_size,
+                            uint8_t                * a_flight_ptr,
+                            size_t                   a_flight_size,
+                            data_stream_out_fptr_t   a_out_write_fptr,
+                            connected_fptr_t         a_connected_fptr,
+                            subscrbe_fptr_t          a_subscribe_fptr,
+                            startup_fptr_t           a_startup_fptr);
+
 /**
  * mqtt_disconnect user API
  *
@@ -368,6 +868,61 @@ bool mqtt_publish_buf(char    * a_topic_ptr,
                       uint8_t * a_output_buffer_ptr,
                       uint32_t  a_output_buffer_size);
 
+/**
+ * mqtt_publish_string user API
+ *
+ * Same as mqtt_publish, topic is given as view @see MQTT_string_t.
+ *
+ * @param a_topic [in] topic.
+ * @param a_msg_ptr [in] pointer to data which shall be published.
+ * @param a_msg_size [in] size of data to be published.
+ * @return true when publish was sent.
+ */
+bool mqtt_publish_string(MQTT_string_t   a_topic,
+                         uint8_t       * a_msg_ptr,
+                         size_t          a_msg_size);
+
+/**
+ * mqtt_publish_try user API
+ *
+ * Same as mqtt_publish, but reports why publish was not sent. With output queue
+ * in use (@see mqtt_set_output_queue) WouldBlock tells that the transport is
+ * congested and publish should be retried after writable callback. RateLimited
+ * tells that publish is over a rate limit (@see mqtt_set_rate_limits).
+ *
+ * @param a_topic_ptr [in] topic (all values alloved = non chars).
+ * @param a_topic_size [in] size of topic.
+ * @param a_msg_ptr [in] pointer to data which shall be published.
+ * @param a_msg_size [in] size of data to be published.
+ * @return Successfull, WouldBlock or other error code @see MQTTErrorCodes_t.
+ */
+MQTTErrorCodes_t mqtt_publish_try(char * a_topic_ptr,
+                                  size_t a_topic_size,
+                                  char * a_msg_ptr,
+                                  size_t a_msg_size);
+
+/**
+ * mqtt_publish_stream user API
+ *
+ * Publish payload which is not in memory as a whole. Total size is announced in the
+ * header and payload is pulled in chunks through the shared transmit buffer, so memory
+ * use does not depend on the payload size. If the source or transport fails midway, the
+ * packet on the wire is left incomplete: session goes to disconnected state and the
+ * connection must be re-established. With output queue in use, streaming starts only
+ * when nothing is pending, and only a packet which fits into the queue as a whole is
+ * safe against a slow transport.
+ *
+ * @param a_topic_ptr [in] topic (all values alloved = non chars).
+ * @param a_topic_size [in] size of topic.
+ * @param a_msg_size [in] total size of data to be published.
+ * @param a_pull_fptr [in] payload source @see publish_pull_fptr_t.
+ * @return true when all a_msg_size bytes were sent out.
+ */
+bool mqtt_publish_stream(char                * a_topic_ptr,
+                         size_t                a_topic_size,
+                         size_t                a_msg_size,
+                         publish_pull_fptr_t   a_pull_fptr);
+
 /**
  * mqtt_subscribe user API
  *
@@ -382,6 +937,18 @@ bool mqtt_subscribe(char    * a_topic,
                     uint16_t  a_topic_size,
                     uint8_t   a_timeout_in_sec);
 
+/**
+ * mqtt_subscribe_string user API
+ *
+ * Same as mqtt_subscribe, topic filter is given as view @see MQTT_string_t.
+ *
+ * @param a_topic_filter [in] topic filter to be subscribed.
+ * @param a_timeout_in_sec [in] timeout in seconds
+ * @return true when subscirbe succeeded.
+ */
+bool mqtt_subscribe_string(MQTT_string_t a_topic_filter,
+                           uint8_t       a_timeout_in_sec);
+
 /**
  * mqtt_keepalive user API
  *
@@ -400,13 +967,500 @@ bool mqtt_keepalive(uint32_t a_duration_in_ms);
  * mqtt_receive user API
  *
  * Feed received MQTT message to this function.
- * The function will parce it for you.
+ * The function will parce it for you. Received QoS 1 messages are acknowledged
+ * through the session output, the same output publish writes to, before they are
+ * delivered. A message whose PUBACK is not taken by the output is not delivered;
+ * give it again later. A partially written PUBACK breaks the session. QoS 2 is not
+ * acknowledged, subscriptions request at most QoS 1. Session is not locked by the
+ * library: receive, publish and keepalive of one session are called from one thread,
+ * or the application serializes them.
  *
  * @param a_data [in] beginning of received MQTT message.
  * @param a_amount [in] amount received data.
- * @return true when message successfully interpreted.
+ * @return true when message successfully interpreted, false also when its PUBACK was not taken.
  */
 bool mqtt_receive(uint8_t * a_data,
                   size_t    a_amount);
 
+/**
+ * mqtt_receive_stream user API
+ *
+ * Feed data of one read to this function, it may hold many MQTT messages. All whole
+ * messages are parsed, without per message API dispatch. Bytes of an incomplete last
+ * message are not consumed; give them again at the beginning of the next call.
+ * PUBACKs are written as in mqtt_receive(), same threading rule applies. Parsing
+ * stops at a QoS 1 message whose PUBACK is not taken, it is not consumed either.
+ *
+ * @param a_data [in] received data.
+ * @param a_amount [in] amount received data.
+ * @return amount of bytes consumed (whole messages).
+ */
+size_t mqtt_receive_stream(uint8_t * a_data,
+                           size_t    a_amount);
+
+/**
+ * mqtt_set_message_batch_cb user API
+ *
+ * Deliver received messages in batches instead of one callback per message. Views of
+ * consecutive PUBLISH messages are collected into the given array and handed to the
+ * batch callback when the array is full, before any other packet is handled and at
+ * the end of each mqtt_receive / mqtt_receive_stream call. Takes precedence over the
+ * message view and subscribe callbacks for messages; SUBACK is still reported through
+ * the subscribe callback. Call after mqtt_connect().
+ *
+ * @param a_batch_fptr [in] @see message_batch_fptr_t, NULL disables batching.
+ * @param a_views_ptr [in] view array, filled by the library.
+ * @param a_max_views [in] number of views in the array.
+ * @return true when batching was set.
+ */
+bool mqtt_set_message_batch_cb(message_batch_fptr_t   a_batch_fptr,
+                               MQTT_message_view_t  * a_views_ptr,
+                               size_t                 a_max_views);
+
+/**
+ * mqtt_set_ack_coalescing user API
+ *
+ * Received QoS 1 messages are acknowledged with PUBACK, by default one write per
+ * message. With coalescing PUBACKs are gathered into the given buffer and written in
+ * one write at the end of each mqtt_receive / mqtt_receive_stream call, or with a
+ * deadline when mqtt_keepalive() finds the oldest waiting ack a_deadline_ms old.
+ * Acks keep the order of the messages and are always written before any later packet
+ * of the client; a due keepalive ping flushes them too. Full buffer is flushed before
+ * the next ack. Call after mqtt_connect().
+ *
+ * @param a_buffer_ptr [in] ack memory (4 bytes per ack), NULL disables coalescing.
+ * @param a_buffer_size [in] size of ack memory.
+ * @param a_deadline_ms [in] longest time an ack waits, 0 flushes at end of each receive call.
+ * @return true when coalescing was set, false when waiting acks could not be written.
+ */
+bool mqtt_set_ack_coalescing(uint8_t  * a_buffer_ptr,
+                             size_t     a_buffer_size,
+                             uint32_t   a_deadline_ms);
+
+/**
+ * mqtt_set_message_view_cb user API
+ *
+ * Deliver received messages as borrowed views instead of through subscribe callback.
+ * Subscribe callback is still used for SUBACK status. Call after mqtt_connect().
+ *
+ * @param a_view_fptr [in] @see message_view_fptr_t, NULL restores subscribe callback.
+ * @param a_pin_fptr [in] transport pin hook @see buffer_pin_fptr_t, NULL disables retain.
+ * @return None
+ */
+void mqtt_set_message_view_cb(message_view_fptr_t a_view_fptr,
+                              buffer_pin_fptr_t   a_pin_fptr);
+
+/**
+ * mqtt_message_retain user API
+ *
+ * Keep message view valid after the callback returns, e.g. to hand it over to
+ * another thread without copying. Every successful retain needs one release.
+ *
+ * @param a_view_ptr [in] view given to message view callback.
+ * @return true when pinned, false when transport can not pin or payload was decoded
+ *         into decode memory of the payload codec (copy the data instead).
+ */
+bool mqtt_message_retain(MQTT_message_view_t * a_view_ptr);
+
+/**
+ * mqtt_message_release user API
+ *
+ * Release message view pinned by mqtt_message_retain(). Can be called from any thread.
+ *
+ * @param a_view_ptr [in] retained view.
+ * @return None
+ */
+void mqtt_message_release(MQTT_message_view_t * a_view_ptr);
+
+/**
+ * mqtt_set_output_queue user API
+ *
+ * Enable backpressure on the send path. Transport (out_fptr) may then accept less
+ * than requested (0 when its buffer is full, negative only when connection is lost);
+ * remaining bytes are kept in the given queue. Publish and subscribe return WouldBlock
+ * when pending output reaches the high watermark, until mqtt_output_flush() has
+ * brought it down to the low watermark. Queue must fit the biggest packet sent,
+ * i.e. at least the shared buffer size. Call after mqtt_connect().
+ *
+ * @param a_queue_ptr [in] queue memory, NULL disables the queue.
+ * @param a_queue_size [in] size of queue memory.
+ * @param a_high_watermark [in] pending bytes at which publishing is blocked.
+ * @param a_low_watermark [in] pending bytes at which publishing is allowed again.
+ * @param a_writable_fptr [in] @see writable_fptr_t (can be NULL).
+ * @return true when queue was taken into use.
+ */
+bool mqtt_set_output_queue(uint8_t         * a_queue_ptr,
+                           size_t            a_queue_size,
+                           size_t            a_high_watermark,
+                           size_t            a_low_watermark,
+                           writable_fptr_t   a_writable_fptr);
+
+/**
+ * mqtt_output_flush user API
+ *
+ * Write pending output to the transport. Call when transport is writable again.
+ *
+ * @return Successfull when queue is empty, WouldBlock when data is still pending,
+ *         ServerUnavailabe when the transport failed.
+ */
+MQTTErrorCodes_t mqtt_output_flush();
+
+/**
+ * mqtt_output_pending user API
+ *
+ * @return amount of bytes waiting in the output queue.
+ */
+size_t mqtt_output_pending();
+
+/**
+ * mqtt_output_blocked user API
+ *
+ * @return true when high watermark has been reached and publishing is refused.
+ */
+bool mqtt_output_blocked();
+
+/**
+ * mqtt_set_packet_id_pool user API
+ *
+ * Track packet identifiers which wait for an ack. Identifier of QoS 1 publish and
+ * subscribe is taken from the pool and given back when PUBACK, PUBCOMP or SUBACK with
+ * it is received, so an identifier in flight is never reused. Publish and subscribe
+ * return WouldBlock when all identifiers are in flight. Without pool identifiers are
+ * taken from a wrapping counter. Call after mqtt_connect().
+ *
+ * @param a_bitmap_ptr [in] bitmap memory, NULL disables the pool.
+ * @param a_bitmap_words [in] size of bitmap in 32 bit words, MQTT_PACKET_ID_POOL_WORDS(n)
+ *                            covers identifiers 1..n (at most MQTT_PACKET_ID_MAX).
+ * @return true when pool was taken into use.
+ */
+bool mqtt_set_packet_id_pool(uint32_t * a_bitmap_ptr,
+                             size_t     a_bitmap_words);
+
+/**
+ * mqtt_packet_id_release user API
+ *
+ * Give packet identifier back to the pool. Acks parsed by mqtt_receive() are handled
+ * already, this is for acks which application handles itself.
+ *
+ * @param a_packet_id [in] packet identifier.
+ * @return true when identifier was in use.
+ */
+bool mqtt_packet_id_release(uint16_t a_packet_id);
+
+/**
+ * mqtt_packet_ids_in_use user API
+ *
+ * @return amount of packet identifiers waiting for an ack.
+ */
+uint32_t mqtt_packet_ids_in_use();
+
+/**
+ * mqtt_topic_valid user API
+ *
+ * Check topic against MQTT 3.1.1 rules: 1-65535 bytes of UTF-8 without U+0000. Topic
+ * name must not contain wildcards, in topic filter '+' must be a whole level and '#'
+ * a whole last level. Publish and subscribe check topics with this and return
+ * InvalidTopic instead of sending a packet which broker would disconnect for.
+ *
+ * @param a_topic_ptr [in] topic, not null terminated.
+ * @param a_topic_length [in] length of topic in bytes.
+ * @param a_filter [in] true for subscribe topic filter, false for publish topic name.
+ * @return true when topic is valid.
+ */
+bool mqtt_topic_valid(const uint8_t * a_topic_ptr,
+                      size_t          a_topic_length,
+                      bool            a_filter);
+
+/**
+ * mqtt_utf8_valid user API
+ *
+ * @param a_data_ptr [in] data to check.
+ * @param a_size [in] size of data in bytes.
+ * @return true when data is well-formed UTF-8 (RFC 3629).
+ */
+bool mqtt_utf8_valid(const uint8_t * a_data_ptr,
+                     size_t          a_size);
+
+/**
+ * mqtt_set_payload_validation user API
+ *
+ * Refuse publishing payloads which are not UTF-8 (InvalidPayload), for applications
+ * promising text payloads to their subscribers. Streamed publish is not checked and
+ * record batches are checked record by record (@see mqtt_record_append).
+ * Disabled by default. Call after mqtt_connect().
+ *
+ * @param a_utf8 [in] true enables UTF-8 check of publish payloads.
+ * @return None
+ */
+void mqtt_set_payload_validation(bool a_utf8);
+
+/**
+ * mqtt_set_payload_codec user API
+ *
+ * Compress publish payloads and decompress received ones. The encoder writes straight
+ * into the output buffer after the headers, which are then put in front of it, so the
+ * payload is not copied in between. The envelope (@see MQTT_CODEC_MARKER) is used only
+ * when it makes the payload smaller, other payloads go out unchanged. Received payloads
+ * in an envelope of a_id are decoded into a_decode_buffer_ptr before delivery, decoded
+ * payload is valid during the callback only. Streamed publish is not encoded.
+ * Envelope which does not decode (other codec id, decoder failure, broken record
+ * batch) is delivered as received, in order, through the same batch, view or subscribe
+ * callback with status InvalidPayload (MQTT_message_view_t status or a_status).
+ * Call after mqtt_connect().
+ *
+ * @param a_compress_fptr [in] encoder @see payload_codec_fptr_t (can be NULL).
+ * @param a_decompress_fptr [in] decoder @see payload_codec_fptr_t (can be NULL).
+ * @param a_id [in] codec id written to and expected from the envelope, 1-253.
+ * @param a_decode_buffer_ptr [in] memory for decoded payloads, needed with decoder.
+ * @param a_decode_size [in] size of decode memory, largest decoded payload.
+ * @return true when codec was set, NULL functions remove it.
+ */
+bool mqtt_set_payload_codec(payload_codec_fptr_t   a_compress_fptr,
+                            payload_codec_fptr_t   a_decompress_fptr,
+                            uint8_t                a_id,
+                            uint8_t              * a_decode_buffer_ptr,
+                            size_t                 a_decode_size);
+
+/**
+ * mqtt_record_batch_init user API
+ *
+ * Gather small records to one topic into a single PUBLISH, so that the broker handles
+ * one message per batch instead of one per record. Batch is published when the next
+ * record would not fit, when the oldest record has waited a_max_delay_ms (timed by
+ * mqtt_keepalive()) or with mqtt_record_flush(). Payload of a batch must fit into the
+ * shared buffer together with the topic. Call after mqtt_connect().
+ *
+ * @param a_batch_ptr [in] batch memory, kept by the session until mqtt_record_batch_close().
+ * @param a_topic_ptr [in] topic of the records.
+ * @param a_topic_size [in] size of topic.
+ * @param a_buffer_ptr [in] memory for the batch payload.
+ * @param a_buffer_size [in] size of batch payload memory.
+ * @param a_max_delay_ms [in] longest time a record waits, 0 = no time bound.
+ * @return true when batch was set up.
+ */
+bool mqtt_record_batch_init(MQTT_record_batch_t * a_batch_ptr,
+                            char                * a_topic_ptr,
+                            uint16_t              a_topic_size,
+                            uint8_t             * a_buffer_ptr,
+                            size_t                a_buffer_size,
+                            uint32_t              a_max_delay_ms);
+
+/**
+ * mqtt_record_append user API
+ *
+ * Add record to the batch, publishing the batch first when the record does not fit.
+ *
+ * @param a_batch_ptr [in] batch @see mqtt_record_batch_init.
+ * @param a_record_ptr [in] record data.
+ * @param a_record_size [in] size of record.
+ * @return Successfull, InvalidArgument when record can not fit into a batch, InvalidPayload
+ *         when record is not UTF-8 while payload validation is on, or status of the
+ *         publish which did not go out (WouldBlock, RateLimited...), record not added.
+ */
+MQTTErrorCodes_t mqtt_record_append(MQTT_record_batch_t * a_batch_ptr,
+                                    uint8_t             * a_record_ptr,
+                                    size_t                a_record_size);
+
+/**
+ * mqtt_record_flush user API
+ *
+ * Publish waiting records now.
+ *
+ * @param a_batch_ptr [in] batch @see mqtt_record_batch_init.
+ * @return Successfull or status of the publish, records are kept when it failed.
+ */
+MQTTErrorCodes_t mqtt_record_flush(MQTT_record_batch_t * a_batch_ptr);
+
+/**
+ * mqtt_record_batch_close user API
+ *
+ * Publish waiting records and detach batch from the session.
+ *
+ * @param a_batch_ptr [in] batch @see mqtt_record_batch_init.
+ * @return Successfull or status of the publish, batch is detached anyway.
+ */
+MQTTErrorCodes_t mqtt_record_batch_close(MQTT_record_batch_t * a_batch_ptr);
+
+/**
+ * mqtt_set_record_unbatching user API
+ *
+ * Deliver records of received batches one by one to the subscribe, view or batch
+ * callback, as if each had been a PUBLISH of its own. Off by default, batch payloads
+ * are then delivered as received.
+ *
+ * @param a_unbatch [in] true enables unbatching.
+ * @return None
+ */
+void mqtt_set_record_unbatching(bool a_unbatch);
+
+/**
+ * mqtt_records_open user API
+ *
+ * Start iterating records of a received payload.
+ *
+ * @param a_iterator_ptr [out] iterator.
+ * @param a_payload_ptr [in] received payload.
+ * @param a_payload_size [in] size of payload.
+ * @return true when payload is a record batch.
+ */
+bool mqtt_records_open(MQTT_record_iterator_t * a_iterator_ptr,
+                       uint8_t                * a_payload_ptr,
+                       uint32_t                 a_payload_size);
+
+/**
+ * mqtt_records_next user API
+ *
+ * @param a_iterator_ptr [in] iterator @see mqtt_records_open.
+ * @param a_record_ptr [out] record, points into the payload.
+ * @param a_record_size_ptr [out] size of record.
+ * @return true when record was found, false at the end or at a malformed record
+ *         (next_ptr of the iterator is then NULL).
+ */
+bool mqtt_records_next(MQTT_record_iterator_t  * a_iterator_ptr,
+                       uint8_t                ** a_record_ptr,
+                       uint32_t                * a_record_size_ptr);
+
+/**
+ * mqtt_set_scheduler user API
+ *
+ * Send publishes through priority lanes instead of one FIFO. mqtt_schedule_run() sends
+ * the oldest message of the highest non-empty lane, one PUBLISH at a time, so an alarm
+ * waits at most for one packet in flight. Bulk and pulled payloads larger than
+ * a_chunk_size are split into PUBLISH packets of a_chunk_size bytes to the same topic,
+ * in order. Each of them starts with a chunk header (MQTT_CHUNK_HEADER), which tells
+ * the subscriber where the chunk belongs, and is put together again with
+ * mqtt_chunks_add(). Split payloads are not checked by mqtt_set_payload_validation().
+ * Other payloads go whole in one PUBLISH, one which does not fit into the shared buffer
+ * is reported with InvalidArgument. Chunk must fit into the shared buffer together with the topic. Call after mqtt_connect().
+ *
+ * @param a_chunk_buffer_ptr [in] memory for pulled and split payloads, NULL when there are none.
+ * @param a_chunk_size [in] payload bytes in one PUBLISH, header included, size of chunk buffer.
+ * @param a_scheduled_fptr [in] @see scheduled_fptr_t (can be NULL).
+ * @return true when scheduler was set.
+ */
+bool mqtt_set_scheduler(uint8_t          * a_chunk_buffer_ptr,
+                        size_t             a_chunk_size,
+                        scheduled_fptr_t   a_scheduled_fptr);
+
+/**
+ * mqtt_schedule user API
+ *
+ * Queue message to the end of a lane. Nothing is written before mqtt_schedule_run().
+ *
+ * @param a_message_ptr [in] message with topic and payload filled in.
+ * @param a_lane [in] @see MQTTLane_t.
+ * @param a_expiry_ms [in] message is dropped when not started within this time, 0 = never.
+ * @return true when message was queued.
+ */
+bool mqtt_schedule(MQTT_scheduled_t * a_message_ptr,
+                   MQTTLane_t         a_lane,
+                   uint32_t           a_expiry_ms);
+
+/**
+ * mqtt_set_rate_limits user API
+ *
+ * Keep publishes within broker quotas. Each publish is charged to every limit whose
+ * prefix starts its topic; a limit with empty prefix covers the whole session. When any
+ * of them is out of tokens the publish is not sent: mqtt_publish() and the other direct
+ * calls reject it (RateLimited), scheduled messages wait in their lane and conflate
+ * there when flagged (@see mqtt_schedule). Buckets start full and are refilled with the
+ * time given to mqtt_keepalive(). Publish larger than a byte burst goes out when the
+ * bucket is full.
+ *
+ * @param a_limits_ptr [in] limits, NULL removes limits.
+ * @param a_count [in] amount of limits.
+ * @return true when limits were set.
+ */
+bool mqtt_set_rate_limits(MQTT_rate_limit_t * a_limits_ptr,
+                          uint32_t            a_count);
+
+/**
+ * mqtt_set_conflation user API
+ *
+ * Enable last-value-wins for messages scheduled with conflate set. When such a message
+ * is scheduled while an unsent one to the same topic is queued, the new one takes the
+ * place of the old one in its lane and the old one is reported Conflated. Queued
+ * messages are then bounded by the number of topics, not by the sample rate. Index
+ * is an open addressing hash table; when it is full messages are queued as usual.
+ *
+ * @param a_index_ptr [in] memory for topic index, NULL disables conflation.
+ * @param a_index_size [in] slots in the index, more than conflated topics in use.
+ * @return true when conflation was set.
+ */
+bool mqtt_set_conflation(MQTT_scheduled_t ** a_index_ptr,
+                         uint32_t            a_index_size);
+
+/**
+ * mqtt_schedule_run user API
+ *
+ * Advance scheduler time, drop expired messages and send at most a_max_packets PUBLISH
+ * packets in priority order. Call from the same loop as mqtt_keepalive(); a small packet
+ * budget keeps pings and newly scheduled alarms close to their time.
+ *
+ * @param a_elapsed_ms [in] time since previous call.
+ * @param a_max_packets [in] most PUBLISH packets written by this call.
+ * @return Successfull, WouldBlock when transport is congested (@see mqtt_set_output_queue),
+ *         RateLimited when waiting messages are over their rate (@see mqtt_set_rate_limits),
+ *         NoConnection when session is not connected.
+ */
+MQTTErrorCodes_t mqtt_schedule_run(uint32_t a_elapsed_ms,
+                                   uint32_t a_max_packets);
+
+/**
+ * mqtt_schedule_pending user API
+ *
+ * @param a_lane [in] @see MQTTLane_t, LANE_COUNT for all lanes.
+ * @return amount of messages waiting in the lane.
+ */
+uint32_t mqtt_schedule_pending(MQTTLane_t a_lane);
+
+/**
+ * mqtt_chunks_init user API
+ *
+ * Set up reassembly of payloads split by the scheduler of the publisher.
+ *
+ * @param a_assembly_ptr [out] reassembly state.
+ * @param a_buffer_ptr [in] memory for the largest reassembled payload.
+ * @param a_buffer_size [in] size of memory.
+ * @return true when set up.
+ */
+bool mqtt_chunks_init(MQTT_chunk_assembly_t * a_assembly_ptr,
+                      uint8_t               * a_buffer_ptr,
+                      size_t                  a_buffer_size);
+
+/**
+ * mqtt_chunks_add user API
+ *
+ * Add received payload of a topic to its reassembly, one reassembly per topic. Chunks
+ * must arrive in order, as they do over one connection. A chunk with offset 0 starts
+ * a new message and drops an unfinished one.
+ *
+ * @param a_assembly_ptr [in] reassembly state @see mqtt_chunks_init.
+ * @param a_payload_ptr [in] received payload.
+ * @param a_payload_size [in] size of payload.
+ * @param a_message_ptr [out] complete message: reassembly memory, or the payload itself
+ *        when it was not split.
+ * @param a_message_size_ptr [out] size of complete message.
+ * @return Successfull when message is complete, WouldBlock when more chunks are needed,
+ *         InvalidPayload when a chunk is missing or message does not fit (message dropped).
+ */
+MQTTErrorCodes_t mqtt_chunks_add(MQTT_chunk_assembly_t  * a_assembly_ptr,
+                                 uint8_t                * a_payload_ptr,
+                                 uint32_t                 a_payload_size,
+                                 uint8_t               ** a_message_ptr,
+                                 size_t                 * a_message_size_ptr);
+
+/**
+ * mqtt_session_select user API
+ *
+ * API calls operate on the active session, which mqtt_connect() sets. Select session
+ * before calling API (including mqtt_receive) when one program drives several sessions.
+ * Active session is per thread when library is built with MQTT_SESSION_THREAD_LOCAL
+ * @see mqtt_adaptation.h.
+ *
+ * @param a_session_ptr [in] session shared data given to mqtt_connect().
+ * @return previously active session.
+ */
+MQTT_shared_data_t * mqtt_session_select(MQTT_shared_data_t * a_session_ptr);
+
 #endif /* MQTT_H */
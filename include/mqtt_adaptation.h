@@ -34,10 +34,40 @@
  */
 #define mqtt_memset memset
 
+/**
+ * mqtt_memcmp
+ *
+ * Compare memory areas = memcmp.
+ *
+ */
+#define mqtt_memcmp memcmp
+
+/**
+ * mqtt_sleep
+ *
+ * Wait of the blocking API functions in seconds. A build may provide its own,
+ * e.g. the simulation harness (test/sim_lib) runs a virtual clock instead.
+ *
+ */
+#ifndef mqtt_sleep
 #define mqtt_sleep sleep
+#endif
 
 #define mqtt_strlen strlen
 
+/**
+ * mqtt_session_storage
+ *
+ * Storage class of the active session pointer. Thread local when built with
+ * MQTT_SESSION_THREAD_LOCAL, so that each thread can drive its own sessions.
+ *
+ */
+#ifdef MQTT_SESSION_THREAD_LOCAL
+#define mqtt_session_storage __thread
+#else
+#define mqtt_session_storage
+#endif
+
 #endif /* BUILD_DEFAULT_C_LIBS */
 
 #ifdef BUILD_FREERTOS
@@ -103,11 +133,21 @@
  */
 #define mqtt_memset memset
 
+/**
+ * mqtt_memcmp
+ *
+ * Compare memory areas = memcmp.
+ *
+ */
+#define mqtt_memcmp memcmp
+
 
 #define mqtt_sleep(x) vTaskDelay(x/portTICK_PERIOD_MS)
 
 #define mqtt_strlen strlen
 
+#define mqtt_session_storage
+
 #endif /* BUILD_FREERTOS */
 
 #endif
@@ -25,7 +25,15 @@
 
 #include "mqtt.h"
 
-static MQTT_shared_data_t * g_shared_data = NULL;
+#if defined(__AVX2__)
+    #include <immintrin.h>  // Topic and UTF-8 scan
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+static mqtt_session_storage MQTT_shared_data_t * g_shared_data = NULL;
 
 /************************************************************************************************************
  *                                                                                                          *
@@ -69,6 +77,58 @@ uint8_t * mqtt_connect_fill(uint8_t        * a_message_buffer_ptr,
                             MQTT_connect_t * a_connect_ptr,
                             uint16_t       * a_ouput_size_ptr);
 
+/**
+ * Encode connect message
+ *
+ * Strings are given with their lengths, nothing is measured or modified. Message is written
+ * from the beginning of the buffer. Last will is included only when both topic and message
+ * are given, username and password only when given.
+ *
+ * @param a_message_buffer_ptr [out] allocated working space.
+ * @param a_max_buffer_size [in] maximum size of the working space.
+ * @param a_client_id_ptr [in] client identifier (mandatory).
+ * @param a_client_id_length [in] length of client identifier.
+ * @param a_username_ptr [in] username or NULL.
+ * @param a_username_length [in] length of username.
+ * @param a_password_ptr [in] password or NULL.
+ * @param a_password_length [in] length of password.
+ * @param a_last_will_topic_ptr [in] last will topic or NULL.
+ * @param a_last_will_topic_length [in] length of last will topic.
+ * @param a_last_will_ptr [in] last will message or NULL.
+ * @param a_last_will_length [in] length of last will message.
+ * @param a_keepalive [in] keepalive time in seconds.
+ * @param a_clean_session [in] clean session flag.
+ * @param a_permanent_will [in] retain last will.
+ * @param a_ouput_size_ptr [out] size of the message.
+ * @return pointer to the message (a_message_buffer_ptr) or NULL in case of failure.
+ */
+uint8_t * mqtt_connect_encode(uint8_t  * a_message_buffer_ptr,
+                              size_t     a_max_buffer_size,
+                              uint8_t  * a_client_id_ptr,
+                              uint16_t   a_client_id_length,
+                              uint8_t  * a_username_ptr,
+                              uint16_t   a_username_length,
+                              uint8_t  * a_password_ptr,
+                              uint16_t   a_password_length,
+                              uint8_t  * a_last_will_topic_ptr,
+                              uint16_t   a_last_will_topic_length,
+                              uint8_t  * a_last_will_ptr,
+                              uint16_t   a_last_will_length,
+                              uint16_t   a_keepalive,
+                              bool       a_clean_session,
+                              bool       a_permanent_will,
+                              uint16_t * a_ouput_size_ptr);
+
+/**
+ * Mark connect message sent.
+ *
+ * Common part of connect actions: start keepalive timing and set state.
+ *
+ * @param a_keepalive [in] keepalive time in seconds given in connect message.
+ * @return None
+ */
+void mqtt_connect_sent(uint16_t a_keepalive);
+
 /**
  * Send MQTT disconnect.
  *
@@ -126,6 +186,257 @@ uint32_t set_size(MQTT_fixed_header_t * a_output_ptr,
 uint8_t * get_size(uint8_t  * a_input_ptr,
                    uint32_t * a_message_size_ptr);
 
+/**
+ * Check that a whole packet is in the input.
+ *
+ * Remaining length field is read only within a_available bytes, so that decode
+ * functions after this check do not read past the received data.
+ *
+ * @param a_input_ptr [in] first byte of received MQTT message.
+ * @param a_available [in] amount of received bytes.
+ * @return size of the whole packet, 0 when fixed header or remaining length bytes
+ *         are not in the input.
+ */
+uint32_t mqtt_packet_length(const uint8_t * a_input_ptr,
+                            uint32_t        a_available);
+
+/**
+ * Add received PUBLISH to the message batch.
+ *
+ * Batch is handed to the batch callback when it is full.
+ *
+ * @param a_view_ptr [in] decoded message.
+ * @return None
+ */
+void mqtt_message_batch_add(MQTT_message_view_t * a_view_ptr);
+
+/**
+ * Hand collected messages to the batch callback.
+ *
+ * @return None
+ */
+void mqtt_message_batch_flush();
+
+/**
+ * Acknowledge received QoS 1 PUBLISH.
+ *
+ * PUBACK is gathered to the ack coalescer when one is set, otherwise written at once.
+ * Called before the message is delivered, a message whose ack is not taken is not
+ * delivered. Partially written ack breaks the session.
+ *
+ * @param a_packet_id [in] packet identifier of the PUBLISH.
+ * @return Successfull when written or gathered, WouldBlock when nothing of it was taken,
+ *         NoConnection when only a part of it was written.
+ */
+MQTTErrorCodes_t mqtt_puback(uint16_t a_packet_id);
+
+/**
+ * Answer PUBREC of a QoS 2 publish with PUBREL.
+ *
+ * @param a_packet_id [in] packet identifier of the publish.
+ * @return Successfull when written.
+ */
+MQTTErrorCodes_t mqtt_pubrel(uint16_t a_packet_id);
+
+/**
+ * Write gathered acks out in one write.
+ *
+ * @return Successfull when nothing is left, WouldBlock when transport took only a
+ *         part, ServerUnavailabe when transport failed.
+ */
+MQTTErrorCodes_t mqtt_ack_flush();
+
+/**
+ * Take the message out of the head of its lane and report it.
+ *
+ * @param a_lane [in] lane of the message.
+ * @param a_status [in] result given to the scheduled callback.
+ * @return None
+ */
+void mqtt_schedule_done(MQTTLane_t       a_lane,
+                        MQTTErrorCodes_t a_status);
+
+/**
+ * Next message to send - head of the highest non-empty lane, expired heads dropped.
+ *
+ * @param a_lane_ptr [out] lane of the message.
+ * @param a_skip_lanes [in] bit per lane not to take messages from.
+ * @return message or NULL when all lanes are empty.
+ */
+MQTT_scheduled_t * mqtt_schedule_next(MQTTLane_t * a_lane_ptr,
+                                      uint32_t     a_skip_lanes);
+
+/**
+ * Find the conflation index slot of a topic.
+ *
+ * @param a_topic_ptr [in] topic name.
+ * @param a_topic_size [in] size of topic name.
+ * @return slot holding a queued message to the topic, empty slot or NULL when index is full.
+ */
+MQTT_scheduled_t ** mqtt_conflation_slot(char     * a_topic_ptr,
+                                         uint16_t   a_topic_size);
+
+/**
+ * Remove message from the conflation index, nothing done when it is not there.
+ *
+ * @param a_message_ptr [in] message which can not be replaced anymore.
+ * @return None
+ */
+void mqtt_conflation_remove(MQTT_scheduled_t * a_message_ptr);
+
+/**
+ * Check that publish fits into every rate limit of its topic.
+ *
+ * @param a_topic_ptr [in] topic name.
+ * @param a_topic_size [in] size of topic name.
+ * @param a_bytes [in] topic and payload bytes of the publish.
+ * @return true when publish can be sent now.
+ */
+bool mqtt_rate_limit_check(uint8_t  * a_topic_ptr,
+                           uint16_t   a_topic_size,
+                           size_t     a_bytes);
+
+/**
+ * Take tokens of a sent publish from every rate limit of its topic.
+ *
+ * @param a_topic_ptr [in] topic name.
+ * @param a_topic_size [in] size of topic name.
+ * @param a_bytes [in] topic and payload bytes of the publish.
+ * @return None
+ */
+void mqtt_rate_limit_take(uint8_t  * a_topic_ptr,
+                          uint16_t   a_topic_size,
+                          size_t     a_bytes);
+
+/**
+ * Refill token buckets.
+ *
+ * @param a_elapsed_ms [in] time since previous refill.
+ * @return None
+ */
+void mqtt_rate_limit_refill(uint32_t a_elapsed_ms);
+
+/**
+ * Open payload envelope of a received publish.
+ *
+ * @param a_message_ptr [in/out] payload, points to decoded payload after the call.
+ * @param a_message_size_ptr [in/out] size of payload.
+ * @return Successfull, InvalidPayload when envelope could not be opened.
+ */
+MQTTErrorCodes_t mqtt_payload_decode(uint8_t  ** a_message_ptr,
+                                     uint32_t  * a_message_size_ptr);
+
+/**
+ * Publish payload in an envelope of the library (record batch, chunk).
+ *
+ * Envelope is binary, so UTF-8 payload validation is not applied.
+ *
+ * @param a_topic_ptr [in] topic.
+ * @param a_topic_size [in] size of topic.
+ * @param a_payload_ptr [in] envelope and payload.
+ * @param a_payload_size [in] size of envelope and payload.
+ * @return status of mqtt_publish_try().
+ */
+MQTTErrorCodes_t mqtt_publish_enveloped(char    * a_topic_ptr,
+                                        size_t    a_topic_size,
+                                        uint8_t * a_payload_ptr,
+                                        size_t    a_payload_size);
+
+/**
+ * Hand received message to the batch, view or subscribe callback.
+ *
+ * @param a_view_ptr [in] decoded message.
+ * @return None
+ */
+void mqtt_message_deliver(MQTT_message_view_t * a_view_ptr);
+
+/**
+ * Publish record batches whose oldest record has waited long enough.
+ *
+ * @param a_elapsed_ms [in] time since previous call.
+ * @return None
+ */
+void mqtt_record_batch_tick(uint32_t a_elapsed_ms);
+
+
+/**
+ * Output function of the session.
+ *
+ * Returns transport output function, or output queue writer when output queue is in use.
+ * Clears status of the previous write.
+ *
+ * @return function to be used for sending @see data_stream_out_fptr_t.
+ */
+data_stream_out_fptr_t mqtt_session_out_fptr();
+
+/**
+ * Write through output queue.
+ *
+ * Packet is written directly to the transport when nothing is pending, bytes not accepted
+ * by the transport are queued. When output is pending, packet is appended to the queue
+ * to keep the order. Packet is accepted only as a whole.
+ *
+ * @param a_data_ptr [in] data to be sent.
+ * @param a_amount [in] amount of data.
+ * @return a_amount when accepted, -1 when not (reason in output_queue.status).
+ */
+int mqtt_output_queue_write(uint8_t * a_data_ptr,
+                            size_t    a_amount);
+
+/**
+ * Gather into startup flight.
+ *
+ * Appends packet to the flight buffer of mqtt_connect_pipelined. Packet is accepted
+ * only as a whole.
+ *
+ * @param a_data_ptr [in] data to be sent.
+ * @param a_amount [in] amount of data.
+ * @return a_amount when gathered, -1 when flight buffer is full.
+ */
+int mqtt_pipeline_write(uint8_t * a_data_ptr,
+                        size_t    a_amount);
+
+/**
+ * Write pending output to the transport.
+ *
+ * @return Successfull when queue is empty, WouldBlock or ServerUnavailabe.
+ */
+MQTTErrorCodes_t mqtt_output_queue_drain();
+
+/**
+ * Take packet identifier for a new packet.
+ *
+ * Free identifier from the packet identifier pool when pool is in use, otherwise
+ * next value of the counter. Identifier 0 is never given.
+ *
+ * @return packet identifier, 0 when all identifiers of the pool are in flight.
+ */
+uint16_t mqtt_packet_id_allocate();
+
+/**
+ * Length of plain ASCII prefix.
+ *
+ * Scans 32 (AVX2) or 16 (SSE2, NEON) bytes at a time for the first byte which needs
+ * a closer look: non-ASCII byte and, in topics, also U+0000, '+' and '#'.
+ *
+ * @param a_data_ptr [in] data to scan.
+ * @param a_size [in] size of data.
+ * @param a_topic [in] stop also at U+0000 and wildcards.
+ * @return amount of plain bytes before the first special one, a_size when none.
+ */
+size_t mqtt_plain_prefix(const uint8_t * a_data_ptr,
+                         size_t          a_size,
+                         bool            a_topic);
+
+/**
+ * Length of multibyte UTF-8 sequence.
+ *
+ * @param a_data_ptr [in] lead byte of the sequence (0x80 or above).
+ * @param a_size [in] bytes available.
+ * @return length of well-formed sequence, 0 when it is not well-formed.
+ */
+size_t mqtt_utf8_sequence(const uint8_t * a_data_ptr,
+                          size_t          a_size);
 
 /************************************************************************************************************
  *                                                                                                          *
@@ -272,6 +583,76 @@ bool encode_publish(data_stream_out_fptr_t   a_out_fptr,
                     uint8_t                * message_ptr,
                     uint32_t                 message_size);
 
+/**
+ * Encode and send publish message with streamed payload.
+ *
+ * Fixed and variable headers are built into the output buffer, after which the rest of
+ * the buffer is used as a window for the payload: it is filled by the pull callback and
+ * sent out until message_size bytes have been written.
+ *
+ * @param a_out_fptr [in] function pointer, which is called to send message out.
+ * @param a_output_ptr [out] working buffer, must fit headers and at least one payload byte.
+ * @param a_output_size [in] size of the working buffer.
+ * @param a_retain [in] retain bit.
+ * @param a_qos [in] quality of service @see MQTTQoSLevel_t.
+ * @param a_dup [in] duplicate bit.
+ * @param topic_ptr [in] pointer to topic.
+ * @param topic_size [in] size of the topic.
+ * @param packet_identifier [in] packet sequence number (QoS 1 and 2 only).
+ * @param a_pull_fptr [in] payload source @see publish_pull_fptr_t.
+ * @param message_size [in] total size of the payload.
+ * @param a_sent_ptr [out] bytes of the packet taken by a_out_fptr, also when sending failed.
+ * @return true when complete message was sent out.
+ */
+bool encode_publish_stream(data_stream_out_fptr_t   a_out_fptr,
+                           uint8_t                * a_output_ptr,
+                           uint32_t                 a_output_size,
+                           bool                     a_retain,
+                           MQTTQoSLevel_t           a_qos,
+                           bool                     a_dup,
+                           uint8_t                * topic_ptr,
+                           uint16_t                 topic_size,
+                           uint16_t                 packet_identifier,
+                           publish_pull_fptr_t      a_pull_fptr,
+                           uint32_t                 message_size,
+                           uint32_t               * a_sent_ptr);
+
+/**
+ * Encode and send publish message with payload compressed by the payload codec.
+ *
+ * Codec writes into the output buffer after room reserved for the headers, headers are
+ * then built right in front of the codec output. Falls back to encode_publish() when the
+ * envelope would not make the payload smaller.
+ *
+ * @param a_out_fptr [in] function pointer, which is called to send message out.
+ * @param a_output_ptr [out] ouptut buffer, where data is stored before sending.
+ * @param a_output_size [in] size of the output buffer.
+ * @param a_retain [in] retain bit.
+ * @param a_qos [in] quality of service @see MQTTQoSLevel_t.
+ * @param a_dup [in] duplicate bit.
+ * @param topic_ptr [in] pointer to topic.
+ * @param topic_size [in] size of the topic.
+ * @param packet_identifier [in] packet sequence number (QoS 1 and 2 only).
+ * @param message_ptr [in] payload.
+ * @param message_size [in] size of the payload.
+ * @return true when message was sent out.
+ */
+bool encode_publish_compressed(data_stream_out_fptr_t   a_out_fptr,
+                               uint8_t                * a_output_ptr,
+                               uint32_t                 a_output_size,
+                               bool                     a_retain,
+                               MQTTQoSLevel_t           a_qos,
+                               bool                     a_dup,
+                               uint8_t                * topic_ptr,
+                               uint16_t                 topic_size,
+                               uint16_t                 packet_identifier,
+                               uint8_t                * message_ptr,
+                               uint32_t                 message_size);
+
+/* encode_publish() or encode_publish_compressed() */
+typedef bool (*encode_publish_fptr_t)(data_stream_out_fptr_t, uint8_t *, uint32_t, bool, MQTTQoSLevel_t, bool,
+                                      uint8_t *, uint16_t, uint16_t, uint8_t *, uint32_t);
+
  /**
  * Construct fixed header from given parameters.
  *
@@ -420,6 +801,34 @@ uint8_t * get_size(uint8_t  * a_input_ptr,
     return (a_input_ptr + cnt);
 }
 
+uint32_t mqtt_packet_length(const uint8_t * a_input_ptr,
+                            uint32_t        a_available)
+{
+    uint32_t multiplier = 1;
+    uint32_t value      = 0;
+    uint32_t cnt        = 1;
+
+    do {
+        /* At most 4 length bytes */
+        if ((cnt >= a_available) || (4 < cnt)) {
+            #ifdef DEBUG
+                mqtt_printf("%s %u Incomplete fixed header %u\n", __FILE__, __LINE__, a_available);
+            #endif
+            return 0;
+        }
+        value      += (a_input_ptr[cnt] & 127) * multiplier;
+        multiplier *= 128;
+    } while (0 != (a_input_ptr[cnt++] & 128));
+
+    if (value > (a_available - cnt)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Incomplete packet %u > %u\n", __FILE__, __LINE__, value, a_available - cnt);
+        #endif
+        return 0;
+    }
+    return cnt + value;
+}
+
 /************************************************************************************************************
  *                                                                                                          *
  * \subsection FixedHeader Fixed Header functions                                                           *
@@ -578,15 +987,16 @@ bool encode_publish(data_stream_out_fptr_t   a_out_fptr,
         if (a_qos > QoS0) /* If QoS set, then additional space is required */
             sizeOfMsg += sizeof(uint16_t);
 
+        uint32_t remaining = sizeOfMsg;
         sizeOfMsg = encode_fixed_header((MQTT_fixed_header_t *) a_output_ptr,
-                                                                a_retain,
-                                                                a_qos,
                                                                 a_dup,
+                                                                a_qos,
+                                                                a_retain,
                                                                 PUBLISH,
                                                                 sizeOfMsg);
 
         if ((0 < sizeOfMsg) &&
-            (sizeOfMsg < a_output_size)) { /* Output buffer is big enough */
+            ((sizeOfMsg + remaining) <= a_output_size)) { /* Output buffer is big enough */
 
             /* First 2 bytes are topic_size */
             a_output_ptr[sizeOfMsg++] = ((topic_size >> 8) & 0xFF);
@@ -619,9 +1029,10 @@ bool encode_publish(data_stream_out_fptr_t   a_out_fptr,
         }
         #ifdef DEBUG
             else {
-                mqtt_printf("%s %u Fixed header failed ",
+                mqtt_printf("%s %u Fixed header failed or publish does not fit %u\n",
                             __FILE__,
-                            __LINE__);
+                            __LINE__,
+                            remaining);
             }
         #endif
     }
@@ -637,6 +1048,213 @@ bool encode_publish(data_stream_out_fptr_t   a_out_fptr,
     return ret;
 }
 
+bool encode_publish_compressed(data_stream_out_fptr_t   a_out_fptr,
+                               uint8_t                * a_output_ptr,
+                               uint32_t                 a_output_size,
+                               bool                     a_retain,
+                               MQTTQoSLevel_t           a_qos,
+                               bool                     a_dup,
+                               uint8_t                * topic_ptr,
+                               uint16_t                 topic_size,
+                               uint16_t                 packet_identifier,
+                               uint8_t                * message_ptr,
+                               uint32_t                 message_size)
+{
+    MQTT_payload_codec_t * codec_ptr = &(g_shared_data->payload_codec);
+
+    if ((NULL == a_output_ptr) ||
+        (NULL == topic_ptr)    ||
+        (NULL == message_ptr))
+        return false;
+
+    /* Room for the largest fixed header, topic, packet identifier and envelope */
+    uint32_t variable_size = sizeof(uint16_t) + topic_size + ((a_qos > QoS0) ? sizeof(uint16_t) : 0);
+    uint32_t payload_at    = sizeof(MQTT_fixed_header_t) + variable_size + MQTT_CODEC_ENVELOPE;
+    bool     marked        = ((0 < message_size) && (MQTT_CODEC_MARKER == message_ptr[0]));
+    int      encoded       = -1;
+    uint8_t  id            = codec_ptr->id;
+
+    /* Worth it only when envelope and codec output are smaller than the payload */
+    if ((payload_at < a_output_size) &&
+        (MQTT_CODEC_ENVELOPE < message_size)) {
+        size_t room = a_output_size - payload_at;
+        if (room > message_size - MQTT_CODEC_ENVELOPE - 1)
+            room = message_size - MQTT_CODEC_ENVELOPE - 1;
+        encoded = codec_ptr->compress_fptr(message_ptr, message_size, &(a_output_ptr[payload_at]), room);
+    }
+
+    if (0 > encoded) {
+        if (false == marked)
+            return encode_publish(a_out_fptr, a_output_ptr, a_output_size, a_retain, a_qos, a_dup,
+                                  topic_ptr, topic_size, packet_identifier, message_ptr, message_size);
+
+        /* Raw payload starting with the marker goes in a stored envelope */
+        if ((payload_at + message_size) > a_output_size) {
+            #ifdef DEBUG
+                mqtt_printf("%s %u Stored envelope does not fit %u\n", __FILE__, __LINE__, message_size);
+            #endif
+            return false;
+        }
+        mqtt_memcpy(&(a_output_ptr[payload_at]), message_ptr, message_size);
+        encoded = (int)message_size;
+        id      = MQTT_CODEC_STORED;
+    }
+
+    MQTT_fixed_header_t header;
+    uint32_t header_size = encode_fixed_header(&header,
+                                               a_dup,
+                                               a_qos,
+                                               a_retain,
+                                               PUBLISH,
+                                               variable_size + MQTT_CODEC_ENVELOPE + (uint32_t)encoded);
+    if (0 == header_size)
+        return false;
+
+    /* Headers end where the codec output starts */
+    uint32_t start = payload_at - MQTT_CODEC_ENVELOPE - variable_size - header_size;
+    uint32_t used  = start;
+
+    mqtt_memcpy(&(a_output_ptr[used]), &header, header_size);
+    used += header_size;
+    a_output_ptr[used++] = ((topic_size >> 8) & 0xFF);
+    a_output_ptr[used++] = ((topic_size >> 0) & 0xFF);
+    mqtt_memcpy(&(a_output_ptr[used]), topic_ptr, topic_size);
+    used += topic_size;
+    if (a_qos > QoS0) {
+        a_output_ptr[used++] = (uint8_t)((packet_identifier >> 8) & 0xFF);
+        a_output_ptr[used++] = (uint8_t)((packet_identifier >> 0) & 0xFF);
+    }
+    a_output_ptr[used++] = MQTT_CODEC_MARKER;
+    a_output_ptr[used++] = id;
+
+    uint32_t packet_size = payload_at + (uint32_t)encoded - start;
+    if (a_out_fptr(&(a_output_ptr[start]), packet_size) == (int)packet_size)
+        return true;
+
+    #ifdef DEBUG
+        mqtt_printf("%s %u Sending publish failed %u", __FILE__, __LINE__, packet_size);
+    #endif
+    return false;
+}
+
+bool encode_publish_stream(data_stream_out_fptr_t   a_out_fptr,
+                           uint8_t                * a_output_ptr,
+                           uint32_t                 a_output_size,
+                           bool                     a_retain,
+                           MQTTQoSLevel_t           a_qos,
+                           bool                     a_dup,
+                           uint8_t                * topic_ptr,
+                           uint16_t                 topic_size,
+                           uint16_t                 packet_identifier,
+                           publish_pull_fptr_t      a_pull_fptr,
+                           uint32_t                 message_size,
+                           uint32_t               * a_sent_ptr)
+{
+    *a_sent_ptr = 0;
+
+    if ((NULL == a_out_fptr)   ||
+        (NULL == a_output_ptr) ||
+        (NULL == topic_ptr)    ||
+        (NULL == a_pull_fptr)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Invalid argument given %p %p %p %p\n",
+                        __FILE__,
+                        __LINE__,
+                        a_out_fptr,
+                        a_output_ptr,
+                        topic_ptr,
+                        a_pull_fptr);
+        #endif
+        return false;
+    }
+
+    uint32_t header_size = sizeof(MQTT_fixed_header_t) + sizeof(uint16_t) + topic_size;
+    if (a_qos > QoS0)
+        header_size += sizeof(uint16_t);
+
+    /* Headers and at least one byte of payload must fit into the working buffer */
+    if ((header_size >= a_output_size) ||
+        ((MQTT_MAX_MESSAGE_SIZE - header_size) < message_size)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Buffer too small or message too big %u %u\n",
+                        __FILE__,
+                        __LINE__,
+                        a_output_size,
+                        message_size);
+        #endif
+        return false;
+    }
+
+    uint32_t sizeOfMsg = message_size + topic_size + sizeof(uint16_t);
+
+    if (a_qos > QoS0) /* If QoS set, then additional space is required */
+        sizeOfMsg += sizeof(uint16_t);
+
+    uint32_t used = encode_fixed_header((MQTT_fixed_header_t *) a_output_ptr,
+                                        a_dup,
+                                        a_qos,
+                                        a_retain,
+                                        PUBLISH,
+                                        sizeOfMsg);
+    if (0 == used)
+        return false;
+
+    /* First 2 bytes are topic_size */
+    a_output_ptr[used++] = ((topic_size >> 8) & 0xFF);
+    a_output_ptr[used++] = ((topic_size >> 0) & 0xFF);
+
+    /* Copy topic name */
+    mqtt_memcpy((void*)&(a_output_ptr[used]), topic_ptr, topic_size);
+    used += topic_size;
+
+    if (a_qos > QoS0) {
+        /* Copy packet identifier - valid only in QoS 1 and 2 levels */
+        a_output_ptr[used++] = (uint8_t)((packet_identifier >> 8) & 0xFF);
+        a_output_ptr[used++] = (uint8_t)((packet_identifier >> 0) & 0xFF);
+    }
+
+    /* Payload shares the first write with the headers, after that whole buffer is used */
+    uint32_t offset = 0;
+    do {
+        uint32_t window = a_output_size - used;
+        if (window > (message_size - offset))
+            window = message_size - offset;
+
+        if (0 < window) {
+            int pulled = a_pull_fptr(&(a_output_ptr[used]), window, offset);
+            if ((0 >= pulled) || ((uint32_t)pulled > window)) {
+                #ifdef DEBUG
+                    mqtt_printf("%s %u Payload source failed at %u/%u\n",
+                                __FILE__,
+                                __LINE__,
+                                offset,
+                                message_size);
+                #endif
+                return false;
+            }
+            used   += (uint32_t)pulled;
+            offset += (uint32_t)pulled;
+        }
+
+        int written = a_out_fptr(a_output_ptr, used);
+        if (0 < written)
+            *a_sent_ptr += (uint32_t)written;
+        if (written != (int)used) {
+            #ifdef DEBUG
+                mqtt_printf("%s %u Sending publish failed %u/%u\n",
+                            __FILE__,
+                            __LINE__,
+                            offset,
+                            message_size);
+            #endif
+            return false;
+        }
+        used = 0;
+    } while (offset < message_size);
+
+    return true;
+}
+
 /************************************************************************************************************
  *                                                                                                          *
  * \subsection DecodePublish Decode publish message                                                         *
@@ -657,7 +1275,8 @@ bool decode_publish(uint8_t         * a_message_in_ptr,
 
     if ((NULL != a_message_in_ptr)       &&
         (NULL != a_topic_out_ptr)        &&
-        (NULL != a_topic_length_out_ptr)) {
+        (NULL != a_topic_length_out_ptr) &&
+        (2    <= a_size_of_msg)) {        /* Topic length */
 
         /* Decode variable header = topic name and length - read topic out and get pointer to payload */
         uint8_t * payload = decode_variable_header_publish(a_message_in_ptr,
@@ -674,7 +1293,8 @@ bool decode_publish(uint8_t         * a_message_in_ptr,
             /* Count ant store message size */
             uint32_t header_size = (payload - a_message_in_ptr);
 
-            if (header_size < a_size_of_msg) {
+            /* Topic and packet identifier within the packet, payload can be empty */
+            if (header_size <= a_size_of_msg) {
                 *a_out_message_size_ptr = a_size_of_msg - header_size;
                 *a_out_message_ptr      = payload;
                 ret = true;
@@ -727,7 +1347,6 @@ uint8_t * decode_variable_header_publish(uint8_t         * a_input_ptr,
         *a_topic_length_out_ptr  = (((uint16_t)(a_input_ptr[index++]) << 8) & 0xFF00); /* Higer byte */
         *a_topic_length_out_ptr |= (((uint16_t)(a_input_ptr[index++]) << 0) & 0x00FF); /* Lower byte */
 
-        printf("topic length %u\n", *a_topic_length_out_ptr);
 
         /* Set pointer to point beginning of topic - no copy, reuse existing buffer. */
         *a_topic_out_ptr = &(a_input_ptr[index++]);
@@ -783,8 +1402,8 @@ bool encode_subscribe(data_stream_out_fptr_t   a_out_fptr,
 
         /* In subscribe QoS must be 1 and rest remain zero */
         sizeOfMsg = encode_fixed_header((MQTT_fixed_header_t *) a_output_ptr,
-                                        true,
-                                        QoS0,
+                                        false,
+                                        QoS1,
                                         false,
                                         SUBSCRIBE,
                                         sizeOfMsg);
@@ -1024,234 +1643,156 @@ uint8_t encode_variable_header_connect(uint8_t        * a_output_ptr,
     return variable_header_size;
 }
 
-uint8_t * mqtt_connect_fill_a_param(uint8_t  * a_input_argument_str_ptr,
-                                    bool       a_input_argument_is_mandatory,
-                                    uint8_t  * a_output_ptr,
-                                    int32_t  * a_remaining_size_ptr,
-                                    uint16_t * a_ouput_size_ptr)
+uint16_t mqtt_connect_string_length(uint8_t * a_str_ptr)
 {
-    if ((NULL != a_input_argument_str_ptr) &&
-        (NULL != a_output_ptr)             &&
-        (NULL != a_remaining_size_ptr)) {
-
-        /* Fill client ID into payload. It must exists and it must be first parameter */
-        uint16_t arg_len       = (uint16_t)mqtt_strlen((char*)(a_input_argument_str_ptr));
-        *a_remaining_size_ptr -= arg_len;
+    return (NULL != a_str_ptr) ? (uint16_t)mqtt_strlen((char*)a_str_ptr) : 0;
+}
 
-        if (0 >= *a_remaining_size_ptr) {
-            #ifdef DEBUG
-                mqtt_printf("%s %u Not enough space %i\n",
-                            __FILE__,
-                            __LINE__,
-                            *a_remaining_size_ptr);
-            #endif
-            return NULL;
-        }
+uint8_t * mqtt_connect_encode(uint8_t  * a_message_buffer_ptr,
+                              size_t     a_max_buffer_size,
+                              uint8_t  * a_client_id_ptr,
+                              uint16_t   a_client_id_length,
+                              uint8_t  * a_username_ptr,
+                              uint16_t   a_username_length,
+                              uint8_t  * a_password_ptr,
+                              uint16_t   a_password_length,
+                              uint8_t  * a_last_will_topic_ptr,
+                              uint16_t   a_last_will_topic_length,
+                              uint8_t  * a_last_will_ptr,
+                              uint16_t   a_last_will_length,
+                              uint16_t   a_keepalive,
+                              bool       a_clean_session,
+                              bool       a_permanent_will,
+                              uint16_t * a_ouput_size_ptr)
+{
+    if ((NULL == a_message_buffer_ptr) ||
+        (NULL == a_client_id_ptr)      ||
+        (0    == a_client_id_length)   ||
+        (NULL == a_ouput_size_ptr)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Invalid argument given %p %p %u %p\n",
+            __FILE__,
+            __LINE__,
+            a_message_buffer_ptr,
+            a_client_id_ptr,
+            a_client_id_length,
+            a_ouput_size_ptr);
+        #endif
+        return NULL;
+    }
 
-        if (0 < arg_len) {
-            return mqtt_add_payload_parameters(a_output_ptr,
-                                               arg_len,
-                                               a_input_argument_str_ptr);
-        } else if (a_input_argument_is_mandatory) {
-            *a_ouput_size_ptr = 0;
-            #ifdef DEBUG
-                mqtt_printf("%s %u Required parameter not set %s\n",
-                    __FILE__,
-                    __LINE__,
-                    a_input_argument_str_ptr);
-            #endif
-        }
-    } else {
+    /* Optional parameters are present only when set, last will needs both topic and message */
+    bool last_will = ((NULL != a_last_will_topic_ptr) && (0 < a_last_will_topic_length) &&
+                      (NULL != a_last_will_ptr)       && (0 < a_last_will_length));
+    bool username  = ((NULL != a_username_ptr) && (0 < a_username_length));
+    bool password  = ((NULL != a_password_ptr) && (0 < a_password_length));
+
+    /* Lengths are known, so the size is counted before anything is written */
+    uint32_t remaining_size = sizeof(MQTT_variable_header_connect_t) + 2 + a_client_id_length;
+    if (last_will)
+        remaining_size += 2 + a_last_will_topic_length + 2 + a_last_will_length;
+    if (username)
+        remaining_size += 2 + a_username_length;
+    if (password)
+        remaining_size += 2 + a_password_length;
+
+    MQTT_fixed_header_t fixed_header;
+    uint8_t size_of_fixed_header = encode_fixed_header(&fixed_header,
+                                                       false,
+                                                       QoS0,
+                                                       false,
+                                                       CONNECT,
+                                                       remaining_size);
+
+    if ((0 == size_of_fixed_header) ||
+        ((size_of_fixed_header + remaining_size) > a_max_buffer_size) ||
+        ((size_of_fixed_header + remaining_size) > UINT16_MAX)) {
         #ifdef DEBUG
-            mqtt_printf("%s %u NULL argument given %p %p %p\n",
+            mqtt_printf("%s %u Not enough space %u %zu\n",
                         __FILE__,
                         __LINE__,
-                        a_input_argument_str_ptr,
-                        a_output_ptr,
-                        a_remaining_size_ptr);
+                        size_of_fixed_header + remaining_size,
+                        a_max_buffer_size);
         #endif
+        return NULL;
     }
-    return NULL;
+
+    mqtt_memcpy(a_message_buffer_ptr, &fixed_header, size_of_fixed_header);
+    uint8_t * payload_ptr = a_message_buffer_ptr + size_of_fixed_header;
+
+    payload_ptr += encode_variable_header_connect(payload_ptr,
+                                                  a_clean_session,
+                                                  last_will,
+                                                  QoS0,
+                                                  (last_will && a_permanent_will),
+                                                  password,
+                                                  username,
+                                                  a_keepalive);
+
+    /* Client ID, last will, username and password - in this order */
+    payload_ptr = mqtt_add_payload_parameters(payload_ptr, a_client_id_length, a_client_id_ptr);
+    if (last_will) {
+        payload_ptr = mqtt_add_payload_parameters(payload_ptr, a_last_will_topic_length, a_last_will_topic_ptr);
+        payload_ptr = mqtt_add_payload_parameters(payload_ptr, a_last_will_length, a_last_will_ptr);
+    }
+    if (username)
+        payload_ptr = mqtt_add_payload_parameters(payload_ptr, a_username_length, a_username_ptr);
+    if (password)
+        payload_ptr = mqtt_add_payload_parameters(payload_ptr, a_password_length, a_password_ptr);
+
+    *a_ouput_size_ptr = (uint16_t)(size_of_fixed_header + remaining_size);
+
+    return a_message_buffer_ptr;
 }
 
-/* Client ID, last will, username and password */
-uint8_t * mqtt_connect_fill_parameters(uint8_t        * a_message_buffer_ptr,
-                                       MQTT_connect_t * a_connect_ptr,
-                                       uint16_t       * a_ouput_size_ptr,
-                                       int32_t        * a_space_remaining_ptr)
+uint8_t * mqtt_connect_fill(uint8_t        * a_message_buffer_ptr,
+                            size_t           a_max_buffer_size,
+                            MQTT_connect_t * a_connect_ptr,
+                            uint16_t       * a_ouput_size_ptr)
 {
     if ((NULL == a_message_buffer_ptr) ||
         (NULL == a_connect_ptr)        ||
-        (NULL == a_ouput_size_ptr)     ||
-        (NULL == a_space_remaining_ptr)) {
+        (NULL == a_ouput_size_ptr)) {
         #ifdef DEBUG
-            mqtt_printf("%s %u NULL argument given %p %p %p %p\n",
+            mqtt_printf("%s %u NULL argument given %p %p %p\n",
             __FILE__,
             __LINE__,
             a_message_buffer_ptr,
             a_connect_ptr,
-            a_ouput_size_ptr,
-            a_space_remaining_ptr);
+            a_ouput_size_ptr);
         #endif
         return NULL;
     }
 
-    uint8_t * payload_ptr = a_message_buffer_ptr + sizeof(MQTT_fixed_header_t) + sizeof(MQTT_variable_header_connect_t);
+    /* Strings are null terminated here, each one is measured once */
+    return mqtt_connect_encode(a_message_buffer_ptr,
+                               a_max_buffer_size,
+                               a_connect_ptr->client_id,
+                               mqtt_connect_string_length(a_connect_ptr->client_id),
+                               a_connect_ptr->username,
+                               mqtt_connect_string_length(a_connect_ptr->username),
+                               a_connect_ptr->password,
+                               mqtt_connect_string_length(a_connect_ptr->password),
+                               a_connect_ptr->last_will_topic,
+                               mqtt_connect_string_length(a_connect_ptr->last_will_topic),
+                               a_connect_ptr->last_will_message,
+                               mqtt_connect_string_length(a_connect_ptr->last_will_message),
+                               a_connect_ptr->keepalive,
+                               a_connect_ptr->connect_flags.clean_session,
+                               a_connect_ptr->connect_flags.permanent_will,
+                               a_ouput_size_ptr);
+}
 
-    /* Client ID */
-    payload_ptr = mqtt_connect_fill_a_param(a_connect_ptr->client_id,
-                                            true,
-                                            payload_ptr,
-                                            a_space_remaining_ptr,
-                                            a_ouput_size_ptr);
-    if (NULL == payload_ptr)
-        return NULL;
-
-    /* Last will and testament */
-    a_connect_ptr->connect_flags.last_will_qos = QoS0;
-    if ((0 < mqtt_strlen((char*)(a_connect_ptr->last_will_topic))) &&
-        (0 < mqtt_strlen((char*)(a_connect_ptr->last_will_message)))) {
-
-        a_connect_ptr->connect_flags.last_will     = true;
-
-        payload_ptr = mqtt_connect_fill_a_param(a_connect_ptr->last_will_topic,
-                                                false,
-                                                payload_ptr,
-                                                a_space_remaining_ptr,
-                                                a_ouput_size_ptr);
-        if (NULL == payload_ptr)
-            return NULL;
-
-        payload_ptr = mqtt_connect_fill_a_param(a_connect_ptr->last_will_message,
-                                                false,
-                                                payload_ptr,
-                                                a_space_remaining_ptr,
-                                                a_ouput_size_ptr);
-
-        if (NULL == payload_ptr)
-            return NULL;
-
-    } else {
-        /* if not defined, disable will flag */
-        a_connect_ptr->connect_flags.last_will     = false;
-        a_connect_ptr->connect_flags.last_will_qos = QoS0;
-    }
-
-    /* Username */
-    if (0 < mqtt_strlen((char*)(a_connect_ptr->username))) {
-
-        a_connect_ptr->connect_flags.username = true;
-        payload_ptr = mqtt_connect_fill_a_param(a_connect_ptr->username,
-                                                false,
-                                                payload_ptr,
-                                                a_space_remaining_ptr,
-                                                a_ouput_size_ptr);
-        if (NULL == payload_ptr)
-            return NULL;
-    } else {
-        a_connect_ptr->connect_flags.username = false;
-    }
-
-    /* Password */
-    if (0 < mqtt_strlen((char*)(a_connect_ptr->password))) {
-
-        a_connect_ptr->connect_flags.password = true;
-        payload_ptr = mqtt_connect_fill_a_param(a_connect_ptr->password,
-                                                false,
-                                                payload_ptr,
-                                                a_space_remaining_ptr,
-                                                a_ouput_size_ptr);
-        if (NULL == payload_ptr)
-            return NULL;
-    } else {
-        a_connect_ptr->connect_flags.password = false;
-    }
-
-    return payload_ptr;
-}
-
-uint8_t * mqtt_connect_fill(uint8_t        * a_message_buffer_ptr,
-                            size_t           a_max_buffer_size,
-                            MQTT_connect_t * a_connect_ptr,
-                            uint16_t       * a_ouput_size_ptr)
+void mqtt_connect_sent(uint16_t a_keepalive)
 {
-    uint8_t sizeOfVarHdr, sizeOfFixedHdr = 0;
-
-    if ((NULL == a_message_buffer_ptr) ||
-        (NULL == a_connect_ptr)        ||
-        (NULL == a_ouput_size_ptr)) {
-        #ifdef DEBUG
-            mqtt_printf("%s %u NULL argument given %p %p %p\n",
-            __FILE__,
-            __LINE__,
-            a_message_buffer_ptr,
-            a_connect_ptr,
-            a_ouput_size_ptr);
-        #endif
-        return NULL;
-    }
-
-    int32_t space_remaining = (int32_t)a_max_buffer_size;
-
-    /* Clear message buffer */
-    mqtt_memset(a_message_buffer_ptr, 0, a_max_buffer_size);
-
-    /* Fill parameters and related flasgs */
-    uint8_t * payload_ptr = mqtt_connect_fill_parameters(a_message_buffer_ptr,
-                                                         a_connect_ptr,
-                                                         a_ouput_size_ptr,
-                                                         &space_remaining);
-    if (NULL == payload_ptr)
-        return NULL;
-
-    /* Construct variable header with given parameters */
-    sizeOfVarHdr = encode_variable_header_connect(a_message_buffer_ptr + sizeof(MQTT_fixed_header_t),
-                                                  a_connect_ptr->connect_flags.clean_session,
-                                                  a_connect_ptr->connect_flags.last_will,
-                                                  a_connect_ptr->connect_flags.last_will_qos,
-                                                  a_connect_ptr->connect_flags.permanent_will,
-                                                  a_connect_ptr->connect_flags.password,
-                                                  a_connect_ptr->connect_flags.username,
-                                                  a_connect_ptr->keepalive);
-
-    space_remaining -= sizeOfVarHdr;
-    if (0 > space_remaining) { /* Not enough space */
-        #ifdef DEBUG
-            mqtt_printf("%s %u Not enough space", __FILE__, __LINE__);
-        #endif
-        return NULL;
-    }
-
-
-    uint32_t payloadSize = payload_ptr - (a_message_buffer_ptr + sizeof(MQTT_fixed_header_t) + sizeof(MQTT_variable_header_connect_t));
-
-    space_remaining -= payloadSize;
-    if (0 > space_remaining) { /* Not enough space */
-        #ifdef DEBUG
-            mqtt_printf("%s %u Not enough space", __FILE__, __LINE__);
-        #endif
-        return NULL;
+    if (0 != a_keepalive) {
+        g_shared_data->keepalive_in_ms  = a_keepalive * 1000;
+        g_shared_data->keepalive_in_ms -= 500;
+    } else {
+        g_shared_data->keepalive_in_ms = INT32_MIN;
     }
-
-
-    MQTT_fixed_header_t temporaryFixedHeader;
-    /* Form fixed header for CONNECT msg */
-    sizeOfFixedHdr = encode_fixed_header(&temporaryFixedHeader,
-                                         false,
-                                         QoS0,
-                                         false,
-                                         CONNECT,
-                                         payloadSize + sizeOfVarHdr);
-
-    /* Count valid starting point for the message, because fixed header length variates between 2 to 4 bytes */
-    uint8_t * message_ptr = a_message_buffer_ptr + (sizeof(MQTT_fixed_header_t) - sizeOfFixedHdr);
-
-    /* Copy fixed header at the beginning of the message */
-    mqtt_memcpy((void*)message_ptr, (void*)&temporaryFixedHeader, sizeOfFixedHdr);
-
-    *a_ouput_size_ptr = (payload_ptr - message_ptr);
-
-    return message_ptr;
+    g_shared_data->time_to_next_ping_in_ms = 0; /* Send Ping immediatelly*/
+    g_shared_data->state = STATE_CONNECTED;
 }
 
 
@@ -1383,226 +1924,1244 @@ MQTTErrorCodes_t mqtt_parse_ping_ack(uint8_t * a_message_in_ptr)
 
 /************************************************************************************************************
  *                                                                                                          *
- * \subsection ParsInput Parse input stream                                                                 *
+ * \subsection OutputQueue Pending output queue                                                             *
  *                                                                                                          *
- * Function decode fixed header from input stream to find out details of received message.                  *
- * Appropriate funciton is called to decode received message successfully.                                  *
+ * Byte ring holding output which transport did not accept yet. Packets are accepted as a whole, so a      *
+ * partially sent packet is always completed before the next one.                                          *
  *                                                                                                          *
  ************************************************************************************************************/
-MQTTErrorCodes_t mqtt_parse_input_stream(uint8_t  * a_input_ptr,
-                                         uint32_t * a_message_size_ptr)
+data_stream_out_fptr_t mqtt_session_out_fptr()
 {
-    MQTTErrorCodes_t  status = InvalidArgument;
-    bool              dup, retain;
-    MQTTQoSLevel_t    qos;
-    MQTTMessageType_t type;
+    /* Gathered acks go out before any later packet */
+    if (0 < g_shared_data->ack_coalescer.used)
+        mqtt_ack_flush();
 
-    if (NULL == a_input_ptr)
-        return InvalidArgument;
+    g_shared_data->output_queue.status = Successfull;
 
-    /* Decode fixed header */
-    uint8_t * next_header_ptr = decode_fixed_header(a_input_ptr, &dup, &qos, &retain, &type, a_message_size_ptr);
+    if (NULL != g_shared_data->pipeline.buffer)
+        return &mqtt_pipeline_write;
 
-    if (NULL == next_header_ptr)
-        return InvalidArgument;
+    if (NULL != g_shared_data->output_queue.buffer)
+        return &mqtt_output_queue_write;
 
-    /* Check message type to and take appropriate action. */
-    switch (type)
-    {
-        case CONNACK:
-            {
-                uint8_t connection_state;
-                if (NULL != decode_variable_header_conack(next_header_ptr, &connection_state)) {
+    return g_shared_data->out_fptr;
+}
 
-                    if (Successfull == connection_state) {
-                        g_shared_data->state = STATE_CONNECTED;
-                        status = Successfull;
+MQTTErrorCodes_t mqtt_output_queue_drain()
+{
+    MQTT_output_queue_t * queue_ptr = &(g_shared_data->output_queue);
 
-                    } else {
-                        g_shared_data->state = STATE_DISCONNECTED;
-                        status = Successfull;
-                    }
+    while (0 < queue_ptr->used) {
+        /* Send contiguous part from the head */
+        size_t chunk = queue_ptr->size - queue_ptr->head;
+        if (chunk > queue_ptr->used)
+            chunk = queue_ptr->used;
 
-                    if (NULL != g_shared_data->connected_cb_fptr)
-                        g_shared_data->connected_cb_fptr(connection_state);
-                    #ifdef DEBUG
-                        else
-                            mqtt_printf("%s %u Connection callback is NULL\n", __FILE__, __LINE__);
-                    #endif
-                }
-                #ifdef DEBUG
-                    else
-                        mqtt_printf("%s %u decode_variable_header_conack returned NULL\n",
-                                    __FILE__,
-                                    __LINE__);
-                #endif
-            }
-            break;
+        int written = g_shared_data->out_fptr(&(queue_ptr->buffer[queue_ptr->head]), chunk);
+        if (0 > written) {
+            #ifdef DEBUG
+                mqtt_printf("%s %u Transport failed %i\n", __FILE__, __LINE__, written);
+            #endif
+            return ServerUnavailabe;
+        }
 
-        case PUBLISH:
-            {
-                uint8_t * topic_ptr    = NULL;
-                uint16_t  topic_length = 0;
-                uint8_t * message_ptr  = NULL;
-                uint32_t  message_size = 0;
+        queue_ptr->head  = (queue_ptr->head + (size_t)written) % queue_ptr->size;
+        queue_ptr->used -= (size_t)written;
 
-                if (decode_publish(next_header_ptr,
-                                   * a_message_size_ptr,
-                                   qos,
-                                   &topic_ptr,
-                                   &topic_length,
-                                   &message_ptr,
-                                   &message_size)){
+        if ((size_t)written < chunk)
+            return WouldBlock;
+    }
+    queue_ptr->head = 0;
+    return Successfull;
+}
 
-                    if (NULL != g_shared_data->subscribe_cb_fptr)
-                        g_shared_data->subscribe_cb_fptr(Successfull,
-                                                         message_ptr,
-                                                         message_size,
-                                                         topic_ptr,
-                                                         topic_length);
-                    #ifdef DEBUG
-                        else
-                            mqtt_printf("%s %u Subscribe callback is not set\n",
-                                        __FILE__,
-                                        __LINE__);
-                    #endif
-                    status = Successfull;
-                } else {
-                    if (NULL != g_shared_data->subscribe_cb_fptr)
-                        g_shared_data->subscribe_cb_fptr(status, NULL, 0, NULL, 0);
-                }
-                break;
-            }
+int mqtt_output_queue_write(uint8_t * a_data_ptr,
+                            size_t    a_amount)
+{
+    MQTT_output_queue_t * queue_ptr = &(g_shared_data->output_queue);
+    size_t                written   = 0;
+
+    /* Older bytes first */
+    if ((0 < queue_ptr->used) &&
+        (ServerUnavailabe == mqtt_output_queue_drain())) {
+        queue_ptr->status = ServerUnavailabe;
+        return -1;
+    }
 
-        case SUBACK:
-            {
-				decode_variable_header_suback(a_input_ptr, &status);
-				if (NULL != g_shared_data) {
+    /* Whatever transport does not take must fit into the queue */
+    if (a_amount > (queue_ptr->size - queue_ptr->used)) {
+        queue_ptr->status = WouldBlock;
+        return -1;
+    }
 
-					if (NULL != g_shared_data->subscribe_cb_fptr) {
-						if (true == status) {
-							g_shared_data->subscribe_cb_fptr(Successfull, NULL, 0, NULL, 0);
-							status = Successfull;
-						}
-						else {
-							g_shared_data->subscribe_cb_fptr(PublishDecodeError, NULL, 0, NULL, 0);
-						}
-					}
-				}
-            }
-            break;
+    if (0 == queue_ptr->used) {
+        int ret = g_shared_data->out_fptr(a_data_ptr, a_amount);
+        if (0 > ret) {
+            queue_ptr->status = ServerUnavailabe;
+            return -1;
+        }
+        written = (size_t)ret;
+    }
 
-        case PINGRESP:
-            status = Successfull;
-            break;
+    /* Queue the rest */
+    while (written < a_amount) {
+        size_t tail  = (queue_ptr->head + queue_ptr->used) % queue_ptr->size;
+        size_t chunk = queue_ptr->size - tail;
+        if (chunk > (a_amount - written))
+            chunk = a_amount - written;
 
-        default:
-            status = InvalidArgument;
-            break;
+        mqtt_memcpy(&(queue_ptr->buffer[tail]), &(a_data_ptr[written]), chunk);
+        queue_ptr->used += chunk;
+        written         += chunk;
     }
-    return status;
+
+    if (queue_ptr->used >= queue_ptr->high_watermark)
+        queue_ptr->blocked = true;
+
+    queue_ptr->status = Successfull;
+    return (int)a_amount;
+}
+
+int mqtt_pipeline_write(uint8_t * a_data_ptr,
+                        size_t    a_amount)
+{
+    MQTT_pipeline_t * pipeline_ptr = &(g_shared_data->pipeline);
+
+    if (a_amount > (pipeline_ptr->size - pipeline_ptr->used)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Startup flight full %zu %zu\n", __FILE__, __LINE__, pipeline_ptr->used, a_amount);
+        #endif
+        return -1;
+    }
+
+    mqtt_memcpy(&(pipeline_ptr->buffer[pipeline_ptr->used]), a_data_ptr, a_amount);
+    pipeline_ptr->used += a_amount;
+    return (int)a_amount;
 }
 
 /************************************************************************************************************
  *                                                                                                          *
- * \subsection API MQTT API functions                                                                       *
+ * \subsection MessageBatch Message batch                                                                   *
  *                                                                                                          *
- * External software components uses services of this library through these API functions.                  *
+ * Views of received PUBLISH packets are collected into application's array and handed over together,     *
+ * when the array is full, when other packet than PUBLISH is received and at the end of each receive call. *
  *                                                                                                          *
  ************************************************************************************************************/
-MQTTErrorCodes_t mqtt(MQTTAction_t         a_action,
-                      MQTT_action_data_t * a_action_ptr)
+void mqtt_message_batch_add(MQTT_message_view_t * a_view_ptr)
 {
-        MQTTErrorCodes_t status = InvalidArgument;
+    MQTT_message_batch_t * batch_ptr = &(g_shared_data->message_batch);
 
-        switch (a_action)
-        {
-            case ACTION_INIT:
-                if (NULL != a_action_ptr) {
+    batch_ptr->views[batch_ptr->used++] = *a_view_ptr;
+    if (batch_ptr->used == batch_ptr->size)
+        mqtt_message_batch_flush();
+}
 
-                    g_shared_data                          = a_action_ptr->action_argument.shared_ptr;
-                    g_shared_data->state                   = STATE_DISCONNECTED;
-                    g_shared_data->mqtt_packet_cntr        = 0;
-                    g_shared_data->keepalive_in_ms         = 0;
-                    g_shared_data->time_to_next_ping_in_ms = 0;
-                    status = Successfull;
-                }
-                break;
+void mqtt_message_batch_flush()
+{
+    if (NULL == g_shared_data)
+        return;
 
-            case ACTION_DISCONNECT:
-                if ((NULL               != g_shared_data) &&
-                    (STATE_DISCONNECTED != g_shared_data->state))
-                    status = mqtt_disconnect_(g_shared_data->out_fptr);
-                else
-                    status = NoConnection;
-                break;
+    MQTT_message_batch_t * batch_ptr = &(g_shared_data->message_batch);
 
-            case ACTION_CONNECT:
-                if ((NULL != g_shared_data) &&
-                    (NULL != a_action_ptr)) {
-                    if (g_shared_data->state == STATE_DISCONNECTED) {
-                        status = mqtt_connect_(g_shared_data->buffer,
-                                               g_shared_data->buffer_size,
-                                               NULL,
-                                               g_shared_data->out_fptr,
-                                               a_action_ptr->action_argument.connect_ptr,
-                                               false);
+    if ((NULL != batch_ptr->batch_fptr) && (0 < batch_ptr->used)) {
+        size_t count = batch_ptr->used;
+        batch_ptr->used = 0;
+        batch_ptr->batch_fptr(batch_ptr->views, count);
+    }
+}
 
-                        if (Successfull == status) {
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection AckCoalescer Ack coalescer                                                                   *
+ *                                                                                                          *
+ * PUBACKs of received QoS 1 messages are gathered into application's buffer and written together at the  *
+ * end of a receive call, or when the deadline passes, and always before any other packet of the client.   *
+ *                                                                                                          *
+ ************************************************************************************************************/
+MQTTErrorCodes_t mqtt_puback(uint16_t a_packet_id)
+{
+    MQTT_ack_coalescer_t * acks_ptr = &(g_shared_data->ack_coalescer);
+    uint8_t                puback[] = {(uint8_t)(PUBACK << 4), 0x02,
+                                       (uint8_t)(a_packet_id >> 8), (uint8_t)(a_packet_id & 0xff)};
 
-                            if (0 != a_action_ptr->action_argument.connect_ptr->keepalive) {
-                                g_shared_data->keepalive_in_ms  = (a_action_ptr->action_argument.connect_ptr->keepalive) * 1000;
-                                g_shared_data->keepalive_in_ms -= 500;
-                            } else {
-                                g_shared_data->keepalive_in_ms = INT32_MIN;
-                            }
-                            g_shared_data->time_to_next_ping_in_ms = 0; /* Send Ping immediatelly*/
-                            g_shared_data->state = STATE_CONNECTED;
-                        } else {
-                            g_shared_data->state = STATE_DISCONNECTED;
-                        }
-                    } else {
-                        status = AllreadyConnected;
-                    }
-                }
-                break;
+    if (NULL == g_shared_data->out_fptr)
+        return NoConnection;
 
-            case ACTION_PUBLISH:
-                if ((NULL            != g_shared_data)        &&
-                    (STATE_CONNECTED == g_shared_data->state) &&
-                    (NULL            != a_action_ptr)) {
+    if (NULL == acks_ptr->buffer) {
+        int written = mqtt_session_out_fptr()(puback, sizeof(puback));
+        if ((int)sizeof(puback) != written) {
+            #ifdef DEBUG
+                mqtt_printf("%s %u PUBACK %u not sent %i\n", __FILE__, __LINE__, a_packet_id, written);
+            #endif
+            /* Broker has a part of the ack, nothing written later can be parsed */
+            if (0 < written) {
+                g_shared_data->state = STATE_DISCONNECTED;
+                return NoConnection;
+            }
+            return (0 == written) ? WouldBlock : ServerUnavailabe;
+        }
+        g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
+        return Successfull;
+    }
 
-                        uint8_t * message_buffer      = g_shared_data->buffer;
-                        uint32_t  message_buffer_size = g_shared_data->buffer_size;
+    if (((acks_ptr->size - acks_ptr->used) < sizeof(puback)) &&
+        (Successfull != mqtt_ack_flush()) &&
+        ((acks_ptr->size - acks_ptr->used) < sizeof(puback))) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u PUBACK %u does not fit, ack buffer full\n", __FILE__, __LINE__, a_packet_id);
+        #endif
+        return WouldBlock;
+    }
 
-                        /* Use special buffer, not the shared one */
-                        if ((NULL != a_action_ptr->action_argument.publish_ptr->output_buffer_ptr) &&
-                            (0     < a_action_ptr->action_argument.publish_ptr->output_buffer_size)){
+    if (0 == acks_ptr->used)
+        acks_ptr->time_left_ms = (int32_t)acks_ptr->deadline_ms;
+    mqtt_memcpy(&(acks_ptr->buffer[acks_ptr->used]), puback, sizeof(puback));
+    acks_ptr->used += sizeof(puback);
+    return Successfull;
+}
 
-                               message_buffer = a_action_ptr->action_argument.publish_ptr->output_buffer_ptr;
-                               message_buffer_size = a_action_ptr->action_argument.publish_ptr->output_buffer_size;
-                           }
-                       if (true == encode_publish(g_shared_data->out_fptr,
-                                                   message_buffer,
-                                                   message_buffer_size,
-                                                   a_action_ptr->action_argument.publish_ptr->flags.retain,
-                                                   a_action_ptr->action_argument.publish_ptr->flags.qos,
-                                                   false, /* a_action_ptr->action_argument.publish_ptr->flags.dup,*/
-                                                   a_action_ptr->action_argument.publish_ptr->topic_ptr,
-                                                   a_action_ptr->action_argument.publish_ptr->topic_length,
-                                                   g_shared_data->mqtt_packet_cntr++,
-                                                   a_action_ptr->action_argument.publish_ptr->message_buffer_ptr,
-                                                   a_action_ptr->action_argument.publish_ptr->message_buffer_size)) {
+MQTTErrorCodes_t mqtt_pubrel(uint16_t a_packet_id)
+{
+    /* Reserved flags of PUBREL are 0010 (MQTT 3.1.1 chapter 3.6.1) */
+    uint8_t pubrel[] = {(uint8_t)((PUBREL << 4) | 0x02), 0x02,
+                        (uint8_t)(a_packet_id >> 8), (uint8_t)(a_packet_id & 0xff)};
 
-                            g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
-                            status = Successfull;
-                        }
-                        #ifdef DEBUG
-                            else {
-                               mqtt_printf("%s %u Publish encode failed\n", __FILE__, __LINE__);
-                            }
-                        #endif
-                }
+    if (NULL == g_shared_data->out_fptr)
+        return NoConnection;
+
+    if ((int)sizeof(pubrel) != mqtt_session_out_fptr()(pubrel, sizeof(pubrel))) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u PUBREL %u not sent\n", __FILE__, __LINE__, a_packet_id);
+        #endif
+        return ServerUnavailabe;
+    }
+    g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
+    return Successfull;
+}
+
+MQTTErrorCodes_t mqtt_ack_flush()
+{
+    MQTT_ack_coalescer_t * acks_ptr = &(g_shared_data->ack_coalescer);
+    size_t                 amount   = acks_ptr->used;
+
+    if (0 == amount)
+        return Successfull;
+
+    /* Nothing pending while writing - session writer does not come back here */
+    acks_ptr->used = 0;
+    int written = mqtt_session_out_fptr()(acks_ptr->buffer, amount);
+
+    if ((size_t)written == amount) {
+        g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
+        return Successfull;
+    }
+
+    #ifdef DEBUG
+        mqtt_printf("%s %u Acks written %i of %zu\n", __FILE__, __LINE__, written, amount);
+    #endif
+
+    /* Keep what was not taken, whole acks stay in order */
+    if (0 > written)
+        written = 0;
+    for (size_t i = (size_t)written; i < amount; i++)
+        acks_ptr->buffer[i - (size_t)written] = acks_ptr->buffer[i];
+    acks_ptr->used = amount - (size_t)written;
+    return (0 < written) ? WouldBlock : ServerUnavailabe;
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection Scheduler Outbound scheduler                                                                 *
+ *                                                                                                          *
+ * FIFO lane per priority. Each run step sends one PUBLISH from the highest non-empty lane, bulk payloads   *
+ * one chunk at a time, so a message scheduled to a higher lane goes out before the next chunk.            *
+ *                                                                                                          *
+ ************************************************************************************************************/
+void mqtt_schedule_done(MQTTLane_t       a_lane,
+                        MQTTErrorCodes_t a_status)
+{
+    MQTT_scheduler_t * scheduler_ptr = &(g_shared_data->scheduler);
+    MQTT_scheduled_t * message_ptr   = scheduler_ptr->head[a_lane];
+
+    if (true == message_ptr->conflate)
+        mqtt_conflation_remove(message_ptr);
+
+    scheduler_ptr->head[a_lane] = message_ptr->next;
+    if (NULL == scheduler_ptr->head[a_lane])
+        scheduler_ptr->tail[a_lane] = NULL;
+    else
+        scheduler_ptr->head[a_lane]->prev = NULL;
+    message_ptr->next = NULL;
+
+    if (NULL != scheduler_ptr->scheduled_fptr)
+        scheduler_ptr->scheduled_fptr(message_ptr, a_status);
+}
+
+MQTT_scheduled_t * mqtt_schedule_next(MQTTLane_t * a_lane_ptr,
+                                      uint32_t     a_skip_lanes)
+{
+    MQTT_scheduler_t * scheduler_ptr = &(g_shared_data->scheduler);
+
+    for (uint32_t lane = LANE_ALARM; lane < LANE_COUNT; lane++) {
+        if (0 != (a_skip_lanes & (1u << lane)))
+            continue;
+        while (NULL != scheduler_ptr->head[lane]) {
+            MQTT_scheduled_t * message_ptr = scheduler_ptr->head[lane];
+
+            /* Stale message is dropped, started one is completed */
+            if ((0 == message_ptr->sent)         &&
+                (0 != message_ptr->deadline_ms)  &&
+                (scheduler_ptr->now_ms >= message_ptr->deadline_ms)) {
+                #ifdef DEBUG
+                    mqtt_printf("%s %u Message expired in lane %u\n", __FILE__, __LINE__, lane);
+                #endif
+                mqtt_schedule_done((MQTTLane_t)lane, Expired);
+                continue;
+            }
+            *a_lane_ptr = (MQTTLane_t)lane;
+            return message_ptr;
+        }
+    }
+    return NULL;
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection Conflation Last value wins                                                                   *
+ *                                                                                                          *
+ * Open addressing with linear probing from FNV-1a hash of the topic. Only messages with no byte sent are  *
+ * in the index. Removal shifts following entries back, so a probe ends at the first empty slot.          *
+ *                                                                                                          *
+ ************************************************************************************************************/
+static uint32_t mqtt_conflation_hash(char     * a_topic_ptr,
+                                     uint16_t   a_topic_size)
+{
+    uint32_t hash = 2166136261u;
+    for (uint16_t i = 0; i < a_topic_size; i++) {
+        hash ^= (uint8_t)a_topic_ptr[i];
+        hash *= 16777619u;
+    }
+    return hash % g_shared_data->scheduler.conflation_size;
+}
+
+MQTT_scheduled_t ** mqtt_conflation_slot(char     * a_topic_ptr,
+                                         uint16_t   a_topic_size)
+{
+    MQTT_scheduler_t * scheduler_ptr = &(g_shared_data->scheduler);
+    uint32_t           index         = mqtt_conflation_hash(a_topic_ptr, a_topic_size);
+
+    for (uint32_t probe = 0; probe < scheduler_ptr->conflation_size; probe++) {
+        MQTT_scheduled_t ** slot_ptr = &(scheduler_ptr->conflation_index[index]);
+        if ((NULL == *slot_ptr) ||
+            ((a_topic_size == (*slot_ptr)->topic_size) &&
+             (0 == mqtt_memcmp(a_topic_ptr, (*slot_ptr)->topic_ptr, a_topic_size))))
+            return slot_ptr;
+        index = (index + 1) % scheduler_ptr->conflation_size;
+    }
+    return NULL;
+}
+
+void mqtt_conflation_remove(MQTT_scheduled_t * a_message_ptr)
+{
+    MQTT_scheduler_t * scheduler_ptr = &(g_shared_data->scheduler);
+
+    if (NULL == scheduler_ptr->conflation_index)
+        return;
+
+    MQTT_scheduled_t ** slot_ptr = mqtt_conflation_slot(a_message_ptr->topic_ptr, a_message_ptr->topic_size);
+    if ((NULL == slot_ptr) || (a_message_ptr != *slot_ptr))
+        return;
+
+    /* Move back entries whose home slot is not between the hole and themselves */
+    uint32_t hole = (uint32_t)(slot_ptr - scheduler_ptr->conflation_index);
+    uint32_t next = hole;
+    for (;;) {
+        next = (next + 1) % scheduler_ptr->conflation_size;
+        MQTT_scheduled_t * entry_ptr = scheduler_ptr->conflation_index[next];
+        if ((NULL == entry_ptr) || (next == hole))
+            break;
+        uint32_t home = mqtt_conflation_hash(entry_ptr->topic_ptr, entry_ptr->topic_size);
+        if ((hole <= next) ? ((hole < home) && (home <= next)) : ((hole < home) || (home <= next)))
+            continue;
+        scheduler_ptr->conflation_index[hole] = entry_ptr;
+        hole = next;
+    }
+    scheduler_ptr->conflation_index[hole] = NULL;
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection RateLimit Token buckets                                                                      *
+ *                                                                                                          *
+ * Publish is checked against every limit whose prefix starts its topic before it is encoded, and tokens   *
+ * are taken only after it was written, so a refused or failed publish costs nothing.                      *
+ *                                                                                                          *
+ ************************************************************************************************************/
+static bool mqtt_rate_limit_match(MQTT_rate_limit_t * a_limit_ptr,
+                                  uint8_t           * a_topic_ptr,
+                                  uint16_t            a_topic_size)
+{
+    return (a_limit_ptr->prefix_size <= a_topic_size) &&
+           ((0 == a_limit_ptr->prefix_size) ||
+            (0 == mqtt_memcmp(a_limit_ptr->prefix_ptr, a_topic_ptr, a_limit_ptr->prefix_size)));
+}
+
+bool mqtt_rate_limit_check(uint8_t  * a_topic_ptr,
+                           uint16_t   a_topic_size,
+                           size_t     a_bytes)
+{
+    for (uint32_t i = 0; i < g_shared_data->rate_limit_count; i++) {
+        MQTT_rate_limit_t * limit_ptr = &(g_shared_data->rate_limits[i]);
+
+        if (false == mqtt_rate_limit_match(limit_ptr, a_topic_ptr, a_topic_size))
+            continue;
+
+        if ((0    <  limit_ptr->messages_per_s) &&
+            (1000 >  limit_ptr->message_tokens))
+            return false;
+
+        /* Publish larger than the burst waits for a full bucket */
+        if ((0 < limit_ptr->bytes_per_s) &&
+            (limit_ptr->byte_tokens < (uint64_t)a_bytes * 1000) &&
+            (limit_ptr->byte_tokens < (uint64_t)limit_ptr->byte_burst * 1000))
+            return false;
+    }
+    return true;
+}
+
+void mqtt_rate_limit_take(uint8_t  * a_topic_ptr,
+                          uint16_t   a_topic_size,
+                          size_t     a_bytes)
+{
+    for (uint32_t i = 0; i < g_shared_data->rate_limit_count; i++) {
+        MQTT_rate_limit_t * limit_ptr = &(g_shared_data->rate_limits[i]);
+
+        if (false == mqtt_rate_limit_match(limit_ptr, a_topic_ptr, a_topic_size))
+            continue;
+
+        limit_ptr->message_tokens = (1000 < limit_ptr->message_tokens) ? limit_ptr->message_tokens - 1000 : 0;
+        limit_ptr->byte_tokens    = ((uint64_t)a_bytes * 1000 < limit_ptr->byte_tokens) ?
+                                    limit_ptr->byte_tokens - (uint64_t)a_bytes * 1000 : 0;
+    }
+}
+
+void mqtt_rate_limit_refill(uint32_t a_elapsed_ms)
+{
+    for (uint32_t i = 0; i < g_shared_data->rate_limit_count; i++) {
+        MQTT_rate_limit_t * limit_ptr = &(g_shared_data->rate_limits[i]);
+
+        /* Rate per second is thousandths per millisecond */
+        limit_ptr->message_tokens += (uint64_t)a_elapsed_ms * limit_ptr->messages_per_s;
+        if (limit_ptr->message_tokens > (uint64_t)limit_ptr->message_burst * 1000)
+            limit_ptr->message_tokens = (uint64_t)limit_ptr->message_burst * 1000;
+
+        limit_ptr->byte_tokens += (uint64_t)a_elapsed_ms * limit_ptr->bytes_per_s;
+        if (limit_ptr->byte_tokens > (uint64_t)limit_ptr->byte_burst * 1000)
+            limit_ptr->byte_tokens = (uint64_t)limit_ptr->byte_burst * 1000;
+    }
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection PayloadCodec Payload envelope                                                                *
+ *                                                                                                          *
+ ************************************************************************************************************/
+MQTTErrorCodes_t mqtt_payload_decode(uint8_t  ** a_message_ptr,
+                                     uint32_t  * a_message_size_ptr)
+{
+    MQTT_payload_codec_t * codec_ptr = &(g_shared_data->payload_codec);
+    uint8_t              * data_ptr  = *a_message_ptr;
+
+    if ((NULL == codec_ptr->decompress_fptr)          ||
+        (MQTT_CODEC_ENVELOPE > *a_message_size_ptr)   ||
+        (MQTT_CODEC_MARKER  != data_ptr[0]))
+        return Successfull;
+
+    /* Record batch is opened by the receive path, chunks by the application */
+    if ((MQTT_CODEC_RECORDS == data_ptr[1]) ||
+        (MQTT_CODEC_CHUNK   == data_ptr[1]))
+        return Successfull;
+
+    /* Stored payload stays in the receive buffer */
+    if (MQTT_CODEC_STORED == data_ptr[1]) {
+        *a_message_ptr       = &(data_ptr[MQTT_CODEC_ENVELOPE]);
+        *a_message_size_ptr -= MQTT_CODEC_ENVELOPE;
+        return Successfull;
+    }
+
+    int decoded = -1;
+    if (codec_ptr->id == data_ptr[1])
+        decoded = codec_ptr->decompress_fptr(&(data_ptr[MQTT_CODEC_ENVELOPE]),
+                                             *a_message_size_ptr - MQTT_CODEC_ENVELOPE,
+                                             codec_ptr->decode_buffer,
+                                             codec_ptr->decode_size);
+    if (0 > decoded) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Payload envelope %u not decoded\n", __FILE__, __LINE__, data_ptr[1]);
+        #endif
+        return InvalidPayload;
+    }
+
+    *a_message_ptr      = codec_ptr->decode_buffer;
+    *a_message_size_ptr = (uint32_t)decoded;
+    return Successfull;
+}
+
+MQTTErrorCodes_t mqtt_publish_enveloped(char    * a_topic_ptr,
+                                        size_t    a_topic_size,
+                                        uint8_t * a_payload_ptr,
+                                        size_t    a_payload_size)
+{
+    bool validate = g_shared_data->validate_payload_utf8;
+    g_shared_data->validate_payload_utf8 = false;
+    MQTTErrorCodes_t status = mqtt_publish_try(a_topic_ptr,
+                                               a_topic_size,
+                                               (char*)a_payload_ptr,
+                                               a_payload_size);
+    g_shared_data->validate_payload_utf8 = validate;
+    return status;
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection RecordBatch Record batching                                                                  *
+ *                                                                                                          *
+ * Records to one topic are gathered into one payload: MQTT_CODEC_MARKER, MQTT_CODEC_RECORDS and records,  *
+ * each prefixed with its length encoded as the remaining length of the fixed header.                       *
+ *                                                                                                          *
+ ************************************************************************************************************/
+void mqtt_message_deliver(MQTT_message_view_t * a_view_ptr)
+{
+    if (NULL != g_shared_data->message_batch.batch_fptr)
+        mqtt_message_batch_add(a_view_ptr);
+    else if (NULL != g_shared_data->message_view_cb_fptr)
+        g_shared_data->message_view_cb_fptr(a_view_ptr);
+    else if (NULL != g_shared_data->subscribe_cb_fptr)
+        g_shared_data->subscribe_cb_fptr(a_view_ptr->status,
+                                         a_view_ptr->payload_ptr,
+                                         a_view_ptr->payload_length,
+                                         a_view_ptr->topic_ptr,
+                                         a_view_ptr->topic_length);
+    #ifdef DEBUG
+        else
+            mqtt_printf("%s %u Subscribe callback is not set\n",
+                        __FILE__,
+                        __LINE__);
+    #endif
+}
+
+void mqtt_record_batch_tick(uint32_t a_elapsed_ms)
+{
+    for (MQTT_record_batch_t * batch_ptr = g_shared_data->record_batches;
+         NULL != batch_ptr;
+         batch_ptr = batch_ptr->next) {
+
+        if ((0 == batch_ptr->count) || (0 == batch_ptr->max_delay_ms))
+            continue;
+
+        batch_ptr->time_left_ms -= (int32_t)a_elapsed_ms;
+        if (0 >= batch_ptr->time_left_ms)
+            mqtt_record_flush(batch_ptr);
+    }
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection PacketId Packet identifiers                                                                  *
+ *                                                                                                          *
+ * Next fit search over the pool bitmap: search continues from the word of the previous allocation, so     *
+ * with acks arriving roughly in order a free identifier is found from the first word tried. Identifier   *
+ * just released is not given again before the search has gone around the pool.                           *
+ *                                                                                                          *
+ ************************************************************************************************************/
+uint16_t mqtt_packet_id_allocate()
+{
+    MQTT_packet_id_pool_t * pool_ptr = &(g_shared_data->packet_id_pool);
+
+    if (NULL == pool_ptr->bitmap) {
+        /* No tracking - wrap from 65535 to 1, 0 is not a valid identifier */
+        g_shared_data->mqtt_packet_cntr = (g_shared_data->mqtt_packet_cntr % MQTT_PACKET_ID_MAX) + 1;
+        return (uint16_t)g_shared_data->mqtt_packet_cntr;
+    }
+
+    for (uint32_t cnt = 0; cnt < pool_ptr->words; cnt++) {
+        uint32_t free_bits = ~(pool_ptr->bitmap[pool_ptr->cursor]);
+
+        if (0 != free_bits) {
+            #if defined(__GNUC__)
+                uint32_t bit = (uint32_t)__builtin_ctz(free_bits);
+            #else
+                uint32_t bit = 0;
+                while (0 == (free_bits & (1u << bit)))
+                    bit++;
+            #endif
+            pool_ptr->bitmap[pool_ptr->cursor] |= (1u << bit);
+            pool_ptr->in_use++;
+            return (uint16_t)((pool_ptr->cursor * 32) + bit);
+        }
+
+        if (++(pool_ptr->cursor) == pool_ptr->words)
+            pool_ptr->cursor = 0;
+    }
+
+    #ifdef DEBUG
+        mqtt_printf("%s %u All %u packet identifiers in flight\n", __FILE__, __LINE__, pool_ptr->in_use);
+    #endif
+    return 0;
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection Validate Topic and UTF-8 validation                                                          *
+ *                                                                                                          *
+ * Topics and payloads are mostly ASCII, which is skipped with vector compares. Scalar code only looks at   *
+ * multibyte sequences, wildcards and U+0000.                                                               *
+ *                                                                                                          *
+ ************************************************************************************************************/
+size_t mqtt_plain_prefix(const uint8_t * a_data_ptr,
+                         size_t          a_size,
+                         bool            a_topic)
+{
+    size_t offset = 0;
+
+    #if defined(__AVX2__)
+        const __m256i nul  = _mm256_setzero_si256();
+        const __m256i plus = _mm256_set1_epi8('+');
+        const __m256i hash = _mm256_set1_epi8('#');
+
+        /* Payload has only non-ASCII to look for - one test for 64 bytes */
+        if (false == a_topic) {
+            for (; (offset + 64) <= a_size; offset += 64) {
+                __m256i any = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)&a_data_ptr[offset]),
+                                              _mm256_loadu_si256((const __m256i *)&a_data_ptr[offset + 32]));
+                if (0 != _mm256_movemask_epi8(any))
+                    break;
+            }
+        }
+
+        for (; (offset + 32) <= a_size; offset += 32) {
+            __m256i  chunk = _mm256_loadu_si256((const __m256i *)&a_data_ptr[offset]);
+            uint32_t mask  = (uint32_t)_mm256_movemask_epi8(chunk); /* High bit = non-ASCII */
+            if (a_topic)
+                mask |= (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, nul),
+                                                       _mm256_or_si256(_mm256_cmpeq_epi8(chunk, plus),
+                                                                       _mm256_cmpeq_epi8(chunk, hash))));
+            if (0 != mask)
+                return offset + (size_t)__builtin_ctz(mask);
+        }
+    #endif
+
+    #if defined(__SSE2__)
+        const __m128i nul16  = _mm_setzero_si128();
+        const __m128i plus16 = _mm_set1_epi8('+');
+        const __m128i hash16 = _mm_set1_epi8('#');
+
+        #if !defined(__AVX2__)
+            if (false == a_topic) {
+                for (; (offset + 64) <= a_size; offset += 64) {
+                    __m128i any = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)&a_data_ptr[offset]),
+                                                            _mm_loadu_si128((const __m128i *)&a_data_ptr[offset + 16])),
+                                               _mm_or_si128(_mm_loadu_si128((const __m128i *)&a_data_ptr[offset + 32]),
+                                                            _mm_loadu_si128((const __m128i *)&a_data_ptr[offset + 48])));
+                    if (0 != _mm_movemask_epi8(any))
+                        break;
+                }
+            }
+        #endif
+
+        for (; (offset + 16) <= a_size; offset += 16) {
+            __m128i  chunk = _mm_loadu_si128((const __m128i *)&a_data_ptr[offset]);
+            uint32_t mask  = (uint32_t)_mm_movemask_epi8(chunk);
+            if (a_topic)
+                mask |= (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, nul16),
+                                                    _mm_or_si128(_mm_cmpeq_epi8(chunk, plus16),
+                                                                 _mm_cmpeq_epi8(chunk, hash16))));
+            if (0 != mask)
+                return offset + (size_t)__builtin_ctz(mask);
+        }
+    #elif defined(__ARM_NEON)
+        if (false == a_topic) {
+            for (; (offset + 64) <= a_size; offset += 64) {
+                uint8x16_t any    = vorrq_u8(vorrq_u8(vld1q_u8(&a_data_ptr[offset]),
+                                                      vld1q_u8(&a_data_ptr[offset + 16])),
+                                             vorrq_u8(vld1q_u8(&a_data_ptr[offset + 32]),
+                                                      vld1q_u8(&a_data_ptr[offset + 48])));
+                uint8x8_t  folded = vorr_u8(vget_low_u8(any), vget_high_u8(any));
+                if (0 != (vget_lane_u64(vreinterpret_u64_u8(folded), 0) & 0x8080808080808080ULL))
+                    break;
+            }
+        }
+
+        for (; (offset + 16) <= a_size; offset += 16) {
+            uint8x16_t chunk   = vld1q_u8(&a_data_ptr[offset]);
+            uint8x16_t special = vcgeq_u8(chunk, vdupq_n_u8(0x80));
+            if (a_topic)
+                special = vorrq_u8(special,
+                                   vorrq_u8(vceqq_u8(chunk, vdupq_n_u8(0)),
+                                            vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('+')),
+                                                     vceqq_u8(chunk, vdupq_n_u8('#')))));
+            uint8x8_t folded = vorr_u8(vget_low_u8(special), vget_high_u8(special));
+            if (0 != vget_lane_u64(vreinterpret_u64_u8(folded), 0))
+                break; /* Scalar loop finds the byte */
+        }
+    #endif
+
+    for (; offset < a_size; offset++) {
+        uint8_t byte = a_data_ptr[offset];
+        if ((0x80 <= byte) ||
+            (a_topic && ((0 == byte) || ('+' == byte) || ('#' == byte))))
+            break;
+    }
+    return offset;
+}
+
+size_t mqtt_utf8_sequence(const uint8_t * a_data_ptr,
+                          size_t          a_size)
+{
+    uint8_t lead   = a_data_ptr[0];
+    size_t  length = 0;
+    uint8_t low    = 0x80; /* Range of the second byte, RFC 3629 chapter 4 */
+    uint8_t high   = 0xBF;
+
+    if ((0xC2 <= lead) && (0xDF >= lead)) {
+        length = 2;
+    } else if ((0xE0 <= lead) && (0xEF >= lead)) {
+        length = 3;
+        if (0xE0 == lead)
+            low  = 0xA0;  /* Overlong */
+        if (0xED == lead)
+            high = 0x9F;  /* Surrogates */
+    } else if ((0xF0 <= lead) && (0xF4 >= lead)) {
+        length = 4;
+        if (0xF0 == lead)
+            low  = 0x90;  /* Overlong */
+        if (0xF4 == lead)
+            high = 0x8F;  /* Above U+10FFFF */
+    } else {
+        return 0;
+    }
+
+    if ((length > a_size) ||
+        (a_data_ptr[1] < low) || (a_data_ptr[1] > high))
+        return 0;
+
+    for (size_t cnt = 2; cnt < length; cnt++) {
+        if (0x80 != (a_data_ptr[cnt] & 0xC0))
+            return 0;
+    }
+    return length;
+}
+
+bool mqtt_topic_valid(const uint8_t * a_topic_ptr,
+                      size_t          a_topic_length,
+                      bool            a_filter)
+{
+    size_t offset = 0;
+
+    if ((NULL == a_topic_ptr)     ||
+        (0    == a_topic_length)  ||
+        (0xFFFF < a_topic_length))
+        return false;
+
+    while (true) {
+        offset += mqtt_plain_prefix(&a_topic_ptr[offset], a_topic_length - offset, true);
+        if (offset == a_topic_length)
+            return true;
+
+        uint8_t byte = a_topic_ptr[offset];
+
+        if (('+' == byte) || ('#' == byte)) {
+            /* Wildcard takes a whole level, multi-level wildcard is the last one */
+            if ((false == a_filter) ||
+                ((0 < offset) && ('/' != a_topic_ptr[offset - 1])))
+                return false;
+            if ('#' == byte)
+                return ((offset + 1) == a_topic_length);
+            if (((offset + 1) < a_topic_length) && ('/' != a_topic_ptr[offset + 1]))
+                return false;
+            offset++;
+        } else if (0x80 <= byte) {
+            size_t length = mqtt_utf8_sequence(&a_topic_ptr[offset], a_topic_length - offset);
+            if (0 == length)
+                return false;
+            offset += length;
+        } else {
+            return false; /* U+0000 */
+        }
+    }
+}
+
+bool mqtt_utf8_valid(const uint8_t * a_data_ptr,
+                     size_t          a_size)
+{
+    size_t offset = 0;
+
+    if ((NULL == a_data_ptr) && (0 < a_size))
+        return false;
+
+    while (true) {
+        offset += mqtt_plain_prefix(&a_data_ptr[offset], a_size - offset, false);
+        if (offset == a_size)
+            return true;
+
+        size_t length = mqtt_utf8_sequence(&a_data_ptr[offset], a_size - offset);
+        if (0 == length)
+            return false;
+        offset += length;
+    }
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection ParsInput Parse input stream                                                                 *
+ *                                                                                                          *
+ * Function decode fixed header from input stream to find out details of received message.                  *
+ * Appropriate funciton is called to decode received message successfully.                                  *
+ *                                                                                                          *
+ ************************************************************************************************************/
+MQTTErrorCodes_t mqtt_parse_input_stream(uint8_t  * a_input_ptr,
+                                         uint32_t * a_message_size_ptr)
+{
+    MQTTErrorCodes_t  status = InvalidArgument;
+    bool              dup, retain;
+    MQTTQoSLevel_t    qos;
+    MQTTMessageType_t type;
+
+    /* Nothing is decoded beyond the received bytes */
+    if ((NULL  == a_input_ptr) ||
+        (0     == mqtt_packet_length(a_input_ptr, *a_message_size_ptr)))
+        return InvalidArgument;
+
+    /* Decode fixed header */
+    uint8_t * next_header_ptr = decode_fixed_header(a_input_ptr, &dup, &qos, &retain, &type, a_message_size_ptr);
+
+    if (NULL == next_header_ptr)
+        return InvalidArgument;
+
+    /* Messages collected so far are delivered before anything else is handled */
+    if (PUBLISH != type)
+        mqtt_message_batch_flush();
+
+    /* Check message type to and take appropriate action. */
+    switch (type)
+    {
+        case CONNACK:
+            {
+                uint8_t connection_state;
+                if ((2    <= *a_message_size_ptr) &&
+                    (NULL != decode_variable_header_conack(next_header_ptr, &connection_state))) {
+
+                    if (Successfull == connection_state) {
+                        g_shared_data->state = STATE_CONNECTED;
+                        status = Successfull;
+
+                    } else {
+                        g_shared_data->state = STATE_DISCONNECTED;
+                        status = Successfull;
+                    }
+
+                    if (NULL != g_shared_data->connected_cb_fptr)
+                        g_shared_data->connected_cb_fptr(connection_state);
+                    #ifdef DEBUG
+                        else
+                            mqtt_printf("%s %u Connection callback is NULL\n", __FILE__, __LINE__);
+                    #endif
+                }
+                #ifdef DEBUG
+                    else
+                        mqtt_printf("%s %u decode_variable_header_conack returned NULL\n",
+                                    __FILE__,
+                                    __LINE__);
+                #endif
+            }
+            break;
+
+        case PUBLISH:
+            {
+                uint8_t * topic_ptr    = NULL;
+                uint16_t  topic_length = 0;
+                uint8_t * message_ptr  = NULL;
+                uint32_t  message_size = 0;
+
+                if (decode_publish(next_header_ptr,
+                                   * a_message_size_ptr,
+                                   qos,
+                                   &topic_ptr,
+                                   &topic_length,
+                                   &message_ptr,
+                                   &message_size)){
+
+                    /* Packet identifier follows the topic (MQTT 3.1.1 chapter 3.3.4). Message whose
+                       ack is not taken is left undelivered, transport gives the packet again. */
+                    if (QoS1 == qos) {
+                        status = mqtt_puback((uint16_t)((topic_ptr[topic_length] << 8) | topic_ptr[topic_length + 1]));
+                        if (Successfull != status)
+                            break;
+                    }
+
+                    uint8_t        * payload_ptr  = message_ptr;
+                    MQTTErrorCodes_t codec_status = mqtt_payload_decode(&message_ptr, &message_size);
+                    bool             decoded      = (message_ptr == g_shared_data->payload_codec.decode_buffer);
+
+                    MQTT_message_view_t    view;
+                    MQTT_record_iterator_t records;
+                    view.packet_ptr     = a_input_ptr;
+                    view.topic_ptr      = topic_ptr;
+                    view.topic_length   = topic_length;
+                    view.payload_ptr    = message_ptr;
+                    view.payload_length = message_size;
+                    view.qos            = qos;
+                    view.retain         = retain;
+                    view.dup            = dup;
+                    view.status         = Successfull;
+
+                    /* Records are checked before any of them is delivered */
+                    bool unbatch = ((Successfull == codec_status)        &&
+                                    (g_shared_data->unbatch_records)     &&
+                                    (mqtt_records_open(&records, message_ptr, message_size)));
+                    if (unbatch) {
+                        MQTT_record_iterator_t check = records;
+                        uint8_t              * record_ptr;
+                        uint32_t               record_size;
+                        while (mqtt_records_next(&check, &record_ptr, &record_size))
+                            ;
+                        if (NULL == check.next_ptr) {
+                            codec_status = InvalidPayload;
+                            payload_ptr  = message_ptr;
+                        }
+                    }
+
+                    if (Successfull != codec_status) {
+                        /* Envelope not understood - delivered as received, after the messages before it */
+                        view.payload_ptr = payload_ptr;
+                        view.status      = codec_status;
+                        unbatch          = false;
+                        mqtt_message_batch_flush();
+                    }
+
+                    /* Decode memory is reused by the next message - delivered alone */
+                    if (decoded)
+                        mqtt_message_batch_flush();
+
+                    if (unbatch) {
+                        while (mqtt_records_next(&records, &(view.payload_ptr), &(view.payload_length)))
+                            mqtt_message_deliver(&view);
+                    } else
+                        mqtt_message_deliver(&view);
+
+                    if (decoded)
+                        mqtt_message_batch_flush();
+                    status = Successfull;
+                } else {
+                    if (NULL != g_shared_data->subscribe_cb_fptr)
+                        g_shared_data->subscribe_cb_fptr(status, NULL, 0, NULL, 0);
+                }
+                break;
+            }
+
+        case PUBACK:
+        case PUBCOMP:
+        case PUBREC:
+            {
+                /* Packet identifier only, flags zero (MQTT 3.1.1 chapters 3.4, 3.5 and 3.7) */
+                uint16_t packet_id = 0;
+                if ((2 == *a_message_size_ptr) && (0 == (a_input_ptr[0] & 0x0f)))
+                    packet_id = (uint16_t)((next_header_ptr[0] << 8) | next_header_ptr[1]);
+
+                if (0 == packet_id) {
+                    #ifdef DEBUG
+                        mqtt_printf("%s %u Malformed ack %u of %u bytes\n", __FILE__, __LINE__, type, *a_message_size_ptr);
+                    #endif
+                    break;
+                }
+
+                /* QoS 2 identifier stays in flight until PUBCOMP */
+                if (PUBREC == type)
+                    status = mqtt_pubrel(packet_id);
+                else {
+                    mqtt_packet_id_release(packet_id);
+                    status = Successfull;
+                }
+            }
+            break;
+
+        case SUBACK:
+            {
+				/* Packet identifier and at least one return code */
+				if (3 > *a_message_size_ptr)
+					break;
+				mqtt_packet_id_release((uint16_t)((next_header_ptr[0] << 8) | next_header_ptr[1]));
+				decode_variable_header_suback(a_input_ptr, &status);
+				if (NULL != g_shared_data) {
+
+					if (NULL != g_shared_data->subscribe_cb_fptr) {
+						if (true == status) {
+							g_shared_data->subscribe_cb_fptr(Successfull, NULL, 0, NULL, 0);
+							status = Successfull;
+						}
+						else {
+							g_shared_data->subscribe_cb_fptr(PublishDecodeError, NULL, 0, NULL, 0);
+						}
+					}
+				}
+            }
+            break;
+
+        case PINGRESP:
+            status = Successfull;
+            break;
+
+        default:
+            status = InvalidArgument;
+            break;
+    }
+    return status;
+}
+
+/************************************************************************************************************
+ *                                                                                                          *
+ * \subsection API MQTT API functions                                                                       *
+ *                                                                                                          *
+ * External software components uses services of this library through these API functions.                  *
+ *                                                                                                          *
+ ************************************************************************************************************/
+MQTTErrorCodes_t mqtt(MQTTAction_t         a_action,
+                      MQTT_action_data_t * a_action_ptr)
+{
+        MQTTErrorCodes_t status = InvalidArgument;
+
+        switch (a_action)
+        {
+            case ACTION_INIT:
+                if (NULL != a_action_ptr) {
+
+                    g_shared_data                          = a_action_ptr->action_argument.shared_ptr;
+                    g_shared_data->state                   = STATE_DISCONNECTED;
+                    g_shared_data->mqtt_packet_cntr        = 0;
+                    g_shared_data->keepalive_in_ms         = 0;
+                    g_shared_data->time_to_next_ping_in_ms = 0;
+                    g_shared_data->message_view_cb_fptr    = NULL;
+                    mqtt_memset(&(g_shared_data->message_batch), 0, sizeof(MQTT_message_batch_t));
+                    mqtt_memset(&(g_shared_data->ack_coalescer), 0, sizeof(MQTT_ack_coalescer_t));
+                    mqtt_memset(&(g_shared_data->scheduler), 0, sizeof(MQTT_scheduler_t));
+                    mqtt_memset(&(g_shared_data->payload_codec), 0, sizeof(MQTT_payload_codec_t));
+                    g_shared_data->rate_limits      = NULL;
+                    g_shared_data->rate_limit_count = 0;
+                    g_shared_data->record_batches   = NULL;
+                    g_shared_data->unbatch_records  = false;
+                    g_shared_data->buffer_pin_fptr         = NULL;
+                    mqtt_memset(&(g_shared_data->output_queue), 0, sizeof(MQTT_output_queue_t));
+                    mqtt_memset(&(g_shared_data->packet_id_pool), 0, sizeof(MQTT_packet_id_pool_t));
+                    g_shared_data->validate_payload_utf8   = false;
+                    mqtt_memset(&(g_shared_data->pipeline), 0, sizeof(MQTT_pipeline_t));
+                    status = Successfull;
+                }
+                break;
+
+            case ACTION_DISCONNECT:
+                if ((NULL               != g_shared_data) &&
+                    (STATE_DISCONNECTED != g_shared_data->state))
+                    status = mqtt_disconnect_(mqtt_session_out_fptr());
+                else
+                    status = NoConnection;
+                break;
+
+            case ACTION_CONNECT:
+                if ((NULL != g_shared_data) &&
+                    (NULL != a_action_ptr)) {
+                    if (g_shared_data->state == STATE_DISCONNECTED) {
+                        status = mqtt_connect_(g_shared_data->buffer,
+                                               g_shared_data->buffer_size,
+                                               NULL,
+                                               mqtt_session_out_fptr(),
+                                               a_action_ptr->action_argument.connect_ptr,
+                                               false);
+
+                        if (Successfull == status) {
+                            mqtt_connect_sent(a_action_ptr->action_argument.connect_ptr->keepalive);
+                        } else {
+                            g_shared_data->state = STATE_DISCONNECTED;
+                        }
+                    } else {
+                        status = AllreadyConnected;
+                    }
+                }
+                break;
+
+            case ACTION_CONNECT_PREBUILT:
+                if ((NULL != g_shared_data) &&
+                    (NULL != a_action_ptr)  &&
+                    (NULL != a_action_ptr->action_argument.connect_frame_ptr)) {
+                    if (g_shared_data->state == STATE_DISCONNECTED) {
+                        MQTT_connect_frame_t * frame_ptr = a_action_ptr->action_argument.connect_frame_ptr;
+
+                        /* Sent as is, shared buffer is not touched */
+                        if (mqtt_session_out_fptr()(frame_ptr->frame_ptr, frame_ptr->frame_size) == (int)frame_ptr->frame_size) {
+                            mqtt_connect_sent(frame_ptr->keepalive);
+                            status = Successfull;
+                        } else {
+                            g_shared_data->state = STATE_DISCONNECTED;
+                            status = ServerUnavailabe;
+                        }
+                    } else {
+                        status = AllreadyConnected;
+                    }
+                }
+                break;
+
+            case ACTION_PUBLISH:
+                if ((NULL            != g_shared_data)        &&
+                    (STATE_CONNECTED == g_shared_data->state) &&
+                    (NULL            != a_action_ptr)) {
+
+                        if (true == g_shared_data->output_queue.blocked) {
+                            status = WouldBlock;
+                            break;
+                        }
+
+                        uint8_t * message_buffer      = g_shared_data->buffer;
+                        uint32_t  message_buffer_size = g_shared_data->buffer_size;
+                        uint16_t  packet_id           = 0;
+                        MQTT_publish_t * publish_ptr  = a_action_ptr->action_argument.publish_ptr;
+
+                        if (false == mqtt_topic_valid(publish_ptr->topic_ptr, publish_ptr->topic_length, false)) {
+                            #ifdef DEBUG
+                                mqtt_printf("%s %u Invalid publish topic\n", __FILE__, __LINE__);
+                            #endif
+                            status = InvalidTopic;
+                            break;
+                        }
+
+                        if ((true  == g_shared_data->validate_payload_utf8) &&
+                            (false == mqtt_utf8_valid(publish_ptr->message_buffer_ptr, publish_ptr->message_buffer_size))) {
+                            #ifdef DEBUG
+                                mqtt_printf("%s %u Payload is not UTF-8\n", __FILE__, __LINE__);
+                            #endif
+                            status = InvalidPayload;
+                            break;
+                        }
+
+                        size_t rate_bytes = publish_ptr->topic_length + publish_ptr->message_buffer_size;
+                        if (false == mqtt_rate_limit_check(publish_ptr->topic_ptr, publish_ptr->topic_length, rate_bytes)) {
+                            status = RateLimited;
+                            break;
+                        }
+
+                        /* QoS 0 publish has no packet identifier */
+                        if (QoS0 < a_action_ptr->action_argument.publish_ptr->flags.qos) {
+                            packet_id = mqtt_packet_id_allocate();
+                            if (0 == packet_id) {
+                                status = WouldBlock;
+                                break;
+                            }
+                        }
+
+                        /* Use special buffer, not the shared one */
+                        if ((NULL != a_action_ptr->action_argument.publish_ptr->output_buffer_ptr) &&
+                            (0     < a_action_ptr->action_argument.publish_ptr->output_buffer_size)){
+
+                               message_buffer = a_action_ptr->action_argument.publish_ptr->output_buffer_ptr;
+                               message_buffer_size = a_action_ptr->action_argument.publish_ptr->output_buffer_size;
+                           }
+                       encode_publish_fptr_t encode_fptr = (NULL == g_shared_data->payload_codec.compress_fptr) ?
+                                                           &encode_publish : &encode_publish_compressed;
+                       if (true == encode_fptr(mqtt_session_out_fptr(),
+                                               message_buffer,
+                                               message_buffer_size,
+                                               a_action_ptr->action_argument.publish_ptr->flags.retain,
+                                               a_action_ptr->action_argument.publish_ptr->flags.qos,
+                                               false, /* a_action_ptr->action_argument.publish_ptr->flags.dup,*/
+                                               a_action_ptr->action_argument.publish_ptr->topic_ptr,
+                                               a_action_ptr->action_argument.publish_ptr->topic_length,
+                                               packet_id,
+                                               a_action_ptr->action_argument.publish_ptr->message_buffer_ptr,
+                                               a_action_ptr->action_argument.publish_ptr->message_buffer_size)) {
+
+                            mqtt_rate_limit_take(publish_ptr->topic_ptr, publish_ptr->topic_length, rate_bytes);
+                            g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
+                            status = Successfull;
+                        }
+                        else {
+                            mqtt_packet_id_release(packet_id);
+                            if (WouldBlock == g_shared_data->output_queue.status)
+                                status = WouldBlock;
+                            #ifdef DEBUG
+                               mqtt_printf("%s %u Publish encode failed\n", __FILE__, __LINE__);
+                            #endif
+                        }
+                }
+                break;
+
+            case ACTION_PUBLISH_STREAM:
+                if ((NULL            != g_shared_data)        &&
+                    (STATE_CONNECTED == g_shared_data->state) &&
+                    (NULL            != a_action_ptr)) {
+
+                        MQTT_publish_stream_t * stream_ptr = a_action_ptr->action_argument.publish_stream_ptr;
+
+                        /* Stream is started only with empty output queue and not into startup
+                           flight, because packet can not be taken back once its first chunk is out. */
+                        if ((NULL != g_shared_data->pipeline.buffer)      ||
+                            (true == g_shared_data->output_queue.blocked) ||
+                            ((NULL != g_shared_data->output_queue.buffer) &&
+                             (Successfull != mqtt_output_queue_drain()))) {
+                            status = WouldBlock;
+                            break;
+                        }
+
+                        if (false == mqtt_topic_valid(stream_ptr->topic_ptr, stream_ptr->topic_length, false)) {
+                            #ifdef DEBUG
+                                mqtt_printf("%s %u Invalid publish topic\n", __FILE__, __LINE__);
+                            #endif
+                            status = InvalidTopic;
+                            break;
+                        }
+
+                        size_t rate_bytes = stream_ptr->topic_length + stream_ptr->message_size;
+                        if (false == mqtt_rate_limit_check(stream_ptr->topic_ptr, stream_ptr->topic_length, rate_bytes)) {
+                            status = RateLimited;
+                            break;
+                        }
+
+                        uint16_t packet_id = 0;
+                        if (QoS0 < stream_ptr->flags.qos) {
+                            packet_id = mqtt_packet_id_allocate();
+                            if (0 == packet_id) {
+                                status = WouldBlock;
+                                break;
+                            }
+                        }
+
+                        uint32_t sent = 0;
+                        if (true == encode_publish_stream(mqtt_session_out_fptr(),
+                                                          g_shared_data->buffer,
+                                                          g_shared_data->buffer_size,
+                                                          stream_ptr->flags.retain,
+                                                          stream_ptr->flags.qos,
+                                                          false,
+                                                          stream_ptr->topic_ptr,
+                                                          stream_ptr->topic_length,
+                                                          packet_id,
+                                                          stream_ptr->pull_fptr,
+                                                          stream_ptr->message_size,
+                                                          &sent)) {
+
+                            mqtt_rate_limit_take(stream_ptr->topic_ptr, stream_ptr->topic_length, rate_bytes);
+                            g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
+                            status = Successfull;
+                        } else {
+                            mqtt_packet_id_release(packet_id);
+                            #ifdef DEBUG
+                               mqtt_printf("%s %u Publish stream failed after %u bytes\n", __FILE__, __LINE__, sent);
+                            #endif
+
+                            /* Broker has a part of the packet, nothing written later can be parsed */
+                            if (0 < sent) {
+                                g_shared_data->state = STATE_DISCONNECTED;
+                                status               = NoConnection;
+                            }
+                        }
+                }
                 break;
 
             case ACTION_SUBSCRIBE:
@@ -1611,34 +3170,77 @@ MQTTErrorCodes_t mqtt(MQTTAction_t         a_action,
                     (STATE_CONNECTED == g_shared_data->state) &&
                     (NULL            != a_action_ptr)) {
 
-                        if (true == encode_subscribe(g_shared_data->out_fptr,
+                        if (true == g_shared_data->output_queue.blocked) {
+                            status = WouldBlock;
+                            break;
+                        }
+
+                        if (false == mqtt_topic_valid(a_action_ptr->action_argument.subscribe_ptr->topic_ptr,
+                                                      a_action_ptr->action_argument.subscribe_ptr->topic_length,
+                                                      true)) {
+                            #ifdef DEBUG
+                                mqtt_printf("%s %u Invalid topic filter\n", __FILE__, __LINE__);
+                            #endif
+                            status = InvalidTopic;
+                            break;
+                        }
+
+                        uint16_t packet_id = mqtt_packet_id_allocate();
+                        if (0 == packet_id) {
+                            status = WouldBlock;
+                            break;
+                        }
+
+                        /* QoS 2 flow (PUBREC, PUBREL, PUBCOMP) is not done for received messages */
+                        MQTTQoSLevel_t qos = a_action_ptr->action_argument.subscribe_ptr->qos;
+                        if (QoS1 < qos)
+                            qos = QoS1;
+
+                        if (true == encode_subscribe(mqtt_session_out_fptr(),
                                                      g_shared_data->buffer,
                                                      g_shared_data->buffer_size,
-                                                     a_action_ptr->action_argument.subscribe_ptr->qos,
+                                                     qos,
                                                      a_action_ptr->action_argument.subscribe_ptr->topic_ptr,
                                                      a_action_ptr->action_argument.subscribe_ptr->topic_length,
-                                                     g_shared_data->mqtt_packet_cntr++)) {
+                                                     packet_id)) {
 
                             g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
                             status = Successfull;
                             g_shared_data->subscribe_status = true;
+                        } else {
+                            mqtt_packet_id_release(packet_id);
+                            if (WouldBlock == g_shared_data->output_queue.status)
+                                status = WouldBlock;
                         }
                 }
                 break;
 
             case ACTION_KEEPALIVE:
                 if (NULL != a_action_ptr) {
+                    mqtt_rate_limit_refill(a_action_ptr->action_argument.epalsed_time_in_ms);
+
                     if (STATE_CONNECTED == g_shared_data->state) {
 
                         if (INT32_MIN != g_shared_data->keepalive_in_ms) {
-
                             if (g_shared_data->time_to_next_ping_in_ms  > (int32_t) a_action_ptr->action_argument.epalsed_time_in_ms)
                                 g_shared_data->time_to_next_ping_in_ms -= (int32_t) a_action_ptr->action_argument.epalsed_time_in_ms;
                             else
                                 g_shared_data->time_to_next_ping_in_ms = 0;
+                        }
+
+                        /* Acks waiting past their deadline, or when a ping would be due, go out now */
+                        if (0 < g_shared_data->ack_coalescer.used) {
+                            g_shared_data->ack_coalescer.time_left_ms -= (int32_t) a_action_ptr->action_argument.epalsed_time_in_ms;
+                            if ((0 >= g_shared_data->ack_coalescer.time_left_ms) ||
+                                ((INT32_MIN != g_shared_data->keepalive_in_ms) &&
+                                 (0 >= g_shared_data->time_to_next_ping_in_ms)))
+                                mqtt_ack_flush();
+                        }
+
+                        if (INT32_MIN != g_shared_data->keepalive_in_ms) {
 
                             if ( 0 >= g_shared_data->time_to_next_ping_in_ms) {
-                                status = mqtt_ping_req(g_shared_data->out_fptr);
+                                status = mqtt_ping_req(mqtt_session_out_fptr());
                                 if (Successfull == status)
                                     g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
                                 #ifdef DBUG
@@ -1663,8 +3265,8 @@ MQTTErrorCodes_t mqtt(MQTTAction_t         a_action,
             case ACTION_PARSE_INPUT_STREAM:
                 status = mqtt_parse_input_stream(a_action_ptr->action_argument.input_stream_ptr->data,
                                                  &(a_action_ptr->action_argument.input_stream_ptr->size_of_data));
-                if (NULL != g_shared_data)
-                     g_shared_data->time_to_next_ping_in_ms = g_shared_data->keepalive_in_ms;
+                /* Keepalive counts packets sent by the client only (MQTT 3.1.1 chapter 3.1.2.10),
+                   received traffic does not postpone the next ping. */
                 break;
 
             default:
@@ -1678,6 +3280,33 @@ MQTTErrorCodes_t mqtt(MQTTAction_t         a_action,
     return status;
 }
 
+MQTT_string_t mqtt_string(char * a_str_ptr)
+{
+    MQTT_string_t string;
+    string.ptr    = (uint8_t*)a_str_ptr;
+    string.length = 0;
+
+    if (NULL != a_str_ptr) {
+        size_t length = mqtt_strlen(a_str_ptr);
+        if (UINT16_MAX >= length)
+            string.length = (uint16_t)length;
+        else {
+            /* Not sent cut short or as empty - no data with a length is refused later */
+            #ifdef DEBUG
+                mqtt_printf("%s %u String too long %zu\n", __FILE__, __LINE__, length);
+            #endif
+            string.ptr    = NULL;
+            string.length = UINT16_MAX;
+        }
+    }
+    return string;
+}
+
+bool mqtt_string_valid(MQTT_string_t a_string)
+{
+    return ((NULL != a_string.ptr) || (0 == a_string.length));
+}
+
 bool mqtt_connect(char                   * a_client_name_ptr,
                   uint16_t                 a_keepalive_timeout,
                   uint8_t                * a_username_str_ptr,
@@ -1693,68 +3322,225 @@ bool mqtt_connect(char                   * a_client_name_ptr,
                   subscrbe_fptr_t          a_subscribe_fptr,
                   uint8_t                  a_timeout_in_sec)
 {
-    /* Initialize MQTT */
-    if ((NULL != a_client_name_ptr)         &&
-        (NULL != a_username_str_ptr)        &&
-        (NULL != a_password_str_ptr)        &&
-        (NULL != a_last_will_topic_str_ptr) &&
-        (NULL != a_last_will_str_ptr)       &&
-        (NULL != mqtt_shared_data_ptr)      &&
-        (NULL != a_output_buffer_ptr)) {
+    if ((NULL == a_client_name_ptr)         ||
+        (NULL == a_username_str_ptr)        ||
+        (NULL == a_password_str_ptr)        ||
+        (NULL == a_last_will_topic_str_ptr) ||
+        (NULL == a_last_will_str_ptr))
+        return false;
+
+    /* Each string is measured once here, nothing after this walks them */
+    return mqtt_connect_string(mqtt_string(a_client_name_ptr),
+                               a_keepalive_timeout,
+                               mqtt_string((char*)a_username_str_ptr),
+                               mqtt_string((char*)a_password_str_ptr),
+                               mqtt_string((char*)a_last_will_topic_str_ptr),
+                               mqtt_string((char*)a_last_will_str_ptr),
+                               mqtt_shared_data_ptr,
+                               a_output_buffer_ptr,
+                               a_output_buffer_size,
+                               a_clean_session,
+                               a_out_write_fptr,
+                               a_connected_fptr,
+                               a_subscribe_fptr,
+                               a_timeout_in_sec);
+}
 
-        g_shared_data = mqtt_shared_data_ptr;
-        g_shared_data->buffer             = a_output_buffer_ptr;
-        g_shared_data->buffer_size        = a_output_buffer_size;
+bool mqtt_connect_string(MQTT_string_t            a_client_id,
+                         uint16_t                 a_keepalive_timeout,
+                         MQTT_string_t            a_username,
+                         MQTT_string_t            a_password,
+                         MQTT_string_t            a_last_will_topic,
+                         MQTT_string_t            a_last_will,
+                         MQTT_shared_data_t     * mqtt_shared_data_ptr,
+                         uint8_t                * a_output_buffer_ptr,
+                         size_t                   a_output_buffer_size,
+                         bool                     a_clean_session,
+                         data_stream_out_fptr_t   a_out_write_fptr,
+                         connected_fptr_t         a_connected_fptr,
+                         subscrbe_fptr_t          a_subscribe_fptr,
+                         uint8_t                  a_timeout_in_sec)
+{
+    MQTT_connect_frame_t frame;
+
+    /* Shared buffer is free until connected, encode the message there */
+    if (false == mqtt_connect_prebuild(&frame,
+                                       a_output_buffer_ptr,
+                                       a_output_buffer_size,
+                                       a_client_id,
+                                       a_username,
+                                       a_password,
+                                       a_last_will_topic,
+                                       a_last_will,
+                                       a_keepalive_timeout,
+                                       a_clean_session))
+        return false;
+
+    return mqtt_connect_prebuilt(&frame,
+                                 mqtt_shared_data_ptr,
+                                 a_output_buffer_ptr,
+                                 a_output_buffer_size,
+                                 a_out_write_fptr,
+                                 a_connected_fptr,
+                                 a_subscribe_fptr,
+                                 a_timeout_in_sec);
+}
 
-        g_shared_data->out_fptr           = a_out_write_fptr;
-        g_shared_data->connected_cb_fptr  = a_connected_fptr;
-        g_shared_data->subscribe_cb_fptr  = a_subscribe_fptr;
+bool mqtt_connect_prebuild(MQTT_connect_frame_t * a_frame_ptr,
+                           uint8_t              * a_storage_ptr,
+                           size_t                 a_storage_size,
+                           MQTT_string_t          a_client_id,
+                           MQTT_string_t          a_username,
+                           MQTT_string_t          a_password,
+                           MQTT_string_t          a_last_will_topic,
+                           MQTT_string_t          a_last_will,
+                           uint16_t               a_keepalive_timeout,
+                           bool                   a_clean_session)
+{
+    if (NULL == a_frame_ptr)
+        return false;
+
+    /* View of a too long string - nothing is sent in its place */
+    if ((false == mqtt_string_valid(a_client_id))       ||
+        (false == mqtt_string_valid(a_username))        ||
+        (false == mqtt_string_valid(a_password))        ||
+        (false == mqtt_string_valid(a_last_will_topic)) ||
+        (false == mqtt_string_valid(a_last_will))) {
+        a_frame_ptr->frame_ptr  = NULL;
+        a_frame_ptr->frame_size = 0;
+        return false;
+    }
 
-        MQTT_action_data_t action;
-        action.action_argument.shared_ptr = g_shared_data;
+    a_frame_ptr->frame_ptr  = mqtt_connect_encode(a_storage_ptr,
+                                                  a_storage_size,
+                                                  a_client_id.ptr,
+                                                  a_client_id.length,
+                                                  a_username.ptr,
+                                                  a_username.length,
+                                                  a_password.ptr,
+                                                  a_password.length,
+                                                  a_last_will_topic.ptr,
+                                                  a_last_will_topic.length,
+                                                  a_last_will.ptr,
+                                                  a_last_will.length,
+                                                  a_keepalive_timeout,
+                                                  a_clean_session,
+                                                  false,
+                                                  &(a_frame_ptr->frame_size));
+    a_frame_ptr->keepalive  = a_keepalive_timeout;
+
+    if (NULL == a_frame_ptr->frame_ptr) {
+        a_frame_ptr->frame_size = 0;
+        return false;
+    }
+    return true;
+}
 
-        MQTTErrorCodes_t state = mqtt(ACTION_INIT,
-                                      &action);
+bool mqtt_connect_prebuilt(MQTT_connect_frame_t   * a_frame_ptr,
+                           MQTT_shared_data_t     * mqtt_shared_data_ptr,
+                           uint8_t                * a_output_buffer_ptr,
+                           size_t                   a_output_buffer_size,
+                           data_stream_out_fptr_t   a_out_write_fptr,
+                           connected_fptr_t         a_connected_fptr,
+                           subscrbe_fptr_t          a_subscribe_fptr,
+                           uint8_t                  a_timeout_in_sec)
+{
+    if ((NULL == a_frame_ptr)            ||
+        (NULL == a_frame_ptr->frame_ptr) ||
+        (NULL == mqtt_shared_data_ptr)   ||
+        (NULL == a_output_buffer_ptr))
+        return false;
 
-        /* Connect to broker */
-        if (Successfull == state) {
-            #ifdef DEBUG
-                mqtt_printf("%s %u MQTT Initialized\n", __FILE__, __LINE__);
-            #endif
+    g_shared_data = mqtt_shared_data_ptr;
+    g_shared_data->buffer             = a_output_buffer_ptr;
+    g_shared_data->buffer_size        = a_output_buffer_size;
 
-            /* Connect to broker */
-            MQTT_connect_t connect_params;
-            connect_params.client_id                    = (uint8_t *)a_client_name_ptr;
-            connect_params.last_will_topic              = a_last_will_topic_str_ptr;
-            connect_params.last_will_message            = a_last_will_str_ptr;
-            connect_params.connect_flags.last_will_qos  = QoS0;
-            connect_params.connect_flags.permanent_will = false;
-            connect_params.username                     = a_username_str_ptr;
-            connect_params.password                     = a_password_str_ptr;
-            connect_params.keepalive                    = a_keepalive_timeout;
-            connect_params.connect_flags.clean_session  = a_clean_session;
+    g_shared_data->out_fptr           = a_out_write_fptr;
+    g_shared_data->connected_cb_fptr  = a_connected_fptr;
+    g_shared_data->subscribe_cb_fptr  = a_subscribe_fptr;
 
-            action.action_argument.connect_ptr = &connect_params;
+    MQTT_action_data_t action;
+    action.action_argument.shared_ptr = g_shared_data;
 
-            state = mqtt(ACTION_CONNECT,
-                         &action);
+    if (Successfull != mqtt(ACTION_INIT, &action))
+        return false;
 
-            if (Successfull == state) {
+    action.action_argument.connect_frame_ptr = a_frame_ptr;
+    if (Successfull == mqtt(ACTION_CONNECT_PREBUILT, &action)) {
 
-                uint8_t timeout = (a_timeout_in_sec * 10);
+        uint8_t timeout = (a_timeout_in_sec * 10);
 
-                while ((0!= timeout) &&
-                       (STATE_CONNECTED != g_shared_data->state)) {
-                    timeout--;
-                    mqtt_sleep(0.1);
-                }
-            }
+        while ((0!= timeout) &&
+               (STATE_CONNECTED != g_shared_data->state)) {
+            timeout--;
+            mqtt_sleep(0.1);
         }
     }
 
     return (g_shared_data->state == STATE_CONNECTED);
 }
 
+bool mqtt_connect_pipelined(MQTT_connect_frame_t   * a_frame_ptr,
+                            MQTT_shared_data_t     * mqtt_shared_data_ptr,
+                            uint8_t                * a_output_buffer_ptr,
+                            size_t                   a_output_buffer_size,
+                            uint8_t                * a_flight_ptr,
+                            size_t                   a_flight_size,
+                            data_stream_out_fptr_t   a_out_write_fptr,
+                            connected_fptr_t         a_connected_fptr,
+                            subscrbe_fptr_t          a_subscribe_fptr,
+                            startup_fptr_t           a_startup_fptr)
+{
+    if ((NULL == a_frame_ptr)            ||
+        (NULL == a_frame_ptr->frame_ptr) ||
+        (NULL == mqtt_shared_data_ptr)   ||
+        (NULL == a_output_buffer_ptr)    ||
+        (NULL == a_flight_ptr)           ||
+        (NULL == a_out_write_fptr))
+        return false;
+
+    g_shared_data = mqtt_shared_data_ptr;
+    g_shared_data->buffer             = a_output_buffer_ptr;
+    g_shared_data->buffer_size        = a_output_buffer_size;
+
+    g_shared_data->out_fptr           = a_out_write_fptr;
+    g_shared_data->connected_cb_fptr  = a_connected_fptr;
+    g_shared_data->subscribe_cb_fptr  = a_subscribe_fptr;
+
+    MQTT_action_data_t action;
+    action.action_argument.shared_ptr = g_shared_data;
+
+    if (Successfull != mqtt(ACTION_INIT, &action))
+        return false;
+
+    /* Everything sent until the flight is written is gathered */
+    g_shared_data->pipeline.buffer = a_flight_ptr;
+    g_shared_data->pipeline.size   = a_flight_size;
+    g_shared_data->pipeline.used   = 0;
+
+    /* MQTT 3.1.1 chapter 3.1.4: client may send further packets without waiting for CONNACK */
+    action.action_argument.connect_frame_ptr = a_frame_ptr;
+    bool connected = (Successfull == mqtt(ACTION_CONNECT_PREBUILT, &action));
+
+    if (connected && (NULL != a_startup_fptr))
+        a_startup_fptr();
+
+    size_t used = g_shared_data->pipeline.used;
+    mqtt_memset(&(g_shared_data->pipeline), 0, sizeof(MQTT_pipeline_t));
+
+    if (connected && (a_out_write_fptr(a_flight_ptr, used) != (int)used)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Startup flight not written %zu\n", __FILE__, __LINE__, used);
+        #endif
+        connected = false;
+    }
+
+    if (false == connected)
+        g_shared_data->state = STATE_DISCONNECTED;
+
+    return connected;
+}
+
 bool mqtt_disconnect()
 {
     return (Successfull == mqtt(ACTION_DISCONNECT, NULL));
@@ -1774,6 +3560,47 @@ bool mqtt_publish(char * a_topic_ptr,
                             0);
 }
 
+bool mqtt_publish_string(MQTT_string_t   a_topic,
+                         uint8_t       * a_msg_ptr,
+                         size_t          a_msg_size)
+{
+    if (false == mqtt_string_valid(a_topic))
+        return false;
+
+    return mqtt_publish_buf((char*)a_topic.ptr,
+                            a_topic.length,
+                            (char*)a_msg_ptr,
+                            a_msg_size,
+                            NULL,
+                            0);
+}
+
+MQTTErrorCodes_t mqtt_publish_try(char * a_topic_ptr,
+                                  size_t a_topic_size,
+                                  char * a_msg_ptr,
+                                  size_t a_msg_size)
+{
+    if ((NULL == a_topic_ptr) ||
+        (NULL == a_msg_ptr))
+        return InvalidArgument;
+
+    MQTT_publish_t publish;
+    publish.flags.dup           = false;
+    publish.flags.retain        = false;
+    publish.flags.qos           = QoS0;
+    publish.topic_ptr           = (uint8_t*)a_topic_ptr;
+    publish.topic_length        = (uint16_t)a_topic_size;
+    publish.message_buffer_ptr  = (uint8_t*)a_msg_ptr;
+    publish.message_buffer_size = a_msg_size;
+    publish.output_buffer_ptr   = NULL;
+    publish.output_buffer_size  = 0;
+
+    MQTT_action_data_t action;
+    action.action_argument.publish_ptr = &publish;
+
+    return mqtt(ACTION_PUBLISH, &action);
+}
+
 bool mqtt_publish_buf(char    * a_topic_ptr,
                       size_t    a_topic_size,
                       char    * a_msg_ptr,
@@ -1797,17 +3624,54 @@ bool mqtt_publish_buf(char    * a_topic_ptr,
         publish.output_buffer_size  = a_output_buffer_size;
 
         MQTT_action_data_t action;
-        action.action_argument.publish_ptr = &publish;
-
-        MQTTErrorCodes_t state = mqtt(ACTION_PUBLISH,
-                                    &action);
+        action.action_argument.publish_ptr = &publish;
+
+        MQTTErrorCodes_t state = mqtt(ACTION_PUBLISH,
+                                    &action);
+
+        if (Successfull == state)
+            return true;
+    }
+    return false;
+}
+
+bool mqtt_publish_stream(char                * a_topic_ptr,
+                         size_t                a_topic_size,
+                         size_t                a_msg_size,
+                         publish_pull_fptr_t   a_pull_fptr)
+{
+    if ((NULL != a_topic_ptr) &&
+        (NULL != a_pull_fptr) &&
+        (MQTT_MAX_MESSAGE_SIZE > a_msg_size)) {
+
+        MQTT_publish_stream_t publish;
+        publish.flags.dup    = false;
+        publish.flags.retain = false;
+        publish.flags.qos    = QoS0;
+        publish.topic_ptr    = (uint8_t*)a_topic_ptr;
+        publish.topic_length = (uint16_t)a_topic_size;
+        publish.message_size = (uint32_t)a_msg_size;
+        publish.pull_fptr    = a_pull_fptr;
+
+        MQTT_action_data_t action;
+        action.action_argument.publish_stream_ptr = &publish;
 
-        if (Successfull == state)
-            return true;
+        return (Successfull == mqtt(ACTION_PUBLISH_STREAM, &action));
     }
     return false;
 }
 
+bool mqtt_subscribe_string(MQTT_string_t a_topic_filter,
+                           uint8_t       a_timeout_in_sec)
+{
+    if (false == mqtt_string_valid(a_topic_filter))
+        return false;
+
+    return mqtt_subscribe((char*)a_topic_filter.ptr,
+                          a_topic_filter.length,
+                          a_timeout_in_sec);
+}
+
 bool mqtt_subscribe(char     * a_topic,
                     uint16_t   a_topic_size,
                     uint8_t    a_timeout_in_sec)
@@ -1850,10 +3714,20 @@ bool mqtt_subscribe(char     * a_topic,
 
 bool mqtt_keepalive(uint32_t a_duration_in_ms)
 {
+    /* Good moment to push out what transport did not take earlier */
+    if ((NULL != g_shared_data) &&
+        (0     < g_shared_data->output_queue.used))
+        mqtt_output_flush();
+
     MQTT_action_data_t ap;
     ap.action_argument.epalsed_time_in_ms = a_duration_in_ms;
 
     MQTTErrorCodes_t state = mqtt(ACTION_KEEPALIVE, &ap);
+
+    /* Record batches due by their latency bound */
+    if (NULL != g_shared_data)
+        mqtt_record_batch_tick(a_duration_in_ms);
+
     return ((Successfull == state) ||
             (PingNotSend == state));
 }
@@ -1871,8 +3745,850 @@ bool mqtt_receive(uint8_t * a_data, size_t a_amount)
         MQTT_action_data_t action;
         action.action_argument.input_stream_ptr = &input;
 
-        return (Successfull == mqtt(ACTION_PARSE_INPUT_STREAM, &action));
+        bool ret = (Successfull == mqtt(ACTION_PARSE_INPUT_STREAM, &action));
+        mqtt_message_batch_flush();
+        if ((NULL != g_shared_data) &&
+            (0    == g_shared_data->ack_coalescer.deadline_ms))
+            mqtt_ack_flush();
+        return ret;
+    }
+
+    return false;
+}
+
+size_t mqtt_receive_stream(uint8_t * a_data,
+                           size_t    a_amount)
+{
+    size_t offset = 0;
+
+    if ((NULL == a_data) || (NULL == g_shared_data))
+        return 0;
+
+    /* Packets are parsed directly, mqtt() dispatch is done once per read */
+    while (offset < a_amount) {
+        uint32_t available = (uint32_t)(((a_amount - offset) > UINT32_MAX) ? UINT32_MAX : (a_amount - offset));
+        uint32_t length    = mqtt_packet_length(&a_data[offset], available);
+
+        if (0 == length)
+            break;
+
+        uint32_t         size   = length;
+        MQTTErrorCodes_t status = mqtt_parse_input_stream(&a_data[offset], &size);
+        if (Successfull != status) {
+            #ifdef DEBUG
+                mqtt_printf("%s %u Packet %x of %u bytes not handled %u\n", __FILE__, __LINE__, a_data[offset], length, status);
+            #endif
+            /* PUBLISH whose ack was not taken is not consumed */
+            if (((PUBLISH << 4) == (a_data[offset] & 0xf0)) &&
+                ((WouldBlock       == status) ||
+                 (ServerUnavailabe == status) ||
+                 (NoConnection     == status)))
+                break;
+        }
+        offset += length;
+    }
+    mqtt_message_batch_flush();
+    if (0 == g_shared_data->ack_coalescer.deadline_ms)
+        mqtt_ack_flush();
+    return offset;
+}
+
+void mqtt_set_message_view_cb(message_view_fptr_t a_view_fptr,
+                              buffer_pin_fptr_t   a_pin_fptr)
+{
+    if (NULL != g_shared_data) {
+        g_shared_data->message_view_cb_fptr = a_view_fptr;
+        g_shared_data->buffer_pin_fptr      = a_pin_fptr;
+    }
+}
+
+bool mqtt_set_message_batch_cb(message_batch_fptr_t   a_batch_fptr,
+                               MQTT_message_view_t  * a_views_ptr,
+                               size_t                 a_max_views)
+{
+    if (NULL == g_shared_data)
+        return false;
+
+    if (NULL == a_batch_fptr) {
+        mqtt_message_batch_flush();
+        mqtt_memset(&(g_shared_data->message_batch), 0, sizeof(MQTT_message_batch_t));
+        return true;
+    }
+
+    if ((NULL == a_views_ptr) || (0 == a_max_views))
+        return false;
+
+    g_shared_data->message_batch.batch_fptr = a_batch_fptr;
+    g_shared_data->message_batch.views      = a_views_ptr;
+    g_shared_data->message_batch.size       = a_max_views;
+    g_shared_data->message_batch.used       = 0;
+    return true;
+}
+
+bool mqtt_set_ack_coalescing(uint8_t  * a_buffer_ptr,
+                             size_t     a_buffer_size,
+                             uint32_t   a_deadline_ms)
+{
+    if (NULL == g_shared_data)
+        return false;
+
+    /* Waiting acks are written before the buffer is given back */
+    if (Successfull != mqtt_ack_flush())
+        return false;
+
+    if (NULL == a_buffer_ptr) {
+        mqtt_memset(&(g_shared_data->ack_coalescer), 0, sizeof(MQTT_ack_coalescer_t));
+        return true;
+    }
+
+    if ((4 > a_buffer_size) || (INT32_MAX < a_deadline_ms))
+        return false;
+
+    g_shared_data->ack_coalescer.buffer       = a_buffer_ptr;
+    g_shared_data->ack_coalescer.size         = a_buffer_size;
+    g_shared_data->ack_coalescer.used         = 0;
+    g_shared_data->ack_coalescer.deadline_ms  = a_deadline_ms;
+    g_shared_data->ack_coalescer.time_left_ms = 0;
+    return true;
+}
+
+bool mqtt_message_retain(MQTT_message_view_t * a_view_ptr)
+{
+    if ((NULL != a_view_ptr)    &&
+        (NULL != g_shared_data) &&
+        (NULL != g_shared_data->buffer_pin_fptr)) {
+
+        /* Decoded payload is not in the receive buffer, pinning the packet does not keep it */
+        MQTT_payload_codec_t * codec_ptr = &(g_shared_data->payload_codec);
+        if ((NULL != codec_ptr->decode_buffer)                                    &&
+            (a_view_ptr->payload_ptr >= codec_ptr->decode_buffer)                 &&
+            (a_view_ptr->payload_ptr <  (codec_ptr->decode_buffer + codec_ptr->decode_size)))
+            return false;
+
+        return g_shared_data->buffer_pin_fptr(a_view_ptr->packet_ptr, true);
     }
 
     return false;
 }
+
+void mqtt_message_release(MQTT_message_view_t * a_view_ptr)
+{
+    if ((NULL != a_view_ptr)    &&
+        (NULL != g_shared_data) &&
+        (NULL != g_shared_data->buffer_pin_fptr))
+        g_shared_data->buffer_pin_fptr(a_view_ptr->packet_ptr, false);
+}
+
+bool mqtt_set_output_queue(uint8_t         * a_queue_ptr,
+                           size_t            a_queue_size,
+                           size_t            a_high_watermark,
+                           size_t            a_low_watermark,
+                           writable_fptr_t   a_writable_fptr)
+{
+    if (NULL == g_shared_data)
+        return false;
+
+    if (NULL == a_queue_ptr) {
+        mqtt_memset(&(g_shared_data->output_queue), 0, sizeof(MQTT_output_queue_t));
+        return true;
+    }
+
+    if ((0 == a_high_watermark)              ||
+        (a_high_watermark > a_queue_size)    ||
+        (a_low_watermark >= a_high_watermark)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Invalid watermarks %zu %zu %zu\n",
+                        __FILE__,
+                        __LINE__,
+                        a_queue_size,
+                        a_high_watermark,
+                        a_low_watermark);
+        #endif
+        return false;
+    }
+
+    MQTT_output_queue_t * queue_ptr = &(g_shared_data->output_queue);
+    queue_ptr->buffer         = a_queue_ptr;
+    queue_ptr->size           = a_queue_size;
+    queue_ptr->head           = 0;
+    queue_ptr->used           = 0;
+    queue_ptr->high_watermark = a_high_watermark;
+    queue_ptr->low_watermark  = a_low_watermark;
+    queue_ptr->blocked        = false;
+    queue_ptr->status         = Successfull;
+    queue_ptr->writable_fptr  = a_writable_fptr;
+    return true;
+}
+
+MQTTErrorCodes_t mqtt_output_flush()
+{
+    if ((NULL == g_shared_data) ||
+        (NULL == g_shared_data->output_queue.buffer))
+        return InvalidArgument;
+
+    MQTT_output_queue_t * queue_ptr = &(g_shared_data->output_queue);
+    MQTTErrorCodes_t      status    = mqtt_output_queue_drain();
+
+    if ((true == queue_ptr->blocked) &&
+        (queue_ptr->used <= queue_ptr->low_watermark)) {
+        queue_ptr->blocked = false;
+        if (NULL != queue_ptr->writable_fptr)
+            queue_ptr->writable_fptr();
+    }
+    return status;
+}
+
+size_t mqtt_output_pending()
+{
+    if (NULL == g_shared_data)
+        return 0;
+    return g_shared_data->output_queue.used;
+}
+
+bool mqtt_output_blocked()
+{
+    if (NULL == g_shared_data)
+        return false;
+    return g_shared_data->output_queue.blocked;
+}
+
+bool mqtt_set_packet_id_pool(uint32_t * a_bitmap_ptr,
+                             size_t     a_bitmap_words)
+{
+    if (NULL == g_shared_data)
+        return false;
+
+    MQTT_packet_id_pool_t * pool_ptr = &(g_shared_data->packet_id_pool);
+    mqtt_memset(pool_ptr, 0, sizeof(MQTT_packet_id_pool_t));
+
+    if (NULL == a_bitmap_ptr)
+        return true;
+
+    if (0 == a_bitmap_words) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Empty packet identifier pool\n", __FILE__, __LINE__);
+        #endif
+        return false;
+    }
+
+    /* Identifiers above 65535 do not exist */
+    if (a_bitmap_words > MQTT_PACKET_ID_POOL_WORDS(MQTT_PACKET_ID_MAX))
+        a_bitmap_words = MQTT_PACKET_ID_POOL_WORDS(MQTT_PACKET_ID_MAX);
+
+    mqtt_memset(a_bitmap_ptr, 0, a_bitmap_words * sizeof(uint32_t));
+    a_bitmap_ptr[0]  = 1; /* Identifier 0 is never given */
+    pool_ptr->bitmap = a_bitmap_ptr;
+    pool_ptr->words  = (uint32_t)a_bitmap_words;
+    return true;
+}
+
+bool mqtt_packet_id_release(uint16_t a_packet_id)
+{
+    if ((NULL == g_shared_data)                          ||
+        (NULL == g_shared_data->packet_id_pool.bitmap)   ||
+        (0    == a_packet_id))
+        return false;
+
+    MQTT_packet_id_pool_t * pool_ptr = &(g_shared_data->packet_id_pool);
+    uint32_t                word     = a_packet_id / 32;
+    uint32_t                mask     = 1u << (a_packet_id % 32);
+
+    if ((word >= pool_ptr->words)   ||
+        (0 == (pool_ptr->bitmap[word] & mask))) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Packet identifier %u not in flight\n", __FILE__, __LINE__, a_packet_id);
+        #endif
+        return false;
+    }
+
+    pool_ptr->bitmap[word] &= ~mask;
+    pool_ptr->in_use--;
+    return true;
+}
+
+uint32_t mqtt_packet_ids_in_use()
+{
+    if (NULL == g_shared_data)
+        return 0;
+    return g_shared_data->packet_id_pool.in_use;
+}
+
+void mqtt_set_payload_validation(bool a_utf8)
+{
+    if (NULL != g_shared_data)
+        g_shared_data->validate_payload_utf8 = a_utf8;
+}
+
+bool mqtt_set_payload_codec(payload_codec_fptr_t   a_compress_fptr,
+                            payload_codec_fptr_t   a_decompress_fptr,
+                            uint8_t                a_id,
+                            uint8_t              * a_decode_buffer_ptr,
+                            size_t                 a_decode_size)
+{
+    if (NULL == g_shared_data)
+        return false;
+
+    if (((NULL != a_compress_fptr) || (NULL != a_decompress_fptr)) &&
+        ((MQTT_CODEC_STORED == a_id) || (MQTT_CODEC_RECORDS == a_id) || (MQTT_CODEC_CHUNK == a_id)))
+        return false;
+
+    if ((NULL != a_decompress_fptr) &&
+        ((NULL == a_decode_buffer_ptr) || (0 == a_decode_size)))
+        return false;
+
+    MQTT_payload_codec_t * codec_ptr = &(g_shared_data->payload_codec);
+    codec_ptr->compress_fptr   = a_compress_fptr;
+    codec_ptr->decompress_fptr = a_decompress_fptr;
+    codec_ptr->id              = a_id;
+    codec_ptr->decode_buffer   = a_decode_buffer_ptr;
+    codec_ptr->decode_size     = a_decode_size;
+    return true;
+}
+
+bool mqtt_record_batch_init(MQTT_record_batch_t * a_batch_ptr,
+                            char                * a_topic_ptr,
+                            uint16_t              a_topic_size,
+                            uint8_t             * a_buffer_ptr,
+                            size_t                a_buffer_size,
+                            uint32_t              a_max_delay_ms)
+{
+    if ((NULL == g_shared_data)                ||
+        (NULL == a_batch_ptr)                  ||
+        (NULL == a_topic_ptr)                  ||
+        (NULL == a_buffer_ptr)                 ||
+        (MQTT_CODEC_ENVELOPE >= a_buffer_size) ||
+        (INT32_MAX < a_max_delay_ms))
+        return false;
+
+    /* Whole batch goes out as one publish from the shared buffer */
+    if (g_shared_data->buffer_size < (sizeof(MQTT_fixed_header_t) + 2 + a_topic_size + a_buffer_size)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Record batch %u does not fit to buffer %u\n",
+                        __FILE__,
+                        __LINE__,
+                        (uint32_t)a_buffer_size,
+                        (uint32_t)g_shared_data->buffer_size);
+        #endif
+        return false;
+    }
+
+    a_batch_ptr->topic_ptr    = a_topic_ptr;
+    a_batch_ptr->topic_size   = a_topic_size;
+    a_batch_ptr->buffer       = a_buffer_ptr;
+    a_batch_ptr->size         = a_buffer_size;
+    a_batch_ptr->used         = MQTT_CODEC_ENVELOPE;
+    a_batch_ptr->count        = 0;
+    a_batch_ptr->max_delay_ms = a_max_delay_ms;
+    a_batch_ptr->time_left_ms = 0;
+    a_buffer_ptr[0]           = MQTT_CODEC_MARKER;
+    a_buffer_ptr[1]           = MQTT_CODEC_RECORDS;
+
+    /* Set up again - already in the list */
+    for (MQTT_record_batch_t * batch_ptr = g_shared_data->record_batches; NULL != batch_ptr; batch_ptr = batch_ptr->next)
+        if (batch_ptr == a_batch_ptr)
+            return true;
+
+    a_batch_ptr->next             = g_shared_data->record_batches;
+    g_shared_data->record_batches = a_batch_ptr;
+    return true;
+}
+
+MQTTErrorCodes_t mqtt_record_append(MQTT_record_batch_t * a_batch_ptr,
+                                    uint8_t             * a_record_ptr,
+                                    size_t                a_record_size)
+{
+    if ((NULL == a_batch_ptr) ||
+        ((NULL == a_record_ptr) && (0 < a_record_size)))
+        return InvalidArgument;
+
+    /* Length prefix, at most 4 bytes */
+    uint8_t  length[4];
+    uint32_t length_size = 0;
+    size_t   value       = a_record_size;
+    do {
+        length[length_size] = value % 128;
+        value               = value / 128;
+        if (value > 0)
+            length[length_size] |= 128;
+        length_size++;
+    } while ((value > 0) && (length_size < sizeof(length)));
+
+    if ((0 < value) ||
+        (a_batch_ptr->size < (MQTT_CODEC_ENVELOPE + length_size + a_record_size))) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Record %u does not fit to batch\n", __FILE__, __LINE__, (uint32_t)a_record_size);
+        #endif
+        return InvalidArgument;
+    }
+
+    /* Envelope and length prefixes are binary, so text promise is checked per record */
+    if ((NULL != g_shared_data)                          &&
+        (true == g_shared_data->validate_payload_utf8)   &&
+        (false == mqtt_utf8_valid(a_record_ptr, a_record_size))) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Record is not UTF-8\n", __FILE__, __LINE__);
+        #endif
+        return InvalidPayload;
+    }
+
+    if (a_batch_ptr->size < (a_batch_ptr->used + length_size + a_record_size)) {
+        MQTTErrorCodes_t status = mqtt_record_flush(a_batch_ptr);
+        if (Successfull != status)
+            return status;
+    }
+
+    /* First record starts the latency bound */
+    if (0 == a_batch_ptr->count)
+        a_batch_ptr->time_left_ms = (int32_t)a_batch_ptr->max_delay_ms;
+
+    mqtt_memcpy(&(a_batch_ptr->buffer[a_batch_ptr->used]), length, length_size);
+    a_batch_ptr->used += length_size;
+    if (0 < a_record_size)
+        mqtt_memcpy(&(a_batch_ptr->buffer[a_batch_ptr->used]), a_record_ptr, a_record_size);
+    a_batch_ptr->used += a_record_size;
+    a_batch_ptr->count++;
+    return Successfull;
+}
+
+MQTTErrorCodes_t mqtt_record_flush(MQTT_record_batch_t * a_batch_ptr)
+{
+    if ((NULL == g_shared_data) ||
+        (NULL == a_batch_ptr))
+        return InvalidArgument;
+
+    if (0 == a_batch_ptr->count)
+        return Successfull;
+
+    /* Records were checked by mqtt_record_append */
+    MQTTErrorCodes_t status = mqtt_publish_enveloped(a_batch_ptr->topic_ptr,
+                                                     a_batch_ptr->topic_size,
+                                                     a_batch_ptr->buffer,
+                                                     a_batch_ptr->used);
+    if (Successfull == status) {
+        a_batch_ptr->used  = MQTT_CODEC_ENVELOPE;
+        a_batch_ptr->count = 0;
+    }
+    return status;
+}
+
+MQTTErrorCodes_t mqtt_record_batch_close(MQTT_record_batch_t * a_batch_ptr)
+{
+    if ((NULL == g_shared_data) ||
+        (NULL == a_batch_ptr))
+        return InvalidArgument;
+
+    MQTTErrorCodes_t status = mqtt_record_flush(a_batch_ptr);
+
+    MQTT_record_batch_t ** link_ptr = &(g_shared_data->record_batches);
+    while ((NULL != *link_ptr) && (a_batch_ptr != *link_ptr))
+        link_ptr = &((*link_ptr)->next);
+    if (NULL != *link_ptr)
+        *link_ptr = a_batch_ptr->next;
+    a_batch_ptr->next = NULL;
+    return status;
+}
+
+void mqtt_set_record_unbatching(bool a_unbatch)
+{
+    if (NULL != g_shared_data)
+        g_shared_data->unbatch_records = a_unbatch;
+}
+
+bool mqtt_records_open(MQTT_record_iterator_t * a_iterator_ptr,
+                       uint8_t                * a_payload_ptr,
+                       uint32_t                 a_payload_size)
+{
+    if ((NULL == a_iterator_ptr)                ||
+        (NULL == a_payload_ptr)                 ||
+        (MQTT_CODEC_ENVELOPE > a_payload_size)  ||
+        (MQTT_CODEC_MARKER  != a_payload_ptr[0]) ||
+        (MQTT_CODEC_RECORDS != a_payload_ptr[1]))
+        return false;
+
+    a_iterator_ptr->next_ptr = &(a_payload_ptr[MQTT_CODEC_ENVELOPE]);
+    a_iterator_ptr->end_ptr  = &(a_payload_ptr[a_payload_size]);
+    return true;
+}
+
+bool mqtt_records_next(MQTT_record_iterator_t  * a_iterator_ptr,
+                       uint8_t                ** a_record_ptr,
+                       uint32_t                * a_record_size_ptr)
+{
+    if ((NULL == a_iterator_ptr)           ||
+        (NULL == a_iterator_ptr->next_ptr) ||
+        (a_iterator_ptr->end_ptr == a_iterator_ptr->next_ptr))
+        return false;
+
+    uint8_t  * data_ptr = a_iterator_ptr->next_ptr;
+    uint32_t   value    = 0;
+    uint32_t   shift    = 0;
+    uint8_t    aByte    = 0;
+    do {
+        /* Length cut short or longer than 4 bytes */
+        if ((a_iterator_ptr->end_ptr == data_ptr) || (28 == shift)) {
+            a_iterator_ptr->next_ptr = NULL;
+            return false;
+        }
+        aByte  = *data_ptr++;
+        value |= (uint32_t)(aByte & 127) << shift;
+        shift += 7;
+    } while (0 != (aByte & 128));
+
+    if (value > (uint32_t)(a_iterator_ptr->end_ptr - data_ptr)) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Record %u past the payload\n", __FILE__, __LINE__, value);
+        #endif
+        a_iterator_ptr->next_ptr = NULL;
+        return false;
+    }
+
+    *a_record_ptr            = data_ptr;
+    *a_record_size_ptr       = value;
+    a_iterator_ptr->next_ptr = data_ptr + value;
+    return true;
+}
+
+bool mqtt_set_scheduler(uint8_t          * a_chunk_buffer_ptr,
+                        size_t             a_chunk_size,
+                        scheduled_fptr_t   a_scheduled_fptr)
+{
+    if ((NULL == g_shared_data)              ||
+        (MQTT_CHUNK_HEADER >= a_chunk_size)  ||
+        (g_shared_data->buffer_size < a_chunk_size))
+        return false;
+
+    MQTT_scheduler_t * scheduler_ptr = &(g_shared_data->scheduler);
+    scheduler_ptr->chunk_buffer   = a_chunk_buffer_ptr;
+    scheduler_ptr->chunk_size     = a_chunk_size;
+    scheduler_ptr->scheduled_fptr = a_scheduled_fptr;
+    return true;
+}
+
+bool mqtt_schedule(MQTT_scheduled_t * a_message_ptr,
+                   MQTTLane_t         a_lane,
+                   uint32_t           a_expiry_ms)
+{
+    if ((NULL      == g_shared_data)                          ||
+        (0         == g_shared_data->scheduler.chunk_size)    ||
+        (NULL      == a_message_ptr)                          ||
+        (NULL      == a_message_ptr->topic_ptr)               ||
+        (LANE_COUNT <= (uint32_t)a_lane))
+        return false;
+
+    MQTT_scheduler_t * scheduler_ptr = &(g_shared_data->scheduler);
+
+    /* Pulled and split payloads go through the chunk buffer */
+    bool split = ((LANE_BULK == a_lane) && (a_message_ptr->payload_size > scheduler_ptr->chunk_size));
+    if (((NULL == a_message_ptr->payload_ptr) && (NULL == a_message_ptr->pull_fptr)) ||
+        (((NULL == a_message_ptr->payload_ptr) || split) && (NULL == scheduler_ptr->chunk_buffer))) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u No payload or chunk buffer\n", __FILE__, __LINE__);
+        #endif
+        return false;
+    }
+
+    a_message_ptr->sent        = 0;
+    a_message_ptr->deadline_ms = (0 == a_expiry_ms) ? 0 : scheduler_ptr->now_ms + a_expiry_ms;
+    a_message_ptr->lane        = (uint8_t)a_lane;
+    a_message_ptr->prev        = scheduler_ptr->tail[a_lane];
+    a_message_ptr->next        = NULL;
+
+    MQTT_scheduled_t ** slot_ptr = NULL;
+    if ((true == a_message_ptr->conflate) && (NULL != scheduler_ptr->conflation_index))
+        slot_ptr = mqtt_conflation_slot(a_message_ptr->topic_ptr, a_message_ptr->topic_size);
+
+    /* Unsent message to the same topic - new one takes its place */
+    if ((NULL != slot_ptr) && (NULL != *slot_ptr)) {
+        MQTT_scheduled_t * old_ptr = *slot_ptr;
+
+        a_message_ptr->lane = old_ptr->lane;
+        a_message_ptr->prev = old_ptr->prev;
+        a_message_ptr->next = old_ptr->next;
+        if (NULL == old_ptr->prev)
+            scheduler_ptr->head[old_ptr->lane] = a_message_ptr;
+        else
+            old_ptr->prev->next = a_message_ptr;
+        if (NULL == old_ptr->next)
+            scheduler_ptr->tail[old_ptr->lane] = a_message_ptr;
+        else
+            old_ptr->next->prev = a_message_ptr;
+        *slot_ptr = a_message_ptr;
+
+        old_ptr->prev = NULL;
+        old_ptr->next = NULL;
+        if (NULL != scheduler_ptr->scheduled_fptr)
+            scheduler_ptr->scheduled_fptr(old_ptr, Conflated);
+        return true;
+    }
+
+    if (NULL != slot_ptr)
+        *slot_ptr = a_message_ptr;
+
+    if (NULL == scheduler_ptr->tail[a_lane])
+        scheduler_ptr->head[a_lane] = a_message_ptr;
+    else
+        scheduler_ptr->tail[a_lane]->next = a_message_ptr;
+    scheduler_ptr->tail[a_lane] = a_message_ptr;
+    return true;
+}
+
+MQTTErrorCodes_t mqtt_schedule_run(uint32_t a_elapsed_ms,
+                                   uint32_t a_max_packets)
+{
+    if ((NULL == g_shared_data) ||
+        (0    == g_shared_data->scheduler.chunk_size))
+        return InvalidArgument;
+
+    MQTT_scheduler_t * scheduler_ptr = &(g_shared_data->scheduler);
+    MQTT_scheduled_t * message_ptr   = NULL;
+    MQTTLane_t         lane          = LANE_ALARM;
+    uint32_t           limited_lanes = 0;
+
+    scheduler_ptr->now_ms += a_elapsed_ms;
+
+    while ((0 < a_max_packets) && (NULL != (message_ptr = mqtt_schedule_next(&lane, limited_lanes)))) {
+
+        if (STATE_CONNECTED != g_shared_data->state)
+            return NoConnection;
+
+        /* Bulk and pulled payloads larger than a chunk are split, others go whole */
+        size_t amount = message_ptr->payload_size - message_ptr->sent;
+        bool   split  = (((LANE_BULK == lane) || (NULL == message_ptr->payload_ptr)) &&
+                         (message_ptr->payload_size > scheduler_ptr->chunk_size));
+        size_t header = split ? MQTT_CHUNK_HEADER : 0;
+        if (split && (amount > (scheduler_ptr->chunk_size - header)))
+            amount = scheduler_ptr->chunk_size - header;
+
+        if (split && (NULL == scheduler_ptr->chunk_buffer)) {
+            mqtt_schedule_done(lane, InvalidArgument);
+            continue;
+        }
+
+        char * data_ptr = (NULL != message_ptr->payload_ptr) ? &(message_ptr->payload_ptr[message_ptr->sent]) : "";
+        if ((NULL == message_ptr->payload_ptr) && (0 < amount)) {
+            data_ptr = (char*)scheduler_ptr->chunk_buffer;
+            if ((int)amount != message_ptr->pull_fptr(&(scheduler_ptr->chunk_buffer[header]), amount, message_ptr->sent)) {
+                mqtt_schedule_done(lane, InvalidPayload);
+                continue;
+            }
+        } else if (split) {
+            mqtt_memcpy(&(scheduler_ptr->chunk_buffer[header]), data_ptr, amount);
+            data_ptr = (char*)scheduler_ptr->chunk_buffer;
+        }
+
+        MQTTErrorCodes_t status;
+        if (split) {
+            uint8_t * chunk_ptr = scheduler_ptr->chunk_buffer;
+            uint32_t  offset    = (uint32_t)message_ptr->sent;
+
+            if (0 == message_ptr->sent)
+                message_ptr->chunk_id = scheduler_ptr->next_chunk_id;
+            chunk_ptr[0] = MQTT_CODEC_MARKER;
+            chunk_ptr[1] = MQTT_CODEC_CHUNK;
+            chunk_ptr[2] = (uint8_t)((message_ptr->chunk_id >> 8) & 0xFF);
+            chunk_ptr[3] = (uint8_t)((message_ptr->chunk_id >> 0) & 0xFF);
+            chunk_ptr[4] = (uint8_t)((offset >> 24) & 0xFF);
+            chunk_ptr[5] = (uint8_t)((offset >> 16) & 0xFF);
+            chunk_ptr[6] = (uint8_t)((offset >>  8) & 0xFF);
+            chunk_ptr[7] = (uint8_t)((offset >>  0) & 0xFF);
+            chunk_ptr[8] = ((message_ptr->sent + amount) == message_ptr->payload_size) ? MQTT_CHUNK_LAST : 0;
+
+            status = mqtt_publish_enveloped(message_ptr->topic_ptr,
+                                            message_ptr->topic_size,
+                                            chunk_ptr,
+                                            header + amount);
+        } else
+            status = mqtt_publish_try(message_ptr->topic_ptr,
+                                      message_ptr->topic_size,
+                                      data_ptr,
+                                      amount);
+        if ((WouldBlock == status) || (NoConnection == status))
+            return status;
+
+        /* Over the rate - message waits, lower lanes may still go */
+        if (RateLimited == status) {
+            limited_lanes |= (1u << lane);
+            continue;
+        }
+
+        a_max_packets--;
+        if (Successfull != status) {
+            mqtt_schedule_done(lane, status);
+            continue;
+        }
+
+        /* Started message is not replaced anymore */
+        if ((0 == message_ptr->sent) && (true == message_ptr->conflate))
+            mqtt_conflation_remove(message_ptr);
+        if ((0 == message_ptr->sent) && split)
+            scheduler_ptr->next_chunk_id++;
+        message_ptr->sent += amount;
+        if (message_ptr->sent == message_ptr->payload_size)
+            mqtt_schedule_done(lane, Successfull);
+    }
+    return (0 != limited_lanes) ? RateLimited : Successfull;
+}
+
+bool mqtt_set_conflation(MQTT_scheduled_t ** a_index_ptr,
+                         uint32_t            a_index_size)
+{
+    if ((NULL == g_shared_data) ||
+        ((NULL != a_index_ptr) && (0 == a_index_size)))
+        return false;
+
+    MQTT_scheduler_t * scheduler_ptr = &(g_shared_data->scheduler);
+    scheduler_ptr->conflation_index = a_index_ptr;
+    scheduler_ptr->conflation_size  = (NULL == a_index_ptr) ? 0 : a_index_size;
+    if (NULL == a_index_ptr)
+        return true;
+
+    /* Queued unsent messages are indexed again */
+    mqtt_memset(a_index_ptr, 0, a_index_size * sizeof(MQTT_scheduled_t*));
+    for (uint32_t lane = LANE_ALARM; lane < LANE_COUNT; lane++) {
+        for (MQTT_scheduled_t * message_ptr = scheduler_ptr->head[lane];
+             NULL != message_ptr;
+             message_ptr = message_ptr->next) {
+            if ((false == message_ptr->conflate) || (0 != message_ptr->sent))
+                continue;
+            /* Later one of the same topic wins */
+            MQTT_scheduled_t ** slot_ptr = mqtt_conflation_slot(message_ptr->topic_ptr, message_ptr->topic_size);
+            if (NULL != slot_ptr)
+                *slot_ptr = message_ptr;
+        }
+    }
+    return true;
+}
+
+bool mqtt_set_rate_limits(MQTT_rate_limit_t * a_limits_ptr,
+                          uint32_t            a_count)
+{
+    if ((NULL == g_shared_data) ||
+        ((NULL != a_limits_ptr) && (0 == a_count)))
+        return false;
+
+    for (uint32_t i = 0; (NULL != a_limits_ptr) && (i < a_count); i++) {
+        MQTT_rate_limit_t * limit_ptr = &(a_limits_ptr[i]);
+
+        if (((0 < limit_ptr->messages_per_s) && (0 == limit_ptr->message_burst)) ||
+            ((0 < limit_ptr->bytes_per_s)    && (0 == limit_ptr->byte_burst))    ||
+            ((NULL == limit_ptr->prefix_ptr) && (0 != limit_ptr->prefix_size))) {
+            #ifdef DEBUG
+                mqtt_printf("%s %u Invalid rate limit %u\n", __FILE__, __LINE__, i);
+            #endif
+            return false;
+        }
+        limit_ptr->message_tokens = (uint64_t)limit_ptr->message_burst * 1000;
+        limit_ptr->byte_tokens    = (uint64_t)limit_ptr->byte_burst * 1000;
+    }
+
+    g_shared_data->rate_limits      = a_limits_ptr;
+    g_shared_data->rate_limit_count = (NULL == a_limits_ptr) ? 0 : a_count;
+    return true;
+}
+
+uint32_t mqtt_schedule_pending(MQTTLane_t a_lane)
+{
+    uint32_t pending = 0;
+
+    if (NULL == g_shared_data)
+        return 0;
+
+    for (uint32_t lane = LANE_ALARM; lane < LANE_COUNT; lane++) {
+        if ((LANE_COUNT != a_lane) && (lane != (uint32_t)a_lane))
+            continue;
+        for (MQTT_scheduled_t * message_ptr = g_shared_data->scheduler.head[lane];
+             NULL != message_ptr;
+             message_ptr = message_ptr->next)
+            pending++;
+    }
+    return pending;
+}
+
+bool mqtt_chunks_init(MQTT_chunk_assembly_t * a_assembly_ptr,
+                      uint8_t               * a_buffer_ptr,
+                      size_t                  a_buffer_size)
+{
+    if ((NULL == a_assembly_ptr) ||
+        (NULL == a_buffer_ptr)   ||
+        (0    == a_buffer_size))
+        return false;
+
+    a_assembly_ptr->buffer   = a_buffer_ptr;
+    a_assembly_ptr->size     = a_buffer_size;
+    a_assembly_ptr->used     = 0;
+    a_assembly_ptr->chunk_id = 0;
+    return true;
+}
+
+MQTTErrorCodes_t mqtt_chunks_add(MQTT_chunk_assembly_t  * a_assembly_ptr,
+                                 uint8_t                * a_payload_ptr,
+                                 uint32_t                 a_payload_size,
+                                 uint8_t               ** a_message_ptr,
+                                 size_t                 * a_message_size_ptr)
+{
+    if ((NULL == a_assembly_ptr)         ||
+        (NULL == a_assembly_ptr->buffer) ||
+        (NULL == a_payload_ptr)          ||
+        (NULL == a_message_ptr)          ||
+        (NULL == a_message_size_ptr))
+        return InvalidArgument;
+
+    *a_message_ptr      = NULL;
+    *a_message_size_ptr = 0;
+
+    /* Not split - message as such */
+    if ((MQTT_CHUNK_HEADER  > a_payload_size)   ||
+        (MQTT_CODEC_MARKER != a_payload_ptr[0]) ||
+        (MQTT_CODEC_CHUNK  != a_payload_ptr[1])) {
+        *a_message_ptr      = a_payload_ptr;
+        *a_message_size_ptr = a_payload_size;
+        return Successfull;
+    }
+
+    uint16_t chunk_id = (uint16_t)((a_payload_ptr[2] << 8) | a_payload_ptr[3]);
+    uint32_t offset   = ((uint32_t)a_payload_ptr[4] << 24) |
+                        ((uint32_t)a_payload_ptr[5] << 16) |
+                        ((uint32_t)a_payload_ptr[6] <<  8) |
+                        ((uint32_t)a_payload_ptr[7] <<  0);
+    bool     last     = (0 != (a_payload_ptr[8] & MQTT_CHUNK_LAST));
+    uint32_t amount   = a_payload_size - MQTT_CHUNK_HEADER;
+
+    /* First chunk starts a new message */
+    if (0 == offset) {
+        a_assembly_ptr->chunk_id = chunk_id;
+        a_assembly_ptr->used     = 0;
+    }
+
+    if ((chunk_id != a_assembly_ptr->chunk_id) ||
+        (offset   != a_assembly_ptr->used)     ||
+        (amount    > (a_assembly_ptr->size - a_assembly_ptr->used))) {
+        #ifdef DEBUG
+            mqtt_printf("%s %u Chunk %u at %u does not follow %u at %u\n",
+                        __FILE__,
+                        __LINE__,
+                        chunk_id,
+                        offset,
+                        a_assembly_ptr->chunk_id,
+                        (uint32_t)a_assembly_ptr->used);
+        #endif
+        a_assembly_ptr->used = 0;
+        return InvalidPayload;
+    }
+
+    mqtt_memcpy(&(a_assembly_ptr->buffer[a_assembly_ptr->used]), &(a_payload_ptr[MQTT_CHUNK_HEADER]), amount);
+    a_assembly_ptr->used += amount;
+    if (false == last)
+        return WouldBlock;
+
+    *a_message_ptr       = a_assembly_ptr->buffer;
+    *a_message_size_ptr  = a_assembly_ptr->used;
+    a_assembly_ptr->used = 0;
+    return Successfull;
+}
+
+MQTT_shared_data_t * mqtt_session_select(MQTT_shared_data_t * a_session_ptr)
+{
+    MQTT_shared_data_t * previous_ptr = g_shared_data;
+    g_shared_data = a_session_ptr;
+    return previous_ptr;
+}
@@ -2,8 +2,8 @@
 #include <stdbool.h>
 #include <stdint.h>  // uint
 #include <stdlib.h>  // atoi
-#include <string.h>  // strlen
 #include <stdarg.h>  // tracing
+#include <string.h>  // strncmp
 
 #include<stdio.h>
 #include<sys/socket.h>
@@ -15,6 +15,7 @@
 
 #include "mqtt.h"
 #include "socket_read_write.h"
+#include "dispatch.h"
 
 const char *argp_program_version = "ROjal_MQTT_Client v0.1";
 static char doc[]                = "MQTT 3.1.1 Client supporting QoS0 level communication";
@@ -25,7 +26,7 @@ static struct argp_option options[] = {
     { "message",   'm', "Message",    0, "Message in case of publish. If not defined = publish:", 0},
     { "file",      'f', "File",       0, "Send file", 0},
     { "receive",   'r', 0,            0, "Receive file", 0},
-    { "broker",    'b', "IP",         0, "Broker IP address e.g. 192.168.0.1:", 0},
+    { "broker",    'b', "IP",         0, "Broker IP address e.g. 192.168.0.1 or unix:/path/to/socket (unix:@name for abstract)", 0},
     { "clean",     'c', 0,            0, "Disable clean session(default is clean):", 0},
     { "keepalive", 'k', "sec",        0, "Keepalive in seconds (default = 0 = no keepalive):", 0},
     { "lastwill",  'w', "Will",       0, "Last will message:", 0},
@@ -35,25 +36,27 @@ static struct argp_option options[] = {
     { "user",      'u', "Username",   0, "Username (if required by broker):", 0},
     { "password",  'p', "Password",   0, "Password (if required by broker):", 0},
     { "verbose",   'v', 0,            0, "Verbose:", 0},
+    { "dispatch",  'd', "Workers",    0, "Handle received messages in given amount of worker threads:", 0},
     { 0 }
 };
 
+/* Strings point to argv, which lives as long as the process */
 struct arguments {
-    uint8_t * message;
-    uint8_t * topic;
-    uint8_t * clientID;
-    bool      clientid_set;
-    uint8_t * hostip;
-    uint8_t * last_will_message;
-    uint8_t * last_will_topic;
-    uint8_t * username;
-    uint8_t * password;
-    uint32_t  keepalive;
-    bool      clean;
-    uint32_t  hostport;
-    uint8_t * filename;
-    bool      receive_file;
-    bool      verbose;
+    MQTT_string_t   message;
+    MQTT_string_t   topic;
+    MQTT_string_t   clientID;
+    char          * hostip;
+    MQTT_string_t   last_will_message;
+    MQTT_string_t   last_will_topic;
+    MQTT_string_t   username;
+    MQTT_string_t   password;
+    uint32_t        keepalive;
+    bool            clean;
+    uint32_t        hostport;
+    char          * filename;
+    bool            receive_file;
+    bool            verbose;
+    uint32_t        workers;
 };
 
 static MQTT_shared_data_t mqtt_shared_data;
@@ -63,6 +66,8 @@ static struct arguments arguments; /* Argument prarsing script    */
 
 static volatile int subscribe_continue = 1;
 
+static FILE * publish_file = NULL; /* Source of streamed file publish */
+
 void ctrl_c_exit(int a_ignore) {
     a_ignore = a_ignore;
     printf("Cntr+C received - exit\n");
@@ -99,62 +104,26 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     if (arg) {
         switch (key) {
             case 't':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->topic   = p;
+                arguments->topic = mqtt_string(arg);
                 break;
-            }
             case 'm':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->message = p;
+                arguments->message = mqtt_string(arg);
                 break;
-            }
             case 'b':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->hostip = p;
+                arguments->hostip = arg;
                 break;
-            }
             case 'n':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->clientID = p;
-                arguments->clientid_set = true;
+                arguments->clientID = mqtt_string(arg);
                 break;
-            }
             case 'u':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->username = p;
+                arguments->username = mqtt_string(arg);
                 break;
-            }
             case 'p':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->password = p;
+                arguments->password = mqtt_string(arg);
                 break;
-            }
             case 'f':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->filename = p;
+                arguments->filename = arg;
                 break;
-            }
             case 'k':
             {
                 int value = atoi(arg);
@@ -162,6 +131,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                     arguments->keepalive = value;
                 break;
             }
+            case 'd':
+            {
+                int value = atoi(arg);
+                if (0 < value)
+                    arguments->workers = value;
+                break;
+            }
             case 's':
             {
                 int value = atoi(arg);
@@ -170,26 +146,26 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                 break;
             }
             case 'w':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->last_will_message = p;
+                arguments->last_will_message = mqtt_string(arg);
                 break;
-            }
             case 'l':
-            {
-                size_t len = strlen(arg);
-                uint8_t * p = (uint8_t*)malloc(len);
-                memcpy(p, arg, len);
-                arguments->last_will_topic = p;
+                arguments->last_will_topic = mqtt_string(arg);
                 break;
-            }
             case ARGP_KEY_ARG:
                 return 0;
             default:
                 return ARGP_ERR_UNKNOWN;
         }
+
+        /* Not sent cut short or empty */
+        if ((false == mqtt_string_valid(arguments->topic))             ||
+            (false == mqtt_string_valid(arguments->message))           ||
+            (false == mqtt_string_valid(arguments->clientID))          ||
+            (false == mqtt_string_valid(arguments->username))          ||
+            (false == mqtt_string_valid(arguments->password))          ||
+            (false == mqtt_string_valid(arguments->last_will_message)) ||
+            (false == mqtt_string_valid(arguments->last_will_topic)))
+            argp_error(state, "-%c is longer than 65535 bytes", key);
     } else {
         switch (key) {
             case 'c':
@@ -241,8 +217,8 @@ void subscrbe_cb(MQTTErrorCodes_t   a_status,
     if (Successfull == a_status) {
         if (0 < a_data_len) {
             /* Save to file */
-            if ('\0' != (char)(arguments.filename[0])) {
-                FILE * fp = fopen((const char *)arguments.filename, "ab+");
+            if ('\0' != arguments.filename[0]) {
+                FILE * fp = fopen(arguments.filename, "ab+");
                 if (fp) {
                     fwrite(a_data_ptr, sizeof(uint8_t), a_data_len, fp);
                     fclose(fp);
@@ -267,44 +243,67 @@ void subscrbe_cb(MQTTErrorCodes_t   a_status,
     }
 }
 
-void data_from_socket(uint8_t * a_data, size_t a_amount)
+void dispatched_cb(MQTT_message_view_t * a_view_ptr)
 {
-    mqtt_receive(a_data, a_amount);
+    subscrbe_cb(Successfull,
+                a_view_ptr->payload_ptr,
+                a_view_ptr->payload_length,
+                a_view_ptr->topic_ptr,
+                a_view_ptr->topic_length);
 }
 
+int file_pull_cb(uint8_t * a_data_ptr, size_t a_amount, size_t a_offset)
+{
+    if (NULL == publish_file)
+        return -1;
+    return (int)pread(fileno(publish_file), a_data_ptr, a_amount, (off_t)a_offset);
+}
 
-void clean(uint8_t * a_data, char * a_param)
+void data_from_socket(uint8_t * a_data, size_t a_amount)
 {
-    if (1 < strlen((char*)a_data))
-    {
-        trace("\tClean %s\n", (char*)a_param);
-        free((char*)a_data);
-    }
+    mqtt_receive(a_data, a_amount);
 }
 
+
 bool rmc_connect(struct arguments * arguments)
 {
-    if (false == socket_initialize((char*)(arguments->hostip), arguments->hostport, &data_from_socket))
+    /* Co-located broker - Unix domain socket */
+    bool socket_ok = (0 == strncmp(arguments->hostip, "unix:", 5)) ?
+                     socket_initialize_unix(&arguments->hostip[5], &data_from_socket) :
+                     socket_initialize(arguments->hostip, arguments->hostport, &data_from_socket);
+    if (false == socket_ok)
         return false;
-    return mqtt_connect((char *)arguments->clientID,
-                                arguments->keepalive,
-                                arguments->username,
-                                arguments->password,
-                                arguments->last_will_topic,
-                                arguments->last_will_message,
-                                &mqtt_shared_data,
-                                a_output_buffer,
-                                sizeof(a_output_buffer),
-                                arguments->clean,
-                                &socket_write,
-                                &connected_cb,
-                                &subscrbe_cb,
-                                10);
+    bool connected = mqtt_connect_string(arguments->clientID,
+                                         arguments->keepalive,
+                                         arguments->username,
+                                         arguments->password,
+                                         arguments->last_will_topic,
+                                         arguments->last_will_message,
+                                         &mqtt_shared_data,
+                                         a_output_buffer,
+                                         sizeof(a_output_buffer),
+                                         arguments->clean,
+                                         &socket_write,
+                                         &connected_cb,
+                                         &subscrbe_cb,
+                                         10);
+
+    /* Move message handling off the socket reading thread */
+    if (connected && (0 < arguments->workers)) {
+        if (dispatch_start(arguments->workers, 64, &dispatched_cb))
+            mqtt_set_message_view_cb(&dispatch_message, &socket_buffer_pin);
+    }
+    return connected;
 }
 
 void rmc_disconnect()
 {
     mqtt_disconnect();
+
+    /* Reader thread is the caller of dispatch_message - joined before worker queues go away */
+    stop_reading_thread();
+    dispatch_stop();
+    mqtt_set_message_view_cb(NULL, NULL);
 }
 
 
@@ -318,61 +317,62 @@ int main(int argc, char *argv[])
     uint8_t tempClientID[128] = "";
     sprintf((char*)tempClientID, "ROjal_MQTT_Client%i", random);
 
-    uint8_t empty[]             = "\0";
+    char empty[]                = "";
 
     arguments.keepalive         = 0;
     arguments.clean             = true;
-    arguments.clientid_set      = false;
-    arguments.clientID          = tempClientID;
-    arguments.message           = empty;
-    arguments.topic             = empty;
+    arguments.clientID          = mqtt_string((char*)tempClientID);
+    arguments.message           = mqtt_string(empty);
+    arguments.topic             = mqtt_string(empty);
     arguments.hostip            = empty;
-    arguments.last_will_message = empty;
-    arguments.last_will_topic   = empty;
-    arguments.username          = empty;
-    arguments.password          = empty;
+    arguments.last_will_message = mqtt_string(empty);
+    arguments.last_will_topic   = mqtt_string(empty);
+    arguments.username          = mqtt_string(empty);
+    arguments.password          = mqtt_string(empty);
     arguments.hostport          = 1883;
     arguments.filename          = empty;
     arguments.receive_file      = false;
     arguments.verbose           = false;
+    arguments.workers           = 0;
 
     argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
     trace("\tBroker    %s:%i\n", arguments.hostip, arguments.hostport);
-    trace("\tUsername  %s\n",    arguments.username);
-    trace("\tPassword  %s\n",    arguments.password);
+    trace("\tUsername  %.*s\n", arguments.username.length, (char*)arguments.username.ptr);
+    trace("\tPassword  %.*s\n", arguments.password.length, (char*)arguments.password.ptr);
     trace("\tKeepalive %i\n",    arguments.keepalive);
     trace("\tClean     %i\n",    arguments.clean);
     trace("\tReveive   %i\n",    arguments.receive_file);
-    trace("\tClientID  %s\n",    arguments.clientID);
-    trace("\tMessage   %s\n",    arguments.message);
+    trace("\tClientID  %.*s\n", arguments.clientID.length, (char*)arguments.clientID.ptr);
+    trace("\tMessage   %.*s\n", arguments.message.length, (char*)arguments.message.ptr);
     trace("\tFilename  %s\n",    arguments.filename);
-    trace("\tTopic     %s\n",    arguments.topic);
-    trace("\tLWT       %s\n",    arguments.last_will_message);
-    trace("\tLWT topic %s\n",    arguments.last_will_topic);
+    trace("\tTopic     %.*s\n", arguments.topic.length, (char*)arguments.topic.ptr);
+    trace("\tLWT       %.*s\n", arguments.last_will_message.length, (char*)arguments.last_will_message.ptr);
+    trace("\tLWT topic %.*s\n", arguments.last_will_topic.length, (char*)arguments.last_will_topic.ptr);
+    trace("\tWorkers   %i\n",    arguments.workers);
 
     bool valid_parameters = true;
 
-    if (0 == strlen((char*)(arguments.hostip))) {
+    if ('\0' == arguments.hostip[0]) {
         printf("Broker IP must be defined\n");
         valid_parameters = false;
     }
 
-    if (0 == strlen((char*)(arguments.topic))) {
+    if (0 == arguments.topic.length) {
         printf("Topic must be defined\n");
         valid_parameters = false;
     }
 
     if (valid_parameters) {
         if (rmc_connect(&arguments)) {
-            if (((0 == strlen((char*)(arguments.message)))  && // No message & No filename & no receive
-                 (0 == strlen((char*)(arguments.filename))) &&
-                 (false == arguments.receive_file))         || // or filename and receive
-                ((0 < strlen((char*)(arguments.filename)))  &&
+            if (((0 == arguments.message.length)    && // No message & No filename & no receive
+                 ('\0' == arguments.filename[0])    &&
+                 (false == arguments.receive_file)) || // or filename and receive
+                (('\0' != arguments.filename[0])    &&
                  (true == arguments.receive_file))) {
 
                 printf("Subscribe\n");
-                if (true == mqtt_subscribe((char *)arguments.topic, strlen((char*)(arguments.topic)), 10)) {
+                if (true == mqtt_subscribe_string(arguments.topic, 10)) {
 
                     signal(SIGINT, ctrl_c_exit);
 
@@ -392,45 +392,31 @@ int main(int argc, char *argv[])
                 }
 
             } else {
-                if (0 < strlen((char*)(arguments.message))) {
+                if (0 < arguments.message.length) {
 
                     printf("Publish MSG\n");
-                    mqtt_publish((char *)arguments.topic,
-                                  strlen((char*)(arguments.topic)),
-                                 (char *)arguments.message,
-                                  strlen((char*)(arguments.message)));
+                    mqtt_publish_string(arguments.topic,
+                                        arguments.message.ptr,
+                                        arguments.message.length);
                 } else {
 
-                    if (0 < strlen((char*)(arguments.filename))) {
+                    if ('\0' != arguments.filename[0]) {
 
-                        FILE * f = fopen((char*)(arguments.filename), "r");
+                        FILE * f = fopen(arguments.filename, "r");
                         if (NULL != f) {
                             fseek(f, 0, SEEK_END); // End of the file
                             unsigned long len = (unsigned long)ftell(f);
                             fseek(f, 0, SEEK_SET); // Beginning of the file
-                            char * buf = malloc(len + 1);
-                            if(len != fread(buf, len, 1, f)) {
-                                fclose(f);
-                                uint32_t mqttbuf_size = len +
-                                                        strlen((char*)(arguments.topic)) +
-                                                        sizeof(MQTT_fixed_header_t) +
-                                                        64 /* Spare */;
-
-                                uint8_t * mqttbuf = (uint8_t *)malloc(mqttbuf_size);
-
-                                printf("Sending file %s [%lu Bytes] %p\n", (char*)(arguments.filename), len, a_output_buffer);
-                                printf("Status: %i\n", mqtt_publish_buf((char *)arguments.topic,
-                                                                        strlen((char*)(arguments.topic)),
-                                                                        buf,
-                                                                        len,
-                                                                        mqttbuf,
-                                                                        mqttbuf_size));
-
-                                free(mqttbuf);
-                            } else {
-                                printf("Failed to read file %s\n", (char*)(arguments.filename));
-                            }
-                            free(buf);
+                            publish_file = f;
+
+                            /* File content is streamed through the shared buffer */
+                            printf("Sending file %s [%lu Bytes]\n", arguments.filename, len);
+                            printf("Status: %i\n", mqtt_publish_stream((char *)arguments.topic.ptr,
+                                                                       arguments.topic.length,
+                                                                       len,
+                                                                       &file_pull_cb));
+                            publish_file = NULL;
+                            fclose(f);
                         } else {
                             printf("Failed to open %s\n", arguments.filename);
                         }
@@ -442,18 +428,4 @@ int main(int argc, char *argv[])
             rmc_disconnect();
         }
     }
-
-    trace("\n\n--------------------\nCleanUp\n");
-    if (arguments.clientid_set)
-        clean(arguments.clientID,      "ClientID");
-
-    clean(arguments.hostip,            "Broker");
-    clean(arguments.message,           "Message");
-    clean(arguments.filename,          "Filename");
-    clean(arguments.topic,             "Topic");
-    clean(arguments.last_will_message, "LWT");
-    clean(arguments.last_will_topic,   "LWT Topic");
-    clean(arguments.username,          "Username");
-    clean(arguments.password,          "Password");
-    trace("--------------------\n");
 }
@@ -0,0 +1,352 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+#include "deflate_codec.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define DOCUMENTS 200
+
+static MQTT_shared_data_t  g_shared;
+static uint8_t             g_buffer[512];
+static uint8_t             g_decoded[512];
+static MQTT_message_view_t g_views[8];
+static bool                g_retained[4];
+static int32_t             g_pins      = 0;
+
+/* Written packets, one after another */
+static uint8_t             g_sent[1024*64];
+static uint32_t            g_sent_size = 0;
+static uint32_t            g_writes    = 0;
+static bool                g_in_buffer = true;
+
+/* Received payloads */
+static char                g_received[DOCUMENTS + 4][256];
+static uint32_t            g_received_size[DOCUMENTS + 4];
+static uint32_t            g_received_count = 0;
+static MQTTErrorCodes_t    g_status         = Successfull;
+static MQTTErrorCodes_t    g_view_status[DOCUMENTS + 4];
+static uint32_t            g_batches        = 0;
+
+/* Typical documents, most common content last */
+static const char g_dictionary[] =
+    "{\"device\":\"sensor-0000\",\"ts\":1700000000,\"status\":\"alarm\",\"rssi\":-80}"
+    "{\"device\":\"sensor-0001\",\"ts\":1700000000,\"temperature\":20.00,\"humidity\":40.0,"
+    "\"pressure\":1010.0,\"battery\":3.70,\"status\":\"ok\",\"rssi\":-70}";
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    /* Packet is written from the shared buffer it was built in */
+    if ((a_data_ptr < g_buffer) || ((a_data_ptr + a_amount) > (g_buffer + sizeof(g_buffer))))
+        g_in_buffer = false;
+    memcpy(&g_sent[g_sent_size], a_data_ptr, a_amount);
+    g_sent_size += (uint32_t)a_amount;
+    g_writes++;
+    return (int)a_amount;
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if (NULL == a_data_ptr)
+        return;
+    g_status = a_status;
+    memcpy(g_received[g_received_count], a_data_ptr, a_data_len);
+    g_received_size[g_received_count++] = a_data_len;
+}
+
+void batch_cb_(MQTT_message_view_t * a_views_ptr, size_t a_count)
+{
+    g_batches++;
+    for (size_t i = 0; i < a_count; i++) {
+        g_view_status[g_received_count] = a_views_ptr[i].status;
+        memcpy(g_received[g_received_count], a_views_ptr[i].payload_ptr, a_views_ptr[i].payload_length);
+        g_received_size[g_received_count++] = a_views_ptr[i].payload_length;
+    }
+}
+
+bool pin_fptr_(uint8_t * a_data_ptr, bool a_pin)
+{
+    a_data_ptr = a_data_ptr;
+    g_pins += a_pin ? 1 : -1;
+    return true;
+}
+
+void view_cb_(MQTT_message_view_t * a_view_ptr)
+{
+    g_view_status[g_received_count] = a_view_ptr->status;
+    g_retained[g_received_count] = mqtt_message_retain(a_view_ptr);
+    if (g_retained[g_received_count])
+        mqtt_message_release(a_view_ptr);
+    g_received_size[g_received_count++] = a_view_ptr->payload_length;
+}
+
+void connect_(bool a_codec)
+{
+    g_shared.buffer            = g_buffer;
+    g_shared.buffer_size       = sizeof(g_buffer);
+    g_shared.out_fptr          = &out_fptr_;
+    g_shared.subscribe_cb_fptr = &subscribe_cb_;
+
+    session_connect(&g_shared, "JAMKtest deflate", 0);
+
+    if (a_codec) {
+        TEST_ASSERT_TRUE(deflate_codec_initialize((const uint8_t*)g_dictionary, sizeof(g_dictionary) - 1, 9));
+        TEST_ASSERT_TRUE(mqtt_set_payload_codec(&deflate_codec_compress, &deflate_codec_decompress,
+                                                DEFLATE_CODEC_ID, g_decoded, sizeof(g_decoded)));
+    }
+
+    g_sent_size      = 0;
+    g_writes         = 0;
+    g_in_buffer      = true;
+    g_received_count = 0;
+    g_batches        = 0;
+    g_status         = Successfull;
+}
+
+/* Telemetry document of a device, values vary per sample */
+static size_t document_(char * a_output_ptr, uint32_t a_sample)
+{
+    return (size_t)sprintf(a_output_ptr,
+                           "{\"device\":\"sensor-%04u\",\"ts\":%u,\"temperature\":%u.%02u,\"humidity\":%u.%u,"
+                           "\"pressure\":%u.%u,\"battery\":3.%02u,\"status\":\"ok\",\"rssi\":-%u}",
+                           a_sample % 16,
+                           1700000000 + a_sample * 7,
+                           18 + a_sample % 7, (a_sample * 37) % 100,
+                           35 + a_sample % 20, a_sample % 10,
+                           1005 + a_sample % 11, (a_sample * 3) % 10,
+                           60 + a_sample % 40,
+                           55 + a_sample % 30);
+}
+
+/* Written packets are received back */
+static void loopback_()
+{
+    TEST_ASSERT_EQUAL_UINT32(g_sent_size, (uint32_t)mqtt_receive_stream(g_sent, g_sent_size));
+}
+
+void test_deflate_round_trip()
+{
+    char     documents[DOCUMENTS][256];
+    size_t   sizes[DOCUMENTS];
+    size_t   raw_total = 0;
+
+    connect_(true);
+    for (uint32_t i = 0; i < DOCUMENTS; i++) {
+        sizes[i]   = document_(documents[i], i);
+        raw_total += sizes[i];
+        TEST_ASSERT_TRUE(mqtt_publish("telemetry/floor1", 16, documents[i], sizes[i]));
+    }
+
+    /* One write per publish, built in place in the shared buffer */
+    TEST_ASSERT_EQUAL_UINT32(DOCUMENTS, g_writes);
+    TEST_ASSERT_TRUE(g_in_buffer);
+    uint32_t compressed_total = g_sent_size;
+
+    loopback_();
+    TEST_ASSERT_EQUAL_UINT32(DOCUMENTS, g_received_count);
+    for (uint32_t i = 0; i < DOCUMENTS; i++) {
+        TEST_ASSERT_EQUAL_UINT32(sizes[i], g_received_size[i]);
+        TEST_ASSERT_EQUAL_MEMORY(documents[i], g_received[i], sizes[i]);
+    }
+
+    /* Same documents without codec */
+    connect_(false);
+    for (uint32_t i = 0; i < DOCUMENTS; i++)
+        TEST_ASSERT_TRUE(mqtt_publish("telemetry/floor1", 16, documents[i], sizes[i]));
+    uint32_t plain_total = g_sent_size;
+
+    size_t headers = plain_total - raw_total;
+    printf("%u documents: payload %zu -> %zu bytes (%.1fx), packets %u -> %u bytes (%.1fx)\n",
+           DOCUMENTS,
+           raw_total, compressed_total - headers, (double)raw_total / (compressed_total - headers),
+           plain_total, compressed_total, (double)plain_total / compressed_total);
+    TEST_ASSERT_TRUE((compressed_total - headers) * 3 <= raw_total);
+}
+
+void test_deflate_small_payload_as_is()
+{
+    /* Nothing to gain - sent and received unchanged */
+    connect_(true);
+    TEST_ASSERT_TRUE(mqtt_publish("telemetry/t", 11, "21.5", 4));
+    TEST_ASSERT_EQUAL_UINT32(2 + 2 + 11 + 4, g_sent_size);
+    TEST_ASSERT_EQUAL_MEMORY("21.5", &g_sent[15], 4);
+
+    loopback_();
+    TEST_ASSERT_EQUAL_UINT32(1, g_received_count);
+    TEST_ASSERT_EQUAL_UINT32(4, g_received_size[0]);
+    TEST_ASSERT_EQUAL_MEMORY("21.5", g_received[0], 4);
+}
+
+void test_deflate_marker_payload_stored()
+{
+    /* Binary payload starting with the marker is stored in an envelope */
+    uint8_t binary[] = {MQTT_CODEC_MARKER, 0x01, 0x02, 0x03};
+
+    connect_(true);
+    TEST_ASSERT_TRUE(mqtt_publish("bin", 3, (char*)binary, sizeof(binary)));
+    TEST_ASSERT_EQUAL_UINT32(2 + 2 + 3 + 2 + sizeof(binary), g_sent_size);
+    TEST_ASSERT_EQUAL_HEX8(MQTT_CODEC_MARKER, g_sent[7]);
+    TEST_ASSERT_EQUAL_HEX8(MQTT_CODEC_STORED, g_sent[8]);
+
+    loopback_();
+    TEST_ASSERT_EQUAL_UINT32(1, g_received_count);
+    TEST_ASSERT_EQUAL_UINT32(sizeof(binary), g_received_size[0]);
+    TEST_ASSERT_EQUAL_MEMORY(binary, g_received[0], sizeof(binary));
+}
+
+void test_deflate_unknown_envelope()
+{
+    /* Envelope of another codec is delivered as received with InvalidPayload */
+    uint8_t publish[] = {0x30, 0x08, 0x00, 0x01, 'x', MQTT_CODEC_MARKER, 0x07, 'a', 'b', 'c'};
+
+    connect_(true);
+    TEST_ASSERT_TRUE(mqtt_receive(publish, sizeof(publish)));
+    TEST_ASSERT_EQUAL_UINT32(1, g_received_count);
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, g_status);
+    TEST_ASSERT_EQUAL_UINT32(5, g_received_size[0]);
+
+    /* Without decoder payload is not touched */
+    TEST_ASSERT_TRUE(mqtt_set_payload_codec(&deflate_codec_compress, NULL, DEFLATE_CODEC_ID, NULL, 0));
+    TEST_ASSERT_TRUE(mqtt_receive(publish, sizeof(publish)));
+    TEST_ASSERT_EQUAL_INT(Successfull, g_status);
+    TEST_ASSERT_EQUAL_UINT32(5, g_received_size[1]);
+
+    TEST_ASSERT_FALSE(mqtt_set_payload_codec(&deflate_codec_compress, NULL, MQTT_CODEC_STORED, NULL, 0));
+    TEST_ASSERT_FALSE(mqtt_set_payload_codec(NULL, &deflate_codec_decompress, DEFLATE_CODEC_ID, NULL, 0));
+}
+
+void test_deflate_unknown_envelope_in_order()
+{
+    /* Envelope not understood goes through batch and view callbacks too, after earlier messages */
+    uint8_t stream[] = {0x30, 0x04, 0x00, 0x01, 'x', '1',
+                        0x30, 0x08, 0x00, 0x01, 'x', MQTT_CODEC_MARKER, 0x07, 'a', 'b', 'c',
+                        0x30, 0x04, 0x00, 0x01, 'x', '3'};
+
+    connect_(true);
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&batch_cb_, g_views, sizeof(g_views) / sizeof(g_views[0])));
+    TEST_ASSERT_EQUAL_UINT32(sizeof(stream), (uint32_t)mqtt_receive_stream(stream, sizeof(stream)));
+    TEST_ASSERT_EQUAL_UINT32(2, g_batches);
+    TEST_ASSERT_EQUAL_UINT32(3, g_received_count);
+    TEST_ASSERT_EQUAL_INT(Successfull,    g_view_status[0]);
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, g_view_status[1]);
+    TEST_ASSERT_EQUAL_INT(Successfull,    g_view_status[2]);
+    TEST_ASSERT_EQUAL_UINT32(5, g_received_size[1]);
+    TEST_ASSERT_EQUAL_MEMORY(&stream[11], g_received[1], 5);
+    TEST_ASSERT_EQUAL_HEX8('3', g_received[2][0]);
+
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(NULL, NULL, 0));
+    mqtt_set_message_view_cb(&view_cb_, &pin_fptr_);
+    TEST_ASSERT_TRUE(mqtt_receive(&stream[6], 10));
+    TEST_ASSERT_EQUAL_UINT32(4, g_received_count);
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, g_view_status[3]);
+    TEST_ASSERT_EQUAL_UINT32(5, g_received_size[3]);
+    TEST_ASSERT_EQUAL_INT(Successfull, g_status);
+    mqtt_set_message_view_cb(NULL, NULL);
+}
+
+void test_deflate_batch_delivery()
+{
+    /* Decoded messages are delivered alone, others stay batched, order is kept */
+    char     documents[6][256];
+    size_t   sizes[6];
+
+    connect_(true);
+    for (uint32_t i = 0; i < 6; i++) {
+        if (1 == (i % 2))
+            sizes[i] = (size_t)sprintf(documents[i], "%u", i);
+        else
+            sizes[i] = document_(documents[i], i);
+        TEST_ASSERT_TRUE(mqtt_publish("telemetry/floor1", 16, documents[i], sizes[i]));
+    }
+
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&batch_cb_, g_views, sizeof(g_views) / sizeof(g_views[0])));
+    loopback_();
+    TEST_ASSERT_EQUAL_UINT32(6, g_received_count);
+    for (uint32_t i = 0; i < 6; i++) {
+        TEST_ASSERT_EQUAL_UINT32(sizes[i], g_received_size[i]);
+        TEST_ASSERT_EQUAL_MEMORY(documents[i], g_received[i], sizes[i]);
+    }
+}
+
+void test_deflate_retain_decoded()
+{
+    /* Decode memory is reused by the next message, pinning the packet would not keep it */
+    char   document[256];
+    size_t size;
+
+    connect_(true);
+    size = document_(document, 1);
+    TEST_ASSERT_TRUE(mqtt_publish("telemetry/floor1", 16, document, size));
+    TEST_ASSERT_TRUE(mqtt_publish("telemetry/t", 11, "21.5", 4));
+
+    mqtt_set_message_view_cb(&view_cb_, &pin_fptr_);
+    g_pins = 0;
+    loopback_();
+    TEST_ASSERT_EQUAL_UINT32(2, g_received_count);
+    TEST_ASSERT_EQUAL_UINT32(size, g_received_size[0]);
+    TEST_ASSERT_FALSE(g_retained[0]);
+    TEST_ASSERT_TRUE(g_retained[1]);
+    TEST_ASSERT_EQUAL_INT32(0, g_pins);
+}
+
+static void publish_retained_(char * a_msg_ptr, size_t a_msg_size)
+{
+    MQTT_publish_t publish;
+    publish.flags.dup           = false;
+    publish.flags.retain        = true;
+    publish.flags.qos           = QoS0;
+    publish.topic_ptr           = (uint8_t*)"telemetry/floor1";
+    publish.topic_length        = 16;
+    publish.message_buffer_ptr  = (uint8_t*)a_msg_ptr;
+    publish.message_buffer_size = (uint32_t)a_msg_size;
+    publish.output_buffer_ptr   = NULL;
+    publish.output_buffer_size  = 0;
+
+    MQTT_action_data_t action;
+    action.action_argument.publish_ptr = &publish;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt(ACTION_PUBLISH, &action));
+}
+
+void test_deflate_retained_fixed_header()
+{
+    /* PUBLISH, RETAIN in bit 0, DUP clear - plain and compressed alike */
+    char   document[256];
+    size_t size = document_(document, 1);
+
+    connect_(false);
+    publish_retained_(document, size);
+    TEST_ASSERT_EQUAL_HEX8(0x31, g_sent[0]);
+
+    connect_(true);
+    publish_retained_(document, size);
+    TEST_ASSERT_EQUAL_HEX8(0x31, g_sent[0]);
+    TEST_ASSERT_EQUAL_HEX8(MQTT_CODEC_MARKER, g_sent[2 + 2 + 16]);
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Payload deflate");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_deflate_round_trip,                 tCntr++);
+    RUN_TEST(test_deflate_small_payload_as_is,        tCntr++);
+    RUN_TEST(test_deflate_marker_payload_stored,      tCntr++);
+    RUN_TEST(test_deflate_unknown_envelope,           tCntr++);
+    RUN_TEST(test_deflate_batch_delivery,             tCntr++);
+    RUN_TEST(test_deflate_retain_decoded,             tCntr++);
+    RUN_TEST(test_deflate_retained_fixed_header,      tCntr++);
+    RUN_TEST(test_deflate_unknown_envelope_in_order,  tCntr++);
+    int failures = UnityEnd();
+
+    deflate_codec_cleanup();
+    return failures;
+}
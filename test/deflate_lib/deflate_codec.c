@@ -0,0 +1,101 @@
+#include <stdio.h>      // printf
+#include <string.h>     // memset
+#include <zlib.h>
+#include "deflate_codec.h"
+
+/* Streams are set up once and reset per payload, so zlib allocates only at initialize */
+static z_stream        deflate_encoder;
+static z_stream        deflate_decoder;
+static bool            deflate_ready           = false;
+static const uint8_t * deflate_dictionary      = NULL;
+static size_t          deflate_dictionary_size = 0;
+
+bool deflate_codec_initialize(const uint8_t * a_dictionary,
+                              size_t          a_dictionary_size,
+                              int             a_level)
+{
+    deflate_codec_cleanup();
+
+    /* Window is 32 KB - older dictionary bytes would not be reached */
+    if (a_dictionary_size > 32768) {
+        a_dictionary      += a_dictionary_size - 32768;
+        a_dictionary_size  = 32768;
+    }
+
+    memset(&deflate_encoder, 0, sizeof(deflate_encoder));
+    memset(&deflate_decoder, 0, sizeof(deflate_decoder));
+
+    /* Raw deflate, no zlib header or checksum - MQTT already frames the payload */
+    if (Z_OK != deflateInit2(&deflate_encoder, a_level, Z_DEFLATED, -15, 9, Z_DEFAULT_STRATEGY)) {
+        printf("%s %u deflateInit2 failed\n", __FILE__, __LINE__);
+        return false;
+    }
+    if (Z_OK != inflateInit2(&deflate_decoder, -15)) {
+        printf("%s %u inflateInit2 failed\n", __FILE__, __LINE__);
+        deflateEnd(&deflate_encoder);
+        return false;
+    }
+
+    deflate_dictionary      = a_dictionary;
+    deflate_dictionary_size = a_dictionary_size;
+    deflate_ready           = true;
+    return true;
+}
+
+int deflate_codec_compress(uint8_t * a_input,
+                           size_t    a_input_size,
+                           uint8_t * a_output,
+                           size_t    a_output_size)
+{
+    if ((false == deflate_ready) ||
+        (Z_OK  != deflateReset(&deflate_encoder)))
+        return -1;
+
+    if ((0    <  deflate_dictionary_size) &&
+        (Z_OK != deflateSetDictionary(&deflate_encoder, deflate_dictionary, (uInt)deflate_dictionary_size)))
+        return -1;
+
+    deflate_encoder.next_in   = a_input;
+    deflate_encoder.avail_in  = (uInt)a_input_size;
+    deflate_encoder.next_out  = a_output;
+    deflate_encoder.avail_out = (uInt)a_output_size;
+
+    /* Output buffer ran out before the end - payload is not worth compressing */
+    if (Z_STREAM_END != deflate(&deflate_encoder, Z_FINISH))
+        return -1;
+    return (int)deflate_encoder.total_out;
+}
+
+int deflate_codec_decompress(uint8_t * a_input,
+                             size_t    a_input_size,
+                             uint8_t * a_output,
+                             size_t    a_output_size)
+{
+    if ((false == deflate_ready) ||
+        (Z_OK  != inflateReset(&deflate_decoder)))
+        return -1;
+
+    if ((0    <  deflate_dictionary_size) &&
+        (Z_OK != inflateSetDictionary(&deflate_decoder, deflate_dictionary, (uInt)deflate_dictionary_size)))
+        return -1;
+
+    deflate_decoder.next_in   = a_input;
+    deflate_decoder.avail_in  = (uInt)a_input_size;
+    deflate_decoder.next_out  = a_output;
+    deflate_decoder.avail_out = (uInt)a_output_size;
+
+    if (Z_STREAM_END != inflate(&deflate_decoder, Z_FINISH))
+        return -1;
+    return (int)deflate_decoder.total_out;
+}
+
+void deflate_codec_cleanup()
+{
+    if (deflate_ready) {
+        deflateEnd(&deflate_encoder);
+        inflateEnd(&deflate_decoder);
+    }
+    deflate_ready           = false;
+    deflate_dictionary      = NULL;
+    deflate_dictionary_size = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef DEFLATE_CODEC_H
+#define DEFLATE_CODEC_H
+
+#include <stdint.h>  // uint
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+/* Codec id of deflate with the preset dictionary, for mqtt_set_payload_codec() */
+#define DEFLATE_CODEC_ID 1
+
+/* Prepare raw deflate streams with a preset dictionary. Both ends must use the same
+   dictionary: typical payloads, most common content last, at most 32 KB is used.
+   a_level is the zlib compression level 1-9. */
+bool deflate_codec_initialize(const uint8_t * a_dictionary,
+                              size_t          a_dictionary_size,
+                              int             a_level);
+
+/* payload_codec_fptr_t encoder and decoder for mqtt_set_payload_codec(). Output goes
+   straight to a_output, -1 when it does not fit or input is not valid. */
+int deflate_codec_compress(uint8_t * a_input,
+                           size_t    a_input_size,
+                           uint8_t * a_output,
+                           size_t    a_output_size);
+
+int deflate_codec_decompress(uint8_t * a_input,
+                             size_t    a_input_size,
+                             uint8_t * a_output,
+                             size_t    a_output_size);
+
+/* Release zlib streams */
+void deflate_codec_cleanup();
+
+#endif
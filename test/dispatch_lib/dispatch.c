@@ -0,0 +1,154 @@
+#include <pthread.h>    // workers
+#include <stdlib.h>     // malloc/free
+#include <string.h>     // memcpy
+#include "dispatch.h"
+
+/* One bounded queue per worker. The socket reader thread is the only producer, topic hash
+   selects the queue so messages of a topic are handled in order by a single worker. */
+typedef struct dispatch_entry
+{
+    MQTT_message_view_t   view;
+    uint8_t             * copy; /* Heap copy when receive buffer could not be retained */
+} dispatch_entry_t;
+
+typedef struct dispatch_queue
+{
+    pthread_t          thread;
+    pthread_mutex_t    lock;
+    pthread_cond_t     not_empty;
+    pthread_cond_t     not_full;
+    dispatch_entry_t * entries;
+    uint32_t           head;
+    uint32_t           count;
+} dispatch_queue_t;
+
+static dispatch_queue_t    * dispatch_queues  = NULL;
+static uint32_t              dispatch_workers = 0;
+static uint32_t              dispatch_depth   = 0;
+static message_view_fptr_t   dispatch_handler = NULL;
+static volatile bool         dispatch_running = false;
+
+static uint32_t topic_hash(uint8_t * a_topic_ptr, uint16_t a_topic_length)
+{
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    for (uint16_t i = 0; i < a_topic_length; i++) {
+        hash ^= a_topic_ptr[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void *dispatch_worker_thread(void * a_ptr)
+{
+    dispatch_queue_t * queue = (dispatch_queue_t*)a_ptr;
+
+    pthread_mutex_lock(&(queue->lock));
+    while (true) {
+        while ((0 == queue->count) && dispatch_running)
+            pthread_cond_wait(&(queue->not_empty), &(queue->lock));
+
+        if (0 == queue->count)
+            break; /* Stopped and drained */
+
+        dispatch_entry_t entry = queue->entries[queue->head];
+        queue->head = (queue->head + 1) % dispatch_depth;
+        queue->count--;
+        pthread_cond_signal(&(queue->not_full));
+        pthread_mutex_unlock(&(queue->lock));
+
+        dispatch_handler(&(entry.view));
+
+        if (NULL != entry.copy)
+            free(entry.copy);
+        else
+            mqtt_message_release(&(entry.view));
+
+        pthread_mutex_lock(&(queue->lock));
+    }
+    pthread_mutex_unlock(&(queue->lock));
+    return 0;
+}
+
+bool dispatch_start(uint32_t a_worker_count, uint32_t a_queue_depth, message_view_fptr_t a_handler)
+{
+    if ((0 == a_worker_count) || (0 == a_queue_depth) || (NULL == a_handler) || dispatch_running)
+        return false;
+
+    dispatch_queues = (dispatch_queue_t*)calloc(a_worker_count, sizeof(dispatch_queue_t));
+    if (NULL == dispatch_queues)
+        return false;
+
+    dispatch_workers = a_worker_count;
+    dispatch_depth   = a_queue_depth;
+    dispatch_handler = a_handler;
+    dispatch_running = true;
+
+    for (uint32_t i = 0; i < a_worker_count; i++) {
+        dispatch_queue_t * queue = &dispatch_queues[i];
+        queue->entries = (dispatch_entry_t*)calloc(a_queue_depth, sizeof(dispatch_entry_t));
+        pthread_mutex_init(&(queue->lock), NULL);
+        pthread_cond_init(&(queue->not_empty), NULL);
+        pthread_cond_init(&(queue->not_full), NULL);
+        if ((NULL == queue->entries) ||
+            (0 != pthread_create(&(queue->thread), NULL, dispatch_worker_thread, queue))) {
+            free(queue->entries);
+            dispatch_workers = i;
+            dispatch_stop();
+            return false;
+        }
+    }
+    return true;
+}
+
+void dispatch_message(MQTT_message_view_t * a_view_ptr)
+{
+    if ((NULL == a_view_ptr) || (false == dispatch_running))
+        return;
+
+    dispatch_entry_t entry;
+    entry.view = *a_view_ptr;
+    entry.copy = NULL;
+
+    /* Keep receive buffer alive until the worker is done, copy only when transport can not */
+    if (false == mqtt_message_retain(a_view_ptr)) {
+        entry.copy = (uint8_t*)malloc(a_view_ptr->topic_length + a_view_ptr->payload_length + 1);
+        if (NULL == entry.copy)
+            return;
+        memcpy(entry.copy, a_view_ptr->topic_ptr, a_view_ptr->topic_length);
+        memcpy(entry.copy + a_view_ptr->topic_length, a_view_ptr->payload_ptr, a_view_ptr->payload_length);
+        entry.view.packet_ptr  = NULL;
+        entry.view.topic_ptr   = entry.copy;
+        entry.view.payload_ptr = entry.copy + a_view_ptr->topic_length;
+    }
+
+    dispatch_queue_t * queue = &dispatch_queues[topic_hash(a_view_ptr->topic_ptr,
+                                                           a_view_ptr->topic_length) % dispatch_workers];
+
+    pthread_mutex_lock(&(queue->lock));
+    while (queue->count == dispatch_depth)
+        pthread_cond_wait(&(queue->not_full), &(queue->lock));
+
+    queue->entries[(queue->head + queue->count) % dispatch_depth] = entry;
+    queue->count++;
+    pthread_cond_signal(&(queue->not_empty));
+    pthread_mutex_unlock(&(queue->lock));
+}
+
+void dispatch_stop()
+{
+    if (NULL == dispatch_queues)
+        return;
+
+    dispatch_running = false;
+
+    for (uint32_t i = 0; i < dispatch_workers; i++) {
+        pthread_mutex_lock(&(dispatch_queues[i].lock));
+        pthread_cond_broadcast(&(dispatch_queues[i].not_empty));
+        pthread_mutex_unlock(&(dispatch_queues[i].lock));
+        pthread_join(dispatch_queues[i].thread, NULL);
+        free(dispatch_queues[i].entries);
+    }
+    free(dispatch_queues);
+    dispatch_queues  = NULL;
+    dispatch_workers = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <stdint.h>  // uint
+#include <stdbool.h> // bool
+
+#include "mqtt.h"
+
+/* Start worker threads. Messages of one topic are always handled by the same worker,
+   so per-topic order is kept. a_queue_depth is the number of queued messages per worker. */
+bool dispatch_start(uint32_t a_worker_count, uint32_t a_queue_depth, message_view_fptr_t a_handler);
+
+/* Message view callback for mqtt_set_message_view_cb() - queues message to its worker.
+   Blocks when the worker queue is full. */
+void dispatch_message(MQTT_message_view_t * a_view_ptr);
+
+/* Handle queued messages and stop worker threads. Thread calling dispatch_message must
+   be stopped (e.g. stop_reading_thread) first - queues are freed here. */
+void dispatch_stop();
+
+#endif
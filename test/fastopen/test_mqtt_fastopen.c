@@ -0,0 +1,303 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "socket_read_write.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CONNECTIONS 4
+
+static uint8_t              g_buffer[1024];
+static uint8_t              g_flight[256];
+static uint8_t              g_frame_storage[128];
+static MQTT_shared_data_t   g_shared;
+static MQTT_connect_frame_t g_frame;
+static volatile bool        g_connack = false;
+static volatile bool        g_suback  = false;
+
+static int                  stub_listen   = -1;
+static uint16_t             stub_port     = 0;
+static pthread_t            stub_thread_id;
+static volatile bool        stub_running  = false;
+static volatile uint32_t    stub_connects = 0;
+static volatile uint32_t    stub_syn_data = 0;
+static volatile uint32_t    stub_subscribes = 0;
+
+/****************************************************************************************
+ * Loopback broker stand-in with Fast Open enabled - CONNACK and SUBACK                  *
+ ****************************************************************************************/
+static bool stub_read(int a_client, uint8_t * a_buffer, size_t a_amount)
+{
+    return (a_amount == 0) || ((ssize_t)a_amount == recv(a_client, a_buffer, a_amount, MSG_WAITALL));
+}
+
+static void stub_serve(int a_client)
+{
+    uint8_t packet[512];
+
+    while (stub_read(a_client, packet, 2)) {
+        size_t cnt    = 1;
+        size_t value  = packet[1] & 127;
+        size_t factor = 128;
+
+        while ((packet[cnt] & 128) && (cnt < 4)) {
+            if (false == stub_read(a_client, &packet[++cnt], 1))
+                return;
+            value  += (packet[cnt] & 127) * factor;
+            factor *= 128;
+        }
+        if (((cnt + 1 + value) > sizeof(packet)) || (false == stub_read(a_client, &packet[cnt + 1], value)))
+            return;
+
+        switch (packet[0] >> 4) {
+            case 1: { /* CONNECT */
+                uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+                stub_connects++;
+                send(a_client, connack, sizeof(connack), MSG_NOSIGNAL);
+                break;
+            }
+            case 8: { /* SUBSCRIBE */
+                uint8_t suback[] = {0x90, 0x03, packet[2], packet[3], 0x00};
+                stub_subscribes++;
+                send(a_client, suback, sizeof(suback), MSG_NOSIGNAL);
+                break;
+            }
+            case 14: /* DISCONNECT */
+                return;
+            default:
+                break;
+        }
+    }
+}
+
+static void *stub_thread(void * a_ptr)
+{
+    (void)a_ptr;
+
+    while (stub_running) {
+        struct pollfd pfd;
+        pfd.fd      = stub_listen;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (0 >= poll(&pfd, 1, 100))
+            continue;
+
+        int client = accept(stub_listen, NULL, NULL);
+        if (0 > client)
+            continue;
+
+        /* Server side view - SYN data was accepted */
+        struct tcp_info info;
+        socklen_t       info_size = sizeof(info);
+        if ((0 == getsockopt(client, IPPROTO_TCP, TCP_INFO, &info, &info_size)) &&
+            (0 != (info.tcpi_options & TCPI_OPT_SYN_DATA)))
+            stub_syn_data++;
+
+        struct timeval timeout;
+            timeout.tv_sec  = 5;
+            timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+
+        stub_serve(client);
+        close(client);
+    }
+    return 0;
+}
+
+static bool stub_start()
+{
+    struct sockaddr_in server;
+    socklen_t          server_size = sizeof(server);
+    int                queue       = 16;
+
+    stub_listen = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&server, 0, sizeof(server));
+    server.sin_addr.s_addr = inet_addr("127.0.0.1");
+    server.sin_family      = AF_INET;
+    server.sin_port        = 0; /* Any free port */
+
+    /* Not fatal - without server support connections fall back to normal handshake */
+    if (0 > setsockopt(stub_listen, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)))
+        printf("TCP_FASTOPEN not supported by listener\n");
+
+    if ((0 > bind(stub_listen, (struct sockaddr *)&server, sizeof(server))) ||
+        (0 > listen(stub_listen, 4)) ||
+        (0 > getsockname(stub_listen, (struct sockaddr *)&server, &server_size)))
+        return false;
+
+    stub_port    = ntohs(server.sin_port);
+    stub_running = true;
+    return (0 == pthread_create(&stub_thread_id, NULL, stub_thread, NULL));
+}
+
+static void stub_stop()
+{
+    stub_running = false;
+    pthread_join(stub_thread_id, NULL);
+    close(stub_listen);
+}
+
+/* Client and server bits of net.ipv4.tcp_fastopen */
+static bool fastopen_enabled_()
+{
+    int   value = 0;
+    FILE* file  = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    if (NULL != file) {
+        if (1 != fscanf(file, "%i", &value))
+            value = 0;
+        fclose(file);
+    }
+    return (3 == (value & 3));
+}
+
+/****************************************************************************************
+ * Client                                                                               *
+ ****************************************************************************************/
+void data_from_socket_(uint8_t * a_data, size_t a_amount)
+{
+    mqtt_receive(a_data, a_amount);
+}
+
+void connected_cb_(MQTTErrorCodes_t a_status)
+{
+    g_connack = (Successfull == a_status);
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_status    = a_status;
+    a_data_len  = a_data_len;
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if (NULL == a_data_ptr)
+        g_suback = true; /* SUBACK */
+}
+
+void startup_()
+{
+    TEST_ASSERT_TRUE(mqtt_subscribe("tfo/test", 8, 0));
+}
+
+static void wait_(volatile bool * a_flag_ptr)
+{
+    for (uint32_t i = 0; (i < 200) && (false == *a_flag_ptr); i++)
+        usleep(5000);
+}
+
+static void build_frame_()
+{
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&g_frame,
+                                           g_frame_storage,
+                                           sizeof(g_frame_storage),
+                                           mqtt_string("JAMKtest fastopen"),
+                                           mqtt_string(""),
+                                           mqtt_string(""),
+                                           mqtt_string(""),
+                                           mqtt_string(""),
+                                           30,
+                                           true));
+}
+
+void test_fastopen_prebuilt()
+{
+    uint32_t attempts  = socket_fastopen_attempts();
+    uint32_t successes = socket_fastopen_successes();
+    uint32_t connects  = stub_connects;
+
+    build_frame_();
+    for (uint32_t i = 0; i < CONNECTIONS; i++) {
+        TEST_ASSERT_TRUE(socket_initialize_fastopen("127.0.0.1", stub_port,
+                                                    g_frame.frame_ptr, g_frame.frame_size,
+                                                    &data_from_socket_));
+        g_connack = false;
+        TEST_ASSERT_TRUE(mqtt_connect_prebuilt(&g_frame, &g_shared, g_buffer, sizeof(g_buffer),
+                                               &socket_write, &connected_cb_, &subscribe_cb_, 0));
+        wait_(&g_connack);
+        TEST_ASSERT_TRUE(g_connack);
+        TEST_ASSERT_TRUE(mqtt_disconnect());
+        stop_reading_thread();
+    }
+
+    /* CONNECT was sent once per connection, in SYN or after the handshake */
+    usleep(100000);
+    TEST_ASSERT_EQUAL_UINT32(connects + CONNECTIONS, stub_connects);
+    TEST_ASSERT_EQUAL_UINT32(attempts + CONNECTIONS, socket_fastopen_attempts());
+
+    /* First connection may have to fetch the cookie */
+    successes = socket_fastopen_successes() - successes;
+    printf("Fast Open: %u of %u connections had CONNECT in SYN (server saw %u)\n",
+           successes, CONNECTIONS, stub_syn_data);
+    if (fastopen_enabled_()) {
+        TEST_ASSERT_TRUE((CONNECTIONS - 1) <= successes);
+    } else {
+        TEST_ASSERT_EQUAL_UINT32(0, successes);
+    }
+    TEST_ASSERT_EQUAL_UINT32(successes, stub_syn_data);
+}
+
+void test_fastopen_pipelined()
+{
+    /* Flight starts with the frame sent in SYN - only SUBSCRIBE goes out after it */
+    uint32_t connects   = stub_connects;
+    uint32_t subscribes = stub_subscribes;
+
+    build_frame_();
+    TEST_ASSERT_TRUE(socket_initialize_fastopen("127.0.0.1", stub_port,
+                                                g_frame.frame_ptr, g_frame.frame_size,
+                                                &data_from_socket_));
+    g_connack = false;
+    g_suback  = false;
+    TEST_ASSERT_TRUE(mqtt_connect_pipelined(&g_frame, &g_shared, g_buffer, sizeof(g_buffer),
+                                            g_flight, sizeof(g_flight),
+                                            &socket_write, &connected_cb_, &subscribe_cb_, &startup_));
+
+    /* Broker got CONNECT once and SUBSCRIBE after it, CONNACK and SUBACK may come in one read */
+    wait_(&g_suback);
+    TEST_ASSERT_TRUE(g_connack);
+    TEST_ASSERT_TRUE(g_suback);
+    TEST_ASSERT_EQUAL_UINT32(connects + 1, stub_connects);
+    TEST_ASSERT_EQUAL_UINT32(subscribes + 1, stub_subscribes);
+    TEST_ASSERT_TRUE(mqtt_disconnect());
+    stop_reading_thread();
+}
+
+void test_fastopen_refused()
+{
+    /* Nobody listening - no socket is left behind */
+    build_frame_();
+    TEST_ASSERT_FALSE(socket_initialize_fastopen("127.0.0.1", 1, g_frame.frame_ptr, g_frame.frame_size,
+                                                 &data_from_socket_));
+    TEST_ASSERT_FALSE(socket_initialize_fastopen("127.0.0.1", stub_port, NULL, 0, &data_from_socket_));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    if (false == stub_start()) {
+        printf("Broker stub failed\n");
+        return 1;
+    }
+
+    UnityBegin("TCP Fast Open");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_fastopen_prebuilt,  tCntr++);
+    RUN_TEST(test_fastopen_pipelined, tCntr++);
+    RUN_TEST(test_fastopen_refused,   tCntr++);
+    int failures = UnityEnd();
+
+    stub_stop();
+    return failures;
+}
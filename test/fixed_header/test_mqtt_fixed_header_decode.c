@@ -107,7 +107,7 @@ void test_decode_fixed_header_all_zeros()
 
 void test_decode_fixed_header_with_dub_set()
 {
-    uint8_t input[]        = {0x02, 0x00, 0x00};
+    uint8_t input[]        = {0x08, 0x00, 0x00};
     bool dup               = 1;
     MQTTQoSLevel_t qos     = 2;
     bool retain            = 1;
@@ -123,7 +123,7 @@ void test_decode_fixed_header_with_dub_set()
 
 void test_decode_fixed_header_with_qos1()
 {
-    uint8_t input[]        = {0x04, 0x00, 0x00};
+    uint8_t input[]        = {0x02, 0x00, 0x00};
     bool dup               = 0;
     MQTTQoSLevel_t qos     = 2;
     bool retain            = 1;
@@ -139,7 +139,7 @@ void test_decode_fixed_header_with_qos1()
 
 void test_decode_fixed_header_with_qos2()
 {
-    uint8_t input[]        = {0x08, 0x00, 0x00};
+    uint8_t input[]        = {0x04, 0x00, 0x00};
     bool dup               = 1;
     MQTTQoSLevel_t qos     = 2;
     bool retain            = 1;
@@ -0,0 +1,315 @@
+/****************************************************************************************
+ * Receive path fuzz target and decode benchmark.                                       *
+ *                                                                                      *
+ * libFuzzer: build with clang -fsanitize=fuzzer, LLVMFuzzerTestOneInput is the entry.  *
+ * AFL:       build with MQTT_FUZZ_MAIN, input is read from stdin when no files given.  *
+ * Replay:    fuzz_receive [-m mutations] [-b] [-r baseline -t percent] files/dirs      *
+ *            -m runs deterministic mutations of each file (bounds checks under ASan),  *
+ *            -b prints decode throughput per file, -r fails when a file decodes        *
+ *            slower than its baseline by more than -t percent (default 25).           *
+ ****************************************************************************************/
+#include "mqtt.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[64];
+static uint32_t           g_pool[MQTT_PACKET_ID_POOL_WORDS(MQTT_PACKET_ID_MAX)];
+static volatile uint32_t  g_sink  = 0;
+static bool               g_touch = true;  /* Off when benchmarking the decoder alone */
+
+static int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    (void)a_data_ptr;
+    return (int)a_amount;
+}
+
+static void connected_cb_(MQTTErrorCodes_t a_status)
+{
+    g_sink += (uint32_t)a_status;
+}
+
+/* Touch every byte given to the application, so over-reads show up under ASan */
+static void touch_(const uint8_t * a_data_ptr, size_t a_size)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; g_touch && (NULL != a_data_ptr) && (i < a_size); i++)
+        sum += a_data_ptr[i];
+    g_sink += sum;
+}
+
+static void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                          uint8_t          * a_data_ptr,
+                          uint32_t           a_data_len,
+                          uint8_t          * a_topic_ptr,
+                          uint16_t           a_topic_len)
+{
+    g_sink += (uint32_t)a_status;
+    touch_(a_data_ptr, a_data_len);
+    touch_(a_topic_ptr, a_topic_len);
+}
+
+static void message_view_cb_(MQTT_message_view_t * a_view_ptr)
+{
+    touch_(a_view_ptr->payload_ptr, a_view_ptr->payload_length);
+    touch_(a_view_ptr->topic_ptr, a_view_ptr->topic_length);
+}
+
+static void session_init_(bool a_view)
+{
+    g_shared.buffer            = g_buffer;
+    g_shared.buffer_size       = sizeof(g_buffer);
+    g_shared.out_fptr          = &out_fptr_;
+    g_shared.connected_cb_fptr = &connected_cb_;
+    g_shared.subscribe_cb_fptr = &subscribe_cb_;
+
+    MQTT_action_data_t action;
+    action.action_argument.shared_ptr = &g_shared;
+    mqtt(ACTION_INIT, &action);
+    g_shared.state = STATE_CONNECTED;
+
+    mqtt_set_packet_id_pool(g_pool, sizeof(g_pool) / sizeof(g_pool[0]));
+    if (a_view)
+        mqtt_set_message_view_cb(&message_view_cb_, NULL);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * a_data, size_t a_size)
+{
+    /* Both delivery paths */
+    session_init_(false);
+    mqtt_receive((uint8_t*)a_data, a_size);
+    session_init_(true);
+    mqtt_receive((uint8_t*)a_data, a_size);
+    return 0;
+}
+
+#ifdef MQTT_FUZZ_MAIN
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define FUZZ_MAX_INPUT (1024*1024)
+
+typedef struct options
+{
+    uint32_t     mutations;
+    bool         benchmark;
+    const char * baseline;
+    double       tolerance;
+    uint32_t     files;
+    uint32_t     slower;
+} options_t;
+
+static uint64_t g_random = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t random_()
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 7;
+    g_random ^= g_random << 17;
+    return (uint32_t)g_random;
+}
+
+static double now_ns_()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Run on exactly sized heap copy - ASan sees a read past the end */
+static void run_(const uint8_t * a_data, size_t a_size)
+{
+    uint8_t * copy = (uint8_t*)malloc(a_size ? a_size : 1);
+    memcpy(copy, a_data, a_size);
+    LLVMFuzzerTestOneInput(copy, a_size);
+    free(copy);
+}
+
+static void mutate_(const uint8_t * a_data, size_t a_size, uint32_t a_count)
+{
+    static uint8_t work[FUZZ_MAX_INPUT + 64];
+
+    for (uint32_t round = 0; round < a_count; round++) {
+        size_t size = a_size;
+        memcpy(work, a_data, a_size);
+
+        switch (random_() % 5) {
+            case 0: /* Truncate */
+                size = (0 < a_size) ? random_() % a_size : 0;
+                break;
+            case 1: /* Flip bits */
+                for (uint32_t i = 0; (0 < size) && (i < 1 + random_() % 4); i++)
+                    work[random_() % size] ^= (uint8_t)(1u << (random_() % 8));
+                break;
+            case 2: /* Remaining length or topic length */
+                if (4 <= size)
+                    work[1 + random_() % 3] = (uint8_t)random_();
+                break;
+            case 3: /* Random bytes appended */
+                for (uint32_t i = 0; i < random_() % 64; i++)
+                    work[size++] = (uint8_t)random_();
+                break;
+            default: /* Packet type */
+                if (0 < size)
+                    work[0] = (uint8_t)((random_() % 16) << 4 | (work[0] & 0x0F));
+                break;
+        }
+        run_(work, size);
+    }
+}
+
+static double baseline_ns_(const char * a_file, const char * a_name)
+{
+    FILE * file  = fopen(a_file, "r");
+    char   name[256];
+    double value = 0;
+
+    if (NULL == file)
+        return 0;
+    while (2 == fscanf(file, "%255s %lf", name, &value)) {
+        if (0 == strcmp(name, a_name)) {
+            fclose(file);
+            return value;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static void benchmark_(options_t * a_options, const char * a_name, const uint8_t * a_data, size_t a_size)
+{
+    uint32_t rounds = 1;
+    double   elapsed = 0;
+
+    session_init_(false);
+    g_touch = false;
+    /* Grow until measurement takes 50 ms */
+    while (true) {
+        double start = now_ns_();
+        for (uint32_t i = 0; i < rounds; i++)
+            mqtt_receive((uint8_t*)a_data, a_size);
+        elapsed = now_ns_() - start;
+        if ((50e6 <= elapsed) || (rounds >= (1u << 30)))
+            break;
+        rounds *= 2;
+    }
+
+    g_touch = true;
+
+    double ns_per_packet = elapsed / rounds;
+    printf("%-32s %8zu B %10.1f ns/packet %9.1f MB/s", a_name, a_size, ns_per_packet,
+           (a_size * 1e3) / ns_per_packet);
+
+    if (NULL != a_options->baseline) {
+        double baseline = baseline_ns_(a_options->baseline, a_name);
+        if (0 < baseline) {
+            double change = (ns_per_packet - baseline) * 100 / baseline;
+            printf(" %+6.1f %%", change);
+            if (change > a_options->tolerance) {
+                printf(" SLOWER");
+                a_options->slower++;
+            }
+        }
+    }
+    printf("\n");
+}
+
+static void file_(options_t * a_options, const char * a_path)
+{
+    static uint8_t data[FUZZ_MAX_INPUT];
+    FILE * file = fopen(a_path, "rb");
+    if (NULL == file)
+        return;
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+
+    const char * name = strrchr(a_path, '/');
+    name = (NULL != name) ? name + 1 : a_path;
+
+    run_(data, size);
+    if (0 < a_options->mutations)
+        mutate_(data, size, a_options->mutations);
+    if (a_options->benchmark)
+        benchmark_(a_options, name, data, size);
+    a_options->files++;
+}
+
+static int compare_(const void * a_a, const void * a_b)
+{
+    return strcmp(*(char * const *)a_a, *(char * const *)a_b);
+}
+
+static void path_(options_t * a_options, const char * a_path)
+{
+    struct stat info;
+    if (0 != stat(a_path, &info))
+        return;
+
+    if (false == S_ISDIR(info.st_mode)) {
+        file_(a_options, a_path);
+        return;
+    }
+
+    /* Sorted for stable benchmark output */
+    DIR    * dir = opendir(a_path);
+    char   * names[1024];
+    uint32_t count = 0;
+    struct dirent * entry;
+    while ((NULL != dir) && (NULL != (entry = readdir(dir))) && (count < 1024)) {
+        if ('.' != entry->d_name[0])
+            names[count++] = strdup(entry->d_name);
+    }
+    if (NULL != dir)
+        closedir(dir);
+    qsort(names, count, sizeof(char*), compare_);
+
+    for (uint32_t i = 0; i < count; i++) {
+        char full[4096];
+        snprintf(full, sizeof(full), "%s/%s", a_path, names[i]);
+        file_(a_options, full);
+        free(names[i]);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    options_t options;
+    memset(&options, 0, sizeof(options));
+    options.tolerance = 25;
+
+    int arg = 1;
+    for (; arg < argc && '-' == argv[arg][0]; arg++) {
+        if ((0 == strcmp(argv[arg], "-m")) && (arg + 1 < argc))
+            options.mutations = (uint32_t)atoi(argv[++arg]);
+        else if (0 == strcmp(argv[arg], "-b"))
+            options.benchmark = true;
+        else if ((0 == strcmp(argv[arg], "-r")) && (arg + 1 < argc))
+            options.baseline = argv[++arg];
+        else if ((0 == strcmp(argv[arg], "-t")) && (arg + 1 < argc))
+            options.tolerance = atof(argv[++arg]);
+        else {
+            printf("usage: %s [-m mutations] [-b] [-r baseline -t percent] files/dirs\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (arg == argc) {
+        /* AFL - one input from stdin */
+        static uint8_t data[FUZZ_MAX_INPUT];
+        size_t size = fread(data, 1, sizeof(data), stdin);
+        run_(data, size);
+        return 0;
+    }
+
+    for (; arg < argc; arg++)
+        path_(&options, argv[arg]);
+
+    printf("%u files, %u mutations each\n", options.files, options.mutations);
+    return ((0 == options.files) || (0 < options.slower)) ? 1 : 0;
+}
+
+#endif /* MQTT_FUZZ_MAIN */
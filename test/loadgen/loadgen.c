@@ -0,0 +1,708 @@
+#include <argp.h>    // http://www.gnu.org/software/libc/manual/html_node/Argp.html#Argp
+#include <stdbool.h>
+#include <stdint.h>  // uint
+#include <stdlib.h>  // atoi
+#include <string.h>  // strlen
+#include <stdio.h>
+#include <stdarg.h>  // va_list
+#include <errno.h>
+#include <fcntl.h>   // O_NONBLOCK
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>  // SIGPIPE
+#include <time.h>    // clock_gettime
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h> // RLIMIT_NOFILE
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>  // TCP_NODELAY
+#include <arpa/inet.h>    // inet_addr
+
+#include "mqtt.h"
+
+/* Load generator: N sessions over M threads. Each thread runs its sessions from one
+   epoll loop, selecting the session before every library call (library is built with
+   thread local active session). Publishers stamp payloads with send time, subscribers
+   measure latency from it - same process, same clock. */
+
+const char *argp_program_version = "ROjal_MQTT_Client load generator v0.1";
+static char doc[]                = "MQTT 3.1.1 load generator";
+static char args_doc[]           = "rmload [FLAGS]";
+
+static struct argp_option options[] = {
+    { "broker",      'b', "IP",         0, "Broker IP address e.g. 192.168.0.1:", 0},
+    { "sport",       's', "SocketPort", 0, "MQTT's Socket port (if not defined 1883 will be used):", 0},
+    { "sessions",    'n', "Count",      0, "Number of client sessions (default 10):", 0},
+    { "threads",     'j', "Count",      0, "Number of threads running the sessions (default 2):", 0},
+    { "subscribers", 'S', "Count",      0, "Sessions subscribing, rest are publishing (default 1):", 0},
+    { "rate",        'r', "Msg/s",      0, "Publish rate per publisher, 0 = as fast as possible (default 10):", 0},
+    { "size",        'z', "Bytes",      0, "Payload size, at least 8 (default 64):", 0},
+    { "topic",       't', "Template",   0, "Publish topic, %i is replaced by topic index (default load/%i):", 0},
+    { "topics",      'o', "Count",      0, "Number of distinct topics (default = publishers):", 0},
+    { "filter",      'w', "Filter",     0, "Subscription of subscribers (default load/#):", 0},
+    { "duration",    'd', "sec",        0, "Publishing time in seconds (default 10):", 0},
+    { "keepalive",   'k', "sec",        0, "Keepalive in seconds (default = 0 = no keepalive):", 0},
+    { "verbose",     'v', 0,            0, "Verbose:", 0},
+    { 0 }
+};
+
+struct arguments {
+    char     * hostip;
+    uint32_t   hostport;
+    uint32_t   sessions;
+    uint32_t   threads;
+    uint32_t   subscribers;
+    uint32_t   rate;
+    uint32_t   size;
+    char     * topic;
+    uint32_t   topics;
+    char     * filter;
+    uint32_t   duration;
+    uint32_t   keepalive;
+    bool       verbose;
+};
+
+#define PHASE_CONNECT 0
+#define PHASE_RUN     1
+#define PHASE_STOP    2
+
+#define LATENCY_SAMPLES (1024*1024) /* Per thread, reservoir sampled beyond this */
+
+struct worker;
+
+typedef struct session
+{
+    MQTT_shared_data_t   shared;
+    struct worker      * worker;
+    int                  fd;
+    uint32_t             index;
+    bool                 publisher;
+    bool                 connected;
+    bool                 subscribe_pending;
+    bool                 write_watch;    /* EPOLLOUT requested */
+    bool                 closed;
+    uint64_t             next_publish_ns;
+    char                 topic[256];
+    uint16_t             topic_length;
+    uint8_t            * tx;             /* Shared buffer of the session */
+    size_t               tx_size;
+    uint8_t            * queue;          /* Output queue @see mqtt_set_output_queue */
+    size_t               queue_size;
+    uint8_t            * rx;             /* Packet reassembly */
+    size_t               rx_size;
+    size_t               rx_used;
+} session_t;
+
+typedef struct worker
+{
+    pthread_t    thread;
+    uint32_t     index;
+    int          epoll_fd;
+    session_t  * sessions;
+    uint32_t     count;
+    uint8_t    * payload;
+
+    /* Statistics, read by main thread after join (counters also while running) */
+    atomic_uint  connected;
+    atomic_uint  subscribed;
+    uint32_t     connect_failures;
+    uint32_t     closed;
+    uint64_t     last_connack_ns;
+    uint64_t     published;
+    uint64_t     publish_blocked;
+    uint64_t     received;
+    uint64_t     received_bytes;
+    uint64_t   * latency_ns;
+    uint32_t     latency_count;
+    uint64_t     latency_seen;
+    unsigned int random_seed;
+} worker_t;
+
+static struct arguments  arguments;
+static atomic_int        phase = PHASE_CONNECT;
+static uint64_t          start_ns;
+
+static __thread session_t * current_session = NULL;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ms(int milliseconds)
+{
+    struct timespec ts;
+    ts.tv_sec  = milliseconds / 1000;
+    ts.tv_nsec = (milliseconds % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+static int trace(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if(arguments.verbose)
+        vprintf(format, args);
+
+    va_end(args);
+
+    return 0;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state) {
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case 'b': arguments->hostip      = arg;             break;
+        case 's': arguments->hostport    = atoi(arg);       break;
+        case 'n': arguments->sessions    = atoi(arg);       break;
+        case 'j': arguments->threads     = atoi(arg);       break;
+        case 'S': arguments->subscribers = atoi(arg);       break;
+        case 'r': arguments->rate        = atoi(arg);       break;
+        case 'z': arguments->size        = atoi(arg);       break;
+        case 't': arguments->topic       = arg;             break;
+        case 'o': arguments->topics      = atoi(arg);       break;
+        case 'w': arguments->filter      = arg;             break;
+        case 'd': arguments->duration    = atoi(arg);       break;
+        case 'k': arguments->keepalive   = atoi(arg);       break;
+        case 'v': arguments->verbose     = true;            break;
+        case ARGP_KEY_ARG:
+            return 0;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+/* Topic template with %i replaced by a_topic_index */
+static uint16_t topic_from_template(char * a_out, size_t a_size, uint32_t a_topic_index)
+{
+    char   number[16];
+    size_t used = 0;
+
+    snprintf(number, sizeof(number), "%u", a_topic_index);
+    for (char * p = arguments.topic; ('\0' != *p) && (used + 1 < a_size); p++) {
+        if (('%' == p[0]) && ('i' == p[1])) {
+            for (char * n = number; ('\0' != *n) && (used + 1 < a_size); n++)
+                a_out[used++] = *n;
+            p++;
+        } else {
+            a_out[used++] = *p;
+        }
+    }
+    a_out[used] = '\0';
+    return (uint16_t)used;
+}
+
+/****************************************************************************************
+ * Transport - non blocking socket per session, short writes go to the output queue     *
+ ****************************************************************************************/
+int session_write(uint8_t * a_data, size_t a_amount)
+{
+    int ret = send(current_session->fd, a_data, a_amount, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if ((0 > ret) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)))
+        return 0;
+    return ret;
+}
+
+static void session_watch_write(session_t * a_session, bool a_watch)
+{
+    if (a_session->write_watch == a_watch)
+        return;
+
+    struct epoll_event event;
+    event.events   = EPOLLIN | (a_watch ? EPOLLOUT : 0);
+    event.data.ptr = a_session;
+    epoll_ctl(a_session->worker->epoll_fd, EPOLL_CTL_MOD, a_session->fd, &event);
+    a_session->write_watch = a_watch;
+}
+
+static size_t packet_size(uint8_t * a_data, size_t a_amount)
+{
+    size_t   value      = 0;
+    size_t   multiplier = 1;
+    uint32_t cnt        = 1;
+
+    do {
+        if ((cnt >= a_amount) || (4 < cnt))
+            return 0;
+        value      += (a_data[cnt] & 127) * multiplier;
+        multiplier *= 128;
+    } while (0 != (a_data[cnt++] & 128));
+
+    return value + cnt;
+}
+
+static void session_close(session_t * a_session)
+{
+    if (a_session->closed)
+        return;
+    epoll_ctl(a_session->worker->epoll_fd, EPOLL_CTL_DEL, a_session->fd, NULL);
+    close(a_session->fd);
+    a_session->closed = true;
+    a_session->worker->closed++;
+}
+
+static void session_read(session_t * a_session)
+{
+    while (true) {
+        ssize_t bytes = recv(a_session->fd,
+                             &a_session->rx[a_session->rx_used],
+                             a_session->rx_size - a_session->rx_used,
+                             MSG_DONTWAIT);
+        if (0 >= bytes) {
+            if ((0 > bytes) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)))
+                return;
+            session_close(a_session);
+            return;
+        }
+        a_session->rx_used += (size_t)bytes;
+
+        size_t offset = 0;
+        while (2 <= (a_session->rx_used - offset)) {
+            size_t size = packet_size(&a_session->rx[offset], a_session->rx_used - offset);
+            if ((0 == size) || (size > (a_session->rx_used - offset)))
+                break;
+            mqtt_receive(&a_session->rx[offset], size);
+            offset += size;
+        }
+        memmove(a_session->rx, &a_session->rx[offset], a_session->rx_used - offset);
+        a_session->rx_used -= offset;
+
+        if (a_session->rx_used == a_session->rx_size) {
+            printf("Session %u: packet does not fit to %zu bytes\n", a_session->index, a_session->rx_size);
+            session_close(a_session);
+            return;
+        }
+    }
+}
+
+/****************************************************************************************
+ * Library callbacks - current_session tells whose                                      *
+ ****************************************************************************************/
+void connected_cb(MQTTErrorCodes_t a_status)
+{
+    session_t * session = current_session;
+    worker_t  * worker  = session->worker;
+
+    if (Successfull == a_status) {
+        session->connected         = true;
+        session->subscribe_pending = (false == session->publisher);
+        worker->last_connack_ns    = now_ns();
+        atomic_fetch_add(&worker->connected, 1);
+    } else {
+        worker->connect_failures++;
+        trace("Session %u connection refused %i\n", session->index, a_status);
+    }
+}
+
+void subscribe_cb(MQTTErrorCodes_t   a_status,
+                  uint8_t          * a_data_ptr,
+                  uint32_t           a_data_len,
+                  uint8_t          * a_topic_ptr,
+                  uint16_t           a_topic_len)
+{
+    worker_t * worker = current_session->worker;
+    (void)a_topic_ptr;
+    (void)a_topic_len;
+
+    if (NULL == a_data_ptr) {
+        atomic_fetch_add(&worker->subscribed, 1); /* SUBACK, granted or not broker delivers */
+        return;
+    }
+
+    if (Successfull != a_status)
+        return;
+
+    worker->received++;
+    worker->received_bytes += a_data_len;
+
+    if (sizeof(uint64_t) <= a_data_len) {
+        uint64_t sent_ns;
+        memcpy(&sent_ns, a_data_ptr, sizeof(sent_ns));
+        uint64_t latency = now_ns() - sent_ns;
+
+        /* Reservoir sampling keeps percentiles fair over long runs */
+        worker->latency_seen++;
+        if (worker->latency_count < LATENCY_SAMPLES) {
+            worker->latency_ns[worker->latency_count++] = latency;
+        } else {
+            uint64_t slot = (uint64_t)rand_r(&worker->random_seed) % worker->latency_seen;
+            if (slot < LATENCY_SAMPLES)
+                worker->latency_ns[slot] = latency;
+        }
+    }
+}
+
+/****************************************************************************************
+ * Worker thread                                                                        *
+ ****************************************************************************************/
+static bool session_connect(session_t * a_session)
+{
+    struct sockaddr_in server;
+    char               client_id[64];
+    uint8_t            empty[] = "\0";
+
+    a_session->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (0 > a_session->fd)
+        return false;
+
+    int value = 1;
+    setsockopt(a_session->fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(int));
+
+    server.sin_addr.s_addr = inet_addr(arguments.hostip);
+    server.sin_family      = AF_INET;
+    server.sin_port        = htons(arguments.hostport);
+
+    if (0 > connect(a_session->fd, (struct sockaddr *)&server, sizeof(server))) {
+        close(a_session->fd);
+        return false;
+    }
+    fcntl(a_session->fd, F_SETFL, fcntl(a_session->fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events   = EPOLLIN;
+    event.data.ptr = a_session;
+    epoll_ctl(a_session->worker->epoll_fd, EPOLL_CTL_ADD, a_session->fd, &event);
+
+    current_session = a_session;
+    snprintf(client_id, sizeof(client_id), "ROjal_MQTT_load%u_%u", (uint32_t)getpid(), a_session->index);
+
+    /* Zero timeout - CONNACK is handled by the event loop */
+    mqtt_connect(client_id,
+                 arguments.keepalive,
+                 empty,
+                 empty,
+                 empty,
+                 empty,
+                 &a_session->shared,
+                 a_session->tx,
+                 a_session->tx_size,
+                 true,
+                 &session_write,
+                 &connected_cb,
+                 &subscribe_cb,
+                 0);
+
+    return mqtt_set_output_queue(a_session->queue,
+                                 a_session->queue_size,
+                                 a_session->queue_size - a_session->tx_size,
+                                 a_session->tx_size,
+                                 NULL);
+}
+
+static void session_publish(session_t * a_session, worker_t * a_worker)
+{
+    uint64_t now = now_ns();
+    memcpy(a_worker->payload, &now, sizeof(now));
+
+    MQTTErrorCodes_t status = mqtt_publish_try(a_session->topic,
+                                               a_session->topic_length,
+                                               (char*)a_worker->payload,
+                                               arguments.size);
+    if (Successfull == status)
+        a_worker->published++;
+    else if (WouldBlock == status)
+        a_worker->publish_blocked++;
+
+    if (0 < mqtt_output_pending())
+        session_watch_write(a_session, true);
+}
+
+static void *worker_thread(void * a_ptr)
+{
+    worker_t           * worker = (worker_t*)a_ptr;
+    struct epoll_event   events[64];
+    uint64_t             period_ns      = (0 < arguments.rate) ? (1000000000ull / arguments.rate) : 0;
+    uint64_t             last_keepalive = now_ns();
+
+    for (uint32_t i = 0; i < worker->count; i++) {
+        if (false == session_connect(&worker->sessions[i])) {
+            worker->connect_failures++;
+            worker->sessions[i].closed = true;
+        }
+    }
+
+    while (PHASE_STOP != atomic_load(&phase)) {
+        int timeout_ms = ((PHASE_RUN == atomic_load(&phase)) && (0 == period_ns)) ? 0 : 1;
+        int count      = epoll_wait(worker->epoll_fd, events, 64, timeout_ms);
+
+        for (int e = 0; e < count; e++) {
+            session_t * session = (session_t*)events[e].data.ptr;
+            current_session = session;
+            mqtt_session_select(&session->shared);
+
+            if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                session_read(session);
+
+            if ((false == session->closed) && (events[e].events & EPOLLOUT)) {
+                mqtt_output_flush();
+                if (0 == mqtt_output_pending())
+                    session_watch_write(session, false);
+            }
+        }
+
+        uint64_t now = now_ns();
+        for (uint32_t i = 0; i < worker->count; i++) {
+            session_t * session = &worker->sessions[i];
+            if (session->closed || (false == session->connected))
+                continue;
+
+            current_session = session;
+            mqtt_session_select(&session->shared);
+
+            if (session->subscribe_pending) {
+                session->subscribe_pending = false;
+                mqtt_subscribe(arguments.filter, (uint16_t)strlen(arguments.filter), 0);
+            }
+
+            if (session->publisher && (PHASE_RUN == atomic_load(&phase))) {
+                if (0 == period_ns) {
+                    session_publish(session, worker);
+                } else if (session->next_publish_ns <= now) {
+                    if (0 == session->next_publish_ns)
+                        session->next_publish_ns = now;
+                    session_publish(session, worker);
+                    session->next_publish_ns += period_ns;
+                    if ((session->next_publish_ns + 1000000000ull) < now)
+                        session->next_publish_ns = now; /* Over a second late - do not burst */
+                }
+            }
+        }
+
+        if ((0 < arguments.keepalive) && ((now - last_keepalive) >= 100000000ull)) {
+            uint32_t elapsed_ms = (uint32_t)((now - last_keepalive) / 1000000ull);
+            for (uint32_t i = 0; i < worker->count; i++) {
+                if (worker->sessions[i].closed)
+                    continue;
+                current_session = &worker->sessions[i];
+                mqtt_session_select(&worker->sessions[i].shared);
+                mqtt_keepalive(elapsed_ms);
+            }
+            last_keepalive = now;
+        }
+    }
+
+    for (uint32_t i = 0; i < worker->count; i++) {
+        session_t * session = &worker->sessions[i];
+        if (session->closed)
+            continue;
+        current_session = session;
+        mqtt_session_select(&session->shared);
+        mqtt_output_flush();
+        mqtt_disconnect();
+        session_close(session);
+        worker->closed--; /* Closed by us, not by the broker */
+    }
+    return 0;
+}
+
+/****************************************************************************************
+ * Report                                                                               *
+ ****************************************************************************************/
+static int compare_u64(const void * a_ptr, const void * b_ptr)
+{
+    uint64_t a = *(const uint64_t*)a_ptr;
+    uint64_t b = *(const uint64_t*)b_ptr;
+    return (a > b) - (a < b);
+}
+
+static double percentile_us(uint64_t * a_sorted, uint64_t a_count, double a_percentile)
+{
+    if (0 == a_count)
+        return 0.0;
+    uint64_t index = (uint64_t)(a_percentile / 100.0 * (double)(a_count - 1) + 0.5);
+    return (double)a_sorted[index] / 1000.0;
+}
+
+static uint32_t total_of(worker_t * a_workers, bool a_subscribed)
+{
+    uint32_t total = 0;
+    for (uint32_t w = 0; w < arguments.threads; w++)
+        total += a_subscribed ? atomic_load(&a_workers[w].subscribed) : atomic_load(&a_workers[w].connected);
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    struct argp argp = { options, parse_opt, args_doc, doc, 0, 0, 0 };
+
+    arguments.hostip      = "";
+    arguments.hostport    = 1883;
+    arguments.sessions    = 10;
+    arguments.threads     = 2;
+    arguments.subscribers = 1;
+    arguments.rate        = 10;
+    arguments.size        = 64;
+    arguments.topic       = "load/%i";
+    arguments.topics      = 0;
+    arguments.filter      = "load/#";
+    arguments.duration    = 10;
+    arguments.keepalive   = 0;
+    arguments.verbose     = false;
+
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if ((0 == strlen(arguments.hostip))                 ||
+        (0 == arguments.sessions)                       ||
+        (0 == arguments.threads)                        ||
+        (arguments.subscribers > arguments.sessions)    ||
+        (sizeof(uint64_t) > arguments.size)) {
+        printf("Broker IP, sessions and threads must be given, subscribers <= sessions and size >= 8\n");
+        return 1;
+    }
+    if (arguments.threads > arguments.sessions)
+        arguments.threads = arguments.sessions;
+
+    uint32_t publishers = arguments.sessions - arguments.subscribers;
+    if (0 == arguments.topics)
+        arguments.topics = (0 < publishers) ? publishers : 1;
+
+    /* One descriptor per session */
+    struct rlimit limit;
+    if (0 == getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Buffers fit one publish, queue a few */
+    size_t tx_size = arguments.size + 256 + 16;
+    size_t rx_size = tx_size + 4096;
+
+    session_t * sessions = calloc(arguments.sessions, sizeof(session_t));
+    worker_t  * workers  = calloc(arguments.threads, sizeof(worker_t));
+    if ((NULL == sessions) || (NULL == workers))
+        return 1;
+
+    for (uint32_t i = 0; i < arguments.sessions; i++) {
+        session_t * session  = &sessions[i];
+        session->index       = i;
+        session->publisher   = (i >= arguments.subscribers);
+        session->tx_size     = tx_size;
+        session->tx          = malloc(tx_size);
+        session->queue_size  = 4 * tx_size;
+        session->queue       = malloc(session->queue_size);
+        session->rx_size     = rx_size;
+        session->rx          = malloc(rx_size);
+        session->topic_length = topic_from_template(session->topic,
+                                                    sizeof(session->topic),
+                                                    (i - arguments.subscribers) % arguments.topics);
+        if ((NULL == session->tx) || (NULL == session->queue) || (NULL == session->rx))
+            return 1;
+    }
+
+    /* Sessions are spread evenly, subscribers and publishers mixed over threads */
+    uint32_t first = 0;
+    for (uint32_t w = 0; w < arguments.threads; w++) {
+        worker_t * worker    = &workers[w];
+        worker->index        = w;
+        worker->count        = arguments.sessions / arguments.threads + ((w < (arguments.sessions % arguments.threads)) ? 1 : 0);
+        worker->sessions     = &sessions[first];
+        worker->epoll_fd     = epoll_create1(0);
+        worker->payload      = calloc(1, arguments.size);
+        worker->latency_ns   = malloc(LATENCY_SAMPLES * sizeof(uint64_t));
+        worker->random_seed  = w + 1;
+        if ((NULL == worker->payload) || (NULL == worker->latency_ns))
+            return 1;
+        for (uint32_t i = 0; i < worker->count; i++)
+            sessions[first + i].worker = worker;
+        first += worker->count;
+    }
+
+    printf("%u sessions (%u publishers, %u subscribers) over %u threads, %u msg/s x %u bytes, %u s\n",
+           arguments.sessions, publishers, arguments.subscribers, arguments.threads,
+           arguments.rate, arguments.size, arguments.duration);
+
+    /* Connect storm */
+    start_ns = now_ns();
+    for (uint32_t w = 0; w < arguments.threads; w++)
+        pthread_create(&workers[w].thread, NULL, worker_thread, &workers[w]);
+
+    uint64_t deadline = start_ns + 30000000000ull;
+    while ((total_of(workers, false) < arguments.sessions) && (now_ns() < deadline))
+        sleep_ms(1);
+
+    uint64_t storm_end = 0;
+    for (uint32_t w = 0; w < arguments.threads; w++)
+        if (workers[w].last_connack_ns > storm_end)
+            storm_end = workers[w].last_connack_ns;
+    uint32_t connected = total_of(workers, false);
+
+    deadline = now_ns() + 10000000000ull;
+    while ((total_of(workers, true) < arguments.subscribers) && (now_ns() < deadline))
+        sleep_ms(1);
+    trace("%u subscriptions acknowledged\n", total_of(workers, true));
+
+    /* Publishing */
+    uint64_t run_start = now_ns();
+    atomic_store(&phase, PHASE_RUN);
+    sleep_ms(arguments.duration * 1000);
+    atomic_store(&phase, PHASE_STOP);
+    double run_seconds = (double)(now_ns() - run_start) / 1e9;
+
+    for (uint32_t w = 0; w < arguments.threads; w++)
+        pthread_join(workers[w].thread, NULL);
+
+    /* Aggregate */
+    uint64_t published = 0, blocked = 0, received = 0, received_bytes = 0, samples = 0;
+    uint32_t failures  = 0, closed  = 0;
+    for (uint32_t w = 0; w < arguments.threads; w++) {
+        published      += workers[w].published;
+        blocked        += workers[w].publish_blocked;
+        received       += workers[w].received;
+        received_bytes += workers[w].received_bytes;
+        failures       += workers[w].connect_failures;
+        closed         += workers[w].closed;
+        samples        += workers[w].latency_count;
+    }
+
+    uint64_t * latency = malloc((samples + 1) * sizeof(uint64_t));
+    uint64_t   used    = 0;
+    for (uint32_t w = 0; (NULL != latency) && (w < arguments.threads); w++) {
+        memcpy(&latency[used], workers[w].latency_ns, workers[w].latency_count * sizeof(uint64_t));
+        used += workers[w].latency_count;
+    }
+    if (NULL != latency)
+        qsort(latency, used, sizeof(uint64_t), compare_u64);
+
+    printf("Connect storm:  %u/%u connected in %.1f ms, %u failed, %u closed by broker\n",
+           connected, arguments.sessions,
+           (storm_end > start_ns) ? (double)(storm_end - start_ns) / 1e6 : 0.0,
+           failures, closed);
+    printf("Published:      %llu msgs, %.0f msg/s, %llu refused by backpressure\n",
+           (unsigned long long)published, (double)published / run_seconds, (unsigned long long)blocked);
+    printf("Received:       %llu msgs, %.0f msg/s, %.2f MB/s\n",
+           (unsigned long long)received, (double)received / run_seconds,
+           (double)received_bytes / run_seconds / (1024.0 * 1024.0));
+    printf("Latency (us):   p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  max %.0f  (%llu samples)\n",
+           percentile_us(latency, used, 50.0),
+           percentile_us(latency, used, 90.0),
+           percentile_us(latency, used, 99.0),
+           percentile_us(latency, used, 99.9),
+           percentile_us(latency, used, 100.0),
+           (unsigned long long)used);
+
+    free(latency);
+    for (uint32_t w = 0; w < arguments.threads; w++) {
+        close(workers[w].epoll_fd);
+        free(workers[w].payload);
+        free(workers[w].latency_ns);
+    }
+    for (uint32_t i = 0; i < arguments.sessions; i++) {
+        free(sessions[i].tx);
+        free(sessions[i].queue);
+        free(sessions[i].rx);
+    }
+    free(sessions);
+    free(workers);
+
+    /* Usable as a regression check */
+    bool ok = (connected == arguments.sessions) &&
+              ((0 == arguments.subscribers) || (0 == publishers) || (0 < received));
+    return ok ? 0 : 1;
+}
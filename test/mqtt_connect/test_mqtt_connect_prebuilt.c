@@ -0,0 +1,325 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "../help/help.h"
+
+#include <string.h>
+#include <sys/socket.h>
+
+static uint8_t  g_sent[1024];
+static uint32_t g_sent_size = 0;
+
+static MQTT_string_t g_none = { NULL, 0 };
+
+int capture_out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    memcpy(&g_sent[g_sent_size], a_data_ptr, a_amount);
+    g_sent_size += a_amount;
+    return (int)a_amount;
+}
+
+static MQTT_string_t view_(void * a_ptr, uint16_t a_length)
+{
+    MQTT_string_t string;
+    string.ptr    = (uint8_t*)a_ptr;
+    string.length = a_length;
+    return string;
+}
+
+/* Reference message encoded by the original connect path */
+static uint32_t reference_connect_(uint8_t * a_clientid,
+                                   uint8_t * a_username,
+                                   uint8_t * a_password,
+                                   uint8_t * a_lwt,
+                                   uint8_t * a_lwm,
+                                   uint16_t  a_keepalive,
+                                   uint8_t * a_output_ptr)
+{
+    uint8_t        buffer[512];
+    MQTT_connect_t connect_params;
+
+    connect_params.client_id                    = a_clientid;
+    connect_params.last_will_topic              = a_lwt;
+    connect_params.last_will_message            = a_lwm;
+    connect_params.username                     = a_username;
+    connect_params.password                     = a_password;
+    connect_params.keepalive                    = a_keepalive;
+    connect_params.connect_flags.clean_session  = true;
+    connect_params.connect_flags.permanent_will = false;
+    connect_params.connect_flags.last_will_qos  = 0;
+
+    g_sent_size = 0;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_connect_(buffer,
+                                                     sizeof(buffer),
+                                                     NULL,
+                                                     &capture_out_fptr_,
+                                                     &connect_params,
+                                                     false));
+    memcpy(a_output_ptr, g_sent, g_sent_size);
+    return g_sent_size;
+}
+
+void test_mqtt_connect_prebuild_matches_connect()
+{
+    uint8_t clientid[]  = "JAMKtest prebuilt";
+    uint8_t ausername[] = "aUsername";
+    uint8_t apassword[] = "aPassword";
+    uint8_t alwt[]      = "/IoT/device/state";
+    uint8_t alwm[]      = "Offline";
+    uint8_t aparam[]    = "\0";
+    uint8_t reference[512];
+    uint8_t storage[512];
+
+    MQTT_connect_frame_t frame;
+
+    /* All details */
+    uint32_t size = reference_connect_(clientid, ausername, apassword, alwt, alwm, 60, reference);
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&frame,
+                                           storage,
+                                           sizeof(storage),
+                                           mqtt_string((char*)clientid),
+                                           mqtt_string((char*)ausername),
+                                           mqtt_string((char*)apassword),
+                                           mqtt_string((char*)alwt),
+                                           mqtt_string((char*)alwm),
+                                           60,
+                                           true));
+    TEST_ASSERT_EQUAL_UINT32(size, frame.frame_size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(reference, frame.frame_ptr, size);
+    TEST_ASSERT_EQUAL_UINT16(60, frame.keepalive);
+
+    /* Client ID only, empty strings and NULLs are the same */
+    size = reference_connect_(clientid, aparam, aparam, aparam, aparam, 0, reference);
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&frame,
+                                           storage,
+                                           sizeof(storage),
+                                           mqtt_string((char*)clientid),
+                                           g_none,
+                                           view_(aparam, 0),
+                                           g_none,
+                                           g_none,
+                                           0,
+                                           true));
+    TEST_ASSERT_EQUAL_UINT32(size, frame.frame_size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(reference, frame.frame_ptr, size);
+
+    /* Last will topic without message is left out */
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&frame,
+                                           storage,
+                                           sizeof(storage),
+                                           mqtt_string((char*)clientid),
+                                           g_none,
+                                           g_none,
+                                           mqtt_string((char*)alwt),
+                                           g_none,
+                                           0,
+                                           true));
+    TEST_ASSERT_EQUAL_UINT32(size, frame.frame_size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(reference, frame.frame_ptr, size);
+}
+
+void test_mqtt_connect_prebuild_length_explicit()
+{
+    /* Client ID is a slice of a longer string, no terminator */
+    uint8_t  ids[] = "sensor-0001sensor-0002";
+    uint8_t  storage[64];
+    MQTT_connect_frame_t frame;
+
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&frame, storage, sizeof(storage),
+                                           view_(&ids[11], 11), g_none, g_none, g_none, g_none, 0, true));
+    /* Fixed header 2 + variable header 10 + length 2 + client ID */
+    TEST_ASSERT_EQUAL_UINT16(2 + 10 + 2 + 11, frame.frame_size);
+    TEST_ASSERT_EQUAL_UINT8(11, frame.frame_ptr[13]);
+    TEST_ASSERT_EQUAL_MEMORY("sensor-0002", &frame.frame_ptr[14], 11);
+}
+
+void test_mqtt_connect_prebuild_invalid()
+{
+    uint8_t clientid[] = "JAMKtest prebuilt";
+    uint8_t storage[64];
+    MQTT_connect_frame_t frame;
+
+    /* Client ID is mandatory */
+    TEST_ASSERT_FALSE(mqtt_connect_prebuild(&frame, storage, sizeof(storage),
+                                            view_(clientid, 0), g_none, g_none, g_none, g_none, 0, true));
+    TEST_ASSERT_FALSE(mqtt_connect_prebuild(&frame, storage, sizeof(storage),
+                                            view_(NULL, 5), g_none, g_none, g_none, g_none, 0, true));
+    TEST_ASSERT_EQUAL_UINT16(0, frame.frame_size);
+
+    /* Exactly fitting storage is enough, one byte less is not */
+    uint16_t needed = 2 + 10 + 2 + 17;
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&frame, storage, needed,
+                                           view_(clientid, 17), g_none, g_none, g_none, g_none, 0, true));
+    TEST_ASSERT_FALSE(mqtt_connect_prebuild(&frame, storage, needed - 1,
+                                            view_(clientid, 17), g_none, g_none, g_none, g_none, 0, true));
+    TEST_ASSERT_FALSE(mqtt_connect_prebuild(NULL, storage, sizeof(storage),
+                                            view_(clientid, 17), g_none, g_none, g_none, g_none, 0, true));
+}
+
+void test_mqtt_string_too_long()
+{
+    static char          password[UINT16_MAX + 2];
+    uint8_t              clientid[] = "JAMKtest prebuilt";
+    uint8_t              storage[64];
+    MQTT_connect_frame_t frame;
+    MQTT_shared_data_t   shared;
+
+    /* 65536 bytes is not cut to an empty password */
+    memset(password, 'p', sizeof(password) - 1);
+    MQTT_string_t view = mqtt_string(password);
+    TEST_ASSERT_FALSE(mqtt_string_valid(view));
+    TEST_ASSERT_TRUE(mqtt_string_valid(g_none));
+    TEST_ASSERT_TRUE(mqtt_string_valid(mqtt_string("")));
+
+    TEST_ASSERT_FALSE(mqtt_connect_prebuild(&frame, storage, sizeof(storage),
+                                            view_(clientid, 17), g_none, view, g_none, g_none, 0, true));
+    TEST_ASSERT_EQUAL_UINT16(0, frame.frame_size);
+    g_sent_size = 0;
+    TEST_ASSERT_FALSE(mqtt_connect((char*)clientid, 0, (uint8_t*)"user", (uint8_t*)password,
+                                   (uint8_t*)"", (uint8_t*)"", &shared, storage, sizeof(storage),
+                                   true, &capture_out_fptr_, NULL, NULL, 1));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+    TEST_ASSERT_FALSE(mqtt_publish_string(view, (uint8_t*)"x", 1));
+    TEST_ASSERT_FALSE(mqtt_subscribe_string(view, 0));
+
+    /* Longest allowed string is kept */
+    password[UINT16_MAX] = '\0';
+    TEST_ASSERT_EQUAL_UINT16(UINT16_MAX, mqtt_string(password).length);
+    TEST_ASSERT_TRUE(mqtt_string_valid(mqtt_string(password)));
+}
+
+void test_mqtt_connect_prebuilt_resend()
+{
+    uint8_t clientid[] = "JAMKtest prebuilt";
+    uint8_t storage[64];
+    uint8_t shared_buffer[128];
+    uint8_t untouched[128];
+    MQTT_shared_data_t   shared;
+    MQTT_connect_frame_t frame;
+
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&frame, storage, sizeof(storage),
+                                           view_(clientid, 17), g_none, g_none, g_none, g_none, 10, true));
+
+    memset(shared_buffer, 0xAA, sizeof(shared_buffer));
+    memset(untouched,     0xAA, sizeof(untouched));
+
+    /* Every attempt sends the same bytes without encoding into shared buffer */
+    for (int attempt = 0; attempt < 3; attempt++) {
+        g_sent_size = 0;
+        TEST_ASSERT_TRUE(mqtt_connect_prebuilt(&frame,
+                                               &shared,
+                                               shared_buffer,
+                                               sizeof(shared_buffer),
+                                               &capture_out_fptr_,
+                                               NULL,
+                                               NULL,
+                                               0));
+        TEST_ASSERT_EQUAL_UINT32(frame.frame_size, g_sent_size);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(frame.frame_ptr, g_sent, g_sent_size);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(untouched, shared_buffer, sizeof(shared_buffer));
+        TEST_ASSERT_EQUAL_INT32(10 * 1000 - 500, shared.keepalive_in_ms);
+
+        MQTT_action_data_t action;
+        action.action_argument.connect_frame_ptr = &frame;
+        TEST_ASSERT_EQUAL_INT(AllreadyConnected, mqtt(ACTION_CONNECT_PREBUILT, &action));
+    }
+}
+
+void test_mqtt_connect_string_slices()
+{
+    /* Credentials are slices of one configuration line, nothing is terminated */
+    char    config[] = "JAMKtest prebuilt;aUsername;aPassword;sensors/1/temperature";
+    uint8_t clientid[]  = "JAMKtest prebuilt";
+    uint8_t ausername[] = "aUsername";
+    uint8_t apassword[] = "aPassword";
+    uint8_t aparam[]    = "\0";
+    uint8_t reference[512];
+    uint8_t shared_buffer[256];
+    MQTT_shared_data_t shared;
+
+    uint32_t size = reference_connect_(clientid, ausername, apassword, aparam, aparam, 0, reference);
+
+    g_sent_size = 0;
+    TEST_ASSERT_TRUE(mqtt_connect_string(view_(&config[0], 17),
+                                         0,
+                                         view_(&config[18], 9),
+                                         view_(&config[28], 9),
+                                         g_none,
+                                         g_none,
+                                         &shared,
+                                         shared_buffer,
+                                         sizeof(shared_buffer),
+                                         true,
+                                         &capture_out_fptr_,
+                                         NULL,
+                                         NULL,
+                                         0));
+    TEST_ASSERT_EQUAL_UINT32(size, g_sent_size);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(reference, g_sent, size);
+
+    /* Topic slice is published as is: header 2 + topic length 2 + topic + message */
+    uint8_t msg[] = "21.5";
+    g_sent_size = 0;
+    TEST_ASSERT_TRUE(mqtt_publish_string(view_(&config[38], 13), msg, 4));
+    TEST_ASSERT_EQUAL_UINT32(2 + 2 + 13 + 4, g_sent_size);
+    TEST_ASSERT_EQUAL_MEMORY("sensors/1/tem", &g_sent[4], 13);
+
+    /* Views of C strings */
+    TEST_ASSERT_EQUAL_UINT16(0, mqtt_string(NULL).length);
+    TEST_ASSERT_EQUAL_UINT16(17, mqtt_string((char*)clientid).length);
+    TEST_ASSERT_FALSE(mqtt_subscribe_string(g_none, 0));
+    TEST_ASSERT_TRUE(mqtt_disconnect());
+}
+
+void test_mqtt_connect_prebuilt_broker()
+{
+    uint8_t clientid[] = "JAMKtest test_mqtt_connect_prebuilt_broker";
+    uint8_t storage[128];
+    uint8_t shared_buffer[128];
+    uint8_t response[16];
+    MQTT_shared_data_t   shared;
+    MQTT_connect_frame_t frame;
+
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&frame, storage, sizeof(storage),
+                                           mqtt_string((char*)clientid),
+                                           g_none, g_none, g_none, g_none, 0, true));
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int socket_desc = open_mqtt_socket_();
+        TEST_ASSERT_TRUE_MESSAGE(socket_desc >= 0, "MQTT Broker not running?");
+
+        TEST_ASSERT_TRUE(mqtt_connect_prebuilt(&frame,
+                                               &shared,
+                                               shared_buffer,
+                                               sizeof(shared_buffer),
+                                               &data_stream_out_fptr_,
+                                               NULL,
+                                               NULL,
+                                               0));
+
+        /* CONNACK, connection accepted */
+        TEST_ASSERT_EQUAL_INT(4, recv(socket_desc, response, 4, MSG_WAITALL));
+        TEST_ASSERT_EQUAL_HEX8(0x20, response[0]);
+        TEST_ASSERT_EQUAL_HEX8(0x00, response[3]);
+
+        TEST_ASSERT_TRUE(mqtt_disconnect());
+        close_mqtt_socket_();
+    }
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("MQTT connect prebuilt");
+    unsigned int tCntr = 1;
+
+    RUN_TEST(test_mqtt_connect_prebuild_matches_connect,    tCntr++);
+    RUN_TEST(test_mqtt_connect_prebuild_length_explicit,    tCntr++);
+    RUN_TEST(test_mqtt_connect_prebuild_invalid,            tCntr++);
+    RUN_TEST(test_mqtt_string_too_long,                     tCntr++);
+    RUN_TEST(test_mqtt_connect_prebuilt_resend,             tCntr++);
+    RUN_TEST(test_mqtt_connect_string_slices,               tCntr++);
+    RUN_TEST(test_mqtt_connect_prebuilt_broker,             tCntr++);
+    return (UnityEnd());
+}
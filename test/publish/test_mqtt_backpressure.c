@@ -0,0 +1,238 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <string.h>
+
+static uint8_t  g_sent[1024*16];
+static uint32_t g_sent_size      = 0;
+static uint32_t g_budget         = 0;     /* Bytes transport accepts before it is "full" */
+static bool     g_dead           = false;
+static uint32_t g_writable_count = 0;
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[256];
+static uint8_t            g_queue[256];
+static uint8_t            g_payload[1000];
+
+int limited_out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    if (true == g_dead)
+        return -1;
+    if (a_amount > g_budget)
+        a_amount = g_budget;
+    memcpy(&g_sent[g_sent_size], a_data_ptr, a_amount);
+    g_sent_size += a_amount;
+    g_budget    -= a_amount;
+    return (int)a_amount;
+}
+
+int payload_pull_fptr_(uint8_t * a_data_ptr, size_t a_amount, size_t a_offset)
+{
+    memcpy(a_data_ptr, &g_payload[a_offset], a_amount);
+    return (int)a_amount;
+}
+
+void writable_fptr_()
+{
+    g_writable_count++;
+}
+
+void connect_()
+{
+    g_shared.buffer      = g_buffer;
+    g_shared.buffer_size = sizeof(g_buffer);
+    g_shared.out_fptr    = &limited_out_fptr_;
+
+    g_budget         = 1024;
+    g_dead           = false;
+
+    session_connect(&g_shared, "JAMKtest backpressure", 0);
+
+    g_sent_size      = 0;
+    g_writable_count = 0;
+}
+
+void test_backpressure_disabled_by_default()
+{
+    char topic[] = "bp/test";
+    char msg[]   = "0123456789";
+
+    connect_();
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_output_pending());
+    TEST_ASSERT_FALSE(mqtt_output_blocked());
+    TEST_ASSERT_EQUAL_INT(InvalidArgument, mqtt_output_flush());
+
+    /* Short write without queue fails the publish */
+    g_budget = 5;
+    TEST_ASSERT_FALSE(mqtt_publish(topic, strlen(topic), msg, strlen(msg)));
+}
+
+void test_backpressure_invalid_watermarks()
+{
+    connect_();
+    TEST_ASSERT_FALSE(mqtt_set_output_queue(g_queue, sizeof(g_queue), 0, 0, NULL));
+    TEST_ASSERT_FALSE(mqtt_set_output_queue(g_queue, sizeof(g_queue), sizeof(g_queue) + 1, 0, NULL));
+    TEST_ASSERT_FALSE(mqtt_set_output_queue(g_queue, sizeof(g_queue), 64, 64, NULL));
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(g_queue, sizeof(g_queue), 64, 16, NULL));
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(NULL, 0, 0, 0, NULL));
+}
+
+void test_backpressure_short_write_is_queued()
+{
+    char topic[] = "bp/test";
+    char msg[]   = "0123456789";
+    uint8_t expected[] = {0x30, 0x13, 0x00, 0x07, 'b', 'p', '/', 't', 'e', 's', 't',
+                          '0', '1', '2', '3', '4', '5', '6', '7', '8', '9'};
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(g_queue, sizeof(g_queue), 128, 32, &writable_fptr_));
+
+    g_budget = 5;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)));
+    TEST_ASSERT_EQUAL_UINT32(5, g_sent_size);
+    TEST_ASSERT_EQUAL_UINT32(sizeof(expected) - 5, mqtt_output_pending());
+
+    /* Nothing moves while transport is full */
+    TEST_ASSERT_EQUAL_INT(WouldBlock, mqtt_output_flush());
+
+    g_budget = 1024;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_output_flush());
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_output_pending());
+    TEST_ASSERT_EQUAL_UINT32(sizeof(expected), g_sent_size);
+    TEST_ASSERT_EQUAL_MEMORY_ARRAY(expected, g_sent, 1, sizeof(expected));
+
+    /* Watermark was never reached */
+    TEST_ASSERT_EQUAL_UINT32(0, g_writable_count);
+}
+
+void test_backpressure_watermarks()
+{
+    char topic[] = "bp/test";
+    char msg[]   = "0123456789";
+    uint32_t accepted = 0;
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(g_queue, sizeof(g_queue), 100, 30, &writable_fptr_));
+
+    /* Transport takes nothing, publish until refused */
+    g_budget = 0;
+    while (Successfull == mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)))
+        accepted++;
+
+    /* 21 bytes per packet, blocked at 100 */
+    TEST_ASSERT_EQUAL_UINT32(5, accepted);
+    TEST_ASSERT_TRUE(mqtt_output_blocked());
+    TEST_ASSERT_EQUAL_UINT32(5 * 21, mqtt_output_pending());
+    TEST_ASSERT_EQUAL_INT(WouldBlock, mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)));
+    TEST_ASSERT_FALSE(mqtt_publish(topic, strlen(topic), msg, strlen(msg)));
+
+    /* Above low watermark - still blocked */
+    g_budget = 50;
+    TEST_ASSERT_EQUAL_INT(WouldBlock, mqtt_output_flush());
+    TEST_ASSERT_TRUE(mqtt_output_blocked());
+    TEST_ASSERT_EQUAL_UINT32(0, g_writable_count);
+
+    /* Down to low watermark */
+    g_budget = 25;
+    TEST_ASSERT_EQUAL_INT(WouldBlock, mqtt_output_flush());
+    TEST_ASSERT_EQUAL_UINT32(30, mqtt_output_pending());
+    TEST_ASSERT_FALSE(mqtt_output_blocked());
+    TEST_ASSERT_EQUAL_UINT32(1, g_writable_count);
+
+    /* New publish goes behind pending bytes */
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)));
+    g_budget = 1024;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_output_flush());
+    TEST_ASSERT_EQUAL_UINT32(6 * 21, g_sent_size);
+    for (uint32_t i = 0; i < 6; i++)
+        TEST_ASSERT_EQUAL_UINT8(0x30, g_sent[i * 21]);
+}
+
+void test_backpressure_queue_wraps()
+{
+    char topic[] = "bp/test";
+    char msg[]   = "0123456789";
+
+    connect_();
+    /* Queue smaller than its memory so that tail wraps around */
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(g_queue, 50, 50, 10, NULL));
+
+    for (uint32_t round = 0; round < 20; round++) {
+        g_budget = 13;
+        TEST_ASSERT_EQUAL_INT(Successfull, mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)));
+        g_budget = 8;
+        mqtt_output_flush();
+    }
+    g_budget = 1024;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_output_flush());
+    TEST_ASSERT_EQUAL_UINT32(20 * 21, g_sent_size);
+    for (uint32_t i = 0; i < 20; i++) {
+        TEST_ASSERT_EQUAL_UINT8(0x30, g_sent[i * 21]);
+        TEST_ASSERT_EQUAL_MEMORY_ARRAY(msg, &g_sent[i * 21 + 11], 1, strlen(msg));
+    }
+}
+
+void test_backpressure_transport_lost()
+{
+    char topic[] = "bp/test";
+    char msg[]   = "0123456789";
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(g_queue, sizeof(g_queue), 128, 32, NULL));
+
+    g_budget = 3;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)));
+    g_dead = true;
+    TEST_ASSERT_EQUAL_INT(ServerUnavailabe, mqtt_output_flush());
+    TEST_ASSERT_NOT_EQUAL(Successfull, mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)));
+    TEST_ASSERT_NOT_EQUAL(WouldBlock, mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)));
+}
+
+void test_backpressure_stream()
+{
+    char topic[] = "bp/test";
+    char msg[]   = "0123456789";
+
+    for (uint32_t i = 0; i < sizeof(g_payload); i++)
+        g_payload[i] = (uint8_t)i;
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(g_queue, sizeof(g_queue), 250, 32, NULL));
+
+    /* Packet which fits into the queue is never cut */
+    g_budget = 20;
+    TEST_ASSERT_TRUE(mqtt_publish_stream(topic, strlen(topic), 200, &payload_pull_fptr_));
+    TEST_ASSERT_EQUAL_UINT32(20, g_sent_size);
+    g_budget = 1024;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_output_flush());
+    TEST_ASSERT_EQUAL_UINT32(3 + 9 + 200, g_sent_size);
+    TEST_ASSERT_EQUAL_UINT8(0x30, g_sent[0]);
+    TEST_ASSERT_EQUAL_MEMORY_ARRAY(g_payload, &g_sent[12], 1, 200);
+
+    /* Larger one stalls midway: the rest of the packet can not follow, session is dropped */
+    g_sent_size = 0;
+    g_budget    = 20;
+    TEST_ASSERT_FALSE(mqtt_publish_stream(topic, strlen(topic), sizeof(g_payload), &payload_pull_fptr_));
+    TEST_ASSERT_EQUAL_INT(STATE_DISCONNECTED, g_shared.state);
+    g_budget = 1024;
+    TEST_ASSERT_FALSE(mqtt_publish(topic, strlen(topic), msg, strlen(msg)));
+    TEST_ASSERT_NOT_EQUAL(Successfull, mqtt_publish_try(topic, strlen(topic), msg, strlen(msg)));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Backpressure");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_backpressure_disabled_by_default,   tCntr++);
+    RUN_TEST(test_backpressure_invalid_watermarks,    tCntr++);
+    RUN_TEST(test_backpressure_short_write_is_queued, tCntr++);
+    RUN_TEST(test_backpressure_watermarks,            tCntr++);
+    RUN_TEST(test_backpressure_queue_wraps,           tCntr++);
+    RUN_TEST(test_backpressure_transport_lost,        tCntr++);
+    RUN_TEST(test_backpressure_stream,                tCntr++);
+    return (UnityEnd());
+}
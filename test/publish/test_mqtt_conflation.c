@@ -0,0 +1,248 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TOPICS  5
+#define SAMPLES 64
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[256];
+static uint8_t            g_chunk[16];
+static MQTT_scheduled_t * g_index[8];
+
+static uint8_t            g_sent[1024*16];
+static uint32_t           g_sent_size = 0;
+
+static uint32_t           g_conflated = 0;
+static uint32_t           g_expired   = 0;
+static uint32_t           g_delivered = 0;
+
+static MQTT_scheduled_t   g_samples[TOPICS][SAMPLES];
+static char               g_values[TOPICS][SAMPLES][4];
+static char               g_topics[TOPICS][20] = {"/lampotila/alakerta", "/lampotila/ylakerta",
+                                                  "/kosteus/alakerta",   "/kosteus/ylakerta",
+                                                  "/paine"};
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    memcpy(&g_sent[g_sent_size], a_data_ptr, a_amount);
+    g_sent_size += a_amount;
+    return (int)a_amount;
+}
+
+void scheduled_cb_(MQTT_scheduled_t * a_message_ptr, MQTTErrorCodes_t a_status)
+{
+    a_message_ptr = a_message_ptr;
+    if (Conflated == a_status)
+        g_conflated++;
+    else if (Expired == a_status)
+        g_expired++;
+    else if (Successfull == a_status)
+        g_delivered++;
+}
+
+void connect_()
+{
+    g_shared.buffer      = g_buffer;
+    g_shared.buffer_size = sizeof(g_buffer);
+    g_shared.out_fptr    = &out_fptr_;
+
+    session_connect(&g_shared, "JAMKtest conflation", 0);
+    TEST_ASSERT_TRUE(mqtt_set_scheduler(g_chunk, sizeof(g_chunk), &scheduled_cb_));
+    TEST_ASSERT_TRUE(mqtt_set_conflation(g_index, sizeof(g_index) / sizeof(g_index[0])));
+
+    g_sent_size = 0;
+    g_conflated = 0;
+    g_expired   = 0;
+    g_delivered = 0;
+}
+
+/* Sample a_sample of topic a_topic, payload is its number */
+static MQTT_scheduled_t * sample_(uint32_t a_topic, uint32_t a_sample, bool a_conflate)
+{
+    MQTT_scheduled_t * message_ptr = &g_samples[a_topic][a_sample];
+    memset(message_ptr, 0, sizeof(MQTT_scheduled_t));
+    message_ptr->topic_ptr    = g_topics[a_topic];
+    message_ptr->topic_size   = (uint16_t)strlen(g_topics[a_topic]);
+    message_ptr->payload_ptr  = g_values[a_topic][a_sample];
+    message_ptr->payload_size = 3;
+    message_ptr->conflate     = a_conflate;
+    g_values[a_topic][a_sample][0] = (char)('0' + a_sample / 10);
+    g_values[a_topic][a_sample][1] = (char)('0' + a_sample % 10);
+    g_values[a_topic][a_sample][2] = (char)('a' + a_topic);
+    return message_ptr;
+}
+
+/* Sent PUBLISH packets as "<topic letter><sample>" strings, e.g. "a63" */
+static uint32_t sent_(char a_sent[][4])
+{
+    uint32_t packets = 0;
+    for (uint32_t offset = 0; offset < g_sent_size; offset += 2 + g_sent[offset + 1]) {
+        uint8_t * p          = &g_sent[offset];
+        uint16_t  topic_size = (uint16_t)((p[2] << 8) | p[3]);
+        char    * payload    = (char*)&p[4 + topic_size];
+        a_sent[packets][0] = payload[2];
+        a_sent[packets][1] = payload[0];
+        a_sent[packets][2] = payload[1];
+        a_sent[packets][3] = '\0';
+        packets++;
+    }
+    return packets;
+}
+
+void test_conflation_last_value_wins()
+{
+    char sent[TOPICS * SAMPLES][4];
+
+    /* Congested - samples at full rate, nothing sent */
+    connect_();
+    for (uint32_t sample = 0; sample < SAMPLES; sample++)
+        for (uint32_t topic = 0; topic < TOPICS; topic++)
+            TEST_ASSERT_TRUE(mqtt_schedule(sample_(topic, sample, true), LANE_TELEMETRY, 0));
+
+    /* Backlog is one message per topic, in order of the first sample */
+    TEST_ASSERT_EQUAL_UINT32(TOPICS, mqtt_schedule_pending(LANE_TELEMETRY));
+    TEST_ASSERT_EQUAL_UINT32(TOPICS * (SAMPLES - 1), g_conflated);
+
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+    TEST_ASSERT_EQUAL_UINT32(TOPICS, sent_(sent));
+    TEST_ASSERT_EQUAL_STRING("a63", sent[0]);
+    TEST_ASSERT_EQUAL_STRING("b63", sent[1]);
+    TEST_ASSERT_EQUAL_STRING("c63", sent[2]);
+    TEST_ASSERT_EQUAL_STRING("d63", sent[3]);
+    TEST_ASSERT_EQUAL_STRING("e63", sent[4]);
+    TEST_ASSERT_EQUAL_UINT32(TOPICS, g_delivered);
+}
+
+void test_conflation_opt_in()
+{
+    char sent[SAMPLES][4];
+
+    /* Without conflate flag every sample is queued */
+    connect_();
+    for (uint32_t sample = 0; sample < 10; sample++)
+        TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, sample, false), LANE_TELEMETRY, 0));
+    TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, 10, true), LANE_TELEMETRY, 0));
+    TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, 11, true), LANE_TELEMETRY, 0));
+    TEST_ASSERT_EQUAL_UINT32(11, mqtt_schedule_pending(LANE_COUNT));
+    TEST_ASSERT_EQUAL_UINT32(1, g_conflated);
+
+    /* Index disabled - queued as usual */
+    TEST_ASSERT_TRUE(mqtt_set_conflation(NULL, 0));
+    TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, 12, true), LANE_TELEMETRY, 0));
+    TEST_ASSERT_EQUAL_UINT32(12, mqtt_schedule_pending(LANE_COUNT));
+
+    /* Enabled again - queued unsent messages are found */
+    TEST_ASSERT_FALSE(mqtt_set_conflation(g_index, 0));
+    TEST_ASSERT_TRUE(mqtt_set_conflation(g_index, sizeof(g_index) / sizeof(g_index[0])));
+    TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, 13, true), LANE_TELEMETRY, 0));
+    TEST_ASSERT_EQUAL_UINT32(12, mqtt_schedule_pending(LANE_COUNT));
+
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+    TEST_ASSERT_EQUAL_UINT32(12, sent_(sent));
+    TEST_ASSERT_EQUAL_STRING("a11", sent[10]);
+    TEST_ASSERT_EQUAL_STRING("a13", sent[11]);
+}
+
+void test_conflation_started_is_kept()
+{
+    char             payload[20] = "0123456789abcdefghi";
+    MQTT_scheduled_t first;
+    MQTT_scheduled_t second;
+
+    /* Payload of three chunks - after the first one the next sample queues behind it */
+    connect_();
+    memset(&first, 0, sizeof(first));
+    first.topic_ptr    = g_topics[0];
+    first.topic_size   = (uint16_t)strlen(g_topics[0]);
+    first.payload_ptr  = payload;
+    first.payload_size = sizeof(payload);
+    first.conflate     = true;
+    second = first;
+
+    TEST_ASSERT_TRUE(mqtt_schedule(&first, LANE_BULK, 0));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 1));
+    TEST_ASSERT_TRUE(mqtt_schedule(&second, LANE_BULK, 0));
+    TEST_ASSERT_EQUAL_UINT32(0, g_conflated);
+    TEST_ASSERT_EQUAL_UINT32(2, mqtt_schedule_pending(LANE_BULK));
+
+    /* Waiting one is replaced as usual */
+    TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, 0, true), LANE_BULK, 0));
+    TEST_ASSERT_EQUAL_UINT32(1, g_conflated);
+    TEST_ASSERT_EQUAL_UINT32(2, mqtt_schedule_pending(LANE_BULK));
+
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+    TEST_ASSERT_EQUAL_UINT32(2, g_delivered);
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_schedule_pending(LANE_COUNT));
+}
+
+void test_conflation_expired_leaves_index()
+{
+    /* Dropped stale, next sample is queued as new */
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, 0, true), LANE_TELEMETRY, 10));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(20, 100));
+    TEST_ASSERT_EQUAL_UINT32(1, g_expired);
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_schedule_pending(LANE_COUNT));
+
+    TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, 1, true), LANE_TELEMETRY, 0));
+    TEST_ASSERT_TRUE(mqtt_schedule(sample_(0, 2, true), LANE_TELEMETRY, 0));
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_schedule_pending(LANE_COUNT));
+    TEST_ASSERT_EQUAL_UINT32(1, g_conflated);
+}
+
+void test_conflation_random_order()
+{
+    /* Index of 8 slots, 5 topics - probing and removal under random traffic */
+    uint32_t latest[TOPICS];
+    uint32_t next[TOPICS] = {0};
+    char     sent[TOPICS * SAMPLES][4];
+
+    connect_();
+    srand(1);
+    for (uint32_t round = 0; round < 2000; round++) {
+        uint32_t topic = (uint32_t)rand() % TOPICS;
+        if (0 == (rand() % 3)) {
+            g_sent_size = 0;
+            TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, (uint32_t)rand() % 3));
+        }
+        /* Sample memory is reused only after the message has left */
+        if (0 == mqtt_schedule_pending(LANE_COUNT))
+            memset(next, 0, sizeof(next));
+        if (SAMPLES <= next[topic])
+            continue;
+        latest[topic] = next[topic];
+        TEST_ASSERT_TRUE(mqtt_schedule(sample_(topic, next[topic]++, true), LANE_TELEMETRY, 0));
+        TEST_ASSERT_TRUE(TOPICS >= mqtt_schedule_pending(LANE_COUNT));
+    }
+
+    /* Rest of the backlog is the latest sample of each waiting topic */
+    g_sent_size = 0;
+    uint32_t waiting = mqtt_schedule_pending(LANE_COUNT);
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+    TEST_ASSERT_EQUAL_UINT32(waiting, sent_(sent));
+    for (uint32_t i = 0; i < waiting; i++) {
+        uint32_t topic  = (uint32_t)(sent[i][0] - 'a');
+        uint32_t sample = (uint32_t)((sent[i][1] - '0') * 10 + (sent[i][2] - '0'));
+        TEST_ASSERT_EQUAL_UINT32(latest[topic], sample);
+    }
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Conflation");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_conflation_last_value_wins,       tCntr++);
+    RUN_TEST(test_conflation_opt_in,                tCntr++);
+    RUN_TEST(test_conflation_started_is_kept,       tCntr++);
+    RUN_TEST(test_conflation_expired_leaves_index,  tCntr++);
+    RUN_TEST(test_conflation_random_order,          tCntr++);
+    return (UnityEnd());
+}
@@ -0,0 +1,249 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+static uint8_t  g_sent[256];
+static uint32_t g_sent_size = 0;
+static bool     g_dead      = false;
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[256];
+static uint32_t           g_pool[MQTT_PACKET_ID_POOL_WORDS(MQTT_PACKET_ID_MAX)];
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    if (true == g_dead)
+        return -1;
+    memcpy(g_sent, a_data_ptr, a_amount);
+    g_sent_size = (uint32_t)a_amount;
+    return (int)a_amount;
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_status    = a_status;
+    a_data_ptr  = a_data_ptr;
+    a_data_len  = a_data_len;
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+}
+
+void connect_()
+{
+    g_shared.buffer            = g_buffer;
+    g_shared.buffer_size       = sizeof(g_buffer);
+    g_shared.out_fptr          = &out_fptr_;
+    g_shared.subscribe_cb_fptr = &subscribe_cb_;
+    g_shared.connected_cb_fptr = NULL;
+
+    g_dead = false;
+
+    session_connect(&g_shared, "JAMKtest packet id", 0);
+}
+
+/* Publish "id/test" and return packet identifier from the sent packet, 0 when not sent */
+MQTTErrorCodes_t publish_(MQTTQoSLevel_t a_qos, uint16_t * a_id_ptr)
+{
+    uint8_t        topic[] = "id/test";
+    uint8_t        msg[]   = "x";
+    MQTT_publish_t publish;
+
+    memset(&publish, 0, sizeof(publish));
+    publish.flags.qos           = a_qos;
+    publish.topic_ptr           = topic;
+    publish.topic_length        = 7;
+    publish.message_buffer_ptr  = msg;
+    publish.message_buffer_size = 1;
+
+    MQTT_action_data_t action;
+    action.action_argument.publish_ptr = &publish;
+
+    g_sent_size = 0;
+    MQTTErrorCodes_t status = mqtt(ACTION_PUBLISH, &action);
+
+    *a_id_ptr = 0;
+    if ((Successfull == status) && (QoS0 < a_qos))
+        *a_id_ptr = (uint16_t)((g_sent[2 + 2 + 7] << 8) | g_sent[2 + 2 + 7 + 1]);
+    return status;
+}
+
+uint16_t publish_qos1_()
+{
+    uint16_t id = 0;
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_(QoS1, &id));
+    return id;
+}
+
+bool ack_(MQTTMessageType_t a_type, uint16_t a_id)
+{
+    /* SUBACK carries one return code */
+    uint8_t ack[] = {(uint8_t)(a_type << 4), (SUBACK == a_type) ? 0x03 : 0x02, (uint8_t)(a_id >> 8), (uint8_t)a_id, 0x00};
+    return mqtt_receive(ack, (SUBACK == a_type) ? 5 : 4);
+}
+
+void test_packet_id_counter_skips_zero()
+{
+    connect_();
+    TEST_ASSERT_EQUAL_UINT16(1, publish_qos1_());
+    TEST_ASSERT_EQUAL_UINT16(2, publish_qos1_());
+
+    g_shared.mqtt_packet_cntr = MQTT_PACKET_ID_MAX - 1;
+    TEST_ASSERT_EQUAL_UINT16(MQTT_PACKET_ID_MAX, publish_qos1_());
+    TEST_ASSERT_EQUAL_UINT16(1, publish_qos1_());
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_packet_ids_in_use());
+}
+
+void test_packet_id_pool_invalid()
+{
+    connect_();
+    TEST_ASSERT_FALSE(mqtt_set_packet_id_pool(g_pool, 0));
+    TEST_ASSERT_TRUE(mqtt_set_packet_id_pool(NULL, 0));
+    TEST_ASSERT_FALSE(mqtt_packet_id_release(1));
+}
+
+void test_packet_id_pool_exhausted()
+{
+    uint16_t id = 0;
+
+    connect_();
+    /* Two words - identifiers 1..63 */
+    TEST_ASSERT_TRUE(mqtt_set_packet_id_pool(g_pool, MQTT_PACKET_ID_POOL_WORDS(63)));
+
+    for (uint16_t i = 1; i <= 63; i++)
+        TEST_ASSERT_EQUAL_UINT16(i, publish_qos1_());
+    TEST_ASSERT_EQUAL_UINT32(63, mqtt_packet_ids_in_use());
+
+    TEST_ASSERT_EQUAL_INT(WouldBlock, publish_(QoS1, &id));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+
+    /* QoS 0 needs no identifier */
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_(QoS0, &id));
+
+    /* Acked identifier is the only free one */
+    TEST_ASSERT_TRUE(ack_(PUBACK, 5));
+    TEST_ASSERT_EQUAL_UINT32(62, mqtt_packet_ids_in_use());
+    TEST_ASSERT_EQUAL_UINT16(5, publish_qos1_());
+
+    /* Unknown and duplicate acks are ignored */
+    TEST_ASSERT_TRUE(mqtt_packet_id_release(40));
+    TEST_ASSERT_FALSE(mqtt_packet_id_release(40));
+    TEST_ASSERT_FALSE(mqtt_packet_id_release(0));
+    TEST_ASSERT_FALSE(mqtt_packet_id_release(64));
+    TEST_ASSERT_EQUAL_UINT32(62, mqtt_packet_ids_in_use());
+}
+
+void test_packet_id_not_reused_in_flight()
+{
+    static bool in_flight[MQTT_PACKET_ID_MAX + 1];
+    uint16_t    outstanding[1000];
+    uint32_t    count = 0;
+
+    connect_();
+    memset(in_flight, 0, sizeof(in_flight));
+    TEST_ASSERT_TRUE(mqtt_set_packet_id_pool(g_pool, sizeof(g_pool) / sizeof(g_pool[0])));
+
+    /* Up to 1000 messages in flight, acks in random order, several rounds over the id space */
+    srand(1);
+    for (uint32_t i = 0; i < 200000; i++) {
+        if ((count < 1000) && ((0 == count) || (rand() & 1))) {
+            uint16_t id = publish_qos1_();
+            TEST_ASSERT_NOT_EQUAL(0, id);
+            TEST_ASSERT_FALSE(in_flight[id]);
+            in_flight[id] = true;
+            outstanding[count++] = id;
+        } else {
+            uint32_t index = (uint32_t)rand() % count;
+            uint16_t id    = outstanding[index];
+            outstanding[index] = outstanding[--count];
+            in_flight[id] = false;
+            TEST_ASSERT_TRUE(ack_(PUBCOMP, id));
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT32(count, mqtt_packet_ids_in_use());
+}
+
+void test_packet_id_wire_acks()
+{
+    uint16_t qos1_id = 0;
+    uint16_t qos2_id = 0;
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_packet_id_pool(g_pool, MQTT_PACKET_ID_POOL_WORDS(63)));
+
+    /* QoS in bits 1-2 of the fixed header */
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_(QoS1, &qos1_id));
+    TEST_ASSERT_EQUAL_HEX8(0x32, g_sent[0]);
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_(QoS2, &qos2_id));
+    TEST_ASSERT_EQUAL_HEX8(0x34, g_sent[0]);
+    TEST_ASSERT_EQUAL_UINT32(2, mqtt_packet_ids_in_use());
+
+    /* Ack with extra bytes or flags set releases nothing */
+    uint8_t long_ack[]  = {0x40, 0x03, 0x00, (uint8_t)qos1_id, 0x00};
+    uint8_t flag_ack[]  = {0x41, 0x02, 0x00, (uint8_t)qos1_id};
+    TEST_ASSERT_FALSE(mqtt_receive(long_ack, sizeof(long_ack)));
+    TEST_ASSERT_FALSE(mqtt_receive(flag_ack, sizeof(flag_ack)));
+    TEST_ASSERT_EQUAL_UINT32(2, mqtt_packet_ids_in_use());
+    TEST_ASSERT_TRUE(ack_(PUBACK, qos1_id));
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_packet_ids_in_use());
+
+    /* PUBREC is answered with PUBREL, identifier is free after PUBCOMP */
+    g_sent_size = 0;
+    TEST_ASSERT_TRUE(ack_(PUBREC, qos2_id));
+    TEST_ASSERT_EQUAL_UINT32(4, g_sent_size);
+    TEST_ASSERT_EQUAL_HEX8(0x62, g_sent[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x02, g_sent[1]);
+    TEST_ASSERT_EQUAL_UINT16(qos2_id, (uint16_t)((g_sent[2] << 8) | g_sent[3]));
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_packet_ids_in_use());
+    TEST_ASSERT_TRUE(ack_(PUBCOMP, qos2_id));
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_packet_ids_in_use());
+}
+
+void test_packet_id_subscribe_and_failed_send()
+{
+    uint16_t id = 0;
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_packet_id_pool(g_pool, MQTT_PACKET_ID_POOL_WORDS(63)));
+
+    uint8_t            topic[] = "id/test";
+    MQTT_subscribe_t   subscribe;
+    MQTT_action_data_t action;
+    subscribe.qos          = QoS0;
+    subscribe.topic_ptr    = topic;
+    subscribe.topic_length = 7;
+    action.action_argument.subscribe_ptr = &subscribe;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt(ACTION_SUBSCRIBE, &action));
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_packet_ids_in_use());
+    id = (uint16_t)((g_sent[2] << 8) | g_sent[3]);
+    TEST_ASSERT_EQUAL_UINT16(1, id);
+    TEST_ASSERT_TRUE(ack_(SUBACK, id));
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_packet_ids_in_use());
+
+    /* Identifier of a packet which was not sent is given back */
+    g_dead = true;
+    TEST_ASSERT_NOT_EQUAL(Successfull, publish_(QoS1, &id));
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_packet_ids_in_use());
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Packet identifiers");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_packet_id_counter_skips_zero,        tCntr++);
+    RUN_TEST(test_packet_id_pool_invalid,              tCntr++);
+    RUN_TEST(test_packet_id_pool_exhausted,            tCntr++);
+    RUN_TEST(test_packet_id_not_reused_in_flight,      tCntr++);
+    RUN_TEST(test_packet_id_wire_acks,                 tCntr++);
+    RUN_TEST(test_packet_id_subscribe_and_failed_send, tCntr++);
+    return UnityEnd();
+}
@@ -0,0 +1,133 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <string.h>
+
+static uint8_t  g_sent[1024*16];
+static uint32_t g_sent_size   = 0;
+static uint32_t g_write_count = 0;
+
+static uint8_t  g_payload[5000];
+static int32_t  g_fail_at     = -1;
+
+static MQTT_shared_data_t g_shared;
+
+int capture_out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    if ((g_sent_size + a_amount) > sizeof(g_sent))
+        return -1;
+    memcpy(&g_sent[g_sent_size], a_data_ptr, a_amount);
+    g_sent_size += a_amount;
+    g_write_count++;
+    return (int)a_amount;
+}
+
+int payload_pull_fptr_(uint8_t * a_data_ptr, size_t a_amount, size_t a_offset)
+{
+    if ((0 <= g_fail_at) && (a_offset >= (size_t)g_fail_at))
+        return 0;
+    /* Return less than requested to exercise partial pulls */
+    if (a_amount > 77)
+        a_amount = 77;
+    memcpy(a_data_ptr, &g_payload[a_offset], a_amount);
+    return (int)a_amount;
+}
+
+void connect_with_buffer_(uint8_t * a_buffer, size_t a_size)
+{
+    /* Connect from a buffer of its own, publishes use the given one */
+    static uint8_t connect_buffer[256];
+    g_shared.buffer      = connect_buffer;
+    g_shared.buffer_size = sizeof(connect_buffer);
+    g_shared.out_fptr    = &capture_out_fptr_;
+    session_connect(&g_shared, "JAMKtest publish stream", 0);
+
+    g_shared.buffer      = a_buffer;
+    g_shared.buffer_size = a_size;
+    g_sent_size          = 0;
+    g_write_count        = 0;
+    g_fail_at            = -1;
+
+    for (uint32_t i = 0; i < sizeof(g_payload); i++)
+        g_payload[i] = (uint8_t)(i * 7);
+}
+
+void test_publish_stream_equals_publish_buf()
+{
+    static uint8_t big_buffer[8*1024];
+    static uint8_t expected[8*1024];
+    char topic[] = "stream/test";
+
+    connect_with_buffer_(big_buffer, sizeof(big_buffer));
+    TEST_ASSERT_TRUE(mqtt_publish(topic, strlen(topic), (char*)g_payload, sizeof(g_payload)));
+    uint32_t expected_size = g_sent_size;
+    memcpy(expected, g_sent, expected_size);
+
+    /* Tiny window compared to the payload */
+    uint8_t small_buffer[64];
+    connect_with_buffer_(small_buffer, sizeof(small_buffer));
+    TEST_ASSERT_TRUE(mqtt_publish_stream(topic, strlen(topic), sizeof(g_payload), &payload_pull_fptr_));
+
+    TEST_ASSERT_EQUAL_UINT32(expected_size, g_sent_size);
+    TEST_ASSERT_EQUAL_MEMORY_ARRAY(expected, g_sent, 1, expected_size);
+    TEST_ASSERT_TRUE(1 < g_write_count);
+}
+
+void test_publish_stream_empty_payload()
+{
+    uint8_t buffer[64];
+    char topic[] = "a/b";
+    uint8_t expected[] = {0x30, 0x05, 0x00, 0x03, 'a', '/', 'b'};
+
+    connect_with_buffer_(buffer, sizeof(buffer));
+    TEST_ASSERT_TRUE(mqtt_publish_stream(topic, strlen(topic), 0, &payload_pull_fptr_));
+    TEST_ASSERT_EQUAL_UINT32(sizeof(expected), g_sent_size);
+    TEST_ASSERT_EQUAL_MEMORY_ARRAY(expected, g_sent, 1, sizeof(expected));
+}
+
+void test_publish_stream_source_fails()
+{
+    uint8_t buffer[64];
+    char topic[] = "stream/test";
+
+    connect_with_buffer_(buffer, sizeof(buffer));
+    g_fail_at = 1000;
+    TEST_ASSERT_FALSE(mqtt_publish_stream(topic, strlen(topic), sizeof(g_payload), &payload_pull_fptr_));
+}
+
+void test_publish_stream_buffer_too_small()
+{
+    uint8_t buffer[16];
+    char topic[] = "stream/test/topic/longer/than/buffer";
+
+    connect_with_buffer_(buffer, sizeof(buffer));
+    TEST_ASSERT_FALSE(mqtt_publish_stream(topic, strlen(topic), sizeof(g_payload), &payload_pull_fptr_));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+}
+
+void test_publish_stream_invalid_arguments()
+{
+    uint8_t buffer[64];
+    char topic[] = "stream/test";
+
+    connect_with_buffer_(buffer, sizeof(buffer));
+    TEST_ASSERT_FALSE(mqtt_publish_stream(NULL, 0, 10, &payload_pull_fptr_));
+    TEST_ASSERT_FALSE(mqtt_publish_stream(topic, strlen(topic), 10, NULL));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Publish stream");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_publish_stream_equals_publish_buf, tCntr++);
+    RUN_TEST(test_publish_stream_empty_payload,      tCntr++);
+    RUN_TEST(test_publish_stream_source_fails,       tCntr++);
+    RUN_TEST(test_publish_stream_buffer_too_small,   tCntr++);
+    RUN_TEST(test_publish_stream_invalid_arguments,  tCntr++);
+    return (UnityEnd());
+}
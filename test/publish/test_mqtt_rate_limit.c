@@ -0,0 +1,232 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <string.h>
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[256];
+static uint8_t            g_chunk[64];
+static MQTT_scheduled_t * g_index[8];
+static MQTT_rate_limit_t  g_limits[2];
+
+static uint32_t           g_sent_size = 0;
+static uint32_t           g_writes    = 0;
+static uint32_t           g_conflated = 0;
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    a_data_ptr = a_data_ptr;
+    g_sent_size += a_amount;
+    g_writes++;
+    return (int)a_amount;
+}
+
+void scheduled_cb_(MQTT_scheduled_t * a_message_ptr, MQTTErrorCodes_t a_status)
+{
+    a_message_ptr = a_message_ptr;
+    if (Conflated == a_status)
+        g_conflated++;
+}
+
+/* Connected with keepalive off, so mqtt_keepalive only moves time */
+void connect_()
+{
+    g_shared.buffer      = g_buffer;
+    g_shared.buffer_size = sizeof(g_buffer);
+    g_shared.out_fptr    = &out_fptr_;
+
+    session_connect(&g_shared, "JAMKtest rate limit", 0);
+
+    memset(g_limits, 0, sizeof(g_limits));
+    g_sent_size = 0;
+    g_writes    = 0;
+    g_conflated = 0;
+}
+
+int pull_(uint8_t * a_data_ptr, size_t a_amount, size_t a_offset)
+{
+    a_offset = a_offset;
+    memset(a_data_ptr, 'x', a_amount);
+    return (int)a_amount;
+}
+
+static MQTTErrorCodes_t publish_(char * a_topic_ptr, size_t a_size)
+{
+    static char payload[200];
+    return mqtt_publish_try(a_topic_ptr, strlen(a_topic_ptr), payload, a_size);
+}
+
+void test_rate_limit_session_messages()
+{
+    /* 10 publishes per second, burst of 3 */
+    connect_();
+    g_limits[0].messages_per_s = 10;
+    g_limits[0].message_burst  = 3;
+    TEST_ASSERT_TRUE(mqtt_set_rate_limits(g_limits, 1));
+
+    for (uint32_t i = 0; i < 3; i++)
+        TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 1));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/a", 1));
+    TEST_ASSERT_FALSE(mqtt_publish("rl/b", 4, "x", 1));
+    TEST_ASSERT_EQUAL_UINT32(3, g_writes);
+
+    /* One token per 100 ms */
+    mqtt_keepalive(99);
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/a", 1));
+    mqtt_keepalive(1);
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 1));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/a", 1));
+
+    /* Bucket is not filled over the burst */
+    mqtt_keepalive(10000);
+    for (uint32_t i = 0; i < 3; i++)
+        TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 1));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/a", 1));
+
+    /* Sustained rate over 10 s of 10 ms steps */
+    uint32_t sent = 0;
+    for (uint32_t step = 0; step < 1000; step++) {
+        mqtt_keepalive(10);
+        while (Successfull == publish_("rl/a", 1))
+            sent++;
+    }
+    TEST_ASSERT_EQUAL_UINT32(100, sent);
+}
+
+void test_rate_limit_bytes()
+{
+    /* 1000 bytes per second, burst of 500 - topic counts too */
+    connect_();
+    g_limits[0].bytes_per_s = 1000;
+    g_limits[0].byte_burst  = 500;
+    TEST_ASSERT_TRUE(mqtt_set_rate_limits(g_limits, 1));
+
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 196));
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 196));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/a", 97));
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 96));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/a", 0));
+
+    mqtt_keepalive(200);
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 196));
+
+    /* Publish larger than the burst goes out with a full bucket */
+    mqtt_keepalive(499);
+    TEST_ASSERT_FALSE(mqtt_publish_stream("rl/a", 4, 600, &pull_));
+    mqtt_keepalive(1);
+    TEST_ASSERT_TRUE(mqtt_publish_stream("rl/a", 4, 600, &pull_));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/a", 0));
+}
+
+void test_rate_limit_topic_prefix()
+{
+    /* Session 100/s, "rl/bulk/" 1/s */
+    connect_();
+    g_limits[0].messages_per_s = 100;
+    g_limits[0].message_burst  = 100;
+    g_limits[1].prefix_ptr     = "rl/bulk/";
+    g_limits[1].prefix_size    = 8;
+    g_limits[1].messages_per_s = 1;
+    g_limits[1].message_burst  = 1;
+    TEST_ASSERT_TRUE(mqtt_set_rate_limits(g_limits, 2));
+
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/bulk/1", 1));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/bulk/2", 1));
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/bul", 1));
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/alarm", 1));
+
+    /* Refused publish takes no tokens from the session */
+    for (uint32_t i = 0; i < 200; i++)
+        publish_("rl/bulk/3", 1);
+    uint32_t sent = 0;
+    while (Successfull == publish_("rl/alarm", 1))
+        sent++;
+    TEST_ASSERT_EQUAL_UINT32(97, sent);
+
+    /* Topic limit refills on its own rate */
+    mqtt_keepalive(1000);
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/bulk/1", 1));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/bulk/1", 1));
+}
+
+void test_rate_limit_scheduler_queues_and_conflates()
+{
+    MQTT_scheduled_t other;
+    MQTT_scheduled_t gauges[10];
+    char             topic[] = "rl/gauge";
+    char             bulk_topic[] = "rl/bulk/x";
+
+    connect_();
+    g_limits[0].prefix_ptr     = "rl/gauge";
+    g_limits[0].prefix_size    = 8;
+    g_limits[0].messages_per_s = 1;
+    g_limits[0].message_burst  = 1;
+    TEST_ASSERT_TRUE(mqtt_set_rate_limits(g_limits, 1));
+    TEST_ASSERT_TRUE(mqtt_set_scheduler(g_chunk, sizeof(g_chunk), &scheduled_cb_));
+    TEST_ASSERT_TRUE(mqtt_set_conflation(g_index, sizeof(g_index) / sizeof(g_index[0])));
+
+    /* Gauge samples over the rate wait and conflate in their lane */
+    for (uint32_t i = 0; i < 10; i++) {
+        memset(&gauges[i], 0, sizeof(MQTT_scheduled_t));
+        gauges[i].topic_ptr    = topic;
+        gauges[i].topic_size   = (uint16_t)strlen(topic);
+        gauges[i].payload_ptr  = "21.5";
+        gauges[i].payload_size = 4;
+        gauges[i].conflate     = true;
+        TEST_ASSERT_TRUE(mqtt_schedule(&gauges[i], LANE_TELEMETRY, 0));
+        TEST_ASSERT_EQUAL_INT((0 == i) ? Successfull : RateLimited, mqtt_schedule_run(100, 10));
+    }
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(8, g_conflated);
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_schedule_pending(LANE_TELEMETRY));
+
+    /* Limited lane does not hold back other lanes */
+    memset(&other, 0, sizeof(MQTT_scheduled_t));
+    other.topic_ptr    = bulk_topic;
+    other.topic_size   = (uint16_t)strlen(bulk_topic);
+    other.payload_ptr  = "1";
+    other.payload_size = 1;
+    TEST_ASSERT_TRUE(mqtt_schedule(&other, LANE_BULK, 0));
+    TEST_ASSERT_EQUAL_INT(RateLimited, mqtt_schedule_run(0, 10));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+
+    mqtt_keepalive(1000);
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 10));
+    TEST_ASSERT_EQUAL_UINT32(3, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_schedule_pending(LANE_COUNT));
+}
+
+void test_rate_limit_invalid()
+{
+    connect_();
+    TEST_ASSERT_FALSE(mqtt_set_rate_limits(g_limits, 0));
+    g_limits[0].messages_per_s = 1;
+    TEST_ASSERT_FALSE(mqtt_set_rate_limits(g_limits, 1));
+    g_limits[0].message_burst = 1;
+    g_limits[0].prefix_size   = 2;
+    TEST_ASSERT_FALSE(mqtt_set_rate_limits(g_limits, 1));
+    g_limits[0].prefix_size   = 0;
+    TEST_ASSERT_TRUE(mqtt_set_rate_limits(g_limits, 1));
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 1));
+    TEST_ASSERT_EQUAL_INT(RateLimited, publish_("rl/a", 1));
+
+    /* Removed limits */
+    TEST_ASSERT_TRUE(mqtt_set_rate_limits(NULL, 0));
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("rl/a", 1));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Rate limit");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_rate_limit_session_messages,                tCntr++);
+    RUN_TEST(test_rate_limit_bytes,                           tCntr++);
+    RUN_TEST(test_rate_limit_topic_prefix,                    tCntr++);
+    RUN_TEST(test_rate_limit_scheduler_queues_and_conflates,  tCntr++);
+    RUN_TEST(test_rate_limit_invalid,                         tCntr++);
+    return (UnityEnd());
+}
@@ -0,0 +1,298 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define RECORDS 100
+
+static MQTT_shared_data_t  g_shared;
+static uint8_t             g_buffer[512];
+static uint8_t             g_records[256];
+static MQTT_record_batch_t g_batch;
+static MQTT_message_view_t g_views[4];
+
+/* Written packets, one after another */
+static uint8_t             g_sent[1024*16];
+static uint32_t            g_sent_size = 0;
+static uint32_t            g_writes    = 0;
+
+/* Received payloads */
+static char                g_received[RECORDS + 4][64];
+static uint32_t            g_received_size[RECORDS + 4];
+static uint32_t            g_received_count = 0;
+static uint32_t            g_batches        = 0;
+static MQTTErrorCodes_t    g_status         = Successfull;
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    memcpy(&g_sent[g_sent_size], a_data_ptr, a_amount);
+    g_sent_size += (uint32_t)a_amount;
+    g_writes++;
+    return (int)a_amount;
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if (NULL == a_data_ptr)
+        return;
+    g_status = a_status;
+    if (a_data_len > sizeof(g_received[0]))
+        a_data_len = sizeof(g_received[0]);
+    memcpy(g_received[g_received_count], a_data_ptr, a_data_len);
+    g_received_size[g_received_count++] = a_data_len;
+}
+
+void batch_cb_(MQTT_message_view_t * a_views_ptr, size_t a_count)
+{
+    g_batches++;
+    for (size_t i = 0; i < a_count; i++) {
+        TEST_ASSERT_EQUAL_UINT16(16, a_views_ptr[i].topic_length);
+        memcpy(g_received[g_received_count], a_views_ptr[i].payload_ptr, a_views_ptr[i].payload_length);
+        g_received_size[g_received_count++] = a_views_ptr[i].payload_length;
+    }
+}
+
+/* Connected with keepalive off, so mqtt_keepalive only moves time */
+void connect_()
+{
+    g_shared.buffer            = g_buffer;
+    g_shared.buffer_size       = sizeof(g_buffer);
+    g_shared.out_fptr          = &out_fptr_;
+    g_shared.subscribe_cb_fptr = &subscribe_cb_;
+
+    session_connect(&g_shared, "JAMKtest record batch", 0);
+
+    g_sent_size      = 0;
+    g_writes         = 0;
+    g_received_count = 0;
+    g_batches        = 0;
+    g_status         = Successfull;
+}
+
+/* Sample of 20 bytes */
+static size_t record_(char * a_output_ptr, uint32_t a_sample)
+{
+    return (size_t)sprintf(a_output_ptr, "{\"t\":%04u,\"v\":%05u}", a_sample, a_sample * 7);
+}
+
+/* Written packets are received back */
+static void loopback_()
+{
+    TEST_ASSERT_EQUAL_UINT32(g_sent_size, (uint32_t)mqtt_receive_stream(g_sent, g_sent_size));
+}
+
+void test_record_batch_round_trip()
+{
+    char record[32];
+
+    connect_();
+    mqtt_set_record_unbatching(true);
+    TEST_ASSERT_TRUE(mqtt_record_batch_init(&g_batch, "telemetry/floor1", 16, g_records, sizeof(g_records), 0));
+
+    /* 12 records of 1 + 20 bytes fit to 254 bytes after the envelope */
+    for (uint32_t i = 0; i < RECORDS; i++) {
+        TEST_ASSERT_EQUAL_UINT32(20, (uint32_t)record_(record, i));
+        TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_append(&g_batch, (uint8_t*)record, 20));
+    }
+    TEST_ASSERT_EQUAL_UINT32(8, g_writes);
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_flush(&g_batch));
+    TEST_ASSERT_EQUAL_UINT32(9, g_writes);
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_flush(&g_batch));
+    TEST_ASSERT_EQUAL_UINT32(9, g_writes);
+    printf("%u records in %u publishes (%.1fx fewer messages)\n",
+           RECORDS, g_writes, (double)RECORDS / g_writes);
+
+    /* Subscriber sees every record on its own, in order */
+    loopback_();
+    TEST_ASSERT_EQUAL_UINT32(RECORDS, g_received_count);
+    for (uint32_t i = 0; i < RECORDS; i++) {
+        record_(record, i);
+        TEST_ASSERT_EQUAL_UINT32(20, g_received_size[i]);
+        TEST_ASSERT_EQUAL_MEMORY(record, g_received[i], 20);
+    }
+}
+
+void test_record_batch_latency_bound()
+{
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_record_batch_init(&g_batch, "telemetry/floor1", 16, g_records, sizeof(g_records), 50));
+
+    TEST_ASSERT_TRUE(mqtt_keepalive(100));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_append(&g_batch, (uint8_t*)"a", 1));
+    TEST_ASSERT_TRUE(mqtt_keepalive(30));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_append(&g_batch, (uint8_t*)"b", 1));
+    TEST_ASSERT_TRUE(mqtt_keepalive(19));
+    TEST_ASSERT_EQUAL_UINT32(0, g_writes);
+
+    /* Bound runs from the oldest record */
+    TEST_ASSERT_TRUE(mqtt_keepalive(1));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(2 + 2 + 16 + 2 + 2 + 2, g_sent_size);
+    TEST_ASSERT_EQUAL_HEX8(MQTT_CODEC_MARKER,  g_sent[20]);
+    TEST_ASSERT_EQUAL_HEX8(MQTT_CODEC_RECORDS, g_sent[21]);
+
+    /* Next record starts a new bound */
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_append(&g_batch, (uint8_t*)"c", 1));
+    TEST_ASSERT_TRUE(mqtt_keepalive(49));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_TRUE(mqtt_keepalive(1));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_batch_close(&g_batch));
+}
+
+void test_record_batch_close_and_limits()
+{
+    uint8_t large[300];
+
+    connect_();
+    TEST_ASSERT_FALSE(mqtt_record_batch_init(&g_batch, "telemetry/floor1", 16, g_records, 2, 0));
+    TEST_ASSERT_FALSE(mqtt_record_batch_init(&g_batch, "telemetry/floor1", 16, g_records, 500, 0));
+    TEST_ASSERT_TRUE(mqtt_record_batch_init(&g_batch, "telemetry/floor1", 16, g_records, sizeof(g_records), 1000));
+
+    /* Record larger than the batch is refused without flushing */
+    memset(large, 'x', sizeof(large));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_append(&g_batch, large, 10));
+    TEST_ASSERT_EQUAL_INT(InvalidArgument, mqtt_record_append(&g_batch, large, 253));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_append(&g_batch, large, 0));
+    TEST_ASSERT_EQUAL_UINT32(0, g_writes);
+
+    /* Two byte length prefix: 2 + 2 + 250 fills the batch */
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_append(&g_batch, large, 250));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+
+    /* Close sends the rest, closed batch is not timed anymore */
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_batch_close(&g_batch));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_record_append(&g_batch, large, 1));
+    TEST_ASSERT_TRUE(mqtt_keepalive(5000));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+
+    mqtt_set_record_unbatching(true);
+    loopback_();
+    TEST_ASSERT_EQUAL_UINT32(3, g_received_count);
+    TEST_ASSERT_EQUAL_UINT32(10,  g_received_size[0]);
+    TEST_ASSERT_EQUAL_UINT32(0,   g_received_size[1]);
+    TEST_ASSERT_EQUAL_UINT32(64,  g_received_size[2]);
+}
+
+void test_record_batch_payload_validation()
+{
+    uint8_t text[200];
+    uint8_t binary[] = {'o', 'k', 0xFF};
+
+    connect_();
+    mqtt_set_payload_validation(true);
+    TEST_ASSERT_TRUE(mqtt_record_batch_init(&g_batch, "telemetry/floor1", 16, g_records, sizeof(g_records), 0));
+
+    /* Records are checked one by one, envelope and two byte length prefix are not */
+    memset(text, 't', sizeof(text));
+    TEST_ASSERT_EQUAL_INT(Successfull,    mqtt_record_append(&g_batch, (uint8_t*)"a", 1));
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, mqtt_record_append(&g_batch, binary, sizeof(binary)));
+    TEST_ASSERT_EQUAL_INT(Successfull,    mqtt_record_append(&g_batch, text, sizeof(text)));
+    TEST_ASSERT_EQUAL_INT(Successfull,    mqtt_record_flush(&g_batch));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+
+    /* Plain publishes are still checked */
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, mqtt_publish_try("telemetry/floor1", 16, (char*)binary, sizeof(binary)));
+    TEST_ASSERT_EQUAL_INT(Successfull,    mqtt_record_batch_close(&g_batch));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+
+    mqtt_set_record_unbatching(true);
+    loopback_();
+    TEST_ASSERT_EQUAL_UINT32(2, g_received_count);
+    TEST_ASSERT_EQUAL_UINT32(1,   g_received_size[0]);
+    TEST_ASSERT_EQUAL_UINT32(64,  g_received_size[1]);
+    TEST_ASSERT_EQUAL_MEMORY(text, g_received[1], 64);
+}
+
+void test_record_batch_malformed()
+{
+    /* Second record claims 9 bytes, 2 left - nothing delivered one by one */
+    uint8_t publish[] = {0x30, 0x0a, 0x00, 0x01, 'x',
+                         MQTT_CODEC_MARKER, MQTT_CODEC_RECORDS, 0x01, 'a', 0x09, 'b', 'c'};
+    /* Length prefix of five bytes */
+    uint8_t long_length[] = {0x30, 0x0a, 0x00, 0x01, 'x',
+                             MQTT_CODEC_MARKER, MQTT_CODEC_RECORDS, 0x80, 0x80, 0x80, 0x80, 0x00};
+
+    connect_();
+    mqtt_set_record_unbatching(true);
+    TEST_ASSERT_TRUE(mqtt_receive(publish, sizeof(publish)));
+    TEST_ASSERT_EQUAL_UINT32(1, g_received_count);
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, g_status);
+    TEST_ASSERT_EQUAL_UINT32(7, g_received_size[0]);
+
+    TEST_ASSERT_TRUE(mqtt_receive(long_length, sizeof(long_length)));
+    TEST_ASSERT_EQUAL_UINT32(2, g_received_count);
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, g_status);
+
+    /* Iterator stops at the broken record */
+    MQTT_record_iterator_t records;
+    uint8_t              * record_ptr;
+    uint32_t               record_size;
+    TEST_ASSERT_TRUE(mqtt_records_open(&records, &publish[5], 7));
+    TEST_ASSERT_TRUE(mqtt_records_next(&records, &record_ptr, &record_size));
+    TEST_ASSERT_EQUAL_UINT32(1, record_size);
+    TEST_ASSERT_EQUAL_HEX8('a', record_ptr[0]);
+    TEST_ASSERT_FALSE(mqtt_records_next(&records, &record_ptr, &record_size));
+    TEST_ASSERT_NULL(records.next_ptr);
+    TEST_ASSERT_FALSE(mqtt_records_open(&records, &publish[4], 8));
+
+    /* Unbatching off - batch payload delivered as received */
+    mqtt_set_record_unbatching(false);
+    TEST_ASSERT_TRUE(mqtt_receive(publish, sizeof(publish)));
+    TEST_ASSERT_EQUAL_UINT32(3, g_received_count);
+    TEST_ASSERT_EQUAL_INT(Successfull, g_status);
+    TEST_ASSERT_EQUAL_UINT32(7, g_received_size[2]);
+}
+
+void test_record_batch_views()
+{
+    /* QoS 1 batch is acknowledged once, records go through the batch callback */
+    uint8_t publish[] = {0x32, 0x1c, 0x00, 0x10,
+                         't', 'e', 'l', 'e', 'm', 'e', 't', 'r', 'y', '/', 'f', 'l', 'o', 'o', 'r', '1',
+                         0x00, 0x05,
+                         MQTT_CODEC_MARKER, MQTT_CODEC_RECORDS,
+                         0x01, '1', 0x02, '2', '2', 0x00};
+
+    connect_();
+    mqtt_set_record_unbatching(true);
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&batch_cb_, g_views, sizeof(g_views) / sizeof(g_views[0])));
+    TEST_ASSERT_TRUE(mqtt_receive(publish, sizeof(publish)));
+
+    TEST_ASSERT_EQUAL_UINT32(1, g_batches);
+    TEST_ASSERT_EQUAL_UINT32(3, g_received_count);
+    TEST_ASSERT_EQUAL_UINT32(1, g_received_size[0]);
+    TEST_ASSERT_EQUAL_MEMORY("1", g_received[0], 1);
+    TEST_ASSERT_EQUAL_UINT32(2, g_received_size[1]);
+    TEST_ASSERT_EQUAL_MEMORY("22", g_received[1], 2);
+    TEST_ASSERT_EQUAL_UINT32(0, g_received_size[2]);
+
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(4, g_sent_size);
+    TEST_ASSERT_EQUAL_HEX8(0x40, g_sent[0]);
+    TEST_ASSERT_EQUAL_HEX8(0x05, g_sent[3]);
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Record batch");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_record_batch_round_trip,         tCntr++);
+    RUN_TEST(test_record_batch_latency_bound,      tCntr++);
+    RUN_TEST(test_record_batch_close_and_limits,   tCntr++);
+    RUN_TEST(test_record_batch_payload_validation, tCntr++);
+    RUN_TEST(test_record_batch_malformed,          tCntr++);
+    RUN_TEST(test_record_batch_views,              tCntr++);
+    return (UnityEnd());
+}
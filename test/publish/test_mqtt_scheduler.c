@@ -0,0 +1,458 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <string.h>
+
+#define CHUNK_SIZE 32
+#define CHUNK_DATA (CHUNK_SIZE - MQTT_CHUNK_HEADER)
+#define BULK_SIZE  1000
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[256];
+static uint8_t            g_queue[256];
+static uint8_t            g_chunk[CHUNK_SIZE];
+static char               g_bulk[BULK_SIZE];
+
+static uint8_t            g_sent[1024*8];
+static uint32_t           g_sent_size = 0;
+static uint32_t           g_budget    = 0;     /* Bytes transport accepts before it is "full" */
+
+/* Payloads of sent packets, filled by parse_ */
+static uint8_t          * g_payloads[128];
+static uint32_t           g_payload_sizes[128];
+
+/* Done log - message and status in the order they left the scheduler */
+static MQTT_scheduled_t * g_done[16];
+static MQTTErrorCodes_t   g_status[16];
+static uint32_t           g_done_count = 0;
+
+int limited_out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    if (a_amount > g_budget)
+        a_amount = g_budget;
+    memcpy(&g_sent[g_sent_size], a_data_ptr, a_amount);
+    g_sent_size += a_amount;
+    g_budget    -= a_amount;
+    return (int)a_amount;
+}
+
+void scheduled_cb_(MQTT_scheduled_t * a_message_ptr, MQTTErrorCodes_t a_status)
+{
+    g_done[g_done_count]     = a_message_ptr;
+    g_status[g_done_count++] = a_status;
+}
+
+int pull_(uint8_t * a_data_ptr, size_t a_amount, size_t a_offset)
+{
+    memcpy(a_data_ptr, &g_bulk[a_offset], a_amount);
+    return (int)a_amount;
+}
+
+void connect_()
+{
+    g_shared.buffer      = g_buffer;
+    g_shared.buffer_size = sizeof(g_buffer);
+    g_shared.out_fptr    = &limited_out_fptr_;
+
+    g_budget = sizeof(g_sent);
+
+    session_connect(&g_shared, "JAMKtest scheduler", 10);
+    TEST_ASSERT_TRUE(mqtt_keepalive(0));
+    TEST_ASSERT_TRUE(mqtt_set_scheduler(g_chunk, sizeof(g_chunk), &scheduled_cb_));
+
+    for (uint32_t i = 0; i < BULK_SIZE; i++)
+        g_bulk[i] = (char)('a' + (i % 26));
+    g_sent_size  = 0;
+    g_done_count = 0;
+}
+
+static void message_(MQTT_scheduled_t * a_message_ptr, char * a_topic_ptr, char * a_payload_ptr, size_t a_size)
+{
+    memset(a_message_ptr, 0, sizeof(MQTT_scheduled_t));
+    a_message_ptr->topic_ptr    = a_topic_ptr;
+    a_message_ptr->topic_size   = (uint16_t)strlen(a_topic_ptr);
+    a_message_ptr->payload_ptr  = a_payload_ptr;
+    a_message_ptr->payload_size = a_size;
+}
+
+/* Walk sent PUBLISH packets, topic first letter of each into a_order, payloads of topic
+   "b" concatenated into a_bulk - chunk headers are checked and left out */
+static uint32_t parse_(char * a_order, char * a_bulk, size_t * a_bulk_size)
+{
+    uint32_t packets = 0;
+    size_t   start   = 0;
+    *a_bulk_size = 0;
+
+    for (uint32_t offset = 0; offset < g_sent_size; packets++) {
+        uint8_t * p       = &g_sent[offset];
+        size_t    length  = 0;
+        size_t    factor  = 1;
+        uint32_t  cnt     = 1;
+
+        TEST_ASSERT_EQUAL_HEX8(0x30, p[0]);
+        do {
+            length += (p[cnt] & 127) * factor;
+            factor *= 128;
+        } while (p[cnt++] & 128);
+
+        uint16_t topic_size = (uint16_t)((p[cnt] << 8) | p[cnt + 1]);
+        char   * topic_ptr  = (char*)&p[cnt + 2];
+        size_t   payload    = length - 2 - topic_size;
+
+        uint8_t * data_ptr = (uint8_t*)&topic_ptr[topic_size];
+        g_payloads[packets]      = data_ptr;
+        g_payload_sizes[packets] = (uint32_t)payload;
+
+        a_order[packets] = topic_ptr[0];
+        if ('b' == topic_ptr[0]) {
+            if ((MQTT_CHUNK_HEADER <= payload) &&
+                (MQTT_CODEC_MARKER == data_ptr[0]) &&
+                (MQTT_CODEC_CHUNK  == data_ptr[1])) {
+                uint32_t offset = ((uint32_t)data_ptr[4] << 24) | ((uint32_t)data_ptr[5] << 16) |
+                                  ((uint32_t)data_ptr[6] << 8)  | data_ptr[7];
+                if (0 == offset)
+                    start = *a_bulk_size;
+                TEST_ASSERT_EQUAL_UINT32(*a_bulk_size - start, offset);
+                data_ptr += MQTT_CHUNK_HEADER;
+                payload  -= MQTT_CHUNK_HEADER;
+            }
+            memcpy(&a_bulk[*a_bulk_size], data_ptr, payload);
+            *a_bulk_size += payload;
+        }
+        offset += cnt + length;
+    }
+    a_order[packets] = '\0';
+    return packets;
+}
+
+void test_scheduler_bulk_is_split()
+{
+    MQTT_scheduled_t bulk;
+    char             order[64];
+    char             received[BULK_SIZE];
+    size_t           received_size = 0;
+
+    connect_();
+    message_(&bulk, "b/file", g_bulk, BULK_SIZE);
+    TEST_ASSERT_TRUE(mqtt_schedule(&bulk, LANE_BULK, 0));
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_schedule_pending(LANE_COUNT));
+
+    /* One chunk per packet of budget */
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 3));
+    TEST_ASSERT_EQUAL_UINT32(3, parse_(order, received, &received_size));
+    TEST_ASSERT_EQUAL_UINT32(3 * CHUNK_DATA, (uint32_t)received_size);
+    TEST_ASSERT_EQUAL_UINT32(0, g_done_count);
+
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+    TEST_ASSERT_EQUAL_UINT32((BULK_SIZE + CHUNK_DATA - 1) / CHUNK_DATA, parse_(order, received, &received_size));
+    TEST_ASSERT_EQUAL_UINT32(BULK_SIZE, (uint32_t)received_size);
+    TEST_ASSERT_EQUAL_MEMORY(g_bulk, received, BULK_SIZE);
+
+    TEST_ASSERT_EQUAL_UINT32(1, g_done_count);
+    TEST_ASSERT_EQUAL_PTR(&bulk, g_done[0]);
+    TEST_ASSERT_EQUAL_INT(Successfull, g_status[0]);
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_schedule_pending(LANE_COUNT));
+}
+
+void test_scheduler_pulled_payload()
+{
+    MQTT_scheduled_t bulk;
+    char             order[64];
+    char             received[BULK_SIZE];
+    size_t           received_size = 0;
+
+    /* Pulled payload is chunked in any lane */
+    connect_();
+    message_(&bulk, "b/pulled", NULL, 100);
+    bulk.pull_fptr = &pull_;
+    TEST_ASSERT_TRUE(mqtt_schedule(&bulk, LANE_TELEMETRY, 0));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 10));
+    TEST_ASSERT_EQUAL_UINT32((100 + CHUNK_DATA - 1) / CHUNK_DATA, parse_(order, received, &received_size));
+    TEST_ASSERT_EQUAL_UINT32(100, (uint32_t)received_size);
+    TEST_ASSERT_EQUAL_MEMORY(g_bulk, received, 100);
+    TEST_ASSERT_EQUAL_UINT32(1, g_done_count);
+}
+
+void test_scheduler_large_alarm_goes_whole()
+{
+    MQTT_scheduled_t alarm;
+    MQTT_scheduled_t oversized;
+    char             order[64];
+    char             received[BULK_SIZE];
+    size_t           received_size = 0;
+
+    /* Only bulk and pulled payloads are split, others are one message each */
+    connect_();
+    message_(&alarm,     "a/dump", g_bulk, 100);
+    message_(&oversized, "a/dump", g_bulk, sizeof(g_buffer));
+    TEST_ASSERT_TRUE(mqtt_schedule(&alarm,     LANE_ALARM, 0));
+    TEST_ASSERT_TRUE(mqtt_schedule(&oversized, LANE_TELEMETRY, 0));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+
+    TEST_ASSERT_EQUAL_UINT32(1, parse_(order, received, &received_size));
+    TEST_ASSERT_EQUAL_UINT32(100, g_payload_sizes[0]);
+    TEST_ASSERT_EQUAL_MEMORY(g_bulk, g_payloads[0], 100);
+
+    /* Does not fit into the shared buffer - refused, not cut */
+    TEST_ASSERT_EQUAL_UINT32(2, g_done_count);
+    TEST_ASSERT_EQUAL_PTR(&alarm, g_done[0]);
+    TEST_ASSERT_EQUAL_INT(Successfull, g_status[0]);
+    TEST_ASSERT_EQUAL_PTR(&oversized, g_done[1]);
+    TEST_ASSERT_EQUAL_INT(InvalidArgument, g_status[1]);
+}
+
+void test_scheduler_alarm_preempts_bulk()
+{
+    MQTT_scheduled_t bulk;
+    MQTT_scheduled_t telemetry;
+    MQTT_scheduled_t alarm;
+    char             order[64];
+    char             received[BULK_SIZE];
+    size_t           received_size = 0;
+
+    connect_();
+    message_(&bulk,      "b/file", g_bulk, BULK_SIZE);
+    message_(&telemetry, "t/temp", "21.5", 4);
+    message_(&alarm,     "a/fire", "1",    1);
+    TEST_ASSERT_TRUE(mqtt_schedule(&bulk, LANE_BULK, 0));
+    TEST_ASSERT_TRUE(mqtt_schedule(&telemetry, LANE_TELEMETRY, 0));
+
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 3));
+
+    /* Alarm raised in the middle of the transfer goes out in the next packet */
+    TEST_ASSERT_TRUE(mqtt_schedule(&alarm, LANE_ALARM, 0));
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_schedule_pending(LANE_ALARM));
+    TEST_ASSERT_EQUAL_UINT32(2, mqtt_schedule_pending(LANE_COUNT));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 2));
+    parse_(order, received, &received_size);
+    TEST_ASSERT_EQUAL_STRING("tbbab", order);
+
+    /* Rest of the transfer is intact */
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+    parse_(order, received, &received_size);
+    TEST_ASSERT_EQUAL_UINT32(BULK_SIZE, (uint32_t)received_size);
+    TEST_ASSERT_EQUAL_MEMORY(g_bulk, received, BULK_SIZE);
+    TEST_ASSERT_EQUAL_UINT32(3, g_done_count);
+    TEST_ASSERT_EQUAL_PTR(&telemetry, g_done[0]);
+    TEST_ASSERT_EQUAL_PTR(&alarm,     g_done[1]);
+    TEST_ASSERT_EQUAL_PTR(&bulk,      g_done[2]);
+}
+
+void test_scheduler_lane_is_fifo()
+{
+    MQTT_scheduled_t messages[4];
+    char             topics[4][4] = {"t/0", "t/1", "t/2", "t/3"};
+
+    connect_();
+    for (uint32_t i = 0; i < 4; i++) {
+        message_(&messages[i], topics[i], "x", 1);
+        TEST_ASSERT_TRUE(mqtt_schedule(&messages[i], LANE_TELEMETRY, 0));
+    }
+    TEST_ASSERT_EQUAL_UINT32(4, mqtt_schedule_pending(LANE_TELEMETRY));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+    TEST_ASSERT_EQUAL_UINT32(4, g_done_count);
+    for (uint32_t i = 0; i < 4; i++)
+        TEST_ASSERT_EQUAL_PTR(&messages[i], g_done[i]);
+}
+
+void test_scheduler_expired_is_dropped()
+{
+    MQTT_scheduled_t stale;
+    MQTT_scheduled_t fresh;
+    MQTT_scheduled_t bulk;
+    char             order[64];
+    char             received[BULK_SIZE];
+    size_t           received_size = 0;
+
+    connect_();
+    message_(&stale, "t/old", "1", 1);
+    message_(&fresh, "t/new", "2", 1);
+    message_(&bulk,  "b/file", g_bulk, 100);
+    TEST_ASSERT_TRUE(mqtt_schedule(&stale, LANE_TELEMETRY, 100));
+    TEST_ASSERT_TRUE(mqtt_schedule(&bulk, LANE_BULK, 100));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 1));
+    TEST_ASSERT_EQUAL_UINT32(1, g_done_count);
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(50, 1));
+
+    /* Started bulk transfer is completed after its deadline */
+    TEST_ASSERT_TRUE(mqtt_schedule(&stale, LANE_TELEMETRY, 100));
+    TEST_ASSERT_TRUE(mqtt_schedule(&fresh, LANE_TELEMETRY, 200));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(100, 100));
+    TEST_ASSERT_EQUAL_UINT32(4, g_done_count);
+    TEST_ASSERT_EQUAL_PTR(&stale, g_done[1]);
+    TEST_ASSERT_EQUAL_INT(Expired, g_status[1]);
+    TEST_ASSERT_EQUAL_PTR(&fresh, g_done[2]);
+    TEST_ASSERT_EQUAL_INT(Successfull, g_status[2]);
+    TEST_ASSERT_EQUAL_PTR(&bulk, g_done[3]);
+    TEST_ASSERT_EQUAL_INT(Successfull, g_status[3]);
+
+    parse_(order, received, &received_size);
+    TEST_ASSERT_EQUAL_STRING("tbtbbbb", order);
+    TEST_ASSERT_EQUAL_UINT32(100, (uint32_t)received_size);
+}
+
+void test_scheduler_would_block_keeps_message()
+{
+    MQTT_scheduled_t bulk;
+    char             order[64];
+    char             received[BULK_SIZE];
+    size_t           received_size = 0;
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(g_queue, sizeof(g_queue), 100, 30, NULL));
+    message_(&bulk, "b/file", g_bulk, BULK_SIZE);
+    TEST_ASSERT_TRUE(mqtt_schedule(&bulk, LANE_BULK, 0));
+
+    /* Transport takes nothing - run stops when the queue is full */
+    g_budget = 0;
+    TEST_ASSERT_EQUAL_INT(WouldBlock, mqtt_schedule_run(0, 100));
+    TEST_ASSERT_EQUAL_UINT32(0, g_done_count);
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_schedule_pending(LANE_BULK));
+
+    g_budget = sizeof(g_sent);
+    while (0 < mqtt_schedule_pending(LANE_COUNT)) {
+        TEST_ASSERT_EQUAL_INT(Successfull, mqtt_output_flush());
+        mqtt_schedule_run(0, 100);
+    }
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_output_flush());
+    parse_(order, received, &received_size);
+    TEST_ASSERT_EQUAL_UINT32(BULK_SIZE, (uint32_t)received_size);
+    TEST_ASSERT_EQUAL_MEMORY(g_bulk, received, BULK_SIZE);
+    TEST_ASSERT_TRUE(mqtt_set_output_queue(NULL, 0, 0, 0, NULL));
+}
+
+void test_scheduler_keepalive_during_bulk()
+{
+    MQTT_scheduled_t bulk;
+
+    /* Bulk packets are client traffic - no ping while the transfer runs */
+    connect_();
+    message_(&bulk, "b/file", g_bulk, BULK_SIZE);
+    TEST_ASSERT_TRUE(mqtt_schedule(&bulk, LANE_BULK, 0));
+    while (0 < mqtt_schedule_pending(LANE_COUNT)) {
+        TEST_ASSERT_TRUE(mqtt_keepalive(1000));
+        TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(1000, 1));
+    }
+    for (uint32_t offset = 0; offset < g_sent_size; offset += 2 + g_sent[offset + 1])
+        TEST_ASSERT_EQUAL_HEX8(0x30, g_sent[offset]);
+}
+
+void test_scheduler_invalid()
+{
+    MQTT_scheduled_t message;
+
+    connect_();
+    TEST_ASSERT_FALSE(mqtt_set_scheduler(g_chunk, 0, NULL));
+    TEST_ASSERT_FALSE(mqtt_set_scheduler(g_chunk, sizeof(g_buffer) + 1, NULL));
+    TEST_ASSERT_FALSE(mqtt_set_scheduler(g_chunk, MQTT_CHUNK_HEADER, NULL));
+
+    /* Split payload needs the chunk buffer for its headers */
+    TEST_ASSERT_TRUE(mqtt_set_scheduler(NULL, CHUNK_SIZE, NULL));
+    message_(&message, "b/x", g_bulk, CHUNK_SIZE + 1);
+    TEST_ASSERT_FALSE(mqtt_schedule(&message, LANE_BULK, 0));
+    message_(&message, "b/x", g_bulk, CHUNK_SIZE);
+    TEST_ASSERT_TRUE(mqtt_schedule(&message, LANE_BULK, 0));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 1));
+
+    message_(&message, "t/x", NULL, 10);
+    TEST_ASSERT_FALSE(mqtt_schedule(&message, LANE_TELEMETRY, 0));
+    message_(&message, "t/x", "x", 1);
+    TEST_ASSERT_FALSE(mqtt_schedule(&message, LANE_COUNT, 0));
+    TEST_ASSERT_FALSE(mqtt_schedule(NULL, LANE_ALARM, 0));
+
+    /* Scheduler is cleared by init */
+    MQTT_action_data_t action;
+    action.action_argument.shared_ptr = &g_shared;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt(ACTION_INIT, &action));
+    TEST_ASSERT_FALSE(mqtt_schedule(&message, LANE_ALARM, 0));
+    TEST_ASSERT_EQUAL_INT(InvalidArgument, mqtt_schedule_run(0, 1));
+}
+
+void test_scheduler_chunks_reassembled()
+{
+    MQTT_scheduled_t      first;
+    MQTT_scheduled_t      second;
+    MQTT_scheduled_t      small;
+    MQTT_chunk_assembly_t assembly;
+    uint8_t               memory[BULK_SIZE];
+    uint8_t             * message_ptr  = NULL;
+    size_t                message_size = 0;
+    char                  order[64];
+    char                  received[2 * BULK_SIZE];
+    size_t                received_size = 0;
+
+    /* Two split messages back to back and one sent whole */
+    connect_();
+    message_(&first,  "b/file", g_bulk, 100);
+    message_(&second, "b/file", &g_bulk[100], 60);
+    message_(&small,  "b/file", g_bulk, CHUNK_SIZE);
+    TEST_ASSERT_TRUE(mqtt_schedule(&first,  LANE_BULK, 0));
+    TEST_ASSERT_TRUE(mqtt_schedule(&second, LANE_BULK, 0));
+    TEST_ASSERT_TRUE(mqtt_schedule(&small,  LANE_BULK, 0));
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt_schedule_run(0, 100));
+    uint32_t packets = parse_(order, received, &received_size);
+    TEST_ASSERT_EQUAL_UINT32(5 + 3 + 1, packets);
+
+    /* Subscriber side - every message found again */
+    TEST_ASSERT_FALSE(mqtt_chunks_init(&assembly, NULL, 0));
+    TEST_ASSERT_TRUE(mqtt_chunks_init(&assembly, memory, sizeof(memory)));
+    for (uint32_t i = 0; i < packets; i++) {
+        MQTTErrorCodes_t status = mqtt_chunks_add(&assembly, g_payloads[i], g_payload_sizes[i],
+                                                  &message_ptr, &message_size);
+        if ((4 == i) || (7 == i) || (8 == i))
+            TEST_ASSERT_EQUAL_INT(Successfull, status);
+        else
+            TEST_ASSERT_EQUAL_INT(WouldBlock, status);
+
+        if (4 == i) {
+            TEST_ASSERT_EQUAL_UINT32(100, (uint32_t)message_size);
+            TEST_ASSERT_EQUAL_MEMORY(g_bulk, message_ptr, 100);
+        } else if (7 == i) {
+            TEST_ASSERT_EQUAL_UINT32(60, (uint32_t)message_size);
+            TEST_ASSERT_EQUAL_MEMORY(&g_bulk[100], message_ptr, 60);
+        } else if (8 == i) {
+            TEST_ASSERT_EQUAL_PTR(g_payloads[8], message_ptr);
+            TEST_ASSERT_EQUAL_UINT32(CHUNK_SIZE, (uint32_t)message_size);
+        }
+    }
+
+    /* Lost chunk drops the message, next message starts clean */
+    TEST_ASSERT_EQUAL_INT(WouldBlock,     mqtt_chunks_add(&assembly, g_payloads[0], g_payload_sizes[0], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, mqtt_chunks_add(&assembly, g_payloads[2], g_payload_sizes[2], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, mqtt_chunks_add(&assembly, g_payloads[3], g_payload_sizes[3], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_INT(WouldBlock,     mqtt_chunks_add(&assembly, g_payloads[5], g_payload_sizes[5], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_INT(WouldBlock,     mqtt_chunks_add(&assembly, g_payloads[6], g_payload_sizes[6], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_INT(Successfull,    mqtt_chunks_add(&assembly, g_payloads[7], g_payload_sizes[7], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_UINT32(60, (uint32_t)message_size);
+
+    /* Chunk of another message in the middle */
+    TEST_ASSERT_EQUAL_INT(WouldBlock,     mqtt_chunks_add(&assembly, g_payloads[5], g_payload_sizes[5], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, mqtt_chunks_add(&assembly, g_payloads[1], g_payload_sizes[1], &message_ptr, &message_size));
+
+    /* Message larger than reassembly memory */
+    TEST_ASSERT_TRUE(mqtt_chunks_init(&assembly, memory, 50));
+    TEST_ASSERT_EQUAL_INT(WouldBlock,     mqtt_chunks_add(&assembly, g_payloads[0], g_payload_sizes[0], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_INT(WouldBlock,     mqtt_chunks_add(&assembly, g_payloads[1], g_payload_sizes[1], &message_ptr, &message_size));
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, mqtt_chunks_add(&assembly, g_payloads[2], g_payload_sizes[2], &message_ptr, &message_size));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Scheduler");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_scheduler_bulk_is_split,              tCntr++);
+    RUN_TEST(test_scheduler_pulled_payload,             tCntr++);
+    RUN_TEST(test_scheduler_large_alarm_goes_whole,     tCntr++);
+    RUN_TEST(test_scheduler_alarm_preempts_bulk,        tCntr++);
+    RUN_TEST(test_scheduler_lane_is_fifo,               tCntr++);
+    RUN_TEST(test_scheduler_expired_is_dropped,         tCntr++);
+    RUN_TEST(test_scheduler_would_block_keeps_message,  tCntr++);
+    RUN_TEST(test_scheduler_keepalive_during_bulk,      tCntr++);
+    RUN_TEST(test_scheduler_chunks_reassembled,         tCntr++);
+    RUN_TEST(test_scheduler_invalid,                    tCntr++);
+    return (UnityEnd());
+}
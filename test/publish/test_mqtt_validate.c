@@ -0,0 +1,267 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BIG_SIZE (1024*1024)
+
+static uint8_t  g_sent[256];
+static uint32_t g_sent_size = 0;
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[256];
+static uint8_t            g_big[BIG_SIZE];
+static uint8_t            g_copy[BIG_SIZE];
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    memcpy(g_sent, a_data_ptr, a_amount);
+    g_sent_size = (uint32_t)a_amount;
+    return (int)a_amount;
+}
+
+void connect_()
+{
+    g_shared.buffer      = g_buffer;
+    g_shared.buffer_size = sizeof(g_buffer);
+    g_shared.out_fptr    = &out_fptr_;
+
+    session_connect(&g_shared, "JAMKtest validate", 0);
+    g_sent_size = 0;
+}
+
+/* Byte at a time decoder as reference */
+bool reference_utf8_(const uint8_t * a_data, size_t a_size, bool a_topic)
+{
+    size_t i = 0;
+    while (i < a_size) {
+        uint32_t cp    = a_data[i];
+        size_t   extra = 0;
+        uint32_t min   = 0;
+
+        if (cp < 0x80)                { extra = 0; }
+        else if ((cp & 0xE0) == 0xC0) { extra = 1; cp &= 0x1F; min = 0x80;    }
+        else if ((cp & 0xF0) == 0xE0) { extra = 2; cp &= 0x0F; min = 0x800;   }
+        else if ((cp & 0xF8) == 0xF0) { extra = 3; cp &= 0x07; min = 0x10000; }
+        else return false;
+
+        if ((i + extra) >= a_size && (0 < extra))
+            return false;
+        for (size_t j = 1; j <= extra; j++) {
+            if ((a_data[i + j] & 0xC0) != 0x80)
+                return false;
+            cp = (cp << 6) | (a_data[i + j] & 0x3F);
+        }
+        if ((cp < min) || (cp > 0x10FFFF) || ((cp >= 0xD800) && (cp <= 0xDFFF)))
+            return false;
+        if (a_topic && (0 == cp))
+            return false;
+        i += extra + 1;
+    }
+    return true;
+}
+
+bool reference_topic_(const uint8_t * a_topic, size_t a_size, bool a_filter)
+{
+    if ((0 == a_size) || (false == reference_utf8_(a_topic, a_size, true)))
+        return false;
+    for (size_t i = 0; i < a_size; i++) {
+        if (('+' != a_topic[i]) && ('#' != a_topic[i]))
+            continue;
+        if (false == a_filter)
+            return false;
+        bool level_start = (0 == i) || ('/' == a_topic[i - 1]);
+        bool level_end   = ((i + 1) == a_size) || ('/' == a_topic[i + 1]);
+        if ((false == level_start) || (false == level_end))
+            return false;
+        if (('#' == a_topic[i]) && ((i + 1) != a_size))
+            return false;
+    }
+    return true;
+}
+
+MQTTErrorCodes_t publish_(const char * a_topic, size_t a_topic_size, uint8_t * a_msg, uint32_t a_size)
+{
+    MQTT_publish_t publish;
+    memset(&publish, 0, sizeof(publish));
+    publish.flags.qos           = QoS0;
+    publish.topic_ptr           = (uint8_t*)a_topic;
+    publish.topic_length        = (uint16_t)a_topic_size;
+    publish.message_buffer_ptr  = a_msg;
+    publish.message_buffer_size = a_size;
+
+    MQTT_action_data_t action;
+    action.action_argument.publish_ptr = &publish;
+    g_sent_size = 0;
+    return mqtt(ACTION_PUBLISH, &action);
+}
+
+MQTTErrorCodes_t subscribe_(const char * a_topic)
+{
+    MQTT_subscribe_t subscribe;
+    subscribe.qos          = QoS0;
+    subscribe.topic_ptr    = (uint8_t*)a_topic;
+    subscribe.topic_length = (uint16_t)strlen(a_topic);
+
+    MQTT_action_data_t action;
+    action.action_argument.subscribe_ptr = &subscribe;
+    g_sent_size = 0;
+    return mqtt(ACTION_SUBSCRIBE, &action);
+}
+
+#define T_(s) (const uint8_t *)(s), (sizeof(s) - 1)
+
+void test_topic_names()
+{
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("a"), false));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("sport/tennis/player1"), false));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("/"), false));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("koti/olohuone/l\xc3\xa4mp\xc3\xb6tila"), false));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("emoji/\xf0\x9f\x98\x80"), false));
+
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_(""), false));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(NULL, 4, false));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("sport/+"), false));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("sport/#"), false));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("nul\0inside"), false));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("overlong/\xc0\xaf"), false));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("surrogate/\xed\xa0\x80"), false));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("truncated/\xe2\x82"), false));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("above/\xf4\x90\x80\x80"), false));
+}
+
+void test_topic_filters()
+{
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("#"), true));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("+"), true));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("sport/tennis/#"), true));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("+/tennis/#"), true));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("sport/+/player1"), true));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("+/+"), true));
+    TEST_ASSERT_TRUE(mqtt_topic_valid(T_("/+"), true));
+
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("sport/tennis#"), true));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("sport/tennis/#/ranking"), true));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("sport+"), true));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("sport/+tennis"), true));
+    TEST_ASSERT_FALSE(mqtt_topic_valid(T_("##"), true));
+}
+
+void test_utf8_against_reference()
+{
+    static const char * pieces[] = {"a", "/", "+", "#", "\x00", "\xc3\xa4", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+                                    "\x80", "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xff", "\xe2\x82",
+                                    "abcdefghijklmnopqrstuvwxyz0123456789"};
+    static const size_t sizes[]  = {1, 1, 1, 1, 1, 2, 3, 4, 1, 2, 3, 4, 1, 2, 36};
+    uint8_t data[600];
+
+    srand(1);
+    for (uint32_t round = 0; round < 20000; round++) {
+        size_t used  = 0;
+        size_t count = (size_t)rand() % 16;
+
+        /* Mostly ASCII so that special bytes land at every vector lane */
+        for (size_t i = 0; i < count; i++) {
+            size_t piece = (0 == (rand() % 3)) ? (size_t)rand() % 14 : 14;
+            size_t size  = sizes[piece];
+            if (14 == piece)
+                size = (size_t)rand() % 37;
+            memcpy(&data[used], pieces[piece], size);
+            used += size;
+        }
+
+        TEST_ASSERT_EQUAL(reference_utf8_(data, used, false), mqtt_utf8_valid(data, used));
+        if (0 < used) {
+            TEST_ASSERT_EQUAL(reference_topic_(data, used, false), mqtt_topic_valid(data, used, false));
+            TEST_ASSERT_EQUAL(reference_topic_(data, used, true),  mqtt_topic_valid(data, used, true));
+        }
+    }
+}
+
+void test_publish_and_subscribe_refuse_invalid_topics()
+{
+    uint8_t msg[] = "x";
+
+    connect_();
+    TEST_ASSERT_EQUAL_INT(InvalidTopic, publish_("a/#", 3, msg, 1));
+    TEST_ASSERT_EQUAL_INT(InvalidTopic, publish_("", 0, msg, 1));
+    TEST_ASSERT_EQUAL_INT(InvalidTopic, publish_("a\0b", 3, msg, 1));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+    TEST_ASSERT_FALSE(mqtt_publish("a/+", 3, "x", 1));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+
+    TEST_ASSERT_EQUAL_INT(InvalidTopic, subscribe_("a/b#"));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+    TEST_ASSERT_EQUAL_INT(Successfull, subscribe_("a/+/#"));
+    TEST_ASSERT_NOT_EQUAL(0, g_sent_size);
+
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("a/b", 3, msg, 1));
+    TEST_ASSERT_NOT_EQUAL(0, g_sent_size);
+}
+
+void test_payload_validation()
+{
+    uint8_t binary[] = {0x01, 0xff, 0x00};
+    uint8_t text[]   = "l\xc3\xa4mp\xc3\xb6tila 21.5";
+
+    connect_();
+    /* Binary payloads are fine by default */
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("a/b", 3, binary, sizeof(binary)));
+
+    mqtt_set_payload_validation(true);
+    TEST_ASSERT_EQUAL_INT(InvalidPayload, publish_("a/b", 3, binary, sizeof(binary)));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("a/b", 3, text, sizeof(text) - 1));
+
+    mqtt_set_payload_validation(false);
+    TEST_ASSERT_EQUAL_INT(Successfull, publish_("a/b", 3, binary, sizeof(binary)));
+}
+
+static double now_us_()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void test_validation_speed()
+{
+    for (uint32_t i = 0; i < BIG_SIZE; i++)
+        g_big[i] = (uint8_t)(' ' + (i % 90));
+    g_big[BIG_SIZE / 2] = 0xc3;
+    g_big[BIG_SIZE / 2 + 1] = 0xa4;
+
+    double start = now_us_();
+    for (uint32_t i = 0; i < 20; i++) {
+        memcpy(g_copy, g_big, BIG_SIZE);
+        __asm__ __volatile__("" : : "r"(g_copy) : "memory");
+    }
+    double copy_us = (now_us_() - start) / 20;
+
+    start = now_us_();
+    for (uint32_t i = 0; i < 20; i++)
+        TEST_ASSERT_TRUE(mqtt_utf8_valid(g_big, BIG_SIZE));
+    double validate_us = (now_us_() - start) / 20;
+
+    printf("1 MB: UTF-8 validation %.0f us, memcpy %.0f us\n", validate_us, copy_us);
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Topic and UTF-8 validation");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_topic_names,                                  tCntr++);
+    RUN_TEST(test_topic_filters,                                tCntr++);
+    RUN_TEST(test_utf8_against_reference,                       tCntr++);
+    RUN_TEST(test_publish_and_subscribe_refuse_invalid_topics,  tCntr++);
+    RUN_TEST(test_payload_validation,                           tCntr++);
+    RUN_TEST(test_validation_speed,                             tCntr++);
+    return UnityEnd();
+}
@@ -0,0 +1,348 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "session.h"
+
+#include <string.h>
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[256];
+static uint8_t            g_acks[40];
+static uint8_t            g_stream[2048];
+static size_t             g_stream_size = 0;
+
+static uint8_t            g_sent[4096];
+static uint32_t           g_sent_size = 0;
+static uint32_t           g_writes    = 0;
+static int                g_accept    = -1;   /* Bytes transport takes per write, -1 all */
+
+static uint8_t            g_payload[16];
+static uint32_t           g_payload_size = 0;
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    if ((0 <= g_accept) && (a_amount > (size_t)g_accept))
+        a_amount = (size_t)g_accept;
+    if (0 == a_amount)
+        return 0;
+    memcpy(&g_sent[g_sent_size], a_data_ptr, a_amount);
+    g_sent_size += a_amount;
+    g_writes++;
+    return (int)a_amount;
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_status    = a_status;
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if ((NULL != a_data_ptr) && (a_data_len <= sizeof(g_payload))) {
+        memcpy(g_payload, a_data_ptr, a_data_len);
+        g_payload_size = a_data_len;
+    }
+}
+
+/* Connected with 10 s keepalive, first ping already sent */
+void connect_()
+{
+    g_shared.buffer            = g_buffer;
+    g_shared.buffer_size       = sizeof(g_buffer);
+    g_shared.out_fptr          = &out_fptr_;
+    g_shared.subscribe_cb_fptr = &subscribe_cb_;
+
+    session_connect(&g_shared, "JAMKtest acks", 10);
+    TEST_ASSERT_TRUE(mqtt_keepalive(0));
+
+    g_sent_size    = 0;
+    g_writes       = 0;
+    g_stream_size  = 0;
+    g_payload_size = 0;
+    g_accept       = -1;
+}
+
+/* PUBLISH with topic "q/1" and payload "x", packet identifier for QoS 1. QoS is in
+   bits 1-2 of the fixed header (MQTT 3.1.1 chapter 2.2.2). */
+static void publish_(MQTTQoSLevel_t a_qos, uint16_t a_packet_id)
+{
+    uint8_t * p = &g_stream[g_stream_size];
+    size_t    n = 0;
+
+    p[n++] = (uint8_t)(0x30 | (a_qos << 1));
+    p[n++] = (QoS0 == a_qos) ? 6 : 8;
+    p[n++] = 0x00; p[n++] = 0x03; p[n++] = 'q'; p[n++] = '/'; p[n++] = '1';
+    if (QoS0 != a_qos) {
+        p[n++] = (uint8_t)(a_packet_id >> 8);
+        p[n++] = (uint8_t)(a_packet_id & 0xff);
+    }
+    p[n++] = 'x';
+    g_stream_size += n;
+}
+
+static void assert_pubacks_(uint32_t a_offset, uint16_t a_first_id, uint32_t a_count)
+{
+    for (uint32_t i = 0; i < a_count; i++) {
+        uint8_t * ack = &g_sent[a_offset + 4 * i];
+        TEST_ASSERT_EQUAL_HEX8(0x40, ack[0]);
+        TEST_ASSERT_EQUAL_HEX8(0x02, ack[1]);
+        TEST_ASSERT_EQUAL_UINT16(a_first_id + i, (uint16_t)((ack[2] << 8) | ack[3]));
+    }
+}
+
+void test_ack_one_write_per_message_by_default()
+{
+    connect_();
+    publish_(QoS1, 0x0101);
+    publish_(QoS0, 0);
+    publish_(QoS1, 0x0102);
+    publish_(QoS1, 0x0103);
+
+    TEST_ASSERT_EQUAL_UINT32(g_stream_size, (uint32_t)mqtt_receive_stream(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(3, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(12, g_sent_size);
+    assert_pubacks_(0, 0x0101, 3);
+}
+
+void test_ack_coalesced_per_receive()
+{
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(g_acks, sizeof(g_acks), 0));
+    for (uint16_t i = 1; i <= 8; i++) {
+        publish_(QoS1, i);
+        publish_(QoS0, 0);
+    }
+
+    /* Eight acks in one write, in order */
+    TEST_ASSERT_EQUAL_UINT32(g_stream_size, (uint32_t)mqtt_receive_stream(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(32, g_sent_size);
+    assert_pubacks_(0, 1, 8);
+
+    /* mqtt_receive of one packet - written at the end of the call */
+    g_stream_size = 0;
+    publish_(QoS1, 9);
+    TEST_ASSERT_TRUE(mqtt_receive(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+    assert_pubacks_(0, 1, 9);
+}
+
+void test_ack_full_buffer_is_flushed()
+{
+    /* Room for 10 acks - 25 acks in three writes */
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(g_acks, sizeof(g_acks), 0));
+    for (uint16_t i = 1; i <= 25; i++)
+        publish_(QoS1, i);
+
+    TEST_ASSERT_EQUAL_UINT32(g_stream_size, (uint32_t)mqtt_receive_stream(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(3, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(100, g_sent_size);
+    assert_pubacks_(0, 1, 25);
+}
+
+void test_ack_deadline()
+{
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(g_acks, sizeof(g_acks), 50));
+    for (uint16_t i = 1; i <= 3; i++) {
+        g_stream_size = 0;
+        publish_(QoS1, i);
+        TEST_ASSERT_TRUE(mqtt_receive(g_stream, g_stream_size));
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, g_writes);
+
+    TEST_ASSERT_TRUE(mqtt_keepalive(20));
+    TEST_ASSERT_EQUAL_UINT32(0, g_writes);
+    TEST_ASSERT_TRUE(mqtt_keepalive(30));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(12, g_sent_size);
+    assert_pubacks_(0, 1, 3);
+
+    /* Next ack starts a new deadline */
+    g_stream_size = 0;
+    publish_(QoS1, 4);
+    TEST_ASSERT_TRUE(mqtt_receive(g_stream, g_stream_size));
+    TEST_ASSERT_TRUE(mqtt_keepalive(49));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_TRUE(mqtt_keepalive(1));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+}
+
+void test_ack_before_later_packets()
+{
+    char topic[] = "q/out";
+    char msg[]   = "y";
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(g_acks, sizeof(g_acks), 1000));
+    publish_(QoS1, 7);
+    publish_(QoS1, 8);
+    TEST_ASSERT_EQUAL_UINT32(g_stream_size, (uint32_t)mqtt_receive_stream(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(0, g_writes);
+
+    /* Acks go out first, then the publish */
+    TEST_ASSERT_TRUE(mqtt_publish(topic, strlen(topic), msg, strlen(msg)));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+    assert_pubacks_(0, 7, 2);
+    TEST_ASSERT_EQUAL_HEX8(0x30, g_sent[8]);
+}
+
+void test_ack_replaces_due_ping()
+{
+    /* Ping is due 9.5 s after the previous one - waiting acks are sent instead */
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(g_acks, sizeof(g_acks), 60000));
+    publish_(QoS1, 5);
+    TEST_ASSERT_TRUE(mqtt_receive(g_stream, g_stream_size));
+    TEST_ASSERT_TRUE(mqtt_keepalive(9000));
+    TEST_ASSERT_EQUAL_UINT32(0, g_writes);
+
+    TEST_ASSERT_TRUE(mqtt_keepalive(500));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_EQUAL_UINT32(4, g_sent_size);
+    assert_pubacks_(0, 5, 1);
+
+    /* Ack counted as client traffic - next ping a full keepalive later */
+    TEST_ASSERT_TRUE(mqtt_keepalive(9499));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    TEST_ASSERT_TRUE(mqtt_keepalive(1));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+    TEST_ASSERT_EQUAL_HEX8(0xc0, g_sent[4]);
+}
+
+void test_ack_disable_flushes()
+{
+    connect_();
+    TEST_ASSERT_FALSE(mqtt_set_ack_coalescing(g_acks, 3, 0));
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(g_acks, sizeof(g_acks), 1000));
+    publish_(QoS1, 1);
+    TEST_ASSERT_TRUE(mqtt_receive(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(0, g_writes);
+
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(NULL, 0, 0));
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    assert_pubacks_(0, 1, 1);
+
+    /* Back to one write per message */
+    TEST_ASSERT_TRUE(mqtt_receive(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(2, g_writes);
+}
+
+void test_ack_spec_fixed_header()
+{
+    /* QoS 1 as sent by a broker: acknowledged, packet identifier is not payload */
+    uint8_t qos1[] = {0x32, 0x08, 0x00, 0x03, 'q', '/', '1', 0x12, 0x34, 'x'};
+    /* QoS 2 is not acknowledged with PUBACK, subscriptions never request it */
+    uint8_t qos2[] = {0x34, 0x08, 0x00, 0x03, 'q', '/', '1', 0x56, 0x78, 'y'};
+
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_receive(qos1, sizeof(qos1)));
+    TEST_ASSERT_EQUAL_UINT32(1, g_payload_size);
+    TEST_ASSERT_EQUAL_HEX8('x', g_payload[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+    assert_pubacks_(0, 0x1234, 1);
+
+    TEST_ASSERT_TRUE(mqtt_receive(qos2, sizeof(qos2)));
+    TEST_ASSERT_EQUAL_UINT32(1, g_payload_size);
+    TEST_ASSERT_EQUAL_HEX8('y', g_payload[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, g_writes);
+}
+
+void test_ack_not_taken_is_not_delivered()
+{
+    connect_();
+    publish_(QoS1, 0x0201);
+
+    /* Transport takes nothing - message stays with transport */
+    g_accept = 0;
+    TEST_ASSERT_FALSE(mqtt_receive(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(0, g_payload_size);
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+
+    /* Given again - acknowledged and delivered once */
+    g_accept = -1;
+    TEST_ASSERT_TRUE(mqtt_receive(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(1, g_payload_size);
+    TEST_ASSERT_EQUAL_UINT32(4, g_sent_size);
+    assert_pubacks_(0, 0x0201, 1);
+}
+
+void test_ack_full_buffer_stops_stream()
+{
+    /* Room for 10 acks, transport blocked - 11th message is left for the next call */
+    connect_();
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(g_acks, sizeof(g_acks), 1000));
+    for (uint16_t i = 1; i <= 12; i++)
+        publish_(QoS1, i);
+
+    g_accept = 0;
+    TEST_ASSERT_EQUAL_UINT32(10 * 10, (uint32_t)mqtt_receive_stream(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(0, g_sent_size);
+
+    g_accept = -1;
+    TEST_ASSERT_EQUAL_UINT32(2 * 10, (uint32_t)mqtt_receive_stream(&g_stream[100], g_stream_size - 100));
+    TEST_ASSERT_TRUE(mqtt_set_ack_coalescing(NULL, 0, 0));
+    TEST_ASSERT_EQUAL_UINT32(48, g_sent_size);
+    assert_pubacks_(0, 1, 12);
+}
+
+void test_ack_partly_written_breaks_session()
+{
+    char topic[] = "q/out";
+    char msg[]   = "y";
+
+    connect_();
+    publish_(QoS1, 0x0301);
+
+    g_accept = 2;
+    TEST_ASSERT_FALSE(mqtt_receive(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(0, g_payload_size);
+    TEST_ASSERT_EQUAL_UINT32(2, g_sent_size);
+
+    /* Nothing more is written into the broken stream */
+    g_accept = -1;
+    TEST_ASSERT_FALSE(mqtt_publish(topic, strlen(topic), msg, strlen(msg)));
+    TEST_ASSERT_EQUAL_UINT32(2, g_sent_size);
+}
+
+void test_ack_subscribe_qos2_as_qos1()
+{
+    MQTT_subscribe_t   subscribe;
+    MQTT_action_data_t action;
+    char               topic[] = "q/#";
+
+    connect_();
+    subscribe.qos          = QoS2;
+    subscribe.topic_ptr    = (uint8_t *)topic;
+    subscribe.topic_length = (uint16_t)strlen(topic);
+    action.action_argument.subscribe_ptr = &subscribe;
+
+    /* Requested QoS is the last byte of SUBSCRIBE */
+    TEST_ASSERT_EQUAL(Successfull, mqtt(ACTION_SUBSCRIBE, &action));
+    TEST_ASSERT_EQUAL_HEX8(0x82, g_sent[0]);
+    TEST_ASSERT_EQUAL_HEX8(QoS1, g_sent[g_sent_size - 1]);
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Ack coalescing");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_ack_one_write_per_message_by_default, tCntr++);
+    RUN_TEST(test_ack_coalesced_per_receive,            tCntr++);
+    RUN_TEST(test_ack_full_buffer_is_flushed,           tCntr++);
+    RUN_TEST(test_ack_deadline,                         tCntr++);
+    RUN_TEST(test_ack_before_later_packets,             tCntr++);
+    RUN_TEST(test_ack_replaces_due_ping,                tCntr++);
+    RUN_TEST(test_ack_disable_flushes,                  tCntr++);
+    RUN_TEST(test_ack_spec_fixed_header,                tCntr++);
+    RUN_TEST(test_ack_not_taken_is_not_delivered,       tCntr++);
+    RUN_TEST(test_ack_full_buffer_stops_stream,         tCntr++);
+    RUN_TEST(test_ack_partly_written_breaks_session,    tCntr++);
+    RUN_TEST(test_ack_subscribe_qos2_as_qos1,           tCntr++);
+    return (UnityEnd());
+}
@@ -0,0 +1,142 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "dispatch.h"
+
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define TOPICS   4
+#define MESSAGES 2000
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_packets[MESSAGES][32];
+static atomic_int         g_pins[MESSAGES];
+static atomic_int         g_handled;
+static uint32_t           g_next_sequence[TOPICS];
+static atomic_bool        g_out_of_order;
+static pthread_t          g_topic_thread[TOPICS];
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    a_data_ptr = a_data_ptr;
+    return (int)a_amount;
+}
+
+bool pin_fptr_(uint8_t * a_data_ptr, bool a_pin)
+{
+    uint32_t index = (a_data_ptr - &g_packets[0][0]) / sizeof(g_packets[0]);
+    if (a_pin)
+        atomic_fetch_add(&g_pins[index], 1);
+    else
+        atomic_fetch_sub(&g_pins[index], 1);
+    return true;
+}
+
+/* Payload is 4 digit sequence number, topic is "t/<n>" */
+void handler_(MQTT_message_view_t * a_view_ptr)
+{
+    uint32_t topic    = a_view_ptr->topic_ptr[2] - '0';
+    uint32_t sequence = 0;
+    for (uint32_t i = 0; i < a_view_ptr->payload_length; i++)
+        sequence = sequence * 10 + (a_view_ptr->payload_ptr[i] - '0');
+
+    /* Only one worker handles a topic */
+    if (0 == g_next_sequence[topic])
+        g_topic_thread[topic] = pthread_self();
+    else if (!pthread_equal(g_topic_thread[topic], pthread_self()))
+        atomic_store(&g_out_of_order, true);
+
+    if (sequence != g_next_sequence[topic])
+        atomic_store(&g_out_of_order, true);
+    g_next_sequence[topic] = sequence + 1;
+    atomic_fetch_add(&g_handled, 1);
+}
+
+uint32_t build_publish_(uint8_t * a_output, uint32_t a_topic, uint32_t a_sequence)
+{
+    uint8_t packet[] = {0x30, 0x09, 0x00, 0x03, 't', '/', (uint8_t)('0' + a_topic),
+                        (uint8_t)('0' + (a_sequence / 1000) % 10),
+                        (uint8_t)('0' + (a_sequence / 100) % 10),
+                        (uint8_t)('0' + (a_sequence / 10) % 10),
+                        (uint8_t)('0' + (a_sequence / 1) % 10)};
+    memcpy(a_output, packet, sizeof(packet));
+    return sizeof(packet);
+}
+
+void init_(buffer_pin_fptr_t a_pin_fptr)
+{
+    static uint8_t buffer[128];
+    g_shared.buffer      = buffer;
+    g_shared.buffer_size = sizeof(buffer);
+    g_shared.out_fptr    = &out_fptr_;
+
+    MQTT_action_data_t action;
+    action.action_argument.shared_ptr = &g_shared;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt(ACTION_INIT, &action));
+    mqtt_set_message_view_cb(&dispatch_message, a_pin_fptr);
+
+    memset(g_next_sequence, 0, sizeof(g_next_sequence));
+    atomic_store(&g_handled, 0);
+    atomic_store(&g_out_of_order, false);
+    for (uint32_t i = 0; i < MESSAGES; i++)
+        atomic_store(&g_pins[i], 0);
+}
+
+void test_dispatch_keeps_topic_order_with_retain()
+{
+    init_(&pin_fptr_);
+    TEST_ASSERT_TRUE(dispatch_start(3, 8, &handler_));
+
+    uint32_t sequence[TOPICS] = {0};
+    for (uint32_t i = 0; i < MESSAGES; i++) {
+        uint32_t topic = (i * 7) % TOPICS;
+        uint32_t size  = build_publish_(g_packets[i], topic, sequence[topic]++);
+        TEST_ASSERT_TRUE(mqtt_receive(g_packets[i], size));
+    }
+    dispatch_stop();
+
+    TEST_ASSERT_EQUAL_INT(MESSAGES, atomic_load(&g_handled));
+    TEST_ASSERT_FALSE(atomic_load(&g_out_of_order));
+    for (uint32_t i = 0; i < MESSAGES; i++)
+        TEST_ASSERT_EQUAL_INT(0, atomic_load(&g_pins[i]));
+}
+
+void test_dispatch_copies_without_pin_hook()
+{
+    init_(NULL);
+    TEST_ASSERT_TRUE(dispatch_start(2, 4, &handler_));
+
+    /* Same input buffer is overwritten for each message - workers must see copies */
+    uint8_t  packet[32];
+    uint32_t sequence[TOPICS] = {0};
+    for (uint32_t i = 0; i < MESSAGES; i++) {
+        uint32_t topic = i % TOPICS;
+        uint32_t size  = build_publish_(packet, topic, sequence[topic]++);
+        TEST_ASSERT_TRUE(mqtt_receive(packet, size));
+    }
+    dispatch_stop();
+
+    TEST_ASSERT_EQUAL_INT(MESSAGES, atomic_load(&g_handled));
+    TEST_ASSERT_FALSE(atomic_load(&g_out_of_order));
+}
+
+void test_dispatch_invalid_start()
+{
+    TEST_ASSERT_FALSE(dispatch_start(0, 8, &handler_));
+    TEST_ASSERT_FALSE(dispatch_start(2, 0, &handler_));
+    TEST_ASSERT_FALSE(dispatch_start(2, 8, NULL));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Dispatch");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_dispatch_keeps_topic_order_with_retain, tCntr++);
+    RUN_TEST(test_dispatch_copies_without_pin_hook,       tCntr++);
+    RUN_TEST(test_dispatch_invalid_start,                 tCntr++);
+    return (UnityEnd());
+}
@@ -0,0 +1,232 @@
+#include "mqtt.h"
+#include "unity.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MESSAGES     400
+#define BATCH_VIEWS  64
+#define PUBLISH_SIZE 12
+#define ROUNDS       2000
+
+static MQTT_shared_data_t  g_shared;
+static MQTT_message_view_t g_views[BATCH_VIEWS];
+static uint8_t             g_stream[MESSAGES * PUBLISH_SIZE + 64];
+static size_t              g_stream_size = 0;
+
+/* Delivery log - payload number of each message, -1 for SUBACK */
+static int32_t             g_log[MESSAGES + 8];
+static uint32_t            g_logged        = 0;
+static uint32_t            g_batches       = 0;
+static size_t              g_largest_batch = 0;
+static uint32_t            g_messages      = 0;
+
+/* PUBLISH QoS0, topic "a/b", payload "m" + 4 digit number */
+static size_t publish_(uint8_t * a_data_ptr, uint32_t a_number)
+{
+    uint8_t publish[PUBLISH_SIZE + 1] = {0x30, 0x0a, 0x00, 0x03, 'a', '/', 'b'};
+    snprintf((char*)&publish[7], 6, "m%04u", a_number);
+    memcpy(a_data_ptr, publish, PUBLISH_SIZE);
+    return PUBLISH_SIZE;
+}
+
+static int32_t number_(uint8_t * a_payload_ptr)
+{
+    int32_t value = 0;
+    for (uint32_t i = 1; i < 5; i++)
+        value = value * 10 + (a_payload_ptr[i] - '0');
+    return value;
+}
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    a_data_ptr = a_data_ptr;
+    return (int)a_amount;
+}
+
+void batch_cb_(MQTT_message_view_t * a_views_ptr, size_t a_count)
+{
+    g_batches++;
+    if (a_count > g_largest_batch)
+        g_largest_batch = a_count;
+    for (size_t i = 0; i < a_count; i++) {
+        TEST_ASSERT_EQUAL_UINT32(5, a_views_ptr[i].payload_length);
+        TEST_ASSERT_EQUAL_UINT16(3, a_views_ptr[i].topic_length);
+        g_log[g_logged++] = number_(a_views_ptr[i].payload_ptr);
+    }
+}
+
+void count_cb_(MQTT_message_view_t * a_views_ptr, size_t a_count)
+{
+    a_views_ptr = a_views_ptr;
+    g_batches++;
+    g_messages += (uint32_t)a_count;
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_status    = a_status;
+    a_data_len  = a_data_len;
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if (NULL == a_data_ptr)
+        g_log[g_logged++] = -1;
+    else
+        g_messages++;
+}
+
+void init_()
+{
+    static uint8_t buffer[128];
+    g_shared.buffer            = buffer;
+    g_shared.buffer_size       = sizeof(buffer);
+    g_shared.out_fptr          = &out_fptr_;
+    g_shared.subscribe_cb_fptr = &subscribe_cb_;
+
+    MQTT_action_data_t action;
+    action.action_argument.shared_ptr = &g_shared;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt(ACTION_INIT, &action));
+
+    g_logged        = 0;
+    g_batches       = 0;
+    g_largest_batch = 0;
+    g_messages      = 0;
+}
+
+/* MESSAGES publishes, SUBACK after the first half, first bytes of a publish at the end */
+static void build_stream_()
+{
+    uint8_t suback[] = {0x90, 0x03, 0x00, 0x01, 0x00};
+
+    g_stream_size = 0;
+    for (uint32_t i = 0; i < MESSAGES; i++) {
+        if ((MESSAGES / 2) == i) {
+            memcpy(&g_stream[g_stream_size], suback, sizeof(suback));
+            g_stream_size += sizeof(suback);
+        }
+        g_stream_size += publish_(&g_stream[g_stream_size], i);
+    }
+    publish_(&g_stream[g_stream_size], MESSAGES);
+    g_stream_size += 5;
+}
+
+void test_message_batch_stream_order()
+{
+    init_();
+    build_stream_();
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&batch_cb_, g_views, BATCH_VIEWS));
+
+    /* Partial last packet is left for the next read */
+    TEST_ASSERT_EQUAL_UINT32(g_stream_size - 5, (uint32_t)mqtt_receive_stream(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(MESSAGES + 1, g_logged);
+    TEST_ASSERT_EQUAL_UINT32(0, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(BATCH_VIEWS, (uint32_t)g_largest_batch);
+
+    /* SUBACK is reported after messages before it and before messages after it */
+    for (uint32_t i = 0, number = 0; i < g_logged; i++) {
+        if ((MESSAGES / 2) == i)
+            TEST_ASSERT_EQUAL_INT32(-1, g_log[i]);
+        else
+            TEST_ASSERT_EQUAL_INT32(number++, g_log[i]);
+    }
+
+    /* 200 + 200 messages in batches of 64, flushed at SUBACK and at end of the read */
+    TEST_ASSERT_EQUAL_UINT32(2 * ((MESSAGES / 2 + BATCH_VIEWS - 1) / BATCH_VIEWS), g_batches);
+
+    /* Rest of the packet arrives */
+    uint8_t tail[PUBLISH_SIZE];
+    publish_(tail, MESSAGES);
+    TEST_ASSERT_EQUAL_UINT32(PUBLISH_SIZE, (uint32_t)mqtt_receive_stream(tail, sizeof(tail)));
+    TEST_ASSERT_EQUAL_INT32(MESSAGES, g_log[g_logged - 1]);
+}
+
+void test_message_batch_per_receive()
+{
+    /* Each mqtt_receive call is one batch of one message */
+    init_();
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&batch_cb_, g_views, BATCH_VIEWS));
+
+    uint8_t publish[PUBLISH_SIZE];
+    for (uint32_t i = 0; i < 3; i++) {
+        publish_(publish, i);
+        TEST_ASSERT_TRUE(mqtt_receive(publish, sizeof(publish)));
+        TEST_ASSERT_EQUAL_UINT32(i + 1, g_batches);
+    }
+    TEST_ASSERT_EQUAL_UINT32(3, g_logged);
+    TEST_ASSERT_EQUAL_UINT32(0, g_messages);
+}
+
+void test_message_batch_disabled()
+{
+    init_();
+    build_stream_();
+    TEST_ASSERT_FALSE(mqtt_set_message_batch_cb(&batch_cb_, NULL, BATCH_VIEWS));
+    TEST_ASSERT_FALSE(mqtt_set_message_batch_cb(&batch_cb_, g_views, 0));
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&batch_cb_, g_views, BATCH_VIEWS));
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(NULL, NULL, 0));
+
+    /* Messages go to the subscribe callback as before */
+    TEST_ASSERT_EQUAL_UINT32(g_stream_size - 5, (uint32_t)mqtt_receive_stream(g_stream, g_stream_size));
+    TEST_ASSERT_EQUAL_UINT32(0, g_batches);
+    TEST_ASSERT_EQUAL_UINT32(MESSAGES, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(1, g_logged);
+
+    /* Cleared by init */
+    init_();
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&batch_cb_, g_views, BATCH_VIEWS));
+    init_();
+    TEST_ASSERT_EQUAL_UINT32(PUBLISH_SIZE, (uint32_t)mqtt_receive_stream(g_stream, PUBLISH_SIZE));
+    TEST_ASSERT_EQUAL_UINT32(0, g_batches);
+    TEST_ASSERT_EQUAL_UINT32(1, g_messages);
+}
+
+void test_message_batch_throughput()
+{
+    /* Per packet mqtt_receive with subscribe callback vs. one call per read with batches */
+    build_stream_();
+    init_();
+    clock_t start = clock();
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        g_logged = 0;
+        for (size_t offset = 0; offset < (g_stream_size - 5); ) {
+            size_t size = (0x90 == g_stream[offset]) ? 5 : PUBLISH_SIZE;
+            mqtt_receive(&g_stream[offset], size);
+            offset += size;
+        }
+    }
+    double single = (double)(clock() - start) / CLOCKS_PER_SEC;
+    TEST_ASSERT_EQUAL_UINT32(ROUNDS * MESSAGES, g_messages);
+
+    init_();
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&count_cb_, g_views, BATCH_VIEWS));
+    start = clock();
+    for (uint32_t round = 0; round < ROUNDS; round++) {
+        g_logged = 0;
+        mqtt_receive_stream(g_stream, g_stream_size - 5);
+    }
+    double batched = (double)(clock() - start) / CLOCKS_PER_SEC;
+    TEST_ASSERT_EQUAL_UINT32(ROUNDS * MESSAGES, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(ROUNDS * 2 * ((MESSAGES / 2 + BATCH_VIEWS - 1) / BATCH_VIEWS), g_batches);
+
+    printf("%u messages: per packet %.3f s, batched %.3f s\n",
+           ROUNDS * MESSAGES, single, batched);
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Message batch");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_message_batch_stream_order, tCntr++);
+    RUN_TEST(test_message_batch_per_receive,  tCntr++);
+    RUN_TEST(test_message_batch_disabled,     tCntr++);
+    RUN_TEST(test_message_batch_throughput,   tCntr++);
+    return (UnityEnd());
+}
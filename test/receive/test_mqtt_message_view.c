@@ -0,0 +1,153 @@
+#include "mqtt.h"
+#include "unity.h"
+
+#include <string.h>
+
+static MQTT_shared_data_t  g_shared;
+static MQTT_message_view_t g_view;
+static uint32_t            g_view_calls      = 0;
+static uint32_t            g_subscribe_calls = 0;
+static int32_t             g_pins            = 0;
+static bool                g_retain_in_cb    = false;
+static bool                g_retained        = false;
+
+/* PUBLISH QoS0, retain set, topic "a/b", payload "hello" */
+static uint8_t g_publish[] = {0x31, 0x0a, 0x00, 0x03, 'a', '/', 'b', 'h', 'e', 'l', 'l', 'o'};
+
+int out_fptr_(uint8_t * a_data_ptr, size_t a_amount)
+{
+    a_data_ptr = a_data_ptr;
+    return (int)a_amount;
+}
+
+bool pin_fptr_(uint8_t * a_data_ptr, bool a_pin)
+{
+    if ((a_data_ptr < g_publish) ||
+        (a_data_ptr >= g_publish + sizeof(g_publish)))
+        return false;
+    g_pins += a_pin ? 1 : -1;
+    return true;
+}
+
+void view_cb_(MQTT_message_view_t * a_view_ptr)
+{
+    g_view_calls++;
+    g_view = *a_view_ptr;
+    if (g_retain_in_cb)
+        g_retained = mqtt_message_retain(a_view_ptr);
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_status    = a_status;
+    a_data_ptr  = a_data_ptr;
+    a_data_len  = a_data_len;
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    g_subscribe_calls++;
+}
+
+void init_()
+{
+    static uint8_t buffer[128];
+    g_shared.buffer            = buffer;
+    g_shared.buffer_size       = sizeof(buffer);
+    g_shared.out_fptr          = &out_fptr_;
+    g_shared.subscribe_cb_fptr = &subscribe_cb_;
+
+    MQTT_action_data_t action;
+    action.action_argument.shared_ptr = &g_shared;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt(ACTION_INIT, &action));
+
+    memset(&g_view, 0, sizeof(g_view));
+    g_view_calls      = 0;
+    g_subscribe_calls = 0;
+    g_pins            = 0;
+    g_retain_in_cb    = false;
+    g_retained        = false;
+}
+
+void test_message_view_points_into_input()
+{
+    init_();
+    mqtt_set_message_view_cb(&view_cb_, NULL);
+
+    TEST_ASSERT_TRUE(mqtt_receive(g_publish, sizeof(g_publish)));
+    TEST_ASSERT_EQUAL_UINT32(1, g_view_calls);
+    TEST_ASSERT_EQUAL_UINT32(0, g_subscribe_calls);
+
+    TEST_ASSERT_EQUAL_PTR(g_publish,     g_view.packet_ptr);
+    TEST_ASSERT_EQUAL_PTR(&g_publish[4], g_view.topic_ptr);
+    TEST_ASSERT_EQUAL_UINT16(3,          g_view.topic_length);
+    TEST_ASSERT_EQUAL_PTR(&g_publish[7], g_view.payload_ptr);
+    TEST_ASSERT_EQUAL_UINT32(5,          g_view.payload_length);
+    TEST_ASSERT_EQUAL_INT(QoS0,          g_view.qos);
+    TEST_ASSERT_TRUE(g_view.retain);
+    TEST_ASSERT_FALSE(g_view.dup);
+}
+
+void test_message_view_retain_without_pin_hook()
+{
+    init_();
+    mqtt_set_message_view_cb(&view_cb_, NULL);
+    g_retain_in_cb = true;
+
+    TEST_ASSERT_TRUE(mqtt_receive(g_publish, sizeof(g_publish)));
+    TEST_ASSERT_FALSE(g_retained);
+}
+
+void test_message_view_retain_and_release()
+{
+    init_();
+    mqtt_set_message_view_cb(&view_cb_, &pin_fptr_);
+    g_retain_in_cb = true;
+
+    TEST_ASSERT_TRUE(mqtt_receive(g_publish, sizeof(g_publish)));
+    TEST_ASSERT_TRUE(g_retained);
+    TEST_ASSERT_EQUAL_INT32(1, g_pins);
+
+    mqtt_message_release(&g_view);
+    TEST_ASSERT_EQUAL_INT32(0, g_pins);
+}
+
+void test_message_view_disabled()
+{
+    init_();
+    mqtt_set_message_view_cb(&view_cb_, NULL);
+    mqtt_set_message_view_cb(NULL, NULL);
+
+    TEST_ASSERT_TRUE(mqtt_receive(g_publish, sizeof(g_publish)));
+    TEST_ASSERT_EQUAL_UINT32(0, g_view_calls);
+    TEST_ASSERT_EQUAL_UINT32(1, g_subscribe_calls);
+}
+
+void test_message_view_cleared_by_init()
+{
+    init_();
+    mqtt_set_message_view_cb(&view_cb_, &pin_fptr_);
+    init_();
+
+    TEST_ASSERT_TRUE(mqtt_receive(g_publish, sizeof(g_publish)));
+    TEST_ASSERT_EQUAL_UINT32(0, g_view_calls);
+    TEST_ASSERT_EQUAL_UINT32(1, g_subscribe_calls);
+    TEST_ASSERT_FALSE(mqtt_message_retain(&g_view));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Message view");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_message_view_points_into_input,       tCntr++);
+    RUN_TEST(test_message_view_retain_without_pin_hook, tCntr++);
+    RUN_TEST(test_message_view_retain_and_release,      tCntr++);
+    RUN_TEST(test_message_view_disabled,                tCntr++);
+    RUN_TEST(test_message_view_cleared_by_init,         tCntr++);
+    return (UnityEnd());
+}
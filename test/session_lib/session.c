@@ -0,0 +1,26 @@
+#include "session.h"
+#include "unity.h"
+
+void session_connect(MQTT_shared_data_t * a_shared_ptr,
+                     char               * a_client_id_ptr,
+                     uint16_t             a_keepalive)
+{
+    MQTT_action_data_t action;
+    action.action_argument.shared_ptr = a_shared_ptr;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt(ACTION_INIT, &action));
+
+    MQTT_connect_t connect_params;
+    uint8_t aparam[] = "\0";
+    connect_params.client_id                    = (uint8_t*)a_client_id_ptr;
+    connect_params.last_will_topic              = aparam;
+    connect_params.last_will_message            = aparam;
+    connect_params.username                     = aparam;
+    connect_params.password                     = aparam;
+    connect_params.keepalive                    = a_keepalive;
+    connect_params.connect_flags.clean_session  = true;
+    connect_params.connect_flags.last_will_qos  = 0;
+    connect_params.connect_flags.permanent_will = false;
+
+    action.action_argument.connect_ptr = &connect_params;
+    TEST_ASSERT_EQUAL_INT(Successfull, mqtt(ACTION_CONNECT, &action));
+}
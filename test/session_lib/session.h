@@ -0,0 +1,15 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>  // uint
+
+#include "mqtt.h"
+
+/* Initialize the library on a_shared_ptr and connect with a clean session. Last will,
+   username and password are empty. Buffer, transport and callbacks are set by the test
+   before the call. Keepalive 0 leaves mqtt_keepalive() only moving time. */
+void session_connect(MQTT_shared_data_t * a_shared_ptr,
+                     char               * a_client_id_ptr,
+                     uint16_t             a_keepalive);
+
+#endif
@@ -0,0 +1,179 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "sim.h"
+
+#include <string.h>
+
+#define RTT_MS 600
+
+static uint8_t              g_buffer[1024];
+static uint8_t              g_flight[1024];
+static uint8_t              g_frame_storage[128];
+static uint32_t             g_pool[MQTT_PACKET_ID_POOL_WORDS(64)];
+static MQTT_shared_data_t   g_shared;
+static MQTT_connect_frame_t g_frame;
+static bool                 g_connack  = false;
+static uint32_t             g_subacks  = 0;
+static uint32_t             g_messages = 0;
+static bool                 g_subscribed = false;
+static bool                 g_published  = false;
+static bool                 g_streamed   = false;
+
+void connected_cb_(MQTTErrorCodes_t a_status)
+{
+    g_connack = (Successfull == a_status);
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if (NULL == a_data_ptr)
+        g_subacks++;
+    else if ((Successfull == a_status) && (5 == a_data_len) && (0 == memcmp("first", a_data_ptr, 5)))
+        g_messages++;
+}
+
+int pull_(uint8_t * a_data_ptr, size_t a_amount, size_t a_offset)
+{
+    a_offset = a_offset;
+    memset(a_data_ptr, 'x', a_amount);
+    return (int)a_amount;
+}
+
+void startup_()
+{
+    TEST_ASSERT_TRUE(mqtt_set_packet_id_pool(g_pool, sizeof(g_pool) / sizeof(g_pool[0])));
+    g_subscribed = mqtt_subscribe("sim/pipe", 8, 0);
+    g_published  = mqtt_publish("sim/pipe", 8, "first", 5);
+    g_streamed   = mqtt_publish_stream("sim/pipe", 8, 16, &pull_);
+}
+
+static void scenario_()
+{
+    sim_config_t config;
+    config.seed        = 1;
+    config.latency_ms  = RTT_MS / 2;
+    config.jitter_ms   = 0;
+    config.tick_ms     = 0;
+    config.closed_fptr = NULL;
+    sim_reset(&config);
+    sim_link_up();
+
+    g_connack    = false;
+    g_subacks    = 0;
+    g_messages   = 0;
+    g_subscribed = false;
+    g_published  = false;
+    g_streamed   = false;
+
+    TEST_ASSERT_TRUE(mqtt_connect_prebuild(&g_frame,
+                                           g_frame_storage,
+                                           sizeof(g_frame_storage),
+                                           mqtt_string("JAMKtest pipeline"),
+                                           mqtt_string(""),
+                                           mqtt_string(""),
+                                           mqtt_string(""),
+                                           mqtt_string(""),
+                                           30,
+                                           true));
+}
+
+static void run_until_(bool * a_flag_ptr)
+{
+    for (uint32_t i = 0; (i < 10000) && (false == *a_flag_ptr); i++)
+        sim_run(1);
+}
+
+static void run_until_count_(uint32_t * a_count_ptr)
+{
+    for (uint32_t i = 0; (i < 10000) && (0 == *a_count_ptr); i++)
+        sim_run(1);
+}
+
+void test_pipeline_sequential_baseline()
+{
+    scenario_();
+    TEST_ASSERT_TRUE(mqtt_connect_prebuilt(&g_frame, &g_shared, g_buffer, sizeof(g_buffer),
+                                           &sim_write, &connected_cb_, &subscribe_cb_, 0));
+    run_until_(&g_connack);
+    TEST_ASSERT_TRUE(mqtt_subscribe("sim/pipe", 8, 0));
+    run_until_count_(&g_subacks);
+    TEST_ASSERT_TRUE(mqtt_publish("sim/pipe", 8, "first", 5));
+    run_until_count_(&g_messages);
+
+    TEST_ASSERT_EQUAL_UINT32(1, g_messages);
+    TEST_ASSERT_EQUAL_UINT64(3 * RTT_MS, sim_now_ms());
+    TEST_ASSERT_EQUAL_UINT32(3, sim_stats()->writes);
+}
+
+void test_pipeline_one_flight()
+{
+    scenario_();
+    TEST_ASSERT_TRUE(mqtt_connect_pipelined(&g_frame, &g_shared, g_buffer, sizeof(g_buffer),
+                                            g_flight, sizeof(g_flight),
+                                            &sim_write, &connected_cb_, &subscribe_cb_, &startup_));
+    TEST_ASSERT_TRUE(g_subscribed);
+    TEST_ASSERT_TRUE(g_published);
+    TEST_ASSERT_FALSE(g_streamed);
+    TEST_ASSERT_EQUAL_UINT32(1, sim_stats()->writes);
+    TEST_ASSERT_EQUAL_UINT32(1, mqtt_packet_ids_in_use());
+
+    run_until_count_(&g_messages);
+
+    /* CONNACK, SUBACK and own message after one round trip */
+    TEST_ASSERT_EQUAL_UINT64(RTT_MS, sim_now_ms());
+    TEST_ASSERT_TRUE(g_connack);
+    TEST_ASSERT_EQUAL_UINT32(1, g_subacks);
+    TEST_ASSERT_EQUAL_UINT32(1, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(0, mqtt_packet_ids_in_use());
+    TEST_ASSERT_EQUAL_UINT32(1, sim_stats()->connects);
+    TEST_ASSERT_EQUAL_UINT32(1, sim_stats()->subscribes);
+    TEST_ASSERT_EQUAL_UINT32(1, sim_stats()->publishes);
+
+    /* Gathering ended with the startup - later packets go out directly */
+    TEST_ASSERT_TRUE(mqtt_publish("sim/pipe", 8, "first", 5));
+    TEST_ASSERT_EQUAL_UINT32(2, sim_stats()->writes);
+    TEST_ASSERT_TRUE(mqtt_publish_stream("sim/pipe", 8, 16, &pull_));
+}
+
+void test_pipeline_flight_full()
+{
+    /* Room for CONNECT and SUBSCRIBE only - publish is refused, rest goes out */
+    scenario_();
+    size_t flight = g_frame.frame_size + 2 + 2 + 2 + 8 + 1;
+    TEST_ASSERT_TRUE(mqtt_connect_pipelined(&g_frame, &g_shared, g_buffer, sizeof(g_buffer),
+                                            g_flight, flight,
+                                            &sim_write, &connected_cb_, &subscribe_cb_, &startup_));
+    TEST_ASSERT_TRUE(g_subscribed);
+    TEST_ASSERT_FALSE(g_published);
+    run_until_count_(&g_subacks);
+    TEST_ASSERT_TRUE(g_connack);
+    TEST_ASSERT_EQUAL_UINT32(0, sim_stats()->publishes);
+
+    /* CONNECT itself does not fit - nothing is written */
+    scenario_();
+    TEST_ASSERT_FALSE(mqtt_connect_pipelined(&g_frame, &g_shared, g_buffer, sizeof(g_buffer),
+                                             g_flight, g_frame.frame_size - 1,
+                                             &sim_write, &connected_cb_, &subscribe_cb_, &startup_));
+    TEST_ASSERT_FALSE(g_subscribed);
+    TEST_ASSERT_EQUAL_UINT32(0, sim_stats()->writes);
+    TEST_ASSERT_FALSE(mqtt_publish("sim/pipe", 8, "first", 5));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Pipelined startup");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_pipeline_sequential_baseline, tCntr++);
+    RUN_TEST(test_pipeline_one_flight,          tCntr++);
+    RUN_TEST(test_pipeline_flight_full,         tCntr++);
+    return (UnityEnd());
+}
@@ -0,0 +1,248 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define RANDOM_SCENARIOS 2000
+
+static uint8_t            g_buffer[1024];
+static MQTT_shared_data_t g_shared;
+static bool               g_connack  = false;
+static bool               g_closed   = false;
+static uint32_t           g_messages = 0;
+
+void connected_cb_(MQTTErrorCodes_t a_status)
+{
+    g_connack = (Successfull == a_status);
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_data_len  = a_data_len;
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if ((Successfull == a_status) && (NULL != a_data_ptr))
+        g_messages++;
+}
+
+void closed_cb_()
+{
+    g_closed = true;
+}
+
+static void scenario_(uint32_t a_seed, uint32_t a_latency_ms, uint32_t a_jitter_ms, uint32_t a_tick_ms)
+{
+    sim_config_t config;
+    config.seed        = a_seed;
+    config.latency_ms  = a_latency_ms;
+    config.jitter_ms   = a_jitter_ms;
+    config.tick_ms     = a_tick_ms;
+    config.closed_fptr = &closed_cb_;
+    sim_reset(&config);
+
+    g_connack  = false;
+    g_closed   = false;
+    g_messages = 0;
+}
+
+static bool connect_(uint16_t a_keepalive)
+{
+    uint8_t empty[] = "\0";
+
+    g_connack = false;
+    g_closed  = false;
+    sim_link_up();
+    return mqtt_connect("JAMKtest sim",
+                        a_keepalive,
+                        empty,
+                        empty,
+                        empty,
+                        empty,
+                        &g_shared,
+                        g_buffer,
+                        sizeof(g_buffer),
+                        true,
+                        &sim_write,
+                        &connected_cb_,
+                        &subscribe_cb_,
+                        5);
+}
+
+static uint32_t random_(uint32_t * a_state_ptr, uint32_t a_min, uint32_t a_max)
+{
+    *a_state_ptr ^= *a_state_ptr << 13;
+    *a_state_ptr ^= *a_state_ptr >> 17;
+    *a_state_ptr ^= *a_state_ptr << 5;
+    return a_min + (*a_state_ptr % (a_max - a_min + 1));
+}
+
+void test_sim_keepalive_idle()
+{
+    /* 10 minutes of idle connection */
+    scenario_(1, 20, 0, 100);
+    TEST_ASSERT_TRUE(connect_(5));
+    sim_run(600000);
+
+    TEST_ASSERT_TRUE(g_connack);
+    TEST_ASSERT_EQUAL_UINT64(600000, sim_now_ms());
+
+    /* First ping on first tick, then every keepalive - 0.5 s */
+    TEST_ASSERT_EQUAL_UINT32(1 + (600000 - 100) / 4500, sim_stats()->pings);
+    TEST_ASSERT_EQUAL_UINT32(0, sim_stats()->keepalive_closes);
+    TEST_ASSERT_TRUE(4500 >= sim_stats()->max_silence_ms);
+    TEST_ASSERT_TRUE(mqtt_disconnect());
+}
+
+void test_sim_keepalive_inbound_traffic()
+{
+    /* Broker streams to the client, client only receives */
+    scenario_(2, 50, 0, 100);
+    TEST_ASSERT_TRUE(connect_(2));
+    TEST_ASSERT_TRUE(mqtt_subscribe("sim/in", 6, 0));
+
+    for (uint32_t i = 0; i < 600; i++) {
+        TEST_ASSERT_TRUE(sim_broker_publish("sim/in", (const uint8_t *)"data", 4));
+        sim_run(100);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(600, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(0, sim_stats()->keepalive_closes);
+    TEST_ASSERT_FALSE(g_closed);
+    TEST_ASSERT_TRUE(3000 > sim_stats()->max_silence_ms);
+}
+
+void test_sim_keepalive_stopped()
+{
+    /* Application stops calling mqtt_keepalive - broker closes 1.5 x keepalive after CONNECT */
+    scenario_(3, 10, 0, 0);
+    TEST_ASSERT_TRUE(connect_(4));
+    sim_run(10 + 5999);
+    TEST_ASSERT_FALSE(g_closed);
+    sim_run(1);
+    TEST_ASSERT_TRUE(g_closed);
+    TEST_ASSERT_EQUAL_UINT32(1, sim_stats()->keepalive_closes);
+    TEST_ASSERT_EQUAL_INT(-1, sim_write(g_buffer, 2));
+}
+
+void test_sim_reconnect()
+{
+    /* Application policy: CONNACK within 3 s, retry with doubling backoff up to 8 s */
+    uint32_t backoff_ms  = 1000;
+    uint32_t wait_ms     = 0;
+    uint32_t drops       = 0;
+    uint32_t attempts    = 1;
+    uint64_t first_ack   = 0;
+
+    scenario_(4, 30, 20, 100);
+    sim_broker_mute(true);
+    TEST_ASSERT_TRUE(connect_(3));
+
+    for (uint32_t t = 0; t < 300000; t += 100) {
+        /* Broker comes back after 10 s, link drops every 40 s */
+        if (10000 == t)
+            sim_broker_mute(false);
+        if ((0 == (t % 40000)) && (0 < t) && sim_link_is_up() && g_connack) {
+            sim_link_down();
+            drops++;
+        }
+        sim_run(100);
+
+        if ((false == g_connack) && sim_link_is_up() && (3000 <= (wait_ms += 100))) {
+            sim_link_down();
+            g_closed = true;
+        }
+        if (g_closed) {
+            sim_run(backoff_ms);
+            t += backoff_ms;
+            backoff_ms = (8000 > backoff_ms) ? 2 * backoff_ms : 8000;
+            wait_ms    = 0;
+            attempts++;
+            TEST_ASSERT_TRUE(connect_(3));
+        }
+        if (g_connack) {
+            backoff_ms = 1000;
+            if (0 == first_ack)
+                first_ack = sim_now_ms();
+        }
+    }
+
+    /* Muted broker: attempts at 0, 4 and 9 s time out, fourth at 16 s is acked */
+    TEST_ASSERT_EQUAL_UINT64(16100, first_ack);
+    TEST_ASSERT_TRUE(g_connack);
+    TEST_ASSERT_EQUAL_UINT32(7, drops);
+    TEST_ASSERT_EQUAL_UINT32(4 + drops, attempts);
+    TEST_ASSERT_EQUAL_UINT32(attempts, sim_stats()->connects);
+    TEST_ASSERT_EQUAL_UINT32(0, sim_stats()->keepalive_closes);
+}
+
+void test_sim_random_scenarios()
+{
+    uint32_t failures = 0;
+    uint64_t events   = 0;
+    clock_t  start    = clock();
+
+    for (uint32_t seed = 1; seed <= RANDOM_SCENARIOS; seed++) {
+        uint32_t state     = seed * 2654435761u;
+        uint16_t keepalive = (uint16_t)random_(&state, 1, 30);
+        uint32_t tick      = random_(&state, 50, 500);
+        uint32_t latency   = random_(&state, 0, 300);
+        uint32_t jitter    = random_(&state, 0, 200);
+        uint32_t inbound   = random_(&state, 0, 3);
+        uint32_t outbound  = random_(&state, 0, 3);
+
+        scenario_(seed, latency, jitter, tick);
+        if (false == connect_(keepalive)) {
+            failures++;
+            continue;
+        }
+        mqtt_subscribe("sim/r", 5, 0);
+
+        /* 20 keepalive periods, traffic in random 100 ms slots */
+        for (uint32_t t = 0; t < (20000u * keepalive); t += 100) {
+            if (inbound > random_(&state, 0, 9))
+                sim_broker_publish("sim/r", (const uint8_t *)"in", 2);
+            if (outbound > random_(&state, 0, 9))
+                mqtt_publish("sim/r", 5, "out", 3);
+            sim_run(100);
+        }
+        events += sim_stats()->delivered + sim_stats()->pings + sim_stats()->publishes;
+
+        if ((false == g_connack) ||
+            (0 != sim_stats()->keepalive_closes) ||
+            ((1500u * keepalive) < sim_stats()->max_silence_ms)) {
+            printf("Scenario %u failed: keepalive %u tick %u latency %u jitter %u silence %u\n",
+                   seed, keepalive, tick, latency, jitter, sim_stats()->max_silence_ms);
+            failures++;
+        }
+        mqtt_disconnect();
+        sim_link_down();
+    }
+
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("%u scenarios, %llu packets in %.2f s (%.0f scenarios/s)\n",
+           RANDOM_SCENARIOS, (unsigned long long)events, seconds,
+           (0 < seconds) ? RANDOM_SCENARIOS / seconds : 0);
+    TEST_ASSERT_EQUAL_UINT32(0, failures);
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    UnityBegin("Simulation");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_sim_keepalive_idle,             tCntr++);
+    RUN_TEST(test_sim_keepalive_inbound_traffic,  tCntr++);
+    RUN_TEST(test_sim_keepalive_stopped,          tCntr++);
+    RUN_TEST(test_sim_reconnect,                  tCntr++);
+    RUN_TEST(test_sim_random_scenarios,           tCntr++);
+    return (UnityEnd());
+}
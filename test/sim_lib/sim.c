@@ -0,0 +1,366 @@
+#include <string.h>  // memcpy
+#include "mqtt.h"
+#include "sim.h"
+
+#define SIM_SEGMENTS      64
+#define SIM_SEGMENT_SIZE  512
+#define SIM_STREAM_SIZE   (4 * SIM_SEGMENT_SIZE)
+
+/* Bytes of one write, delivered at once when virtual time reaches due_ms */
+typedef struct sim_segment
+{
+    uint64_t   due_ms;
+    uint16_t   size;
+    uint8_t    data[SIM_SEGMENT_SIZE];
+} sim_segment_t;
+
+/* One direction of the link, in order like a TCP stream */
+typedef struct sim_queue
+{
+    sim_segment_t   segments[SIM_SEGMENTS];
+    uint32_t        head;
+    uint32_t        count;
+    uint64_t        last_due_ms;
+} sim_queue_t;
+
+static sim_config_t  sim_config;
+static sim_stats_t   sim_counters;
+static uint64_t      sim_now          = 0;
+static uint64_t      sim_next_tick    = 0;
+static uint64_t      sim_last_tick    = 0;
+static uint32_t      sim_random       = 1;
+static bool          sim_link         = false;
+static bool          sim_running      = false;
+
+static sim_queue_t   sim_to_broker;
+static sim_queue_t   sim_to_client;
+
+static bool          broker_mute      = false;
+static bool          broker_session   = false;
+static bool          broker_subscribed = false;
+static uint32_t      broker_keepalive_ms = 0;
+static uint64_t      broker_last_rx   = 0;
+static uint8_t       broker_stream[SIM_STREAM_SIZE];
+static size_t        broker_stream_used = 0;
+
+static uint32_t sim_rand()
+{
+    /* xorshift32 - same sequence for same seed on every host */
+    sim_random ^= sim_random << 13;
+    sim_random ^= sim_random >> 17;
+    sim_random ^= sim_random << 5;
+    return sim_random;
+}
+
+static bool sim_queue_push(sim_queue_t * a_queue_ptr, const uint8_t * a_data, size_t a_amount)
+{
+    uint64_t due = sim_now + sim_config.latency_ms;
+    if (0 < sim_config.jitter_ms)
+        due += sim_rand() % (sim_config.jitter_ms + 1);
+
+    /* Stream is never reordered by jitter */
+    if (due < a_queue_ptr->last_due_ms)
+        due = a_queue_ptr->last_due_ms;
+
+    while (0 < a_amount) {
+        if (SIM_SEGMENTS == a_queue_ptr->count)
+            return false;
+
+        size_t          size    = (SIM_SEGMENT_SIZE < a_amount) ? SIM_SEGMENT_SIZE : a_amount;
+        sim_segment_t * segment = &a_queue_ptr->segments[(a_queue_ptr->head + a_queue_ptr->count) % SIM_SEGMENTS];
+        segment->due_ms = due;
+        segment->size   = (uint16_t)size;
+        memcpy(segment->data, a_data, size);
+        a_queue_ptr->count++;
+        a_data   += size;
+        a_amount -= size;
+    }
+    a_queue_ptr->last_due_ms = due;
+    return true;
+}
+
+static sim_segment_t * sim_queue_due(sim_queue_t * a_queue_ptr)
+{
+    if ((0 == a_queue_ptr->count) ||
+        (sim_now < a_queue_ptr->segments[a_queue_ptr->head].due_ms))
+        return NULL;
+    return &a_queue_ptr->segments[a_queue_ptr->head];
+}
+
+static void sim_queue_pop(sim_queue_t * a_queue_ptr)
+{
+    a_queue_ptr->head = (a_queue_ptr->head + 1) % SIM_SEGMENTS;
+    a_queue_ptr->count--;
+}
+
+static uint64_t sim_queue_next(sim_queue_t * a_queue_ptr, uint64_t a_next)
+{
+    if ((0 < a_queue_ptr->count) &&
+        (a_queue_ptr->segments[a_queue_ptr->head].due_ms < a_next))
+        return a_queue_ptr->segments[a_queue_ptr->head].due_ms;
+    return a_next;
+}
+
+static uint64_t broker_deadline()
+{
+    /* Broker closes the connection after 1.5 times keepalive without a packet */
+    return broker_last_rx + broker_keepalive_ms + broker_keepalive_ms / 2;
+}
+
+static void broker_send(const uint8_t * a_data, size_t a_amount)
+{
+    if ((false == broker_mute) && sim_link)
+        sim_queue_push(&sim_to_client, a_data, a_amount);
+}
+
+static void broker_packet(uint8_t * a_packet, size_t a_header_size, size_t a_length)
+{
+    if (broker_session && (0 < broker_keepalive_ms)) {
+        uint64_t silence = sim_now - broker_last_rx;
+        if (silence > sim_counters.max_silence_ms)
+            sim_counters.max_silence_ms = (uint32_t)silence;
+    }
+    broker_last_rx = sim_now;
+
+    switch (a_packet[0] >> 4) {
+        case 1: { /* CONNECT - keepalive follows protocol name, level and flags */
+            uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+            sim_counters.connects++;
+            broker_session      = true;
+            broker_subscribed   = false;
+            broker_keepalive_ms = 0;
+            if ((a_header_size + 10) <= a_length)
+                broker_keepalive_ms = 1000 * (uint32_t)((a_packet[a_header_size + 8] << 8) |
+                                                         a_packet[a_header_size + 9]);
+            broker_send(connack, sizeof(connack));
+            break;
+        }
+        case 3: { /* PUBLISH - acked by QoS, echoed when client has subscribed */
+            uint8_t qos = (a_packet[0] >> 1) & 3;
+            sim_counters.publishes++;
+            if ((1 == qos) && ((a_header_size + 4) <= a_length)) {
+                size_t  id_offset = a_header_size + 2 + ((a_packet[a_header_size] << 8) | a_packet[a_header_size + 1]);
+                uint8_t puback[]  = {0x40, 0x02, 0x00, 0x00};
+                if ((id_offset + 2) <= a_length) {
+                    puback[2] = a_packet[id_offset];
+                    puback[3] = a_packet[id_offset + 1];
+                    broker_send(puback, sizeof(puback));
+                }
+            }
+            if (broker_subscribed && (0 == qos) && (SIM_SEGMENT_SIZE >= a_length))
+                broker_send(a_packet, a_length);
+            break;
+        }
+        case 8: { /* SUBSCRIBE */
+            uint8_t suback[] = {0x90, 0x03, 0x00, 0x00, 0x00};
+            sim_counters.subscribes++;
+            broker_subscribed = true;
+            if ((a_header_size + 2) <= a_length) {
+                suback[2] = a_packet[a_header_size];
+                suback[3] = a_packet[a_header_size + 1];
+            }
+            broker_send(suback, sizeof(suback));
+            break;
+        }
+        case 12: { /* PINGREQ */
+            uint8_t pingresp[] = {0xd0, 0x00};
+            sim_counters.pings++;
+            broker_send(pingresp, sizeof(pingresp));
+            break;
+        }
+        case 14: /* DISCONNECT - no keepalive supervision after it */
+            broker_session = false;
+            break;
+        default:
+            break;
+    }
+}
+
+/* Collect bytes from the link and handle complete packets */
+static void broker_receive(uint8_t * a_data, size_t a_amount)
+{
+    if (a_amount > (sizeof(broker_stream) - broker_stream_used))
+        a_amount = sizeof(broker_stream) - broker_stream_used;
+    memcpy(&broker_stream[broker_stream_used], a_data, a_amount);
+    broker_stream_used += a_amount;
+
+    size_t offset = 0;
+    while (2 <= (broker_stream_used - offset)) {
+        uint8_t * packet     = &broker_stream[offset];
+        size_t    value      = 0;
+        size_t    multiplier = 1;
+        size_t    cnt        = 1;
+        bool      complete   = false;
+
+        while ((cnt < (broker_stream_used - offset)) && (cnt < 5)) {
+            value      += (packet[cnt] & 127) * multiplier;
+            multiplier *= 128;
+            if (0 == (packet[cnt++] & 128)) {
+                complete = true;
+                break;
+            }
+        }
+        size_t length = cnt + value;
+        if ((false == complete) || (length > (broker_stream_used - offset))) {
+            /* Packet larger than the stream buffer is skipped as a whole */
+            if (complete && (length > sizeof(broker_stream)))
+                broker_stream_used = offset;
+            break;
+        }
+        broker_packet(packet, cnt, length);
+        offset += length;
+    }
+    memmove(broker_stream, &broker_stream[offset], broker_stream_used - offset);
+    broker_stream_used -= offset;
+}
+
+void sim_reset(const sim_config_t * a_config_ptr)
+{
+    memcpy(&sim_config, a_config_ptr, sizeof(sim_config));
+    memset(&sim_counters, 0, sizeof(sim_counters));
+    memset(&sim_to_broker, 0, sizeof(sim_to_broker));
+    memset(&sim_to_client, 0, sizeof(sim_to_client));
+
+    sim_now            = 0;
+    sim_next_tick      = 0;
+    sim_last_tick      = 0;
+    sim_random         = (0 == a_config_ptr->seed) ? 1 : a_config_ptr->seed;
+    sim_link           = false;
+    sim_running        = false;
+    broker_mute        = false;
+    broker_session     = false;
+    broker_subscribed  = false;
+    broker_stream_used = 0;
+}
+
+uint64_t sim_now_ms()
+{
+    return sim_now;
+}
+
+void sim_run(uint32_t a_duration_ms)
+{
+    uint64_t end = sim_now + a_duration_ms;
+
+    /* Blocking API called from a callback - time passes but nothing is delivered twice */
+    if (sim_running) {
+        sim_now = end;
+        return;
+    }
+    sim_running = true;
+
+    for (;;) {
+        uint64_t next = end;
+        next = sim_queue_next(&sim_to_broker, next);
+        next = sim_queue_next(&sim_to_client, next);
+        if (sim_link && (0 < sim_config.tick_ms) && (sim_next_tick < next))
+            next = sim_next_tick;
+        if (sim_link && broker_session && (0 < broker_keepalive_ms) && (broker_deadline() < next))
+            next = broker_deadline();
+        if (next > sim_now)
+            sim_now = next;
+
+        sim_segment_t * segment;
+        while (NULL != (segment = sim_queue_due(&sim_to_broker))) {
+            broker_receive(segment->data, segment->size);
+            sim_queue_pop(&sim_to_broker);
+        }
+        while (NULL != (segment = sim_queue_due(&sim_to_client))) {
+            /* Popped first - receive callback may write and fill the queue again */
+            uint8_t packet[SIM_SEGMENT_SIZE];
+            size_t  size = segment->size;
+            memcpy(packet, segment->data, size);
+            sim_queue_pop(&sim_to_client);
+            sim_counters.delivered++;
+            mqtt_receive(packet, size);
+        }
+
+        if (sim_link && broker_session && (0 < broker_keepalive_ms) && (broker_deadline() <= sim_now)) {
+            sim_counters.keepalive_closes++;
+            sim_link_down();
+        }
+
+        if (sim_link && (0 < sim_config.tick_ms) && (sim_next_tick <= sim_now)) {
+            uint32_t elapsed = (uint32_t)(sim_now - sim_last_tick);
+            sim_last_tick  = sim_now;
+            sim_next_tick  = sim_now + sim_config.tick_ms;
+            mqtt_keepalive(elapsed);
+        }
+
+        if (sim_now >= end)
+            break;
+    }
+    sim_running = false;
+}
+
+void sim_sleep(double a_seconds)
+{
+    sim_run((uint32_t)(a_seconds * 1000));
+}
+
+void sim_link_up()
+{
+    memset(&sim_to_broker, 0, sizeof(sim_to_broker));
+    memset(&sim_to_client, 0, sizeof(sim_to_client));
+    sim_link           = true;
+    sim_last_tick      = sim_now;
+    sim_next_tick      = sim_now + sim_config.tick_ms;
+    broker_session     = false;
+    broker_last_rx     = sim_now;
+    broker_stream_used = 0;
+}
+
+void sim_link_down()
+{
+    bool was_up = sim_link;
+
+    sim_link       = false;
+    broker_session = false;
+    sim_to_broker.count = 0;
+    sim_to_client.count = 0;
+    if (was_up && (NULL != sim_config.closed_fptr))
+        sim_config.closed_fptr();
+}
+
+bool sim_link_is_up()
+{
+    return sim_link;
+}
+
+int sim_write(uint8_t * a_data, size_t a_amount)
+{
+    if ((false == sim_link) ||
+        (false == sim_queue_push(&sim_to_broker, a_data, a_amount)))
+        return -1;
+    sim_counters.writes++;
+    return (int)a_amount;
+}
+
+void sim_broker_mute(bool a_mute)
+{
+    broker_mute = a_mute;
+}
+
+bool sim_broker_publish(const char * a_topic, const uint8_t * a_payload, size_t a_size)
+{
+    uint8_t packet[SIM_SEGMENT_SIZE];
+    size_t  topic_size = strlen(a_topic);
+    size_t  remaining  = 2 + topic_size + a_size;
+
+    if ((false == sim_link) || (127 < remaining))
+        return false;
+
+    packet[0] = 0x30;
+    packet[1] = (uint8_t)remaining;
+    packet[2] = (uint8_t)(topic_size >> 8);
+    packet[3] = (uint8_t)topic_size;
+    memcpy(&packet[4], a_topic, topic_size);
+    memcpy(&packet[4 + topic_size], a_payload, a_size);
+    broker_send(packet, 2 + remaining);
+    return true;
+}
+
+const sim_stats_t * sim_stats()
+{
+    return &sim_counters;
+}
@@ -0,0 +1,75 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>  // uint
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+/* Deterministic simulation of one client session.
+
+   Time is a virtual monotonic clock which moves only in sim_run(). The client writes
+   into an in-memory link (sim_write) which delivers the bytes to a scripted broker after
+   the configured latency, and broker answers come back through mqtt_receive() the same
+   way. Between deliveries the application tick calls mqtt_keepalive() with the virtual
+   time elapsed since previous tick.
+
+   The library is built for the simulation with this header force included, which maps
+   mqtt_sleep() of the blocking API waits to sim_sleep(). */
+
+#undef  mqtt_sleep
+#define mqtt_sleep(x) sim_sleep(x)
+
+typedef void (*sim_closed_fptr_t)(void);
+
+typedef struct sim_config
+{
+    uint32_t            seed;           /* Seed of latency jitter                      */
+    uint32_t            latency_ms;     /* One way latency of the link                 */
+    uint32_t            jitter_ms;      /* Random extra latency 0..jitter_ms           */
+    uint32_t            tick_ms;        /* Interval of mqtt_keepalive() calls, 0 = off */
+    sim_closed_fptr_t   closed_fptr;    /* Link closed by broker or sim_link_down()    */
+} sim_config_t;
+
+typedef struct sim_stats
+{
+    uint32_t   writes;              /* Successful sim_write() calls of the client        */
+    uint32_t   connects;            /* CONNECT packets received by broker                */
+    uint32_t   pings;               /* PINGREQ packets received by broker                */
+    uint32_t   publishes;           /* PUBLISH packets received by broker                */
+    uint32_t   subscribes;          /* SUBSCRIBE packets received by broker              */
+    uint32_t   delivered;           /* Packets given to mqtt_receive()                   */
+    uint32_t   keepalive_closes;    /* Broker closed link, keepalive * 1.5 without data  */
+    uint32_t   max_silence_ms;      /* Longest time broker waited for client data       */
+} sim_stats_t;
+
+/* Start a new scenario at virtual time 0, nothing in flight and link down */
+void sim_reset(const sim_config_t * a_config_ptr);
+
+/* Virtual time in ms since sim_reset() */
+uint64_t sim_now_ms();
+
+/* Move virtual time forward, delivering everything which is due on the way */
+void sim_run(uint32_t a_duration_ms);
+
+/* mqtt_sleep() of the simulated build - a blocking wait is virtual time passing */
+void sim_sleep(double a_seconds);
+
+/* Transport connected / dropped. Dropping discards all bytes in flight. Connect the
+   client with mqtt_connect(..., &sim_write, ...) right after sim_link_up(). */
+void sim_link_up();
+void sim_link_down();
+bool sim_link_is_up();
+
+/* data_stream_out_fptr_t of the in-memory link, -1 when link is down */
+int sim_write(uint8_t * a_data, size_t a_amount);
+
+/* Broker stops answering (half open connection) but keeps receiving */
+void sim_broker_mute(bool a_mute);
+
+/* Broker sends QoS0 PUBLISH to the client */
+bool sim_broker_publish(const char * a_topic, const uint8_t * a_payload, size_t a_size);
+
+/* Counters of current scenario */
+const sim_stats_t * sim_stats();
+
+#endif
@@ -2,10 +2,18 @@
 #include <sys/socket.h> // socket
 #include <unistd.h>     // socket / file close
 #include <arpa/inet.h>  // inet_addr
+#include <sys/un.h>     // sockaddr_un
+#include <stddef.h>     // offsetof
 #include <pthread.h>    // pthread_create
 #include <signal.h>     // pthread_kill
 #include <stdlib.h>     // malloc/free
 #include <string.h>     // memcpy
+#include <stdatomic.h>  // receive slot reference counts
+#include <errno.h>      // EAGAIN
+#include <poll.h>       // poll
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h> // TCP_INFO
+#include <time.h>       // clock_gettime
 #include "socket_read_write.h"
 
 static int test_socket = -1;
@@ -15,6 +23,29 @@ static pthread_t socket_reading_thread_id = -1;
 static bool socket_OK = false;
 static volatile bool read_thread_running = true;
 
+/* Data already sent by socket_initialize_fastopen() (in SYN or after the handshake) and
+   its size, reading starts when the client writes it */
+static const uint8_t * fastopen_data_ptr  = NULL;
+static size_t          fastopen_data_size = 0;
+static uint32_t        fastopen_attempts  = 0;
+static uint32_t        fastopen_successes = 0;
+
+/* Whole packets of one read are given with one callback (mqtt_receive_stream) */
+static bool            socket_batch_delivery = false;
+
+/* Inbound flow control - reader stops reading while the application holds too many
+   received messages (retained views), so TCP flow control pushes back on the broker */
+static uint32_t        receive_high_watermark = 0;
+static uint32_t        receive_low_watermark  = 0;
+static atomic_uint     receive_retained       = 0;
+static volatile bool   receive_paused         = false;
+static uint32_t        receive_pauses         = 0;
+static pthread_mutex_t receive_flow_mutex     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  receive_flow_cond      = PTHREAD_COND_INITIALIZER;
+
+static bool socket_start(socket_data_received_fptr_t a_receive_callback);
+static bool socket_start_reading();
+
 void ctrlc_handler()
 {
     socket_OK = false;
@@ -22,11 +53,104 @@ void ctrlc_handler()
 
 #define BUFFER_SIZE (1024*1024)
 
+/* Receive ring - packets are read straight into a slot and handed to the MQTT client
+   from there. Slot stays reserved while reader or a retained message view holds it. */
+#define RECEIVE_RING_SLOTS     8
+#define RECEIVE_RING_SLOT_SIZE (64*1024)
+
+typedef struct receive_slot
+{
+    uint8_t     data[RECEIVE_RING_SLOT_SIZE];
+    atomic_int  references;
+} receive_slot_t;
+
+static receive_slot_t receive_ring[RECEIVE_RING_SLOTS];
+static uint32_t       receive_ring_next = 0;
+
+static receive_slot_t * receive_slot_acquire()
+{
+    for (uint32_t i = 0; i < RECEIVE_RING_SLOTS; i++) {
+        receive_slot_t * slot = &receive_ring[(receive_ring_next + i) % RECEIVE_RING_SLOTS];
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&(slot->references), &expected, 1)) {
+            receive_ring_next = (receive_ring_next + i + 1) % RECEIVE_RING_SLOTS;
+            return slot;
+        }
+    }
+    return NULL; /* All slots pinned by the application */
+}
+
+static receive_slot_t * receive_slot_of(uint8_t * a_data)
+{
+    for (uint32_t i = 0; i < RECEIVE_RING_SLOTS; i++) {
+        if ((a_data >= receive_ring[i].data) &&
+            (a_data <  receive_ring[i].data + RECEIVE_RING_SLOT_SIZE))
+            return &receive_ring[i];
+    }
+    return NULL;
+}
+
+bool socket_buffer_pin(uint8_t * a_data, bool a_pin)
+{
+    receive_slot_t * slot = receive_slot_of(a_data);
+    if (NULL == slot)
+        return false; /* Heap fallback buffer - freed after callback */
+
+    if (a_pin) {
+        atomic_fetch_add(&(slot->references), 1);
+        atomic_fetch_add(&receive_retained, 1);
+    } else {
+        atomic_fetch_sub(&(slot->references), 1);
+        atomic_fetch_sub(&receive_retained, 1);
+
+        /* Waiting reader checks the levels again */
+        if (receive_paused) {
+            pthread_mutex_lock(&receive_flow_mutex);
+            pthread_cond_signal(&receive_flow_cond);
+            pthread_mutex_unlock(&receive_flow_mutex);
+        }
+    }
+    return true;
+}
+
 int socket_write(uint8_t * a_data, size_t a_amount)
 {
+    if (NULL != fastopen_data_ptr) {
+        /* First write starts with the frame sent at connect - only the rest goes out */
+        size_t sent = fastopen_data_size;
+        bool   same = (a_amount >= sent) && (0 == memcmp(a_data, fastopen_data_ptr, sent));
+
+        fastopen_data_ptr = NULL;
+        if (false == socket_start_reading())
+            return -1;
+        if (same) {
+            if (a_amount == sent)
+                return (int)a_amount;
+            int ret = send(test_socket, &a_data[sent], a_amount - sent, 0);
+            return (0 > ret) ? ret : (int)sent + ret;
+        }
+    }
     return send(test_socket, a_data, a_amount , 0);
 }
 
+int socket_write_nonblock(uint8_t * a_data, size_t a_amount)
+{
+    int ret = send(test_socket, a_data, a_amount , MSG_DONTWAIT);
+    /* Full send buffer is not an error, nothing was taken */
+    if ((0 > ret) && ((EAGAIN == errno) || (EWOULDBLOCK == errno)))
+        return 0;
+    return ret;
+}
+
+bool socket_writable(int a_timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd      = test_socket;
+    pfd.events  = POLLOUT;
+    pfd.revents = 0;
+    return (0 < poll(&pfd, 1, a_timeout_ms)) && (0 != (pfd.revents & POLLOUT));
+}
+
 void sleep_ms_(int milliseconds)
 {
     struct timespec ts;
@@ -35,27 +159,26 @@ void sleep_ms_(int milliseconds)
     nanosleep(&ts, NULL);
 }
 
-int32_t get_remainingsize(uint8_t * a_input_ptr)
+/* Size of the whole MQTT packet at a_input_ptr, 0 while its fixed header is not complete,
+   -1 when remaining length is invalid */
+int64_t get_packet_size(uint8_t * a_input_ptr, size_t a_available)
 {
     uint32_t multiplier = 1;
     uint32_t value      = 0;
-    uint8_t  cnt        = 1;
+    size_t   cnt        = 1;
     uint8_t  aByte      = 0;
 
-    /* Verify input parameters */
-    if (NULL == a_input_ptr)
-        return -1;
-
     do {
+        if (cnt >= a_available)
+            return 0;
+        if (4 < cnt)
+            return -1;
         aByte = a_input_ptr[cnt++];
         value += (aByte & 127) * multiplier;
-        if (multiplier > (128*128*128))
-            return -2;
-
         multiplier *= 128;
     } while ((aByte & 128) != 0);
-    value += (cnt); //Add count header to the overal size of MQTT packet to be received
-    return value;
+
+    return (int64_t)(value + cnt);
 }
 
 void read_signal_handler()
@@ -64,63 +187,179 @@ void read_signal_handler()
     read_thread_running = false;
 }
 
+/* Wait on the flow condition at most 100 ms, stop request is checked in between */
+static void receive_flow_wait()
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100 * 1000000;
+    if (1000000000 <= deadline.tv_nsec) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&receive_flow_cond, &receive_flow_mutex, &deadline);
+}
+
+/* Stop reading at high watermark of retained messages, continue at low watermark */
+static bool receive_flow_control()
+{
+    if ((0 == receive_high_watermark) ||
+        (atomic_load(&receive_retained) < receive_high_watermark))
+        return read_thread_running;
+
+    pthread_mutex_lock(&receive_flow_mutex);
+    receive_paused = true;
+    receive_pauses++;
+    while (read_thread_running && (atomic_load(&receive_retained) > receive_low_watermark))
+        receive_flow_wait();
+    receive_paused = false;
+    pthread_mutex_unlock(&receive_flow_mutex);
+    return read_thread_running;
+}
+
+/* Free ring slot - with flow control the reader waits for one instead of using heap */
+static receive_slot_t * receive_slot_wait()
+{
+    receive_slot_t * slot = receive_slot_acquire();
+
+    if ((NULL != slot) || (0 == receive_high_watermark))
+        return slot;
+
+    pthread_mutex_lock(&receive_flow_mutex);
+    receive_paused = true;
+    receive_pauses++;
+    while (read_thread_running && (NULL == (slot = receive_slot_acquire())))
+        receive_flow_wait();
+    receive_paused = false;
+    pthread_mutex_unlock(&receive_flow_mutex);
+    return slot;
+}
+
+/* Receive buffer - ring slot or, when all slots are pinned or packet is bigger, heap */
+typedef struct receive_buffer
+{
+    receive_slot_t * slot;
+    uint8_t        * data;
+    size_t           size;
+    size_t           used;
+} receive_buffer_t;
+
+static bool receive_buffer_get(receive_buffer_t * a_buffer_ptr, size_t a_size)
+{
+    a_buffer_ptr->slot = (RECEIVE_RING_SLOT_SIZE >= a_size) ? receive_slot_wait() : NULL;
+    if ((NULL == a_buffer_ptr->slot) && (false == read_thread_running))
+        return false;
+    if (NULL != a_buffer_ptr->slot) {
+        a_buffer_ptr->data = a_buffer_ptr->slot->data;
+        a_buffer_ptr->size = RECEIVE_RING_SLOT_SIZE;
+    } else {
+        if (RECEIVE_RING_SLOT_SIZE > a_size)
+            a_size = RECEIVE_RING_SLOT_SIZE;
+        a_buffer_ptr->data = (uint8_t*)malloc(a_size);
+        a_buffer_ptr->size = a_size;
+    }
+    a_buffer_ptr->used = 0;
+    return (NULL != a_buffer_ptr->data);
+}
+
+static void receive_buffer_put(receive_buffer_t * a_buffer_ptr)
+{
+    if (NULL != a_buffer_ptr->slot)
+        atomic_fetch_sub(&(a_buffer_ptr->slot->references), 1);
+    else
+        free(a_buffer_ptr->data);
+    a_buffer_ptr->slot = NULL;
+    a_buffer_ptr->data = NULL;
+}
+
+/* Continue with an incomplete packet in a new buffer of at least a_size bytes, so that
+   messages still pinned in the old one are not overwritten */
+static bool receive_buffer_move(receive_buffer_t * a_buffer_ptr, size_t a_offset, size_t a_size)
+{
+    receive_buffer_t next;
+    size_t           rest = a_buffer_ptr->used - a_offset;
+
+    if (false == receive_buffer_get(&next, a_size))
+        return false;
+    memcpy(next.data, &(a_buffer_ptr->data[a_offset]), rest);
+    next.used = rest;
+    receive_buffer_put(a_buffer_ptr);
+    *a_buffer_ptr = next;
+    return true;
+}
+
 void *socket_receive_thread(void * a_ptr)
 {
-    a_ptr = a_ptr;
-    read_thread_running = true;
+    /* Own copy of the descriptor - stopped thread never reads a reconnected socket */
+    int              socket_fd = (int)(intptr_t)a_ptr;
+    receive_buffer_t buffer;
+
     signal(SIGUSR1, read_signal_handler);
+    buffer.data = NULL;
 
-    while (((test_socket) > 0)                     &&
+    while ((socket_fd > 0)                         &&
            (NULL != socket_data_received_callback) &&
            (read_thread_running)) {
 
-        char header[32] = {0};
-        int bytes_read = recv((test_socket), header, sizeof(header) - 1, 0);
-
-        if (2 <= bytes_read) {
-            uint32_t remaining_bytes = get_remainingsize((uint8_t*)header) - bytes_read;
-
-        if (0 < remaining_bytes) {
-
-            /* Need to read more data */
-            char * buff = (char*)malloc(remaining_bytes + bytes_read + 1024 /* safety buffer*/);
-            memcpy(buff, header, bytes_read);
-            while (remaining_bytes) {
-                int nxt_bytes_read = recv(test_socket, &buff[bytes_read], remaining_bytes, 0);
-                remaining_bytes -= nxt_bytes_read;
-                bytes_read += nxt_bytes_read;
+        if (false == receive_flow_control())
+            break;
+        if ((NULL == buffer.data) && (false == receive_buffer_get(&buffer, RECEIVE_RING_SLOT_SIZE)))
+            break;
+
+        int bytes_read = recv(socket_fd, &buffer.data[buffer.used], buffer.size - buffer.used, 0);
+
+        if (0 < bytes_read) {
+            buffer.used += (size_t)bytes_read;
+
+            /* One read may end in the middle of a packet or hold many of them */
+            size_t  offset = 0;
+            int64_t packet = 0;
+            while (0 < (packet = get_packet_size(&buffer.data[offset], buffer.used - offset))) {
+                if ((size_t)packet > (buffer.used - offset))
+                    break;
+                if (false == socket_batch_delivery)
+                    socket_data_received_callback(&buffer.data[offset], (size_t)packet);
+                offset += (size_t)packet;
             }
-
-            socket_data_received_callback((uint8_t*)buff, (uint32_t)bytes_read);
-            free(buff);
-            } else {
-                /* Send packets dirctly to the MQTT client, which fit into 32B buffer */
-                socket_data_received_callback((uint8_t*)header, (uint32_t)bytes_read);
+            if (0 > packet)
+                break; /* Not MQTT */
+
+            /* Whole packets of the read with one call */
+            if (socket_batch_delivery && (0 < offset))
+                socket_data_received_callback(buffer.data, offset);
+
+            if (offset == buffer.used) {
+                receive_buffer_put(&buffer);
+            } else if ((0 < offset) || (buffer.used == buffer.size)) {
+                if (false == receive_buffer_move(&buffer, offset, (size_t)packet))
+                    break;
             }
+        } else if (0 == bytes_read) {
+            break; /* Closed by peer */
         } else {
             char data = 0;
-            if( send(test_socket, &data, 0 , 0) < 0)
-                return 0;
+            if( send(socket_fd, &data, 0 , 0) < 0)
+                break;
         }
     }
+
+    if (NULL != buffer.data)
+        receive_buffer_put(&buffer);
     return 0;
 }
 
-bool socket_initialize(char * a_inet_addr, uint32_t a_port, socket_data_received_fptr_t a_receive_callback)
+static bool socket_start_reading()
 {
-    struct sockaddr_in server;
-    // catch ctrl c
-    signal(SIGPIPE, ctrlc_handler);
-
-    //Create socket
-    test_socket = socket(AF_INET , SOCK_STREAM, 0);
-    if (-1 == test_socket) {
+    read_thread_running = true;
+    if (pthread_create( &socket_reading_thread_id, NULL, socket_receive_thread, (void*)(intptr_t)test_socket) < 0)
         return false;
-    }
 
-    int value = 1;
-    setsockopt(test_socket, SOL_SOCKET, SO_REUSEADDR,&value, sizeof(int)); // https://stackoverflow.com/questions/10619952/how-to-completely-destroy-a-socket-connection-in-c
+    return true;
+}
 
+/* Common part of all socket types - timeouts and reading thread */
+static bool socket_start(socket_data_received_fptr_t a_receive_callback)
+{
     socket_OK = true;
 
     struct timeval timeout;
@@ -135,6 +374,30 @@ bool socket_initialize(char * a_inet_addr, uint32_t a_port, socket_data_received
                     sizeof(timeout)) < 0)
         printf("SO_SNDTIMEO failed\n");
 
+    socket_data_received_callback = a_receive_callback;
+
+    /* Answer to data sent in SYN waits in the socket until client has its session ready */
+    if (NULL != fastopen_data_ptr)
+        return true;
+
+    return socket_start_reading();
+}
+
+bool socket_initialize(char * a_inet_addr, uint32_t a_port, socket_data_received_fptr_t a_receive_callback)
+{
+    struct sockaddr_in server;
+    // catch ctrl c
+    signal(SIGPIPE, ctrlc_handler);
+
+    //Create socket
+    test_socket = socket(AF_INET , SOCK_STREAM, 0);
+    if (-1 == test_socket) {
+        return false;
+    }
+
+    int value = 1;
+    setsockopt(test_socket, SOL_SOCKET, SO_REUSEADDR,&value, sizeof(int)); // https://stackoverflow.com/questions/10619952/how-to-completely-destroy-a-socket-connection-in-c
+
     server.sin_addr.s_addr = inet_addr(a_inet_addr);
     server.sin_family      = AF_INET;
     server.sin_port        = htons(a_port);
@@ -143,17 +406,169 @@ bool socket_initialize(char * a_inet_addr, uint32_t a_port, socket_data_received
     if (connect(test_socket , (struct sockaddr *)&server , sizeof(server)) < 0)
         return false;
 
-    socket_data_received_callback = a_receive_callback;
+    return socket_start(a_receive_callback);
+}
 
-    if (pthread_create( &socket_reading_thread_id, NULL, socket_receive_thread, (void*) &test_socket) < 0)
+bool socket_initialize_fastopen(char                        * a_inet_addr,
+                                uint32_t                      a_port,
+                                const uint8_t               * a_data_ptr,
+                                size_t                        a_data_size,
+                                socket_data_received_fptr_t   a_receive_callback)
+{
+    struct sockaddr_in server;
+
+    if ((NULL == a_data_ptr) || (0 == a_data_size))
         return false;
 
+    signal(SIGPIPE, ctrlc_handler);
+
+    test_socket = socket(AF_INET , SOCK_STREAM, 0);
+    if (-1 == test_socket)
+        return false;
+
+    memset(&server, 0, sizeof(server));
+    server.sin_addr.s_addr = inet_addr(a_inet_addr);
+    server.sin_family      = AF_INET;
+    server.sin_port        = htons(a_port);
+
+    /* Connect and send in one call. Without a cookie kernel asks one in SYN and sends
+       the data after the handshake, without client support (EOPNOTSUPP) normal connect
+       is made. Call returns when connection is established. */
+    fastopen_attempts++;
+    ssize_t sent = sendto(test_socket, a_data_ptr, a_data_size, MSG_FASTOPEN,
+                          (struct sockaddr *)&server, sizeof(server));
+
+    if ((0 > sent) && (EOPNOTSUPP == errno)) {
+        if ((0 > connect(test_socket, (struct sockaddr *)&server, sizeof(server))) ||
+            (0 > (sent = send(test_socket, a_data_ptr, a_data_size, 0)))) {
+            close(test_socket);
+            test_socket = -1;
+            return false;
+        }
+    } else if (0 > sent) {
+        close(test_socket);
+        test_socket = -1;
+        return false;
+    }
+
+    struct tcp_info info;
+    socklen_t       info_size = sizeof(info);
+    if ((0 == getsockopt(test_socket, IPPROTO_TCP, TCP_INFO, &info, &info_size)) &&
+        (0 != (info.tcpi_options & TCPI_OPT_SYN_DATA)))
+        fastopen_successes++;
+
+    /* Rest of a partially sent frame goes out with the first write, which skips only
+       the bytes already sent */
+    fastopen_data_ptr  = a_data_ptr;
+    fastopen_data_size = (size_t)sent;
+    return socket_start(a_receive_callback);
+}
+
+void socket_set_batch_delivery(bool a_batch)
+{
+    socket_batch_delivery = a_batch;
+}
+
+bool socket_set_receive_watermarks(uint32_t a_high_watermark, uint32_t a_low_watermark)
+{
+    if ((0 < a_high_watermark) && (a_low_watermark >= a_high_watermark))
+        return false;
+
+    pthread_mutex_lock(&receive_flow_mutex);
+    receive_high_watermark = a_high_watermark;
+    receive_low_watermark  = a_low_watermark;
+    pthread_cond_signal(&receive_flow_cond);
+    pthread_mutex_unlock(&receive_flow_mutex);
     return true;
 }
 
+bool socket_receive_paused()
+{
+    return receive_paused;
+}
+
+uint32_t socket_receive_pauses()
+{
+    return receive_pauses;
+}
+
+uint32_t socket_receive_retained()
+{
+    return atomic_load(&receive_retained);
+}
+
+uint32_t socket_fastopen_attempts()
+{
+    return fastopen_attempts;
+}
+
+uint32_t socket_fastopen_successes()
+{
+    return fastopen_successes;
+}
+
+bool socket_initialize_unix(const char * a_path, socket_data_received_fptr_t a_receive_callback)
+{
+    struct sockaddr_un server;
+    size_t             path_length = (NULL != a_path) ? strlen(a_path) : 0;
+
+    if ((0 == path_length) || (sizeof(server.sun_path) < path_length))
+        return false;
+
+    signal(SIGPIPE, ctrlc_handler);
+
+    test_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (-1 == test_socket)
+        return false;
+
+    memset(&server, 0, sizeof(server));
+    server.sun_family = AF_UNIX;
+    memcpy(server.sun_path, a_path, path_length);
+
+    /* Abstract name is not null terminated, address length tells where it ends */
+    socklen_t address_length = sizeof(server);
+    if ('@' == a_path[0]) {
+        server.sun_path[0] = '\0';
+        address_length     = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_length);
+    }
+
+    if (connect(test_socket, (struct sockaddr *)&server, address_length) < 0) {
+        close(test_socket);
+        test_socket = -1;
+        return false;
+    }
+
+    return socket_start(a_receive_callback);
+}
+
+bool socket_initialize_pair(int * a_peer_socket_ptr, socket_data_received_fptr_t a_receive_callback)
+{
+    int pair[2];
+
+    if (NULL == a_peer_socket_ptr)
+        return false;
+
+    signal(SIGPIPE, ctrlc_handler);
+
+    if (0 > socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
+        return false;
+
+    test_socket         = pair[0];
+    *a_peer_socket_ptr  = pair[1];
+
+    return socket_start(a_receive_callback);
+}
+
 bool stop_reading_thread()
 {
     printf("Stoping socket...\n");
+    if ((0 < test_socket) && (NULL != fastopen_data_ptr)) {
+        /* Fast Open frame never written by the client - reader was not started */
+        close(test_socket);
+        test_socket       = -1;
+        fastopen_data_ptr = NULL;
+        return true;
+    }
     if (0 < test_socket) {
             //close(test_socket);
             shutdown(test_socket, 2 /* Ignore and stop both RCV and SEND */); //http://www.gnu.org/software/libc/manual/html_node/Closing-a-Socket.html
@@ -163,11 +578,14 @@ bool stop_reading_thread()
                 if(send(test_socket, &data, 1 , 0) < 0)
                    socket_OK = false;
             }
-            test_socket = -1;
             printf("Socket closed...\n");
             // https://www.ibm.com/support/knowledgecenter/en/SSLTBW_2.2.0/com.ibm.zos.v2r2.bpxbd00/ptkill.htm
             pthread_kill(socket_reading_thread_id, SIGUSR1);
-            // pthread_join(socket_reading_thread_id, NULL);
+            /* Reader is done with the descriptor before it can be reused by next connect */
+            pthread_join(socket_reading_thread_id, NULL);
+            close(test_socket);
+            test_socket = -1;
+            fastopen_data_ptr = NULL;
             printf("Stoping closing completed\n");
             socket_reading_thread_id = -1;
             return true;
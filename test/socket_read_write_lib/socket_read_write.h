@@ -2,12 +2,60 @@
 #define SOCKET_READ_WRITE_H
 
 #include <stdint.h>  // uint
+#include <stddef.h>  // size_t
 #include <stdbool.h> // bool
 
 typedef void (*socket_data_received_fptr_t)(uint8_t * a_data, size_t amount);
 
 bool socket_initialize(char * a_inet_addr, uint32_t a_port, socket_data_received_fptr_t);
+
+/* TCP Fast Open - a_data (the pre-built CONNECT frame) is sent in SYN when the broker
+   has given a cookie, otherwise right after the handshake. Data must stay valid until
+   the client writes it: a first write which starts with the same bytes sends only the
+   rest, e.g. mqtt_connect_prebuilt() with the same frame. Received data is read from
+   that write on. */
+bool socket_initialize_fastopen(char                        * a_inet_addr,
+                                uint32_t                      a_port,
+                                const uint8_t               * a_data_ptr,
+                                size_t                        a_data_size,
+                                socket_data_received_fptr_t   a_receive_callback);
+
+/* Fast Open connections made, and how many of them had the data in SYN accepted */
+uint32_t socket_fastopen_attempts();
+uint32_t socket_fastopen_successes();
+
+/* Broker on the same host - AF_UNIX stream socket. Path starting with '@' is a name
+   in the abstract namespace (Linux), e.g. "@mqtt". */
+bool socket_initialize_unix(const char * a_path, socket_data_received_fptr_t);
+
+/* In-process peer - connected socketpair, peer end is returned for the broker side */
+bool socket_initialize_pair(int * a_peer_socket_ptr, socket_data_received_fptr_t);
+
+/* Received data is given to the callback one MQTT packet at a time (mqtt_receive).
+   With batch delivery all whole packets of one read come with one call, for
+   mqtt_receive_stream(). Set before initializing the socket. */
+void socket_set_batch_delivery(bool a_batch);
+
 int socket_write(uint8_t * a_data, size_t a_amount);
+
+/* Non-blocking write for mqtt_set_output_queue() - returns 0 when send buffer is full */
+int socket_write_nonblock(uint8_t * a_data, size_t a_amount);
+bool socket_writable(int a_timeout_ms);
 bool stop_reading_thread();
 
+/* Pin hook for mqtt_set_message_view_cb() - keeps receive ring slot of a message reserved */
+bool socket_buffer_pin(uint8_t * a_data, bool a_pin);
+
+/* Inbound flow control. When the application holds a_high_watermark retained messages
+   (mqtt_message_retain) the reader stops reading the socket, so the broker is pushed back
+   by TCP flow control, and reads again when they are down to a_low_watermark. Reader
+   then also waits for a free receive ring slot instead of using heap, so memory stays
+   at the ring size (heap only for a packet bigger than a slot). 0, 0 disables. */
+bool socket_set_receive_watermarks(uint32_t a_high_watermark, uint32_t a_low_watermark);
+
+/* Reader is waiting for the application, how many times it has waited, messages held */
+bool socket_receive_paused();
+uint32_t socket_receive_pauses();
+uint32_t socket_receive_retained();
+
 #endif
\ No newline at end of file
@@ -147,6 +147,22 @@ void test_sm_subscrbe_with_receive()
     g_auto_state_subscribe_completed_ = false;
     rcv = data_stream_in_fptr_(buffer, sizeof(MQTT_fixed_header_t));
 
+    /* Rest of the echoed publish - only received bytes are decoded */
+    uint32_t remaining  = 0;
+    uint32_t multiplier = 1;
+    int      cnt        = 1;
+    do {
+        remaining  += (buffer[cnt] & 127) * multiplier;
+        multiplier *= 128;
+    } while ((buffer[cnt++] & 128) && (cnt < rcv));
+
+    while ((0 < rcv) && (rcv < (int)(cnt + remaining))) {
+        int more = data_stream_in_fptr_(&buffer[rcv], (size_t)((int)(cnt + remaining) - rcv));
+        if (0 >= more)
+            break;
+        rcv += more;
+    }
+
     // MQTT_input_stream_t input;
 
     if (0 < rcv) {
@@ -0,0 +1,148 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "tls_transport.h"
+#include "tls_broker_stub.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#define CERT_FILE "tls_stub_cert.pem"
+
+static uint8_t            g_buffer[1024];
+static MQTT_shared_data_t g_shared;
+static uint16_t           g_port     = 0;
+static volatile bool      g_received = false;
+static volatile bool      g_connack  = false;
+
+void data_from_tls_(uint8_t * a_data, size_t a_amount)
+{
+    mqtt_receive(a_data, a_amount);
+}
+
+void connected_cb_(MQTTErrorCodes_t a_status)
+{
+    g_connack = (Successfull == a_status);
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if ((Successfull == a_status) &&
+        (NULL        != a_data_ptr) &&
+        (9 == a_data_len) && (0 == memcmp("TLS works", a_data_ptr, a_data_len)))
+        g_received = true;
+}
+
+bool connect_(const char * a_server_name)
+{
+    if (false == tls_initialize("127.0.0.1", g_port, CERT_FILE, a_server_name, &data_from_tls_))
+        return false;
+
+    uint8_t empty[] = "\0";
+    g_connack = false;
+    bool connected = mqtt_connect("JAMKtest TLS",
+                                  0,
+                                  empty,
+                                  empty,
+                                  empty,
+                                  empty,
+                                  &g_shared,
+                                  g_buffer,
+                                  sizeof(g_buffer),
+                                  true,
+                                  &tls_write,
+                                  &connected_cb_,
+                                  &subscribe_cb_,
+                                  5);
+
+    /* Session ticket is sent before CONNACK */
+    for (uint32_t i = 0; (i < 100) && (false == g_connack); i++)
+        usleep(10000);
+    return connected && g_connack;
+}
+
+void disconnect_()
+{
+    mqtt_disconnect();
+    tls_stop();
+}
+
+void test_tls_full_handshake_then_resume()
+{
+    TEST_ASSERT_TRUE(connect_("localhost"));
+    TEST_ASSERT_FALSE(tls_session_resumed());
+
+    /* Data flows both ways through the TLS transport */
+    char topic[] = "tls/test";
+    g_received = false;
+    TEST_ASSERT_TRUE(mqtt_subscribe(topic, strlen(topic), 5));
+    TEST_ASSERT_TRUE(mqtt_publish(topic, strlen(topic), "TLS works", 9));
+    for (uint32_t i = 0; (i < 50) && (false == g_received); i++)
+        usleep(10000);
+    TEST_ASSERT_TRUE(g_received);
+    disconnect_();
+
+    /* Reconnect offers the ticket from the previous connection */
+    TEST_ASSERT_TRUE(connect_("localhost"));
+    TEST_ASSERT_TRUE(tls_session_resumed());
+    disconnect_();
+
+    usleep(100000);
+    TEST_ASSERT_EQUAL_UINT32(2, tls_broker_stub_handshakes());
+    TEST_ASSERT_EQUAL_UINT32(1, tls_broker_stub_resumed());
+}
+
+void test_tls_session_survives_cleanup()
+{
+    uint8_t session[4096];
+
+    TEST_ASSERT_TRUE(connect_("localhost"));
+    disconnect_();
+    size_t length = tls_session_export(session, sizeof(session));
+    TEST_ASSERT_TRUE(0 < length);
+    TEST_ASSERT_EQUAL_UINT32(0, tls_session_export(session, 10));
+
+    /* Like a reboot - everything is lost but the stored session */
+    tls_cleanup();
+    TEST_ASSERT_TRUE(tls_session_import(session, length));
+    TEST_ASSERT_TRUE(connect_("localhost"));
+    TEST_ASSERT_TRUE(tls_session_resumed());
+    disconnect_();
+
+    TEST_ASSERT_FALSE(tls_session_import(session, 3));
+}
+
+void test_tls_wrong_server_name()
+{
+    tls_cleanup();
+    TEST_ASSERT_FALSE(tls_initialize("127.0.0.1", g_port, CERT_FILE, "mqtt.example.com", &data_from_tls_));
+    TEST_ASSERT_EQUAL_UINT32(0, tls_session_export(g_buffer, sizeof(g_buffer)));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    if (false == tls_broker_stub_start(CERT_FILE, &g_port)) {
+        printf("TLS broker stub failed\n");
+        return 1;
+    }
+
+    UnityBegin("TLS transport");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_tls_full_handshake_then_resume, tCntr++);
+    RUN_TEST(test_tls_session_survives_cleanup,   tCntr++);
+    RUN_TEST(test_tls_wrong_server_name,          tCntr++);
+    int failures = UnityEnd();
+
+    tls_cleanup();
+    tls_broker_stub_stop();
+    unlink(CERT_FILE);
+    return failures;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>      // printf
+#include <sys/socket.h> // socket
+#include <unistd.h>     // close
+#include <arpa/inet.h>  // inet_addr
+#include <poll.h>       // poll
+#include <pthread.h>    // pthread_create
+#include <signal.h>     // SIGPIPE
+#include <string.h>     // memmove
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include "tls_broker_stub.h"
+
+static SSL_CTX       * stub_ctx        = NULL;
+static int             stub_listen     = -1;
+static pthread_t       stub_thread_id;
+static volatile bool   stub_running    = false;
+static uint32_t        stub_handshakes = 0;
+static uint32_t        stub_resumed    = 0;
+
+static bool stub_certificate_create(const char * a_cert_file)
+{
+    EVP_PKEY * key  = EVP_EC_gen("P-256");
+    X509     * cert = X509_new();
+    bool       ok   = false;
+
+    if ((NULL != key) && (NULL != cert)) {
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), -60);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+
+        X509_NAME * name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+
+        X509V3_CTX ext_ctx;
+        X509V3_set_ctx_nodb(&ext_ctx);
+        X509V3_set_ctx(&ext_ctx, cert, cert, NULL, NULL, 0);
+        X509_EXTENSION * san = X509V3_EXT_conf_nid(NULL, &ext_ctx, NID_subject_alt_name, "DNS:localhost");
+        X509_add_ext(cert, san, -1);
+        X509_EXTENSION_free(san);
+
+        FILE * file = fopen(a_cert_file, "w");
+        if ((0 < X509_sign(cert, key, EVP_sha256())) && (NULL != file)) {
+            ok = (1 == PEM_write_X509(file, cert)) &&
+                 (1 == SSL_CTX_use_certificate(stub_ctx, cert)) &&
+                 (1 == SSL_CTX_use_PrivateKey(stub_ctx, key));
+        }
+        if (NULL != file)
+            fclose(file);
+    }
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+static bool stub_read_packet(SSL * a_ssl, uint8_t * a_buffer, size_t a_size, size_t * a_length_ptr)
+{
+    size_t received   = 0;
+    size_t needed     = 2;
+    size_t value      = 0;
+    size_t multiplier = 1;
+    size_t cnt        = 1;
+
+    while (received < needed) {
+        int bytes = SSL_read(a_ssl, &a_buffer[received], (int)(needed - received));
+        if (0 >= bytes)
+            return false;
+        received += (size_t)bytes;
+
+        /* Remaining length one byte at a time */
+        if ((received == needed) && (cnt < 5) && (received == cnt + 1)) {
+            value      += (a_buffer[cnt] & 127) * multiplier;
+            multiplier *= 128;
+            needed      = (a_buffer[cnt] & 128) ? (cnt + 2) : (cnt + 1 + value);
+            cnt++;
+            if (needed > a_size)
+                return false;
+        }
+    }
+    *a_length_ptr = received;
+    return true;
+}
+
+static void stub_serve(SSL * a_ssl)
+{
+    uint8_t packet[4096];
+    size_t  length = 0;
+
+    while (stub_running && stub_read_packet(a_ssl, packet, sizeof(packet), &length)) {
+        switch (packet[0] >> 4) {
+            case 1: { /* CONNECT */
+                uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+                SSL_write(a_ssl, connack, sizeof(connack));
+                break;
+            }
+            case 3: /* PUBLISH - echo */
+                SSL_write(a_ssl, packet, (int)length);
+                break;
+            case 8: { /* SUBSCRIBE - short packets only, packet id follows 1 byte length */
+                uint8_t suback[] = {0x90, 0x03, 0x00, 0x00, 0x00};
+                suback[2] = packet[2];
+                suback[3] = packet[3];
+                SSL_write(a_ssl, suback, sizeof(suback));
+                break;
+            }
+            case 12: { /* PINGREQ */
+                uint8_t pingresp[] = {0xd0, 0x00};
+                SSL_write(a_ssl, pingresp, sizeof(pingresp));
+                break;
+            }
+            case 14: /* DISCONNECT */
+                return;
+            default:
+                break;
+        }
+    }
+}
+
+static void *stub_thread(void * a_ptr)
+{
+    (void)a_ptr;
+
+    while (stub_running) {
+        struct pollfd pfd;
+        pfd.fd      = stub_listen;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (0 >= poll(&pfd, 1, 100))
+            continue;
+
+        int client = accept(stub_listen, NULL, NULL);
+        if (0 > client)
+            continue;
+
+        SSL * ssl = SSL_new(stub_ctx);
+        SSL_set_fd(ssl, client);
+        if (1 == SSL_accept(ssl)) {
+            stub_handshakes++;
+            if (SSL_session_reused(ssl))
+                stub_resumed++;
+            stub_serve(ssl);
+            SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        close(client);
+    }
+    return 0;
+}
+
+bool tls_broker_stub_start(const char * a_cert_file, uint16_t * a_port_ptr)
+{
+    struct sockaddr_in server;
+    socklen_t          server_size = sizeof(server);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    stub_ctx = SSL_CTX_new(TLS_server_method());
+    if ((NULL == stub_ctx) || (false == stub_certificate_create(a_cert_file)))
+        return false;
+
+    stub_listen = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&server, 0, sizeof(server));
+    server.sin_addr.s_addr = inet_addr("127.0.0.1");
+    server.sin_family      = AF_INET;
+    server.sin_port        = 0; /* Any free port */
+
+    if ((0 > bind(stub_listen, (struct sockaddr *)&server, sizeof(server))) ||
+        (0 > listen(stub_listen, 4)) ||
+        (0 > getsockname(stub_listen, (struct sockaddr *)&server, &server_size)))
+        return false;
+
+    *a_port_ptr     = ntohs(server.sin_port);
+    stub_handshakes = 0;
+    stub_resumed    = 0;
+    stub_running    = true;
+    return (0 == pthread_create(&stub_thread_id, NULL, stub_thread, NULL));
+}
+
+void tls_broker_stub_stop()
+{
+    stub_running = false;
+    pthread_join(stub_thread_id, NULL);
+    close(stub_listen);
+    SSL_CTX_free(stub_ctx);
+    stub_ctx = NULL;
+}
+
+uint32_t tls_broker_stub_handshakes()
+{
+    return stub_handshakes;
+}
+
+uint32_t tls_broker_stub_resumed()
+{
+    return stub_resumed;
+}
@@ -0,0 +1,17 @@
+#ifndef TLS_BROKER_STUB_H
+#define TLS_BROKER_STUB_H
+
+#include <stdint.h>  // uint
+#include <stdbool.h> // bool
+
+/* Minimal local TLS broker stand-in for tests. Creates a self signed certificate for
+   "localhost" (written to a_cert_file for the client), listens on 127.0.0.1 and serves
+   one client at a time: CONNECT, SUBSCRIBE, PINGREQ and DISCONNECT are answered and
+   every QoS0 PUBLISH is echoed back to the sender. */
+bool tls_broker_stub_start(const char * a_cert_file, uint16_t * a_port_ptr);
+void tls_broker_stub_stop();
+
+uint32_t tls_broker_stub_handshakes();
+uint32_t tls_broker_stub_resumed();
+
+#endif
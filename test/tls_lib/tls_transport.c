@@ -0,0 +1,345 @@
+#include <stdio.h>      // printf
+#include <sys/socket.h> // socket
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h>// TCP_NODELAY
+#include <unistd.h>     // close
+#include <arpa/inet.h>  // inet_addr
+#include <fcntl.h>      // O_NONBLOCK
+#include <poll.h>       // poll
+#include <pthread.h>    // pthread_create
+#include <signal.h>     // SIGPIPE
+#include <string.h>     // memmove
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "tls_transport.h"
+
+#define TLS_RECEIVE_BUFFER_SIZE (256*1024)
+#define TLS_WRITE_TIMEOUT_MS    10000
+#define TLS_POLL_INTERVAL_MS    100
+
+/* One SSL object is shared by the reader thread and the writer, lock serializes them.
+   Socket is non-blocking after handshake so neither side holds the lock while waiting. */
+static SSL_CTX                  * tls_ctx              = NULL;
+static SSL                      * tls_ssl              = NULL;
+static SSL_SESSION              * tls_session          = NULL; /* Latest ticket for resumption */
+static int                        tls_socket           = -1;
+static bool                       tls_resumed          = false;
+static pthread_t                  tls_reading_thread_id;
+static pthread_mutex_t            tls_lock             = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool              tls_thread_running   = false;
+static bool                       tls_thread_started   = false;
+static tls_data_received_fptr_t   tls_received_callback = NULL;
+
+static uint8_t                    tls_receive_buffer[TLS_RECEIVE_BUFFER_SIZE];
+static size_t                     tls_received         = 0;
+
+/* Server hands out a new session (TLS 1.2 at handshake, TLS 1.3 tickets afterwards) */
+static int tls_new_session_cb(SSL * a_ssl, SSL_SESSION * a_session)
+{
+    (void)a_ssl;
+    if (NULL != tls_session)
+        SSL_SESSION_free(tls_session);
+    tls_session = a_session;
+    return 1; /* Reference is kept */
+}
+
+static bool tls_context_create(const char * a_ca_file)
+{
+    if (NULL != tls_ctx)
+        return true;
+
+    tls_ctx = SSL_CTX_new(TLS_client_method());
+    if (NULL == tls_ctx)
+        return false;
+
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_PEER, NULL);
+
+    int loaded = (NULL != a_ca_file) ? SSL_CTX_load_verify_locations(tls_ctx, a_ca_file, NULL) :
+                                       SSL_CTX_set_default_verify_paths(tls_ctx);
+    if (1 != loaded) {
+        printf("TLS CA load failed\n");
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return false;
+    }
+
+    /* Sessions are kept here, not in the OpenSSL internal cache */
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(tls_ctx, tls_new_session_cb);
+    return true;
+}
+
+/* Size of MQTT packet at the start of a_data, 0 when header is not complete yet */
+static size_t tls_packet_size(uint8_t * a_data, size_t a_amount)
+{
+    size_t   value      = 0;
+    size_t   multiplier = 1;
+    uint32_t cnt        = 1;
+
+    do {
+        if ((cnt >= a_amount) || (4 < cnt))
+            return 0;
+        value      += (a_data[cnt] & 127) * multiplier;
+        multiplier *= 128;
+    } while (0 != (a_data[cnt++] & 128));
+
+    return value + cnt;
+}
+
+/* Pass complete packets to the MQTT client and keep partial one for the next read */
+static bool tls_deliver_packets()
+{
+    size_t offset = 0;
+    while (2 <= (tls_received - offset)) {
+        size_t packet_size = tls_packet_size(&tls_receive_buffer[offset], tls_received - offset);
+
+        if ((0 == packet_size) && (5 <= (tls_received - offset)))
+            return false; /* Malformed remaining length */
+
+        if (packet_size > TLS_RECEIVE_BUFFER_SIZE) {
+            printf("TLS packet too big %zu\n", packet_size);
+            return false;
+        }
+
+        if ((0 == packet_size) || (packet_size > (tls_received - offset)))
+            break;
+
+        tls_received_callback(&tls_receive_buffer[offset], packet_size);
+        offset += packet_size;
+    }
+
+    memmove(tls_receive_buffer, &tls_receive_buffer[offset], tls_received - offset);
+    tls_received -= offset;
+    return true;
+}
+
+static void *tls_receive_thread(void * a_ptr)
+{
+    (void)a_ptr;
+
+    while (tls_thread_running) {
+        struct pollfd pfd;
+        pfd.fd      = tls_socket;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (0 >= poll(&pfd, 1, TLS_POLL_INTERVAL_MS))
+            continue;
+
+        /* Read until OpenSSL has nothing buffered */
+        while (tls_thread_running) {
+            pthread_mutex_lock(&tls_lock);
+            int bytes_read = SSL_read(tls_ssl,
+                                      &tls_receive_buffer[tls_received],
+                                      TLS_RECEIVE_BUFFER_SIZE - tls_received);
+            int error      = SSL_get_error(tls_ssl, bytes_read);
+            pthread_mutex_unlock(&tls_lock);
+
+            if (0 < bytes_read) {
+                tls_received += (size_t)bytes_read;
+                if (false == tls_deliver_packets()) {
+                    tls_thread_running = false;
+                    break;
+                }
+            } else if ((SSL_ERROR_WANT_READ  == error) ||
+                       (SSL_ERROR_WANT_WRITE == error)) {
+                break;
+            } else {
+                printf("TLS connection closed %i\n", error);
+                tls_thread_running = false;
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+bool tls_initialize(char                     * a_inet_addr,
+                    uint32_t                   a_port,
+                    const char               * a_ca_file,
+                    const char               * a_server_name,
+                    tls_data_received_fptr_t   a_receive_callback)
+{
+    struct sockaddr_in server;
+
+    if ((NULL == a_inet_addr) || (NULL == a_receive_callback) || (-1 != tls_socket))
+        return false;
+
+    if (false == tls_context_create(a_ca_file))
+        return false;
+
+    /* Peer closing first must not kill the process */
+    signal(SIGPIPE, SIG_IGN);
+
+    tls_socket = socket(AF_INET , SOCK_STREAM, 0);
+    if (-1 == tls_socket)
+        return false;
+
+    struct timeval timeout;
+        timeout.tv_sec  = 10;
+        timeout.tv_usec = 0;
+    setsockopt(tls_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+    setsockopt(tls_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
+
+    int value = 1;
+    setsockopt(tls_socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(int));
+
+    server.sin_addr.s_addr = inet_addr(a_inet_addr);
+    server.sin_family      = AF_INET;
+    server.sin_port        = htons(a_port);
+
+    if (connect(tls_socket , (struct sockaddr *)&server , sizeof(server)) < 0) {
+        close(tls_socket);
+        tls_socket = -1;
+        return false;
+    }
+
+    tls_ssl = SSL_new(tls_ctx);
+    SSL_set_fd(tls_ssl, tls_socket);
+
+    if (NULL != a_server_name) {
+        SSL_set_tlsext_host_name(tls_ssl, a_server_name);
+        SSL_set1_host(tls_ssl, a_server_name);
+    }
+
+    /* Offer earlier session - server decides whether it is resumed */
+    if ((NULL != tls_session) && (1 == SSL_SESSION_is_resumable(tls_session)))
+        SSL_set_session(tls_ssl, tls_session);
+
+    if (1 != SSL_connect(tls_ssl)) {
+        printf("TLS handshake failed: %s\n", ERR_reason_error_string(ERR_get_error()));
+        SSL_free(tls_ssl);
+        tls_ssl = NULL;
+        close(tls_socket);
+        tls_socket = -1;
+        return false;
+    }
+    tls_resumed = (1 == SSL_session_reused(tls_ssl));
+
+    fcntl(tls_socket, F_SETFL, fcntl(tls_socket, F_GETFL) | O_NONBLOCK);
+
+    tls_received          = 0;
+    tls_received_callback = a_receive_callback;
+    tls_thread_running    = true;
+
+    if (0 != pthread_create(&tls_reading_thread_id, NULL, tls_receive_thread, NULL)) {
+        tls_thread_running = false;
+        tls_stop();
+        return false;
+    }
+    tls_thread_started = true;
+    return true;
+}
+
+int tls_write(uint8_t * a_data, size_t a_amount)
+{
+    int written = -1;
+    int waited  = 0;
+
+    pthread_mutex_lock(&tls_lock);
+    while (NULL != tls_ssl) {
+        written   = SSL_write(tls_ssl, a_data, (int)a_amount);
+        int error = SSL_get_error(tls_ssl, written);
+
+        if (0 < written)
+            break;
+
+        written = -1;
+        if (((SSL_ERROR_WANT_WRITE != error) && (SSL_ERROR_WANT_READ != error)) ||
+            (TLS_WRITE_TIMEOUT_MS <= waited))
+            break;
+
+        /* Same arguments must be given again once socket is ready */
+        pthread_mutex_unlock(&tls_lock);
+        struct pollfd pfd;
+        pfd.fd      = tls_socket;
+        pfd.events  = (SSL_ERROR_WANT_WRITE == error) ? POLLOUT : POLLIN;
+        pfd.revents = 0;
+        poll(&pfd, 1, TLS_POLL_INTERVAL_MS);
+        waited += TLS_POLL_INTERVAL_MS;
+        pthread_mutex_lock(&tls_lock);
+    }
+    pthread_mutex_unlock(&tls_lock);
+    return written;
+}
+
+bool tls_stop()
+{
+    if (-1 == tls_socket)
+        return true;
+
+    /* Reader may have stopped by itself already */
+    tls_thread_running = false;
+    if (tls_thread_started) {
+        pthread_join(tls_reading_thread_id, NULL);
+        tls_thread_started = false;
+    }
+
+    pthread_mutex_lock(&tls_lock);
+    if (NULL != tls_ssl) {
+        SSL_shutdown(tls_ssl);
+        /* OpenSSL invalidates the session when close_notify could not be sent. Keys are
+           still good after a dropped link, which is the very case resumption is for. */
+        SSL_set_shutdown(tls_ssl, SSL_get_shutdown(tls_ssl) | SSL_SENT_SHUTDOWN);
+        SSL_free(tls_ssl);
+        tls_ssl = NULL;
+    }
+    close(tls_socket);
+    tls_socket            = -1;
+    tls_received_callback = NULL;
+    pthread_mutex_unlock(&tls_lock);
+    return true;
+}
+
+bool tls_session_resumed()
+{
+    return tls_resumed;
+}
+
+size_t tls_session_export(uint8_t * a_buffer, size_t a_size)
+{
+    size_t length = 0;
+
+    pthread_mutex_lock(&tls_lock);
+    if ((NULL != tls_session) && (1 == SSL_SESSION_is_resumable(tls_session))) {
+        int needed = i2d_SSL_SESSION(tls_session, NULL);
+        if ((0 < needed) && ((size_t)needed <= a_size) && (NULL != a_buffer)) {
+            unsigned char * out = a_buffer;
+            length = (size_t)i2d_SSL_SESSION(tls_session, &out);
+        }
+    }
+    pthread_mutex_unlock(&tls_lock);
+    return length;
+}
+
+bool tls_session_import(uint8_t * a_buffer, size_t a_size)
+{
+    if ((NULL == a_buffer) || (0 == a_size))
+        return false;
+
+    const unsigned char * in      = a_buffer;
+    SSL_SESSION         * session = d2i_SSL_SESSION(NULL, &in, (long)a_size);
+    if (NULL == session)
+        return false;
+
+    pthread_mutex_lock(&tls_lock);
+    if (NULL != tls_session)
+        SSL_SESSION_free(tls_session);
+    tls_session = session;
+    pthread_mutex_unlock(&tls_lock);
+    return true;
+}
+
+void tls_cleanup()
+{
+    tls_stop();
+    if (NULL != tls_session) {
+        SSL_SESSION_free(tls_session);
+        tls_session = NULL;
+    }
+    if (NULL != tls_ctx) {
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+    }
+    tls_resumed = false;
+}
@@ -0,0 +1,39 @@
+#ifndef TLS_TRANSPORT_H
+#define TLS_TRANSPORT_H
+
+#include <stdint.h>  // uint
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+typedef void (*tls_data_received_fptr_t)(uint8_t * a_data, size_t amount);
+
+/* Open TCP connection and run TLS handshake. Server certificate is verified against
+   a_ca_file (system trust store when NULL) and a_server_name (skipped when NULL).
+   Session of the previous connection is offered, so reconnects skip the full handshake
+   when the server accepts it. Whole MQTT packets are passed to a_receive_callback. */
+bool tls_initialize(char                     * a_inet_addr,
+                    uint32_t                   a_port,
+                    const char               * a_ca_file,
+                    const char               * a_server_name,
+                    tls_data_received_fptr_t   a_receive_callback);
+
+/* data_stream_out_fptr_t for mqtt_connect() */
+int tls_write(uint8_t * a_data, size_t a_amount);
+
+/* Close connection. Session is kept for the next tls_initialize(). */
+bool tls_stop();
+
+/* True when the latest handshake resumed an earlier session */
+bool tls_session_resumed();
+
+/* Serialize kept session (to survive a reboot). Returns length, 0 when there is no
+   resumable session or a_size is too small. */
+size_t tls_session_export(uint8_t * a_buffer, size_t a_size);
+
+/* Restore session serialized by tls_session_export() */
+bool tls_session_import(uint8_t * a_buffer, size_t a_size);
+
+/* Forget session and release TLS context */
+void tls_cleanup();
+
+#endif
@@ -0,0 +1,433 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "socket_read_write.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+
+#define ROUND_TRIPS 200
+#define BURST       300
+#define FLOOD       2000
+#define FLOOD_SIZE  1000
+#define HIGH_WATER  64
+#define LOW_WATER   16
+
+static uint8_t              g_buffer[1024];
+static MQTT_shared_data_t   g_shared;
+static volatile uint32_t    g_received   = 0;
+static volatile bool        g_connack    = false;
+static volatile bool        g_suback     = false;
+static volatile uint32_t    g_burst      = 0;
+static volatile uint32_t    g_batches    = 0;
+static volatile size_t      g_unconsumed = 0;
+static MQTT_message_view_t  g_views[32];
+static MQTT_message_view_t  g_held[FLOOD];
+static volatile uint32_t    g_held_count = 0;
+static pthread_mutex_t      g_held_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint32_t    g_peer_sent  = 0;
+static char                 g_path[64];
+static char                 g_abstract[64];
+
+/****************************************************************************************
+ * In-process broker - CONNACK, SUBACK, PINGRESP and PUBLISH echo                        *
+ ****************************************************************************************/
+static bool stub_read(int a_client, uint8_t * a_buffer, size_t a_amount)
+{
+    return (a_amount == 0) || ((ssize_t)a_amount == recv(a_client, a_buffer, a_amount, MSG_WAITALL));
+}
+
+static void stub_serve(int a_client)
+{
+    uint8_t packet[512];
+
+    while (stub_read(a_client, packet, 2)) {
+        size_t cnt    = 1;
+        size_t value  = packet[1] & 127;
+        size_t factor = 128;
+
+        while ((packet[cnt] & 128) && (cnt < 4)) {
+            if (false == stub_read(a_client, &packet[++cnt], 1))
+                return;
+            value  += (packet[cnt] & 127) * factor;
+            factor *= 128;
+        }
+        size_t length = cnt + 1 + value;
+        if ((length > sizeof(packet)) || (false == stub_read(a_client, &packet[cnt + 1], value)))
+            return;
+
+        switch (packet[0] >> 4) {
+            case 1: { /* CONNECT */
+                uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+                send(a_client, connack, sizeof(connack), MSG_NOSIGNAL);
+                break;
+            }
+            case 3: /* PUBLISH - echo */
+                send(a_client, packet, length, MSG_NOSIGNAL);
+                break;
+            case 8: { /* SUBSCRIBE */
+                uint8_t suback[] = {0x90, 0x03, packet[2], packet[3], 0x00};
+                send(a_client, suback, sizeof(suback), MSG_NOSIGNAL);
+                break;
+            }
+            case 12: { /* PINGREQ */
+                uint8_t pingresp[] = {0xd0, 0x00};
+                send(a_client, pingresp, sizeof(pingresp), MSG_NOSIGNAL);
+                break;
+            }
+            case 14: /* DISCONNECT */
+                return;
+            default:
+                break;
+        }
+    }
+}
+
+static void *stub_peer_thread(void * a_ptr)
+{
+    int client = (int)(intptr_t)a_ptr;
+    stub_serve(client);
+    close(client);
+    return 0;
+}
+
+static void *stub_listen_thread(void * a_ptr)
+{
+    int listener = (int)(intptr_t)a_ptr;
+    int client   = accept(listener, NULL, NULL);
+    if (0 <= client) {
+        stub_serve(client);
+        close(client);
+    }
+    close(listener);
+    return 0;
+}
+
+/* Listen one client in a_path, '@' prefix for the abstract namespace */
+static bool stub_listen(const char * a_path, pthread_t * a_thread_ptr)
+{
+    struct sockaddr_un server;
+    size_t             path_length = strlen(a_path);
+    socklen_t          address_length = sizeof(server);
+
+    memset(&server, 0, sizeof(server));
+    server.sun_family = AF_UNIX;
+    memcpy(server.sun_path, a_path, path_length);
+    if ('@' == a_path[0]) {
+        server.sun_path[0] = '\0';
+        address_length     = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_length);
+    } else {
+        unlink(a_path);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((0 > listener) ||
+        (0 > bind(listener, (struct sockaddr *)&server, address_length)) ||
+        (0 > listen(listener, 1))) {
+        close(listener);
+        return false;
+    }
+    return (0 == pthread_create(a_thread_ptr, NULL, stub_listen_thread, (void*)(intptr_t)listener));
+}
+
+/****************************************************************************************
+ * Client side                                                                          *
+ ****************************************************************************************/
+void data_from_socket_(uint8_t * a_data, size_t a_amount)
+{
+    mqtt_receive(a_data, a_amount);
+}
+
+void connected_cb_(MQTTErrorCodes_t a_status)
+{
+    g_connack = (Successfull == a_status);
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if (NULL == a_data_ptr)
+        g_suback = true;
+    if ((Successfull == a_status) && (NULL != a_data_ptr) &&
+        (10 == a_data_len) && (0 == memcmp("UNIX works", a_data_ptr, a_data_len)))
+        g_received++;
+}
+
+/* Batch delivery - whole packets of each read in one call */
+void stream_from_socket_(uint8_t * a_data, size_t a_amount)
+{
+    g_unconsumed += a_amount - mqtt_receive_stream(a_data, a_amount);
+}
+
+void batch_cb_(MQTT_message_view_t * a_views_ptr, size_t a_count)
+{
+    g_batches++;
+    for (size_t i = 0; i < a_count; i++) {
+        if ((2 == a_views_ptr[i].payload_length) &&
+            ((uint8_t)(g_burst & 0xff) == a_views_ptr[i].payload_ptr[1]))
+            g_burst++;
+    }
+}
+
+/* Asynchronous consumer - messages are retained and handled later from the main thread */
+void retain_cb_(MQTT_message_view_t * a_view_ptr)
+{
+    pthread_mutex_lock(&g_held_mutex);
+    if (mqtt_message_retain(a_view_ptr))
+        g_held[g_held_count++] = *a_view_ptr;
+    pthread_mutex_unlock(&g_held_mutex);
+}
+
+/* Broker flooding the client, blocks when the client does not read */
+static void *flood_thread(void * a_ptr)
+{
+    int     peer = (int)(intptr_t)a_ptr;
+    uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+    uint8_t publish[3 + 5 + FLOOD_SIZE];
+
+    send(peer, connack, sizeof(connack), MSG_NOSIGNAL);
+    for (uint32_t i = 0; i < FLOOD; i++) {
+        size_t remaining = 2 + 3 + FLOOD_SIZE;
+        publish[0] = 0x30;
+        publish[1] = (uint8_t)(0x80 | (remaining & 127));
+        publish[2] = (uint8_t)(remaining >> 7);
+        publish[3] = 0x00; publish[4] = 0x03; publish[5] = 'f'; publish[6] = '/'; publish[7] = 'l';
+        memset(&publish[8], 'x', FLOOD_SIZE);
+        memcpy(&publish[8], &i, sizeof(i));
+        if ((ssize_t)sizeof(publish) != send(peer, publish, sizeof(publish), MSG_NOSIGNAL))
+            break;
+        g_peer_sent = i + 1;
+    }
+    return 0;
+}
+
+static double now_us_()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Connect, subscribe and run echo round trips over already opened socket */
+static void run_session_(const char * a_name)
+{
+    MQTT_string_t empty = mqtt_string(NULL);
+    g_connack = false;
+    TEST_ASSERT_TRUE(mqtt_connect_string(mqtt_string("JAMKtest UNIX"),
+                                         0,
+                                         empty,
+                                         empty,
+                                         empty,
+                                         empty,
+                                         &g_shared,
+                                         g_buffer,
+                                         sizeof(g_buffer),
+                                         true,
+                                         &socket_write,
+                                         &connected_cb_,
+                                         &subscribe_cb_,
+                                         5));
+    for (uint32_t i = 0; (i < 100) && (false == g_connack); i++)
+        usleep(10000);
+    TEST_ASSERT_TRUE(g_connack);
+
+    MQTT_string_t topic = mqtt_string("unix/test");
+    g_suback = false;
+    TEST_ASSERT_TRUE(mqtt_subscribe_string(topic, 5));
+    /* Socket reader takes one packet per read - SUBACK before the first echo */
+    for (uint32_t i = 0; (i < 100) && (false == g_suback); i++)
+        usleep(10000);
+    TEST_ASSERT_TRUE(g_suback);
+
+    double start = now_us_();
+    for (uint32_t i = 0; i < ROUND_TRIPS; i++) {
+        g_received = 0;
+        TEST_ASSERT_TRUE(mqtt_publish_string(topic, (uint8_t*)"UNIX works", 10));
+        for (uint32_t j = 0; (j < 100000) && (0 == g_received); j++)
+            usleep(10);
+        TEST_ASSERT_EQUAL_UINT32(1, g_received);
+    }
+    printf("%s: %.1f us per publish round trip\n", a_name, (now_us_() - start) / ROUND_TRIPS);
+
+    mqtt_disconnect();
+    stop_reading_thread();
+}
+
+void test_unix_path()
+{
+    pthread_t stub;
+    TEST_ASSERT_TRUE(stub_listen(g_path, &stub));
+    TEST_ASSERT_TRUE(socket_initialize_unix(g_path, &data_from_socket_));
+    run_session_(g_path);
+    pthread_join(stub, NULL);
+    unlink(g_path);
+}
+
+void test_unix_abstract()
+{
+    pthread_t stub;
+    TEST_ASSERT_TRUE(stub_listen(g_abstract, &stub));
+    TEST_ASSERT_TRUE(socket_initialize_unix(g_abstract, &data_from_socket_));
+    run_session_(g_abstract);
+    pthread_join(stub, NULL);
+}
+
+void test_socketpair()
+{
+    pthread_t stub;
+    int       peer = -1;
+    TEST_ASSERT_TRUE(socket_initialize_pair(&peer, &data_from_socket_));
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&stub, NULL, stub_peer_thread, (void*)(intptr_t)peer));
+    run_session_("socketpair");
+    pthread_join(stub, NULL);
+}
+
+void test_socketpair_burst()
+{
+    /* Many packets in one read and a packet split over two reads */
+    uint8_t burst[(BURST + 1) * 10];
+    size_t  size = 0;
+    int     peer = -1;
+
+    burst[size++] = 0x20; burst[size++] = 0x02; burst[size++] = 0x00; burst[size++] = 0x00;
+    for (uint32_t i = 0; i <= BURST; i++) {
+        uint8_t publish[] = {0x30, 0x06, 0x00, 0x02, 'u', 'b', 'p', (uint8_t)(i & 0xff)};
+        memcpy(&burst[size], publish, sizeof(publish));
+        size += sizeof(publish);
+    }
+
+    g_burst      = 0;
+    g_batches    = 0;
+    g_unconsumed = 0;
+    g_connack    = false;
+    socket_set_batch_delivery(true);
+    TEST_ASSERT_TRUE(socket_initialize_pair(&peer, &stream_from_socket_));
+    MQTT_string_t empty = mqtt_string(NULL);
+    TEST_ASSERT_TRUE(mqtt_connect_string(mqtt_string("JAMKtest burst"), 0, empty, empty, empty, empty,
+                                         &g_shared, g_buffer, sizeof(g_buffer), true,
+                                         &socket_write, &connected_cb_, &subscribe_cb_, 5));
+    TEST_ASSERT_TRUE(mqtt_set_message_batch_cb(&batch_cb_, g_views, sizeof(g_views) / sizeof(g_views[0])));
+
+    TEST_ASSERT_EQUAL_INT((int)(size - 5), send(peer, burst, size - 5, MSG_NOSIGNAL));
+    usleep(50000);
+    TEST_ASSERT_EQUAL_INT(5, send(peer, &burst[size - 5], 5, MSG_NOSIGNAL));
+    for (uint32_t i = 0; (i < 100) && ((BURST + 1) > g_burst); i++)
+        usleep(10000);
+
+    TEST_ASSERT_TRUE(g_connack);
+    TEST_ASSERT_EQUAL_UINT32(BURST + 1, g_burst);
+    TEST_ASSERT_TRUE((BURST + 1) > g_batches);
+    TEST_ASSERT_EQUAL_UINT32(0, (uint32_t)g_unconsumed);
+    printf("%u messages in %u batches\n", BURST + 1, g_batches);
+
+    mqtt_disconnect();
+    stop_reading_thread();
+    socket_set_batch_delivery(false);
+    close(peer);
+}
+
+void test_socketpair_backpressure()
+{
+    /* Consumer falls behind - reader stops at the high watermark and broker is blocked */
+    pthread_t flood;
+    int       peer     = -1;
+    uint32_t  consumed = 0;
+
+    g_held_count = 0;
+    g_peer_sent  = 0;
+    g_connack    = false;
+    TEST_ASSERT_FALSE(socket_set_receive_watermarks(HIGH_WATER, HIGH_WATER));
+    TEST_ASSERT_TRUE(socket_set_receive_watermarks(HIGH_WATER, LOW_WATER));
+    uint32_t pauses = socket_receive_pauses();
+
+    TEST_ASSERT_TRUE(socket_initialize_pair(&peer, &data_from_socket_));
+    MQTT_string_t empty = mqtt_string(NULL);
+    TEST_ASSERT_TRUE(mqtt_connect_string(mqtt_string("JAMKtest flood"), 0, empty, empty, empty, empty,
+                                         &g_shared, g_buffer, sizeof(g_buffer), true,
+                                         &socket_write, &connected_cb_, &subscribe_cb_, 5));
+    mqtt_set_message_view_cb(&retain_cb_, &socket_buffer_pin);
+    TEST_ASSERT_EQUAL_INT(0, pthread_create(&flood, NULL, flood_thread, (void*)(intptr_t)peer));
+
+    for (uint32_t i = 0; (i < 200) && (false == socket_receive_paused()); i++)
+        usleep(10000);
+    TEST_ASSERT_TRUE(socket_receive_paused());
+
+    /* Nothing moves while the consumer sleeps */
+    usleep(100000);
+    uint32_t sent = g_peer_sent;
+    uint32_t held = g_held_count;
+    usleep(100000);
+    TEST_ASSERT_EQUAL_UINT32(sent, g_peer_sent);
+    TEST_ASSERT_EQUAL_UINT32(held, g_held_count);
+    TEST_ASSERT_TRUE(FLOOD > sent);
+    TEST_ASSERT_TRUE(HIGH_WATER <= socket_receive_retained());
+    TEST_ASSERT_TRUE((2 * HIGH_WATER) >= socket_receive_retained());
+    printf("Paused with %u messages held, broker blocked after %u of %u\n",
+           socket_receive_retained(), sent, FLOOD);
+
+    /* Consumer catches up - everything arrives in order */
+    for (uint32_t i = 0; (i < 5000) && (FLOOD > consumed); i++) {
+        pthread_mutex_lock(&g_held_mutex);
+        for (; consumed < g_held_count; consumed++) {
+            uint32_t number = 0;
+            memcpy(&number, g_held[consumed].payload_ptr, sizeof(number));
+            TEST_ASSERT_EQUAL_UINT32(consumed, number);
+            TEST_ASSERT_EQUAL_UINT32(FLOOD_SIZE, g_held[consumed].payload_length);
+            mqtt_message_release(&g_held[consumed]);
+        }
+        pthread_mutex_unlock(&g_held_mutex);
+        usleep(1000);
+    }
+    TEST_ASSERT_EQUAL_UINT32(FLOOD, consumed);
+    TEST_ASSERT_TRUE(g_connack);
+    TEST_ASSERT_EQUAL_UINT32(0, socket_receive_retained());
+    TEST_ASSERT_TRUE(pauses < socket_receive_pauses());
+
+    pthread_join(flood, NULL);
+    mqtt_disconnect();
+    stop_reading_thread();
+    TEST_ASSERT_TRUE(socket_set_receive_watermarks(0, 0));
+    close(peer);
+}
+
+void test_unix_refused()
+{
+    /* Nobody listening, empty and too long names */
+    char long_path[200];
+    memset(long_path, 'x', sizeof(long_path) - 1);
+    long_path[sizeof(long_path) - 1] = '\0';
+
+    TEST_ASSERT_FALSE(socket_initialize_unix(g_abstract, &data_from_socket_));
+    TEST_ASSERT_FALSE(socket_initialize_unix("", &data_from_socket_));
+    TEST_ASSERT_FALSE(socket_initialize_unix(long_path, &data_from_socket_));
+    TEST_ASSERT_FALSE(socket_initialize_pair(NULL, &data_from_socket_));
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    snprintf(g_path,     sizeof(g_path),     "/tmp/rojal_mqtt_%d.sock", (int)getpid());
+    snprintf(g_abstract, sizeof(g_abstract), "@rojal_mqtt_%d",          (int)getpid());
+
+    UnityBegin("Unix domain transport");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_unix_path,                tCntr++);
+    RUN_TEST(test_unix_abstract,            tCntr++);
+    RUN_TEST(test_socketpair,               tCntr++);
+    RUN_TEST(test_socketpair_burst,         tCntr++);
+    RUN_TEST(test_socketpair_backpressure,  tCntr++);
+    RUN_TEST(test_unix_refused,             tCntr++);
+    return UnityEnd();
+}
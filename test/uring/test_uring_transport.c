@@ -0,0 +1,226 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "uring_transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* Local TCP stand-in which echoes everything back in odd sized pieces, so that
+   packets arrive split and merged in every possible way. */
+static int             g_listen  = -1;
+static uint16_t        g_port    = 0;
+static pthread_t       g_echo_thread;
+static volatile bool   g_running = false;
+
+static MQTT_shared_data_t g_shared;
+static uint8_t            g_buffer[64*1024];
+static volatile uint32_t  g_messages = 0;
+static volatile uint32_t  g_bad      = 0;
+
+static void *echo_thread_(void * a_ptr)
+{
+    (void)a_ptr;
+    static uint8_t data[64*1024];
+
+    while (g_running) {
+        struct pollfd pfd = {g_listen, POLLIN, 0};
+        if (0 >= poll(&pfd, 1, 100))
+            continue;
+        int client = accept(g_listen, NULL, NULL);
+        uint32_t piece = 7;
+        int received;
+        while (0 < (received = (int)recv(client, data, sizeof(data), 0))) {
+            for (int offset = 0; offset < received; ) {
+                int amount = ((received - offset) < (int)piece) ? (received - offset) : (int)piece;
+                send(client, &data[offset], amount, MSG_NOSIGNAL);
+                offset += amount;
+                piece   = (piece * 7 + 3) % 1500 + 1;
+            }
+        }
+        close(client);
+    }
+    return 0;
+}
+
+void data_in_(uint8_t * a_data, size_t a_amount)
+{
+    mqtt_receive(a_data, a_amount);
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    if ((Successfull != a_status) || (NULL == a_data_ptr))
+        return;
+
+    /* Payload carries its sequence number, content is derived from it */
+    uint32_t seq = 0;
+    memcpy(&seq, a_data_ptr, sizeof(seq));
+    if ((seq != g_messages) || (8 != a_topic_len) || (0 != memcmp("ur/topic", a_topic_ptr, 8)))
+        g_bad++;
+    for (uint32_t i = sizeof(seq); i < a_data_len; i++)
+        if (a_data_ptr[i] != (uint8_t)(seq + i))
+            g_bad++;
+    g_messages++;
+}
+
+bool connect_()
+{
+    g_messages = 0;
+    g_bad      = 0;
+    if (false == uring_initialize("127.0.0.1", g_port, &data_in_))
+        return false;
+
+    uint8_t empty[] = "\0";
+    return mqtt_connect("JAMKtest uring",
+                        0,
+                        empty,
+                        empty,
+                        empty,
+                        empty,
+                        &g_shared,
+                        g_buffer,
+                        sizeof(g_buffer),
+                        true,
+                        &uring_write,
+                        NULL,
+                        &subscribe_cb_,
+                        5);
+}
+
+void publish_(uint32_t a_seq, uint32_t a_size)
+{
+    static uint8_t payload[48*1024];
+    memcpy(payload, &a_seq, sizeof(a_seq));
+    for (uint32_t i = sizeof(a_seq); i < a_size; i++)
+        payload[i] = (uint8_t)(a_seq + i);
+    TEST_ASSERT_TRUE(mqtt_publish("ur/topic", 8, (char*)payload, a_size));
+}
+
+void wait_messages_(uint32_t a_count)
+{
+    for (uint32_t i = 0; (i < 500) && (g_messages < a_count); i++)
+        usleep(10000);
+}
+
+void test_uring_batched_publish()
+{
+    const uint32_t count = 2000;
+    uring_stats_t  stats;
+
+    TEST_ASSERT_TRUE(connect_());
+    if (false == uring_active()) {
+        TEST_IGNORE_MESSAGE("io_uring not available");
+    }
+
+    uring_batch_begin();
+    for (uint32_t i = 0; i < count; i++)
+        publish_(i, 16 + (i % 100));
+    uring_batch_end();
+
+    wait_messages_(count);
+    TEST_ASSERT_EQUAL_UINT32(count, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(0, g_bad);
+
+    uring_get_stats(&stats);
+    printf("uring: %u sends, %u receives, %u system calls\n",
+           (uint32_t)stats.sends, (uint32_t)stats.receives, (uint32_t)stats.enter_calls);
+    TEST_ASSERT_EQUAL_UINT32(count + 1, (uint32_t)stats.sends); /* + CONNECT */
+    TEST_ASSERT_TRUE(stats.enter_calls < (count / 4));
+
+    mqtt_disconnect();
+    TEST_ASSERT_TRUE(uring_stop());
+}
+
+void test_uring_unbatched_publish_keeps_order()
+{
+    const uint32_t count = 500;
+
+    TEST_ASSERT_TRUE(connect_());
+    for (uint32_t i = 0; i < count; i++)
+        publish_(i, 100 + (i % 3000));
+
+    wait_messages_(count);
+    TEST_ASSERT_EQUAL_UINT32(count, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(0, g_bad);
+
+    mqtt_disconnect();
+    TEST_ASSERT_TRUE(uring_stop());
+}
+
+void test_uring_large_packets()
+{
+    TEST_ASSERT_TRUE(connect_());
+    for (uint32_t i = 0; i < 10; i++)
+        publish_(i, 40*1024 + i);
+
+    wait_messages_(10);
+    TEST_ASSERT_EQUAL_UINT32(10, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(0, g_bad);
+
+    mqtt_disconnect();
+    TEST_ASSERT_TRUE(uring_stop());
+}
+
+void test_uring_fallback_to_socket()
+{
+    setenv("ROJAL_NO_URING", "1", 1);
+    TEST_ASSERT_TRUE(connect_());
+    unsetenv("ROJAL_NO_URING");
+    TEST_ASSERT_FALSE(uring_active());
+
+    /* Same API, plain socket underneath. Its reader takes one packet per read,
+       so let the echoed CONNECT go first. */
+    usleep(200000);
+    uring_batch_begin();
+    publish_(0, 20);
+    uring_batch_end();
+    wait_messages_(1);
+    TEST_ASSERT_EQUAL_UINT32(1, g_messages);
+    TEST_ASSERT_EQUAL_UINT32(0, g_bad);
+
+    mqtt_disconnect();
+    TEST_ASSERT_TRUE(uring_stop());
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    struct sockaddr_in server;
+    socklen_t          server_size = sizeof(server);
+
+    memset(&server, 0, sizeof(server));
+    server.sin_addr.s_addr = inet_addr("127.0.0.1");
+    server.sin_family      = AF_INET;
+    g_listen = socket(AF_INET, SOCK_STREAM, 0);
+    if ((0 > bind(g_listen, (struct sockaddr *)&server, sizeof(server))) ||
+        (0 > listen(g_listen, 4)) ||
+        (0 > getsockname(g_listen, (struct sockaddr *)&server, &server_size)))
+        return 1;
+    g_port    = ntohs(server.sin_port);
+    g_running = true;
+    pthread_create(&g_echo_thread, NULL, echo_thread_, NULL);
+
+    UnityBegin("io_uring transport");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_uring_batched_publish,                tCntr++);
+    RUN_TEST(test_uring_unbatched_publish_keeps_order,  tCntr++);
+    RUN_TEST(test_uring_large_packets,                  tCntr++);
+    RUN_TEST(test_uring_fallback_to_socket,             tCntr++);
+    int failures = UnityEnd();
+
+    g_running = false;
+    pthread_join(g_echo_thread, NULL);
+    close(g_listen);
+    return failures;
+}
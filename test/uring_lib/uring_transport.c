@@ -0,0 +1,601 @@
+#include <stdio.h>      // printf
+#include <stdlib.h>     // getenv, malloc/free
+#include <string.h>     // memcpy
+#include <errno.h>      // ENOBUFS
+#include <time.h>       // clock_gettime
+#include <sys/socket.h> // socket
+#include <sys/mman.h>   // mmap
+#include <sys/syscall.h>// io_uring system calls
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h>// TCP_NODELAY
+#include <arpa/inet.h>  // inet_addr
+#include <unistd.h>     // close
+#include <pthread.h>    // pthread_create
+#include <linux/io_uring.h>
+#include "uring_transport.h"
+
+/* Without liburing - rings are mapped and driven directly with the three system calls */
+
+#define URING_ENTRIES        512
+#define URING_SEND_SLOTS     256
+#define URING_SEND_SLOT_SIZE 2048
+#define URING_RECV_BUFFERS   64              /* Power of two - provided buffer ring */
+#define URING_RECV_SIZE      (16*1024)
+#define URING_RECV_GROUP     1
+#define URING_PACKET_MAX     (256*1024)     /* Reassembly of packets split over buffers */
+#define URING_WAIT_MS        10000
+
+#define URING_TAG_RECV       (1ull << 62)
+#define URING_TAG_STOP       (2ull << 62)
+
+typedef struct uring_send_slot
+{
+    uint8_t   data[URING_SEND_SLOT_SIZE];
+    uint8_t * heap;   /* Packets not fitting into the slot */
+    size_t    length;
+    bool      busy;
+} uring_send_slot_t;
+
+/* Ring */
+static int                        uring_fd          = -1;
+static struct io_uring_params     uring_params;
+static uint8_t                  * uring_sq_ptr      = NULL;
+static size_t                     uring_sq_size     = 0;
+static uint8_t                  * uring_cq_ptr      = NULL;
+static size_t                     uring_cq_size     = 0;
+static struct io_uring_sqe      * uring_sqes        = NULL;
+static uint32_t                 * uring_sq_head;
+static uint32_t                 * uring_sq_tail;
+static uint32_t                 * uring_sq_mask;
+static uint32_t                 * uring_sq_array;
+static uint32_t                 * uring_cq_head;
+static uint32_t                 * uring_cq_tail;
+static uint32_t                 * uring_cq_mask;
+static struct io_uring_cqe      * uring_cqes;
+
+/* Provided receive buffers, only touched by the completion thread */
+static struct io_uring_buf_ring * uring_buf_ring    = NULL;
+static uint16_t                   uring_buf_tail    = 0;
+static uint8_t                  * uring_recv_memory = NULL;
+static uint8_t                    uring_packet[URING_PACKET_MAX];
+static size_t                     uring_packet_used = 0;
+
+/* Send slots and the chain of writes waiting for submission */
+static uring_send_slot_t          uring_slots[URING_SEND_SLOTS];
+static uint32_t                   uring_slot_next   = 0;
+static uint32_t                   uring_pending[URING_SEND_SLOTS];
+static uint32_t                   uring_pending_count = 0;
+static uint32_t                   uring_inflight    = 0;
+static bool                       uring_in_batch    = false;
+static pthread_mutex_t            uring_lock        = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t             uring_send_done   = PTHREAD_COND_INITIALIZER;
+
+static int                        uring_socket      = -1;
+static bool                       uring_is_active   = false;
+static volatile bool              uring_broken      = false;
+static pthread_t                  uring_thread_id;
+static socket_data_received_fptr_t uring_received_callback = NULL;
+static uring_stats_t              uring_stats;
+
+static int uring_enter(uint32_t a_to_submit, uint32_t a_min_complete, uint32_t a_flags)
+{
+    __atomic_fetch_add(&uring_stats.enter_calls, 1, __ATOMIC_RELAXED);
+    return (int)syscall(__NR_io_uring_enter, uring_fd, a_to_submit, a_min_complete, a_flags, NULL, 0);
+}
+
+/* Caller holds uring_lock. NULL when submission queue is full. */
+static struct io_uring_sqe * uring_sqe_get()
+{
+    uint32_t tail = *uring_sq_tail;
+    uint32_t head = __atomic_load_n(uring_sq_head, __ATOMIC_ACQUIRE);
+
+    if ((tail - head) >= uring_params.sq_entries)
+        return NULL;
+
+    struct io_uring_sqe * sqe = &uring_sqes[tail & *uring_sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring_sq_array[tail & *uring_sq_mask] = tail & *uring_sq_mask;
+    return sqe;
+}
+
+/* Caller holds uring_lock - make a_count prepared SQEs visible to the kernel */
+static void uring_sqe_commit(uint32_t a_count)
+{
+    __atomic_store_n(uring_sq_tail, *uring_sq_tail + a_count, __ATOMIC_RELEASE);
+}
+
+/* Caller holds uring_lock */
+static bool uring_recv_arm()
+{
+    struct io_uring_sqe * sqe = uring_sqe_get();
+    if (NULL == sqe)
+        return false;
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = uring_socket;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->buf_group = URING_RECV_GROUP;
+    sqe->user_data = URING_TAG_RECV;
+    uring_sqe_commit(1);
+    return (1 == uring_enter(1, 0, 0));
+}
+
+/* Caller holds uring_lock. Pending writes go out as one linked chain, so they hit
+   the socket in order and cost a single system call. */
+static void uring_submit_pending()
+{
+    uint32_t prepared = 0;
+    uint32_t free_sqe = uring_params.sq_entries -
+                        (*uring_sq_tail - __atomic_load_n(uring_sq_head, __ATOMIC_ACQUIRE));
+    uint32_t count    = (uring_pending_count < free_sqe) ? uring_pending_count : free_sqe;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct io_uring_sqe * sqe = uring_sqe_get();
+        uring_send_slot_t   * slot = &uring_slots[uring_pending[i]];
+
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = uring_socket;
+        sqe->addr      = (uint64_t)(uintptr_t)((NULL != slot->heap) ? slot->heap : slot->data);
+        sqe->len       = (uint32_t)slot->length;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = uring_pending[i];
+        if ((i + 1) < count)
+            sqe->flags = IOSQE_IO_LINK;
+
+        /* Visible one by one, tail may wrap while preparing */
+        uring_sqe_commit(1);
+        prepared++;
+    }
+
+    if (0 == prepared)
+        return;
+
+    /* Rest waits for the next round */
+    memmove(uring_pending, &uring_pending[prepared], (uring_pending_count - prepared) * sizeof(uint32_t));
+    uring_pending_count -= prepared;
+    uring_inflight      += prepared;
+
+    if (0 > uring_enter(prepared, 0, 0))
+        uring_broken = true;
+}
+
+static void uring_buffer_return(uint16_t a_bid)
+{
+    struct io_uring_buf * buf = &(uring_buf_ring->bufs[uring_buf_tail & (URING_RECV_BUFFERS - 1)]);
+    buf->addr = (uint64_t)(uintptr_t)&uring_recv_memory[(size_t)a_bid * URING_RECV_SIZE];
+    buf->len  = URING_RECV_SIZE;
+    buf->bid  = a_bid;
+    uring_buf_tail++;
+    __atomic_store_n(&(uring_buf_ring->tail), uring_buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Size of MQTT packet at the start of a_data, 0 when header is not complete yet */
+static size_t uring_packet_size(uint8_t * a_data, size_t a_amount)
+{
+    size_t   value      = 0;
+    size_t   multiplier = 1;
+    uint32_t cnt        = 1;
+
+    do {
+        if ((cnt >= a_amount) || (4 < cnt))
+            return 0;
+        value      += (a_data[cnt] & 127) * multiplier;
+        multiplier *= 128;
+    } while (0 != (a_data[cnt++] & 128));
+
+    return value + cnt;
+}
+
+/* Deliver whole packets from a_data, returns amount consumed */
+static size_t uring_deliver(uint8_t * a_data, size_t a_amount)
+{
+    size_t offset = 0;
+    while (2 <= (a_amount - offset)) {
+        size_t packet_size = uring_packet_size(&a_data[offset], a_amount - offset);
+        if ((0 == packet_size) || (packet_size > (a_amount - offset)))
+            break;
+        uring_received_callback(&a_data[offset], packet_size);
+        offset += packet_size;
+    }
+    return offset;
+}
+
+/* Packets complete in the received buffer are parsed in place, only partial ones are copied */
+static bool uring_received(uint8_t * a_data, size_t a_amount)
+{
+    if (0 == uring_packet_used) {
+        size_t consumed = uring_deliver(a_data, a_amount);
+        a_data   += consumed;
+        a_amount -= consumed;
+        if (0 == a_amount)
+            return true;
+    }
+
+    if ((uring_packet_used + a_amount) > URING_PACKET_MAX) {
+        printf("uring packet too big\n");
+        return false;
+    }
+    memcpy(&uring_packet[uring_packet_used], a_data, a_amount);
+    uring_packet_used += a_amount;
+
+    size_t consumed = uring_deliver(uring_packet, uring_packet_used);
+    memmove(uring_packet, &uring_packet[consumed], uring_packet_used - consumed);
+    uring_packet_used -= consumed;
+
+    if ((5 <= uring_packet_used) && (0 == uring_packet_size(uring_packet, uring_packet_used)))
+        return false; /* Malformed remaining length */
+    return true;
+}
+
+static void uring_send_completed(uint32_t a_slot, int32_t a_result)
+{
+    pthread_mutex_lock(&uring_lock);
+    uring_send_slot_t * slot = &uring_slots[a_slot];
+
+    if ((0 > a_result) || ((size_t)a_result != slot->length))
+        uring_broken = true;
+
+    free(slot->heap);
+    slot->heap = NULL;
+    slot->busy = false;
+    uring_inflight--;
+    uring_stats.sends++;
+
+    /* Chain done - whatever was written meanwhile goes next */
+    if ((0 == uring_inflight) && (0 < uring_pending_count) && (false == uring_in_batch))
+        uring_submit_pending();
+
+    pthread_cond_broadcast(&uring_send_done);
+    pthread_mutex_unlock(&uring_lock);
+}
+
+static void *uring_completion_thread(void * a_ptr)
+{
+    (void)a_ptr;
+    bool running = true;
+
+    while (running) {
+        uint32_t head = *uring_cq_head;
+        uint32_t tail = __atomic_load_n(uring_cq_tail, __ATOMIC_ACQUIRE);
+
+        /* System call only when there is nothing to reap */
+        if (head == tail) {
+            if ((0 > uring_enter(0, 1, IORING_ENTER_GETEVENTS)) && (EINTR != errno))
+                break;
+            continue;
+        }
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe * cqe = &uring_cqes[head & *uring_cq_mask];
+
+            if (URING_TAG_STOP == cqe->user_data) {
+                running = false;
+            } else if (URING_TAG_RECV == cqe->user_data) {
+                if (0 < cqe->res) {
+                    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                    uring_stats.receives++;
+                    if (false == uring_received(&uring_recv_memory[(size_t)bid * URING_RECV_SIZE], (size_t)cqe->res))
+                        uring_broken = true;
+                    uring_buffer_return(bid);
+                } else if (-ENOBUFS != cqe->res) {
+                    uring_broken = true; /* Closed by peer or failed */
+                }
+
+                /* Multishot ends on errors and when buffers run out */
+                if ((0 == (cqe->flags & IORING_CQE_F_MORE)) && (false == uring_broken)) {
+                    pthread_mutex_lock(&uring_lock);
+                    uring_recv_arm();
+                    pthread_mutex_unlock(&uring_lock);
+                }
+            } else {
+                uring_send_completed((uint32_t)cqe->user_data, cqe->res);
+            }
+        }
+        __atomic_store_n(uring_cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static void uring_release()
+{
+    if (NULL != uring_buf_ring) {
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = URING_RECV_GROUP;
+        syscall(__NR_io_uring_register, uring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(uring_buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+        uring_buf_ring = NULL;
+    }
+    if (NULL != uring_sqes)
+        munmap(uring_sqes, uring_params.sq_entries * sizeof(struct io_uring_sqe));
+    if ((NULL != uring_cq_ptr) && (uring_cq_ptr != uring_sq_ptr))
+        munmap(uring_cq_ptr, uring_cq_size);
+    if (NULL != uring_sq_ptr)
+        munmap(uring_sq_ptr, uring_sq_size);
+    if (-1 != uring_fd)
+        close(uring_fd);
+
+    free(uring_recv_memory);
+    uring_recv_memory = NULL;
+    uring_sqes        = NULL;
+    uring_cq_ptr      = NULL;
+    uring_sq_ptr      = NULL;
+    uring_fd          = -1;
+}
+
+static bool uring_setup()
+{
+    memset(&uring_params, 0, sizeof(uring_params));
+    uring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &uring_params);
+    if (0 > uring_fd) {
+        uring_fd = -1;
+        return false;
+    }
+
+    uring_sq_size = uring_params.sq_off.array + uring_params.sq_entries * sizeof(uint32_t);
+    uring_cq_size = uring_params.cq_off.cqes  + uring_params.cq_entries * sizeof(struct io_uring_cqe);
+    if (uring_params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring_cq_size > uring_sq_size)
+            uring_sq_size = uring_cq_size;
+        uring_cq_size = uring_sq_size;
+    }
+
+    uring_sq_ptr = mmap(NULL, uring_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        uring_fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == uring_sq_ptr) {
+        uring_sq_ptr = NULL;
+        return false;
+    }
+
+    if (uring_params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring_cq_ptr = uring_sq_ptr;
+    } else {
+        uring_cq_ptr = mmap(NULL, uring_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            uring_fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == uring_cq_ptr) {
+            uring_cq_ptr = NULL;
+            return false;
+        }
+    }
+
+    uring_sqes = mmap(NULL, uring_params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+    if (MAP_FAILED == uring_sqes) {
+        uring_sqes = NULL;
+        return false;
+    }
+
+    uring_sq_head  = (uint32_t*)(uring_sq_ptr + uring_params.sq_off.head);
+    uring_sq_tail  = (uint32_t*)(uring_sq_ptr + uring_params.sq_off.tail);
+    uring_sq_mask  = (uint32_t*)(uring_sq_ptr + uring_params.sq_off.ring_mask);
+    uring_sq_array = (uint32_t*)(uring_sq_ptr + uring_params.sq_off.array);
+    uring_cq_head  = (uint32_t*)(uring_cq_ptr + uring_params.cq_off.head);
+    uring_cq_tail  = (uint32_t*)(uring_cq_ptr + uring_params.cq_off.tail);
+    uring_cq_mask  = (uint32_t*)(uring_cq_ptr + uring_params.cq_off.ring_mask);
+    uring_cqes     = (struct io_uring_cqe*)(uring_cq_ptr + uring_params.cq_off.cqes);
+
+    /* Provided buffer ring (kernel 5.19+) */
+    uring_buf_ring = mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == uring_buf_ring) {
+        uring_buf_ring = NULL;
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)uring_buf_ring;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid         = URING_RECV_GROUP;
+    if (0 != syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        munmap(uring_buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+        uring_buf_ring = NULL;
+        return false;
+    }
+
+    uring_recv_memory = malloc((size_t)URING_RECV_BUFFERS * URING_RECV_SIZE);
+    if (NULL == uring_recv_memory)
+        return false;
+
+    uring_buf_tail = 0;
+    for (uint16_t bid = 0; bid < URING_RECV_BUFFERS; bid++)
+        uring_buffer_return(bid);
+
+    return true;
+}
+
+bool uring_initialize(char * a_inet_addr, uint32_t a_port, socket_data_received_fptr_t a_receive_callback)
+{
+    struct sockaddr_in server;
+
+    if ((NULL == a_inet_addr) || (NULL == a_receive_callback) || (-1 != uring_socket))
+        return false;
+
+    memset(&uring_stats, 0, sizeof(uring_stats));
+    uring_is_active = false;
+
+    if ((NULL != getenv("ROJAL_NO_URING")) || (false == uring_setup())) {
+        uring_release();
+        printf("io_uring not available, using socket backend\n");
+        return socket_initialize(a_inet_addr, a_port, a_receive_callback);
+    }
+
+    uring_socket = socket(AF_INET , SOCK_STREAM, 0);
+    if (-1 == uring_socket) {
+        uring_release();
+        return false;
+    }
+
+    int value = 1;
+    setsockopt(uring_socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(int));
+
+    server.sin_addr.s_addr = inet_addr(a_inet_addr);
+    server.sin_family      = AF_INET;
+    server.sin_port        = htons(a_port);
+
+    if (connect(uring_socket , (struct sockaddr *)&server , sizeof(server)) < 0) {
+        close(uring_socket);
+        uring_socket = -1;
+        uring_release();
+        return false;
+    }
+
+    uring_received_callback = a_receive_callback;
+    uring_packet_used       = 0;
+    uring_pending_count     = 0;
+    uring_inflight          = 0;
+    uring_in_batch          = false;
+    uring_broken            = false;
+    for (uint32_t i = 0; i < URING_SEND_SLOTS; i++)
+        uring_slots[i].busy = false;
+
+    pthread_mutex_lock(&uring_lock);
+    bool armed = uring_recv_arm();
+    pthread_mutex_unlock(&uring_lock);
+
+    if ((false == armed) ||
+        (0 != pthread_create(&uring_thread_id, NULL, uring_completion_thread, NULL))) {
+        close(uring_socket);
+        uring_socket = -1;
+        uring_release();
+        return false;
+    }
+
+    uring_is_active = true;
+    return true;
+}
+
+/* Caller holds uring_lock */
+static bool uring_wait_send_done()
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += URING_WAIT_MS / 1000;
+    return (0 == pthread_cond_timedwait(&uring_send_done, &uring_lock, &deadline));
+}
+
+int uring_write(uint8_t * a_data, size_t a_amount)
+{
+    if (false == uring_is_active)
+        return socket_write(a_data, a_amount);
+
+    if ((NULL == a_data) || (0 == a_amount))
+        return -1;
+
+    pthread_mutex_lock(&uring_lock);
+
+    /* Free slot - wait for completions when all are in use */
+    uring_send_slot_t * slot = NULL;
+    while ((NULL == slot) && (false == uring_broken)) {
+        for (uint32_t i = 0; i < URING_SEND_SLOTS; i++) {
+            uint32_t index = (uring_slot_next + i) % URING_SEND_SLOTS;
+            if (false == uring_slots[index].busy) {
+                slot            = &uring_slots[index];
+                uring_slot_next = (index + 1) % URING_SEND_SLOTS;
+                break;
+            }
+        }
+        if (NULL == slot) {
+            if (0 == uring_inflight)
+                uring_submit_pending();
+            if (false == uring_wait_send_done())
+                break;
+        }
+    }
+
+    if ((NULL == slot) || uring_broken) {
+        pthread_mutex_unlock(&uring_lock);
+        return -1;
+    }
+
+    slot->heap = NULL;
+    if (URING_SEND_SLOT_SIZE < a_amount) {
+        slot->heap = malloc(a_amount);
+        if (NULL == slot->heap) {
+            pthread_mutex_unlock(&uring_lock);
+            return -1;
+        }
+    }
+    memcpy((NULL != slot->heap) ? slot->heap : slot->data, a_data, a_amount);
+    slot->length = a_amount;
+    slot->busy   = true;
+    uring_pending[uring_pending_count++] = (uint32_t)(slot - uring_slots);
+
+    /* While a chain is in flight, completion thread submits this with the next chain */
+    if ((0 == uring_inflight) && (false == uring_in_batch))
+        uring_submit_pending();
+
+    pthread_mutex_unlock(&uring_lock);
+    return (int)a_amount;
+}
+
+void uring_batch_begin()
+{
+    pthread_mutex_lock(&uring_lock);
+    uring_in_batch = true;
+    pthread_mutex_unlock(&uring_lock);
+}
+
+void uring_batch_end()
+{
+    pthread_mutex_lock(&uring_lock);
+    uring_in_batch = false;
+    if ((0 == uring_inflight) && uring_is_active)
+        uring_submit_pending();
+    pthread_mutex_unlock(&uring_lock);
+}
+
+bool uring_stop()
+{
+    if (false == uring_is_active)
+        return stop_reading_thread();
+
+    /* Let queued writes (e.g. DISCONNECT) reach the socket */
+    pthread_mutex_lock(&uring_lock);
+    uring_in_batch = false;
+    while (((0 < uring_inflight) || (0 < uring_pending_count)) && (false == uring_broken)) {
+        if (0 == uring_inflight)
+            uring_submit_pending();
+        if (false == uring_wait_send_done())
+            break;
+    }
+
+    /* Wake completion thread for exit */
+    struct io_uring_sqe * sqe = uring_sqe_get();
+    if (NULL != sqe) {
+        sqe->opcode    = IORING_OP_NOP;
+        sqe->user_data = URING_TAG_STOP;
+        uring_sqe_commit(1);
+        uring_enter(1, 0, 0);
+    }
+    pthread_mutex_unlock(&uring_lock);
+
+    shutdown(uring_socket, SHUT_RDWR);
+    pthread_join(uring_thread_id, NULL);
+    close(uring_socket);
+    uring_socket = -1;
+
+    for (uint32_t i = 0; i < URING_SEND_SLOTS; i++) {
+        free(uring_slots[i].heap);
+        uring_slots[i].heap = NULL;
+        uring_slots[i].busy = false;
+    }
+    uring_release();
+    uring_is_active = false;
+    return true;
+}
+
+bool uring_active()
+{
+    return uring_is_active;
+}
+
+void uring_get_stats(uring_stats_t * a_stats_ptr)
+{
+    if (NULL != a_stats_ptr) {
+        a_stats_ptr->enter_calls = __atomic_load_n(&uring_stats.enter_calls, __ATOMIC_RELAXED);
+        a_stats_ptr->sends       = uring_stats.sends;
+        a_stats_ptr->receives    = uring_stats.receives;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef URING_TRANSPORT_H
+#define URING_TRANSPORT_H
+
+#include <stdint.h>  // uint
+#include <stdbool.h> // bool
+
+#include "socket_read_write.h"
+
+typedef struct uring_stats
+{
+    uint64_t enter_calls; /* io_uring_enter system calls, submit and wait */
+    uint64_t sends;       /* Completed send operations                    */
+    uint64_t receives;    /* Completed receive operations                 */
+} uring_stats_t;
+
+/* Connect and start io_uring backend: multishot receive into a provided buffer ring and
+   linked sends. Falls back to socket_read_write when io_uring is not available (or when
+   ROJAL_NO_URING environment variable is set). Whole MQTT packets are passed to
+   a_receive_callback; the data is valid during the callback only. */
+bool uring_initialize(char * a_inet_addr, uint32_t a_port, socket_data_received_fptr_t a_receive_callback);
+
+/* data_stream_out_fptr_t for mqtt_connect(). Data is copied and queued. Writes made while
+   an earlier send is in flight are linked and submitted together when it completes. */
+int uring_write(uint8_t * a_data, size_t a_amount);
+
+/* Hold submission of writes (e.g. around a burst of publishes)... */
+void uring_batch_begin();
+
+/* ...and submit them as one linked chain with a single system call */
+void uring_batch_end();
+
+/* Send pending writes and close connection */
+bool uring_stop();
+
+/* False when plain socket backend is used */
+bool uring_active();
+
+void uring_get_stats(uring_stats_t * a_stats_ptr);
+
+#endif
@@ -0,0 +1,191 @@
+#include "mqtt.h"
+#include "unity.h"
+#include "ws_transport.h"
+#include "ws_broker_stub.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#define LARGE_PAYLOAD (100*1024)
+
+static uint8_t            g_buffer[LARGE_PAYLOAD + 256];
+static uint8_t            g_payload[LARGE_PAYLOAD];
+static MQTT_shared_data_t g_shared;
+static uint16_t           g_port     = 0;
+static volatile uint32_t  g_received = 0;
+static volatile bool      g_connack  = false;
+
+void data_from_ws_(uint8_t * a_data, size_t a_amount)
+{
+    mqtt_receive(a_data, a_amount);
+}
+
+void connected_cb_(MQTTErrorCodes_t a_status)
+{
+    g_connack = (Successfull == a_status);
+}
+
+void subscribe_cb_(MQTTErrorCodes_t   a_status,
+                   uint8_t          * a_data_ptr,
+                   uint32_t           a_data_len,
+                   uint8_t          * a_topic_ptr,
+                   uint16_t           a_topic_len)
+{
+    a_topic_ptr = a_topic_ptr;
+    a_topic_len = a_topic_len;
+    if ((Successfull == a_status) && (NULL != a_data_ptr)) {
+        if ((8 == a_data_len) && (0 == memcmp("WS works", a_data_ptr, a_data_len)))
+            g_received++;
+        if ((LARGE_PAYLOAD == a_data_len) && (0 == memcmp(g_payload, a_data_ptr, a_data_len)))
+            g_received++;
+    }
+}
+
+bool connect_()
+{
+    if (false == ws_initialize("127.0.0.1", g_port, "localhost", "/mqtt", &data_from_ws_))
+        return false;
+
+    uint8_t empty[] = "\0";
+    g_connack = false;
+    bool connected = mqtt_connect("JAMKtest WS",
+                                  0,
+                                  empty,
+                                  empty,
+                                  empty,
+                                  empty,
+                                  &g_shared,
+                                  g_buffer,
+                                  sizeof(g_buffer),
+                                  true,
+                                  &ws_write,
+                                  &connected_cb_,
+                                  &subscribe_cb_,
+                                  5);
+
+    for (uint32_t i = 0; (i < 100) && (false == g_connack); i++)
+        usleep(10000);
+    return connected && g_connack;
+}
+
+void disconnect_()
+{
+    mqtt_disconnect();
+    ws_stop();
+}
+
+bool publish_and_wait_(char * a_topic, char * a_msg, size_t a_size)
+{
+    g_received = 0;
+    if (false == mqtt_publish(a_topic, strlen(a_topic), a_msg, a_size))
+        return false;
+    for (uint32_t i = 0; (i < 100) && (0 == g_received); i++)
+        usleep(10000);
+    return (1 == g_received);
+}
+
+void test_ws_mask()
+{
+    uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+    uint8_t input[100];
+    uint8_t output[100];
+
+    for (uint32_t i = 0; i < sizeof(input); i++)
+        input[i] = (uint8_t)(i * 7);
+
+    /* Vector and byte paths agree for every length and key phase */
+    for (size_t offset = 0; offset < 4; offset++) {
+        for (size_t length = 0; length <= sizeof(input); length++) {
+            ws_mask(output, input, length, mask, offset);
+            for (size_t i = 0; i < length; i++)
+                TEST_ASSERT_EQUAL_HEX8(input[i] ^ mask[(offset + i) & 3], output[i]);
+        }
+    }
+
+    /* In place and twice gives the original */
+    memcpy(output, input, sizeof(input));
+    ws_mask(output, output, sizeof(output), mask, 0);
+    ws_mask(output, output, sizeof(output), mask, 0);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(input, output, sizeof(input));
+}
+
+void test_ws_accept_key()
+{
+    /* RFC 6455 chapter 1.3 example */
+    char accept[32];
+    ws_accept_key("dGhlIHNhbXBsZSBub25jZQ==", accept);
+    TEST_ASSERT_EQUAL_STRING("s3pPLMBiTxaQ9kYGzzhZRbK+xOo=", accept);
+}
+
+void test_ws_publish_subscribe()
+{
+    ws_broker_stub_split(false);
+    TEST_ASSERT_TRUE(connect_());
+
+    char topic[] = "ws/test";
+    TEST_ASSERT_TRUE(mqtt_subscribe(topic, strlen(topic), 5));
+    TEST_ASSERT_TRUE(publish_and_wait_(topic, "WS works", 8));
+
+    /* 64 bit frame length both ways */
+    for (uint32_t i = 0; i < LARGE_PAYLOAD; i++)
+        g_payload[i] = (uint8_t)(i * 31 + 7);
+    TEST_ASSERT_TRUE(publish_and_wait_(topic, (char*)g_payload, LARGE_PAYLOAD));
+
+    /* Whole packets in each frame - all given from the receive buffer */
+    TEST_ASSERT_EQUAL_UINT32(0, ws_receive_copies());
+    disconnect_();
+
+    usleep(100000);
+    TEST_ASSERT_EQUAL_UINT32(1, ws_broker_stub_pongs());
+    TEST_ASSERT_EQUAL_UINT32(0, ws_broker_stub_unmasked_frames());
+}
+
+void test_ws_packets_split_over_frames()
+{
+    ws_broker_stub_split(true);
+    TEST_ASSERT_TRUE(connect_());
+
+    char topic[] = "ws/test";
+    TEST_ASSERT_TRUE(mqtt_subscribe(topic, strlen(topic), 5));
+    TEST_ASSERT_TRUE(publish_and_wait_(topic, "WS works", 8));
+    TEST_ASSERT_TRUE(publish_and_wait_(topic, (char*)g_payload, LARGE_PAYLOAD));
+
+    /* CONNACK, SUBACK and both publishes were reassembled */
+    TEST_ASSERT_EQUAL_UINT32(4, ws_receive_copies());
+    disconnect_();
+    ws_broker_stub_split(false);
+}
+
+void test_ws_bad_accept()
+{
+    ws_broker_stub_bad_accept(true);
+    TEST_ASSERT_FALSE(ws_initialize("127.0.0.1", g_port, "localhost", "/mqtt", &data_from_ws_));
+    ws_broker_stub_bad_accept(false);
+
+    /* Transport is usable again after refused upgrade */
+    TEST_ASSERT_TRUE(connect_());
+    disconnect_();
+}
+
+/****************************************************************************************
+ * TEST main                                                                            *
+ ****************************************************************************************/
+int main(void)
+{
+    if (false == ws_broker_stub_start(&g_port)) {
+        printf("WS broker stub failed\n");
+        return 1;
+    }
+
+    UnityBegin("WebSocket transport");
+    unsigned int tCntr = 1;
+    RUN_TEST(test_ws_mask,                      tCntr++);
+    RUN_TEST(test_ws_accept_key,                tCntr++);
+    RUN_TEST(test_ws_publish_subscribe,         tCntr++);
+    RUN_TEST(test_ws_packets_split_over_frames, tCntr++);
+    RUN_TEST(test_ws_bad_accept,                tCntr++);
+    int failures = UnityEnd();
+
+    ws_broker_stub_stop();
+    return failures;
+}
@@ -0,0 +1,297 @@
+#include <stdio.h>      // printf
+#include <sys/socket.h> // socket
+#include <unistd.h>     // close
+#include <arpa/inet.h>  // inet_addr
+#include <poll.h>       // poll
+#include <pthread.h>    // pthread_create
+#include <signal.h>     // SIGPIPE
+#include <string.h>     // memmove
+#include "ws_transport.h"
+#include "ws_broker_stub.h"
+
+#define STUB_BUFFER_SIZE (256*1024)
+
+static int             stub_listen     = -1;
+static pthread_t       stub_thread_id;
+static volatile bool   stub_running    = false;
+static volatile bool   stub_split      = false;
+static volatile bool   stub_bad_accept = false;
+static uint32_t        stub_pongs      = 0;
+static uint32_t        stub_unmasked   = 0;
+
+static uint8_t         stub_frame[STUB_BUFFER_SIZE];
+static uint8_t         stub_stream[STUB_BUFFER_SIZE];
+static size_t          stub_stream_used = 0;
+
+static bool stub_read(int a_client, uint8_t * a_buffer, size_t a_amount)
+{
+    return (a_amount == 0) || ((ssize_t)a_amount == recv(a_client, a_buffer, a_amount, MSG_WAITALL));
+}
+
+/* Unmasked server frame */
+static void stub_send_frame(int a_client, uint8_t a_opcode, uint8_t * a_data, size_t a_amount)
+{
+    uint8_t header[10];
+    size_t  header_size = 2;
+
+    header[0] = 0x80 | a_opcode;
+    if (126 > a_amount) {
+        header[1] = (uint8_t)a_amount;
+    } else if (0xFFFF >= a_amount) {
+        header[1] = 126;
+        header[2] = (uint8_t)(a_amount >> 8);
+        header[3] = (uint8_t)a_amount;
+        header_size = 4;
+    } else {
+        header[1] = 127;
+        for (uint32_t i = 0; i < 8; i++)
+            header[2 + i] = (uint8_t)((uint64_t)a_amount >> (56 - i * 8));
+        header_size = 10;
+    }
+    send(a_client, header, header_size, MSG_NOSIGNAL);
+    send(a_client, a_data, a_amount, MSG_NOSIGNAL);
+}
+
+static void stub_send_packet(int a_client, uint8_t * a_data, size_t a_amount)
+{
+    if (stub_split && (2 <= a_amount)) {
+        /* Split inside the fixed header for short packets, in the middle for others */
+        size_t first = (8 > a_amount) ? 1 : a_amount / 2;
+        stub_send_frame(a_client, 0x2, a_data, first);
+        stub_send_frame(a_client, 0x0, &a_data[first], a_amount - first);
+    } else {
+        stub_send_frame(a_client, 0x2, a_data, a_amount);
+    }
+}
+
+static bool stub_upgrade(int a_client)
+{
+    char   request[2048] = "";
+    size_t used = 0;
+
+    while (NULL == strstr(request, "\r\n\r\n")) {
+        ssize_t bytes = recv(a_client, &request[used], sizeof(request) - 1 - used, 0);
+        if (0 >= bytes)
+            return false;
+        used += (size_t)bytes;
+        request[used] = '\0';
+    }
+
+    char * key = strstr(request, "Sec-WebSocket-Key: ");
+    if ((NULL == key) || (NULL == strstr(request, "Sec-WebSocket-Protocol: mqtt")))
+        return false;
+    key += strlen("Sec-WebSocket-Key: ");
+    char * key_end = strstr(key, "\r\n");
+    *key_end = '\0';
+
+    char accept[32];
+    ws_accept_key(key, accept);
+    if (stub_bad_accept)
+        accept[0] ^= 1;
+
+    char response[256];
+    int  length = snprintf(response, sizeof(response),
+                           "HTTP/1.1 101 Switching Protocols\r\n"
+                           "Upgrade: websocket\r\n"
+                           "Connection: Upgrade\r\n"
+                           "Sec-WebSocket-Accept: %s\r\n"
+                           "Sec-WebSocket-Protocol: mqtt\r\n"
+                           "\r\n", accept);
+    send(a_client, response, (size_t)length, MSG_NOSIGNAL);
+    return (false == stub_bad_accept);
+}
+
+/* Handle MQTT packets collected from frames, false on DISCONNECT */
+static bool stub_handle_stream(int a_client)
+{
+    size_t offset = 0;
+
+    while (2 <= (stub_stream_used - offset)) {
+        uint8_t * packet     = &stub_stream[offset];
+        size_t    value      = 0;
+        size_t    multiplier = 1;
+        size_t    cnt        = 1;
+        bool      complete   = false;
+
+        while ((cnt < (stub_stream_used - offset)) && (cnt < 5)) {
+            value      += (packet[cnt] & 127) * multiplier;
+            multiplier *= 128;
+            if (0 == (packet[cnt++] & 128)) {
+                complete = true;
+                break;
+            }
+        }
+        size_t length = cnt + value;
+        if ((false == complete) || (length > (stub_stream_used - offset)))
+            break;
+
+        switch (packet[0] >> 4) {
+            case 1: { /* CONNECT */
+                uint8_t connack[] = {0x20, 0x02, 0x00, 0x00};
+                uint8_t hello[]   = "ping";
+                stub_send_packet(a_client, connack, sizeof(connack));
+                stub_send_frame(a_client, 0x9, hello, 4);
+                break;
+            }
+            case 3: /* PUBLISH - echo */
+                stub_send_packet(a_client, packet, length);
+                break;
+            case 8: { /* SUBSCRIBE - short packets only, packet id follows 1 byte length */
+                uint8_t suback[] = {0x90, 0x03, 0x00, 0x00, 0x00};
+                suback[2] = packet[2];
+                suback[3] = packet[3];
+                stub_send_packet(a_client, suback, sizeof(suback));
+                break;
+            }
+            case 12: { /* PINGREQ */
+                uint8_t pingresp[] = {0xd0, 0x00};
+                stub_send_packet(a_client, pingresp, sizeof(pingresp));
+                break;
+            }
+            case 14: /* DISCONNECT */
+                return false;
+            default:
+                break;
+        }
+        offset += length;
+    }
+    memmove(stub_stream, &stub_stream[offset], stub_stream_used - offset);
+    stub_stream_used -= offset;
+    return true;
+}
+
+static void stub_serve(int a_client)
+{
+    uint8_t header[14];
+
+    stub_stream_used = 0;
+    while (stub_running && stub_read(a_client, header, 2)) {
+        uint8_t  opcode = header[0] & 0x0F;
+        bool     masked = (0 != (header[1] & 0x80));
+        uint64_t length = header[1] & 0x7F;
+        uint8_t  mask[4];
+
+        if (126 == length) {
+            if (false == stub_read(a_client, &header[2], 2))
+                return;
+            length = ((uint64_t)header[2] << 8) | header[3];
+        } else if (127 == length) {
+            if (false == stub_read(a_client, &header[2], 8))
+                return;
+            length = 0;
+            for (uint32_t i = 0; i < 8; i++)
+                length = (length << 8) | header[2 + i];
+        }
+        if (masked) {
+            if (false == stub_read(a_client, mask, 4))
+                return;
+        } else {
+            stub_unmasked++;
+        }
+        if ((length > sizeof(stub_frame)) || (false == stub_read(a_client, stub_frame, (size_t)length)))
+            return;
+        if (masked)
+            ws_mask(stub_frame, stub_frame, (size_t)length, mask, 0);
+
+        switch (opcode) {
+            case 0x0:
+            case 0x2:
+                if ((stub_stream_used + length) > sizeof(stub_stream))
+                    return;
+                memcpy(&stub_stream[stub_stream_used], stub_frame, (size_t)length);
+                stub_stream_used += (size_t)length;
+                if (false == stub_handle_stream(a_client))
+                    return;
+                break;
+            case 0x8: /* Close - answer and end */
+                stub_send_frame(a_client, 0x8, stub_frame, (2 <= length) ? 2 : 0);
+                return;
+            case 0xA:
+                if ((4 == length) && (0 == memcmp(stub_frame, "ping", 4)))
+                    stub_pongs++;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void *stub_thread(void * a_ptr)
+{
+    (void)a_ptr;
+
+    while (stub_running) {
+        struct pollfd pfd;
+        pfd.fd      = stub_listen;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (0 >= poll(&pfd, 1, 100))
+            continue;
+
+        int client = accept(stub_listen, NULL, NULL);
+        if (0 > client)
+            continue;
+
+        struct timeval timeout;
+            timeout.tv_sec  = 5;
+            timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+
+        if (stub_upgrade(client))
+            stub_serve(client);
+        close(client);
+    }
+    return 0;
+}
+
+bool ws_broker_stub_start(uint16_t * a_port_ptr)
+{
+    struct sockaddr_in server;
+    socklen_t          server_size = sizeof(server);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    stub_listen = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&server, 0, sizeof(server));
+    server.sin_addr.s_addr = inet_addr("127.0.0.1");
+    server.sin_family      = AF_INET;
+    server.sin_port        = 0; /* Any free port */
+
+    if ((0 > bind(stub_listen, (struct sockaddr *)&server, sizeof(server))) ||
+        (0 > listen(stub_listen, 4)) ||
+        (0 > getsockname(stub_listen, (struct sockaddr *)&server, &server_size)))
+        return false;
+
+    *a_port_ptr     = ntohs(server.sin_port);
+    stub_pongs      = 0;
+    stub_unmasked   = 0;
+    stub_running    = true;
+    return (0 == pthread_create(&stub_thread_id, NULL, stub_thread, NULL));
+}
+
+void ws_broker_stub_stop()
+{
+    stub_running = false;
+    pthread_join(stub_thread_id, NULL);
+    close(stub_listen);
+}
+
+void ws_broker_stub_split(bool a_split)
+{
+    stub_split = a_split;
+}
+
+void ws_broker_stub_bad_accept(bool a_bad)
+{
+    stub_bad_accept = a_bad;
+}
+
+uint32_t ws_broker_stub_pongs()
+{
+    return stub_pongs;
+}
+
+uint32_t ws_broker_stub_unmasked_frames()
+{
+    return stub_unmasked;
+}
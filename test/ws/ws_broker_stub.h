@@ -0,0 +1,23 @@
+#ifndef WS_BROKER_STUB_H
+#define WS_BROKER_STUB_H
+
+#include <stdint.h>  // uint
+#include <stdbool.h> // bool
+
+/* Minimal local MQTT-over-WebSocket broker stand-in for tests. Listens on 127.0.0.1 and
+   serves one client at a time: HTTP upgrade, then CONNECT, SUBSCRIBE, PINGREQ and
+   DISCONNECT are answered and every QoS0 PUBLISH is echoed back to the sender. A ping
+   frame follows CONNACK. */
+bool ws_broker_stub_start(uint16_t * a_port_ptr);
+void ws_broker_stub_stop();
+
+/* Send every MQTT packet split in two frames */
+void ws_broker_stub_split(bool a_split);
+
+/* Answer upgrade with a wrong Sec-WebSocket-Accept */
+void ws_broker_stub_bad_accept(bool a_bad);
+
+uint32_t ws_broker_stub_pongs();
+uint32_t ws_broker_stub_unmasked_frames();
+
+#endif
@@ -0,0 +1,584 @@
+#include <stdio.h>      // printf
+#include <sys/socket.h> // socket
+#include <sys/random.h> // getrandom
+#include <netinet/in.h> // IPPROTO_TCP
+#include <netinet/tcp.h>// TCP_NODELAY
+#include <unistd.h>     // close
+#include <arpa/inet.h>  // inet_addr
+#include <poll.h>       // poll
+#include <pthread.h>    // pthread_create
+#include <signal.h>     // SIGPIPE
+#include <string.h>     // memmove
+#include <strings.h>    // strncasecmp
+#include "ws_transport.h"
+
+#define WS_RECEIVE_BUFFER_SIZE (256*1024)
+#define WS_SEND_BUFFER_SIZE    (16*1024)
+#define WS_POLL_INTERVAL_MS    100
+#define WS_MASK_VECTOR_MIN     32     /* Shorter payloads are masked byte by byte */
+#define WS_GUID                "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT         0x1
+#define WS_OPCODE_BINARY       0x2
+#define WS_OPCODE_CLOSE        0x8
+#define WS_OPCODE_PING         0x9
+#define WS_OPCODE_PONG         0xA
+
+/* 16 byte vector, SSE2 / NEON register with GCC and Clang */
+typedef uint8_t ws_vector_t __attribute__((vector_size(16)));
+
+static int                       ws_socket             = -1;
+static pthread_t                 ws_reading_thread_id;
+static pthread_mutex_t           ws_send_lock          = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool             ws_thread_running     = false;
+static bool                      ws_thread_started     = false;
+static bool                      ws_close_sent         = false;
+static ws_data_received_fptr_t   ws_received_callback  = NULL;
+static uint64_t                  ws_random_state       = 0;
+static uint32_t                  ws_copies             = 0;
+
+static uint8_t                   ws_send_buffer[WS_SEND_BUFFER_SIZE];
+
+/* Raw bytes from the socket, frames are parsed in place */
+static uint8_t                   ws_receive_buffer[WS_RECEIVE_BUFFER_SIZE];
+static size_t                    ws_received           = 0;
+
+/* MQTT packet split over frames is collected here */
+static uint8_t                   ws_packet_buffer[WS_RECEIVE_BUFFER_SIZE];
+static size_t                    ws_packet_used        = 0;
+
+/****************************************************************************************
+ * SHA-1 and base64 for the handshake                                                   *
+ ****************************************************************************************/
+static uint32_t ws_rol(uint32_t a_value, uint32_t a_bits)
+{
+    return (a_value << a_bits) | (a_value >> (32 - a_bits));
+}
+
+static void ws_sha1_block(uint32_t a_state[5], const uint8_t * a_block)
+{
+    uint32_t w[80];
+    for (uint32_t i = 0; i < 16; i++)
+        w[i] = ((uint32_t)a_block[i * 4] << 24) | ((uint32_t)a_block[i * 4 + 1] << 16) |
+               ((uint32_t)a_block[i * 4 + 2] << 8) | (uint32_t)a_block[i * 4 + 3];
+    for (uint32_t i = 16; i < 80; i++)
+        w[i] = ws_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = a_state[0], b = a_state[1], c = a_state[2], d = a_state[3], e = a_state[4];
+    for (uint32_t i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+        uint32_t temp = ws_rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = ws_rol(b, 30);
+        b = a;
+        a = temp;
+    }
+    a_state[0] += a;
+    a_state[1] += b;
+    a_state[2] += c;
+    a_state[3] += d;
+    a_state[4] += e;
+}
+
+static void ws_sha1(const uint8_t * a_data, size_t a_amount, uint8_t a_digest[20])
+{
+    uint32_t state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    uint8_t  block[64];
+    size_t   done = 0;
+
+    for (; done + 64 <= a_amount; done += 64)
+        ws_sha1_block(state, &a_data[done]);
+
+    /* Padding: 0x80, zeros and length in bits */
+    size_t rest = a_amount - done;
+    memset(block, 0, sizeof(block));
+    memcpy(block, &a_data[done], rest);
+    block[rest] = 0x80;
+    if (rest >= 56) {
+        ws_sha1_block(state, block);
+        memset(block, 0, sizeof(block));
+    }
+    uint64_t bits = (uint64_t)a_amount * 8;
+    for (uint32_t i = 0; i < 8; i++)
+        block[63 - i] = (uint8_t)(bits >> (i * 8));
+    ws_sha1_block(state, block);
+
+    for (uint32_t i = 0; i < 20; i++)
+        a_digest[i] = (uint8_t)(state[i / 4] >> (24 - (i % 4) * 8));
+}
+
+static void ws_base64(const uint8_t * a_data, size_t a_amount, char * a_out)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t out = 0;
+
+    for (size_t i = 0; i < a_amount; i += 3) {
+        uint32_t value = (uint32_t)a_data[i] << 16;
+        if (i + 1 < a_amount) value |= (uint32_t)a_data[i + 1] << 8;
+        if (i + 2 < a_amount) value |= (uint32_t)a_data[i + 2];
+        a_out[out++] = table[(value >> 18) & 63];
+        a_out[out++] = table[(value >> 12) & 63];
+        a_out[out++] = (i + 1 < a_amount) ? table[(value >> 6) & 63] : '=';
+        a_out[out++] = (i + 2 < a_amount) ? table[value & 63] : '=';
+    }
+    a_out[out] = '\0';
+}
+
+void ws_accept_key(const char * a_key, char * a_accept)
+{
+    char    input[128];
+    uint8_t digest[20];
+
+    int length = snprintf(input, sizeof(input), "%s%s", a_key, WS_GUID);
+    ws_sha1((const uint8_t*)input, (size_t)length, digest);
+    ws_base64(digest, sizeof(digest), a_accept);
+}
+
+/****************************************************************************************
+ * Masking                                                                              *
+ ****************************************************************************************/
+void ws_mask(uint8_t       * a_out_ptr,
+             const uint8_t * a_in_ptr,
+             size_t          a_amount,
+             const uint8_t   a_mask[4],
+             size_t          a_offset)
+{
+    size_t i = 0;
+
+    if (WS_MASK_VECTOR_MIN <= a_amount) {
+        /* Key repeats every 4 bytes, so one 16 byte vector covers all positions */
+        uint8_t     key_bytes[16];
+        ws_vector_t key;
+        for (uint32_t k = 0; k < sizeof(key_bytes); k++)
+            key_bytes[k] = a_mask[(a_offset + k) & 3];
+        memcpy(&key, key_bytes, sizeof(key));
+
+        for (; i + sizeof(ws_vector_t) <= a_amount; i += sizeof(ws_vector_t)) {
+            ws_vector_t value;
+            memcpy(&value, &a_in_ptr[i], sizeof(value)); /* Unaligned load */
+            value ^= key;
+            memcpy(&a_out_ptr[i], &value, sizeof(value));
+        }
+    }
+
+    for (; i < a_amount; i++)
+        a_out_ptr[i] = a_in_ptr[i] ^ a_mask[(a_offset + i) & 3];
+}
+
+/* xorshift64* - masking keys only need to be unpredictable to intermediaries */
+static void ws_mask_key(uint8_t a_mask[4])
+{
+    ws_random_state ^= ws_random_state >> 12;
+    ws_random_state ^= ws_random_state << 25;
+    ws_random_state ^= ws_random_state >> 27;
+    uint32_t value = (uint32_t)((ws_random_state * 0x2545F4914F6CDD1Dull) >> 32);
+    memcpy(a_mask, &value, 4);
+}
+
+/****************************************************************************************
+ * Sending                                                                              *
+ ****************************************************************************************/
+static bool ws_send_all(uint8_t * a_data, size_t a_amount)
+{
+    while (0 < a_amount) {
+        ssize_t sent = send(ws_socket, a_data, a_amount, MSG_NOSIGNAL);
+        if (0 >= sent)
+            return false;
+        a_data   += sent;
+        a_amount -= (size_t)sent;
+    }
+    return true;
+}
+
+/* One masked frame. Header and start of payload share the first send. */
+static bool ws_send_frame(uint8_t a_opcode, uint8_t * a_data, size_t a_amount)
+{
+    uint8_t mask[4];
+    size_t  header = 2;
+
+    pthread_mutex_lock(&ws_send_lock);
+    if ((-1 == ws_socket) || ws_close_sent) {
+        pthread_mutex_unlock(&ws_send_lock);
+        return false;
+    }
+
+    ws_send_buffer[0] = 0x80 | a_opcode; /* FIN */
+    if (126 > a_amount) {
+        ws_send_buffer[1] = 0x80 | (uint8_t)a_amount;
+    } else if (0xFFFF >= a_amount) {
+        ws_send_buffer[1] = 0x80 | 126;
+        ws_send_buffer[2] = (uint8_t)(a_amount >> 8);
+        ws_send_buffer[3] = (uint8_t)(a_amount);
+        header = 4;
+    } else {
+        ws_send_buffer[1] = 0x80 | 127;
+        for (uint32_t i = 0; i < 8; i++)
+            ws_send_buffer[2 + i] = (uint8_t)((uint64_t)a_amount >> (56 - i * 8));
+        header = 10;
+    }
+    ws_mask_key(mask);
+    memcpy(&ws_send_buffer[header], mask, 4);
+    header += 4;
+
+    /* Caller's data is not modified, it is masked while copied */
+    bool   ok     = true;
+    size_t offset = 0;
+    do {
+        size_t chunk = WS_SEND_BUFFER_SIZE - header;
+        if (chunk > (a_amount - offset))
+            chunk = a_amount - offset;
+        ws_mask(&ws_send_buffer[header], &a_data[offset], chunk, mask, offset);
+        ok      = ws_send_all(ws_send_buffer, header + chunk);
+        offset += chunk;
+        header  = 0;
+    } while (ok && (offset < a_amount));
+
+    if (ok && (WS_OPCODE_CLOSE == a_opcode))
+        ws_close_sent = true;
+    pthread_mutex_unlock(&ws_send_lock);
+    return ok;
+}
+
+int ws_write(uint8_t * a_data, size_t a_amount)
+{
+    if (false == ws_send_frame(WS_OPCODE_BINARY, a_data, a_amount))
+        return -1;
+    return (int)a_amount;
+}
+
+/****************************************************************************************
+ * Receiving                                                                            *
+ ****************************************************************************************/
+/* Size of MQTT packet at the start of a_data, 0 when header is not complete yet */
+static size_t ws_packet_size(uint8_t * a_data, size_t a_amount)
+{
+    size_t   value      = 0;
+    size_t   multiplier = 1;
+    uint32_t cnt        = 1;
+
+    do {
+        if ((cnt >= a_amount) || (4 < cnt))
+            return 0;
+        value      += (a_data[cnt] & 127) * multiplier;
+        multiplier *= 128;
+    } while (0 != (a_data[cnt++] & 128));
+
+    return value + cnt;
+}
+
+/* Payload of a data frame. MQTT packets may be split over frames or share one. */
+static bool ws_deliver_payload(uint8_t * a_payload, size_t a_amount)
+{
+    size_t offset = 0;
+
+    /* Complete the packet started in earlier frames */
+    while ((0 < ws_packet_used) && (offset < a_amount)) {
+        size_t needed = ws_packet_size(ws_packet_buffer, ws_packet_used);
+        size_t take   = (0 == needed) ? 1 : (needed - ws_packet_used);
+        if (take > (a_amount - offset))
+            take = a_amount - offset;
+        if ((ws_packet_used + take) > sizeof(ws_packet_buffer))
+            return false;
+
+        memcpy(&ws_packet_buffer[ws_packet_used], &a_payload[offset], take);
+        ws_packet_used += take;
+        offset         += take;
+
+        needed = ws_packet_size(ws_packet_buffer, ws_packet_used);
+        if ((0 == needed) && (5 <= ws_packet_used))
+            return false; /* Malformed remaining length */
+        if ((0 != needed) && (needed == ws_packet_used)) {
+            ws_copies++;
+            ws_received_callback(ws_packet_buffer, ws_packet_used);
+            ws_packet_used = 0;
+        }
+    }
+
+    /* Whole packets straight from the receive buffer */
+    while (offset < a_amount) {
+        size_t packet_size = ws_packet_size(&a_payload[offset], a_amount - offset);
+        if ((0 == packet_size) || (packet_size > (a_amount - offset)))
+            break;
+        ws_received_callback(&a_payload[offset], packet_size);
+        offset += packet_size;
+    }
+
+    /* Start of a packet continuing in the next frame */
+    if (offset < a_amount) {
+        if ((a_amount - offset) > sizeof(ws_packet_buffer))
+            return false;
+        memcpy(ws_packet_buffer, &a_payload[offset], a_amount - offset);
+        ws_packet_used = a_amount - offset;
+    }
+    return true;
+}
+
+/* Parse complete frames from the receive buffer, false closes the connection */
+static bool ws_parse_frames()
+{
+    size_t offset = 0;
+
+    while (2 <= (ws_received - offset)) {
+        uint8_t * frame   = &ws_receive_buffer[offset];
+        size_t    left    = ws_received - offset;
+        uint8_t   opcode  = frame[0] & 0x0F;
+        bool      masked  = (0 != (frame[1] & 0x80));
+        uint64_t  length  = frame[1] & 0x7F;
+        size_t    header  = 2;
+
+        if (126 == length) {
+            if (4 > left)
+                break;
+            length = ((uint64_t)frame[2] << 8) | frame[3];
+            header = 4;
+        } else if (127 == length) {
+            if (10 > left)
+                break;
+            length = 0;
+            for (uint32_t i = 0; i < 8; i++)
+                length = (length << 8) | frame[2 + i];
+            header = 10;
+        }
+        if (masked)
+            header += 4;
+
+        if ((header + length) > WS_RECEIVE_BUFFER_SIZE) {
+            printf("WS frame too big %llu\n", (unsigned long long)length);
+            return false;
+        }
+        if ((header + length) > left)
+            break;
+
+        uint8_t * payload = &frame[header];
+        if (masked) /* Servers do not mask, but do not choke on it */
+            ws_mask(payload, payload, (size_t)length, &frame[header - 4], 0);
+
+        switch (opcode) {
+            case WS_OPCODE_BINARY:
+            case WS_OPCODE_CONTINUATION:
+                if (false == ws_deliver_payload(payload, (size_t)length))
+                    return false;
+                break;
+            case WS_OPCODE_PING:
+                ws_send_frame(WS_OPCODE_PONG, payload, (size_t)length);
+                break;
+            case WS_OPCODE_PONG:
+                break;
+            case WS_OPCODE_CLOSE:
+                ws_send_frame(WS_OPCODE_CLOSE, payload, (2 <= length) ? 2 : 0);
+                return false;
+            default: /* Text frames are not MQTT */
+                printf("WS unexpected opcode %u\n", opcode);
+                return false;
+        }
+        offset += header + (size_t)length;
+    }
+
+    /* Incomplete frame waits for the rest */
+    memmove(ws_receive_buffer, &ws_receive_buffer[offset], ws_received - offset);
+    ws_received -= offset;
+    return true;
+}
+
+static void *ws_receive_thread(void * a_ptr)
+{
+    (void)a_ptr;
+
+    while (ws_thread_running) {
+        /* Data received with the upgrade response is parsed first */
+        if ((0 < ws_received) && (false == ws_parse_frames()))
+            break;
+
+        struct pollfd pfd;
+        pfd.fd      = ws_socket;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (0 >= poll(&pfd, 1, WS_POLL_INTERVAL_MS))
+            continue;
+
+        ssize_t bytes = recv(ws_socket,
+                             &ws_receive_buffer[ws_received],
+                             WS_RECEIVE_BUFFER_SIZE - ws_received,
+                             0);
+        if (0 >= bytes) {
+            printf("WS connection closed\n");
+            break;
+        }
+        ws_received += (size_t)bytes;
+        if (false == ws_parse_frames())
+            break;
+    }
+    ws_thread_running = false;
+    return 0;
+}
+
+/****************************************************************************************
+ * Connection                                                                           *
+ ****************************************************************************************/
+/* Value of a response header, NULL when missing */
+static char * ws_header_value(char * a_response, const char * a_name)
+{
+    size_t name_length = strlen(a_name);
+
+    for (char * line = strstr(a_response, "\r\n"); NULL != line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (0 == strncasecmp(line, a_name, name_length) && (':' == line[name_length])) {
+            char * value = &line[name_length + 1];
+            while (' ' == *value)
+                value++;
+            return value;
+        }
+    }
+    return NULL;
+}
+
+static bool ws_handshake(const char * a_host, const char * a_path)
+{
+    uint8_t key_bytes[16];
+    char    key[32];
+    char    accept[32];
+    char    request[512];
+
+    if (sizeof(key_bytes) != getrandom(key_bytes, sizeof(key_bytes), 0))
+        return false;
+    memcpy(&ws_random_state, key_bytes, sizeof(ws_random_state));
+    ws_random_state |= 1;
+    ws_base64(key_bytes, sizeof(key_bytes), key);
+
+    int length = snprintf(request, sizeof(request),
+                          "GET %s HTTP/1.1\r\n"
+                          "Host: %s\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: %s\r\n"
+                          "Sec-WebSocket-Version: 13\r\n"
+                          "Sec-WebSocket-Protocol: mqtt\r\n"
+                          "\r\n",
+                          a_path, a_host, key);
+    if ((0 >= length) || ((size_t)length >= sizeof(request)) ||
+        (false == ws_send_all((uint8_t*)request, (size_t)length)))
+        return false;
+
+    /* Response header, frames may follow in the same read */
+    char * end = NULL;
+    ws_received = 0;
+    while (NULL == end) {
+        ssize_t bytes = recv(ws_socket,
+                             &ws_receive_buffer[ws_received],
+                             4096 - 1 - ws_received,
+                             0);
+        if (0 >= bytes)
+            return false;
+        ws_received += (size_t)bytes;
+        ws_receive_buffer[ws_received] = '\0';
+        end = strstr((char*)ws_receive_buffer, "\r\n\r\n");
+        if ((NULL == end) && ((4096 - 1) <= ws_received))
+            return false;
+    }
+    *end = '\0';
+
+    char * response = (char*)ws_receive_buffer;
+    char * value    = ws_header_value(response, "Sec-WebSocket-Accept");
+    ws_accept_key(key, accept);
+
+    bool ok = (0 == strncmp(response, "HTTP/1.1 101", 12)) &&
+              (NULL != value) && (0 == strncmp(value, accept, strlen(accept)));
+    if (false == ok)
+        printf("WS upgrade refused: %.40s\n", response);
+
+    /* Keep bytes after the header */
+    size_t header_size = (size_t)(end - response) + 4;
+    memmove(ws_receive_buffer, &ws_receive_buffer[header_size], ws_received - header_size);
+    ws_received -= header_size;
+    return ok;
+}
+
+bool ws_initialize(char                    * a_inet_addr,
+                   uint32_t                  a_port,
+                   const char              * a_host,
+                   const char              * a_path,
+                   ws_data_received_fptr_t   a_receive_callback)
+{
+    struct sockaddr_in server;
+
+    if ((NULL == a_inet_addr) || (NULL == a_host) || (NULL == a_path) ||
+        (NULL == a_receive_callback) || (-1 != ws_socket))
+        return false;
+
+    /* Peer closing first must not kill the process */
+    signal(SIGPIPE, SIG_IGN);
+
+    ws_socket = socket(AF_INET , SOCK_STREAM, 0);
+    if (-1 == ws_socket)
+        return false;
+
+    struct timeval timeout;
+        timeout.tv_sec  = 10;
+        timeout.tv_usec = 0;
+    setsockopt(ws_socket, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+    setsockopt(ws_socket, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
+
+    int value = 1;
+    setsockopt(ws_socket, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(int));
+
+    server.sin_addr.s_addr = inet_addr(a_inet_addr);
+    server.sin_family      = AF_INET;
+    server.sin_port        = htons(a_port);
+
+    ws_close_sent  = false;
+    ws_packet_used = 0;
+    ws_copies      = 0;
+
+    if ((connect(ws_socket , (struct sockaddr *)&server , sizeof(server)) < 0) ||
+        (false == ws_handshake(a_host, a_path))) {
+        close(ws_socket);
+        ws_socket = -1;
+        return false;
+    }
+
+    ws_received_callback = a_receive_callback;
+    ws_thread_running    = true;
+
+    if (0 != pthread_create(&ws_reading_thread_id, NULL, ws_receive_thread, NULL)) {
+        ws_thread_running = false;
+        ws_stop();
+        return false;
+    }
+    ws_thread_started = true;
+    return true;
+}
+
+bool ws_stop()
+{
+    if (-1 == ws_socket)
+        return true;
+
+    /* 1000 = normal closure */
+    uint8_t status[] = {0x03, 0xE8};
+    ws_send_frame(WS_OPCODE_CLOSE, status, sizeof(status));
+
+    /* Reader may have stopped by itself already */
+    ws_thread_running = false;
+    if (ws_thread_started) {
+        pthread_join(ws_reading_thread_id, NULL);
+        ws_thread_started = false;
+    }
+
+    pthread_mutex_lock(&ws_send_lock);
+    close(ws_socket);
+    ws_socket            = -1;
+    ws_received_callback = NULL;
+    pthread_mutex_unlock(&ws_send_lock);
+    return true;
+}
+
+uint32_t ws_receive_copies()
+{
+    return ws_copies;
+}
@@ -0,0 +1,39 @@
+#ifndef WS_TRANSPORT_H
+#define WS_TRANSPORT_H
+
+#include <stdint.h>  // uint
+#include <stdbool.h> // bool
+#include <stddef.h>  // size_t
+
+typedef void (*ws_data_received_fptr_t)(uint8_t * a_data, size_t amount);
+
+/* Open TCP connection and upgrade it to WebSocket (RFC 6455, subprotocol "mqtt") with
+   GET a_path from a_host. Whole MQTT packets are passed to a_receive_callback. A packet
+   is given directly from the receive buffer unless it is split over WebSocket frames. */
+bool ws_initialize(char                    * a_inet_addr,
+                   uint32_t                  a_port,
+                   const char              * a_host,
+                   const char              * a_path,
+                   ws_data_received_fptr_t   a_receive_callback);
+
+/* data_stream_out_fptr_t for mqtt_connect(), data is sent as one masked binary frame */
+int ws_write(uint8_t * a_data, size_t a_amount);
+
+/* Send close frame and close connection */
+bool ws_stop();
+
+/* Number of received MQTT packets which had to be copied together from several frames */
+uint32_t ws_receive_copies();
+
+/* XOR a_amount bytes with 4 byte masking key. a_offset is the position of a_in_ptr in the
+   frame payload, so a payload can be masked in pieces. Input and output may be the same. */
+void ws_mask(uint8_t       * a_out_ptr,
+             const uint8_t * a_in_ptr,
+             size_t          a_amount,
+             const uint8_t   a_mask[4],
+             size_t          a_offset);
+
+/* Sec-WebSocket-Accept for given Sec-WebSocket-Key, a_accept must hold 29 bytes */
+void ws_accept_key(const char * a_key, char * a_accept);
+
+#endif